@@ -11,6 +11,9 @@
 #include <stddef.h>
 #include "ddriver.h"
 #include "errno.h"
+#include <pthread.h>
+#include <sys/uio.h>
+#include <linux/falloc.h>
 #include "types.h"
 #include "stdint.h"
 
@@ -18,23 +21,193 @@
 #define NEWFS_DEFAULT_PERM    0777   /* 全权限打开 */
 
 /******************************************************************************
-* SECTION: macro debug
+* SECTION: macro trace
+* NEWFS_TRACE(分类, 级别, fmt, ...)写入跟踪环形缓冲区(见newfs_trace.c)。
+* 未达级别或分类被屏蔽时只有一次比较；Release构建(NDEBUG)下整体编译为空，
+* 也可用-DNEWFS_TRACE_ENABLED=0/1强制指定。
 *******************************************************************************/
-#define NEWFS_DBG(fmt, ...) do { printf("NEWFS_DBG: " fmt, ##__VA_ARGS__); } while(0) 
+#ifndef NEWFS_TRACE_ENABLED
+#ifdef NDEBUG
+#define NEWFS_TRACE_ENABLED 0
+#else
+#define NEWFS_TRACE_ENABLED 1
+#endif
+#endif
+
+extern int      newfs_trace_level;
+extern int      newfs_trace_echo;
+extern unsigned newfs_trace_mask;
+
+#if NEWFS_TRACE_ENABLED
+#define NEWFS_TRACE(cat, lvl, fmt, ...) do {                                          \
+	static struct newfs_ratelimit trace_rl;                                               \
+	if (__builtin_expect((lvl) <= newfs_trace_level && ((cat) & newfs_trace_mask), 0) \
+		&& newfs_ratelimit(&trace_rl, (cat), (lvl), __func__)) {                          \
+		newfs_trace_emit((cat), (lvl), __func__, fmt, ##__VA_ARGS__);                 \
+	}                                                                                 \
+} while (0)
+#else
+#define NEWFS_TRACE(cat, lvl, fmt, ...) do {                                          \
+	if (0) {                                                                          \
+		newfs_trace_nop(fmt, ##__VA_ARGS__);          /* 仅保留格式检查 */            \
+	}                                                                                 \
+} while (0)
+#endif
+
+static inline void __attribute__((format(printf, 1, 2))) newfs_trace_nop(const char* fmt, ...) {
+	(void)fmt;
+}
+
+/******************************************************************************
+* SECTION: macro lock
+* FUSE默认多线程调用各操作，内存目录树与inode缓存由一把全局锁保护
+*******************************************************************************/
+#define NEWFS_LOCK()          pthread_mutex_lock(&super.lock)
+#define NEWFS_UNLOCK()        pthread_mutex_unlock(&super.lock)
 
 /******************************************************************************
 * SECTION: newfs_utils.c
 *******************************************************************************/
 int				  	 your_read(int, void*, int);
 int				  	 your_write(int, void*, int);
+int                  newfs_sync_super(uint32_t);
 struct newfs_inode*  newfs_alloc_inode(struct newfs_dentry *);
 int                  newfs_sync_inode(struct newfs_inode *);
+void                 newfs_mark_dirty(struct newfs_inode *);
+void                 newfs_clear_dirty(struct newfs_inode *);
+int                  newfs_flush_dirty(void);
+int                  newfs_flush_inode(struct newfs_inode *);
+int                  newfs_flush_meta(struct newfs_inode *);
 int                  newfs_alloc_dentry(struct newfs_inode*, struct newfs_dentry*);
+int                  newfs_drop_dentry(struct newfs_inode*, struct newfs_dentry*);
+int                  newfs_replace_dentry(struct newfs_inode*, struct newfs_dentry*, struct newfs_dentry*);
+int                  newfs_rename_recover(void);
+int                  newfs_hidden_read(int, void **, int *);
+int                  newfs_hidden_write(int *, const void *, int);
+int                  newfs_inode_d_size(uint32_t);
+int                  newfs_inode_d_read(int, struct newfs_inode_d *);
+int                  newfs_inode_d_write(int, struct newfs_inode_d *);
 struct newfs_inode*  newfs_read_inode(struct newfs_dentry *, int);
+int                  newfs_dir_load(struct newfs_inode *);
 struct newfs_dentry* newfs_get_dentry(struct newfs_inode*, int);
 struct newfs_dentry* newfs_lookup(const char*,  bool*, bool*);
 int                  newfs_calc_lvl(const char* path);
 char*                newfs_get_fname(const char* path);
+int                  newfs_alloc_ino(void);
+void                 newfs_free_ino(int);
+int                  newfs_alloc_blk(void);
+void                 newfs_free_blk(int);
+int                  newfs_alloc_run(int, int*);
+int                  newfs_free_blks(uint32_t*, int);
+void                 newfs_free_inos(uint32_t*, int);
+int                  newfs_bitmap_count(uint8_t*, int);
+int                  newfs_sync_maps(void);
+struct newfs_dentry* new_dentry(char *, NEWFS_FILE_TYPE);
+void                 free_dentry(struct newfs_dentry *);
+
+/******************************************************************************
+* SECTION: newfs_file.c
+*******************************************************************************/
+struct newfs_file*   newfs_file_open(struct newfs_inode *, int);
+struct newfs_file*   newfs_file_open_snap(char *, size_t);
+void                 newfs_file_get(struct newfs_file *);
+void                 newfs_file_put(struct newfs_file *);
+uint8_t*             newfs_file_block(struct newfs_inode *, int, bool);
+int                  newfs_file_read(struct newfs_file *, char *, size_t, off_t);
+int                  newfs_file_write(struct newfs_file *, const char *, size_t, off_t);
+int                  newfs_file_flush(struct newfs_file *);
+int                  newfs_file_truncate(struct newfs_inode *, off_t);
+int                  newfs_file_fallocate(struct newfs_inode *, int, off_t, off_t);
+int                  newfs_file_nblks(struct newfs_inode *);
+off_t                newfs_file_seek(struct newfs_inode *, off_t, bool);
+int                  newfs_file_clone(struct newfs_inode *, off_t, struct newfs_inode *, off_t, size_t);
+void                 newfs_file_prefetch(struct newfs_file *, int, int);
+int                  newfs_symlink_init(struct newfs_inode *, const char *, int);
+const char*          newfs_symlink_target(struct newfs_inode *);
+
+/******************************************************************************
+* SECTION: newfs_comp.c
+*******************************************************************************/
+bool                 newfs_comp_cluster(struct newfs_inode *, int);
+int                  newfs_comp_load(struct newfs_inode *, int);
+int                  newfs_comp_expand(struct newfs_inode *, int);
+bool                 newfs_comp_writeback(struct newfs_inode *, int, uint32_t *, int *);
+
+/******************************************************************************
+* SECTION: newfs_dedup.c
+*******************************************************************************/
+void                 newfs_dedup_load(bool);
+int                  newfs_dedup_writeback(struct newfs_inode *);
+void                 newfs_dedup_forget(uint32_t);
+int                  newfs_dedup_sync(void);
+void                 newfs_dedup_destroy(void);
+int                  newfs_dedup_count(void);
+long                 newfs_dedup_mem(void);
+
+/******************************************************************************
+* SECTION: newfs_csum.c
+*******************************************************************************/
+uint32_t             newfs_crc32c(const void *, size_t);
+const char*          newfs_crc32c_impl(void);
+void                 newfs_csum_super_seal(struct newfs_super_d *);
+bool                 newfs_csum_super_ok(const struct newfs_super_d *);
+void                 newfs_csum_inode_seal(struct newfs_inode_d *, int);
+bool                 newfs_csum_inode_ok(const struct newfs_inode_d *, int);
+void                 newfs_csum_dirblk_seal(void *, int);
+bool                 newfs_csum_dirblk_ok(const void *, int);
+uint32_t             newfs_csum_map(const uint8_t *, int);
+bool                 newfs_csum_map_ok(uint32_t, const uint8_t *, int);
+void                 newfs_csum_load(bool);
+void                 newfs_csum_update(uint32_t, const void *);
+bool                 newfs_csum_verify(uint32_t, const void *);
+void                 newfs_csum_forget(uint32_t);
+int                  newfs_csum_sync(void);
+void                 newfs_csum_destroy(void);
+int                  newfs_csum_count(void);
+
+/******************************************************************************
+* SECTION: newfs_stats.c
+*******************************************************************************/
+uint64_t             newfs_stat_now(void);
+int                  newfs_stat_end(int, uint64_t, int);
+void                 newfs_stats_print(FILE *);
+char*                newfs_stats_snapshot(size_t *);
+bool                 newfs_is_stats_path(const char *);
+
+/******************************************************************************
+* SECTION: newfs_trace.c
+*******************************************************************************/
+void                 newfs_trace_init(void);
+void                 newfs_trace_emit(unsigned, int, const char *, const char *, ...)
+						__attribute__((format(printf, 4, 5)));
+bool                 newfs_ratelimit(struct newfs_ratelimit *, unsigned, int, const char *);
+void                 newfs_trace_dump(int);
+
+/******************************************************************************
+* SECTION: newfs_record.c
+*******************************************************************************/
+const struct fuse_operations* newfs_record_operations(const struct fuse_operations *, const char *);
+
+/******************************************************************************
+* SECTION: newfs_bdev.c
+*******************************************************************************/
+struct newfs_bdev*   newfs_bdev_open(const char *);
+int                  newfs_bdev_read(struct newfs_bdev *, long, void *, int);
+int                  newfs_bdev_write(struct newfs_bdev *, long, const void *, int);
+void*                newfs_bdev_map(struct newfs_bdev *, long, int);
+int                  newfs_bdev_flush(struct newfs_bdev *);
+int                  newfs_bdev_submit(struct newfs_bdev *, struct newfs_bio *);
+int                  newfs_bdev_write_async(struct newfs_bdev *, long, void *, int);
+int                  newfs_bdev_drain(struct newfs_bdev *);
+void                 newfs_bdev_wait(struct newfs_bdev *);
+int                  newfs_bdev_ioctl(struct newfs_bdev *, unsigned long, void *);
+void                 newfs_bdev_close(struct newfs_bdev *);
+
+/******************************************************************************
+* SECTION: newfs_aio.c
+*******************************************************************************/
+extern const struct newfs_bdev_ops newfs_uring_bdev_ops;
+extern const struct newfs_bdev_ops newfs_aio_bdev_ops;
 
 /******************************************************************************
 * SECTION: newfs.c
@@ -54,15 +227,112 @@ int   			   newfs_access(const char *, int);
 int   			   newfs_unlink(const char *);
 int   			   newfs_rmdir(const char *);
 int   			   newfs_rename(const char *, const char *);
+int   			   newfs_link(const char *, const char *);
+int   			   newfs_symlink(const char *, const char *);
+int   			   newfs_readlink(const char *, char *, size_t);
+int   			   newfs_setxattr(const char *, const char *, const char *, size_t, int);
+int   			   newfs_getxattr(const char *, const char *, char *, size_t);
+int   			   newfs_listxattr(const char *, char *, size_t);
+int   			   newfs_removexattr(const char *, const char *);
 int   			   newfs_utimens(const char *, const struct timespec tv[2]);
 int   			   newfs_truncate(const char *, off_t);
+int   			   newfs_ftruncate(const char *, off_t, struct fuse_file_info *);
+int   			   newfs_fallocate(const char *, int, off_t, off_t, struct fuse_file_info *);
+int   			   newfs_ioctl(const char *, int, void *, struct fuse_file_info *, unsigned int, void *);
+int   			   newfs_statfs(const char *, struct statvfs *);
 			
 int   			   newfs_open(const char *, struct fuse_file_info *);
+int   			   newfs_flush(const char *, struct fuse_file_info *);
+int   			   newfs_release(const char *, struct fuse_file_info *);
+const struct fuse_operations* newfs_operations(void);
 int   			   newfs_opendir(const char *, struct fuse_file_info *);
 
+/******************************************************************************
+* SECTION: newfs_icache.c
+*******************************************************************************/
+void                 newfs_icache_init(long);
+void                 newfs_icache_charge(long);
+void                 newfs_icache_insert(struct newfs_inode *);
+struct newfs_inode*  newfs_icache_find(uint32_t);
+struct newfs_inode*  newfs_iget(struct newfs_dentry *);
+void                 newfs_iref(struct newfs_inode *);
+void                 newfs_iput(struct newfs_inode *);
+void                 newfs_icache_reparent(struct newfs_dentry *, struct newfs_dentry *);
+void                 newfs_icache_detach(struct newfs_inode *, struct newfs_dentry *);
+void                 newfs_icache_remove(struct newfs_inode *);
+void                 newfs_icache_free(struct newfs_inode *);
+void                 newfs_icache_shrink(void);
+void                 newfs_icache_destroy(void);
+
+/******************************************************************************
+* SECTION: newfs_reclaim.c
+*******************************************************************************/
+void                 newfs_reclaim_start(void);
+void                 newfs_reclaim_stop(void);
+void                 newfs_reclaim_unlink(struct newfs_inode *);
+void                 newfs_drop_link(struct newfs_inode *, struct newfs_dentry *);
+void                 newfs_reclaim_queue(struct newfs_inode *);
+
+/******************************************************************************
+* SECTION: newfs_prefetch.c
+*******************************************************************************/
+void                 newfs_prefetch_start(void);
+void                 newfs_prefetch_stop(void);
+void                 newfs_prefetch_open(struct newfs_dentry *);
+int                  newfs_prefetch_hint(struct newfs_inode *);
+void                 newfs_prefetch_forget(struct newfs_inode *, struct newfs_dentry *);
+
+/******************************************************************************
+* SECTION: newfs_share.c
+*******************************************************************************/
+int                  newfs_share_ref(uint32_t);
+int                  newfs_share_get(uint32_t);
+bool                 newfs_share_put(uint32_t);
+int                  newfs_share_load(void);
+int                  newfs_share_sync(void);
+void                 newfs_share_destroy(void);
+int                  newfs_share_count(void);
+
+/******************************************************************************
+* SECTION: newfs_snap.c
+*******************************************************************************/
+int                  newfs_snap_load(void);
+int                  newfs_snap_sync(void);
+void                 newfs_snap_destroy(void);
+int                  newfs_snap_mount(const char *);
+bool                 newfs_snap_readonly(void);
+int                  newfs_snap_count(void);
+int                  newfs_snap_slot(int);
+void                 newfs_snap_born(struct newfs_inode *);
+int                  newfs_snap_cow(struct newfs_inode *);
+int                  newfs_snap_create(const char *);
+int                  newfs_snap_delete(const char *);
+
+/******************************************************************************
+* SECTION: newfs_xattr.c
+*******************************************************************************/
+bool                 newfs_xattr_ents_ok(const uint8_t *, int);
+bool                 newfs_xattr_blk_ok(const void *, int, bool);
+int                  newfs_xattr_get(struct newfs_inode *, const char *, void *, size_t);
+int                  newfs_xattr_list(struct newfs_inode *, char *, size_t);
+int                  newfs_xattr_set(struct newfs_inode *, const char *, const void *, size_t, int);
+int                  newfs_xattr_remove(struct newfs_inode *, const char *);
+int                  newfs_xattr_copy(struct newfs_inode_d *);
+
+/******************************************************************************
+* SECTION: newfs_slab.c
+*******************************************************************************/
+void                 newfs_slab_init(void);
+void                 newfs_slab_create(struct newfs_slab *, const char *, size_t, size_t);
+void*                newfs_slab_alloc(struct newfs_slab *);
+void                 newfs_slab_free(struct newfs_slab *, void *);
+uint8_t*             newfs_buf_alloc(void);
+void                 newfs_buf_free(uint8_t *);
+
 /******************************************************************************
 * SECTION: newfs_debug.c
 *******************************************************************************/
 void 			   newfs_dump_map(uint8_t *);
+void 			   newfs_dump_stats(void);
 
 #endif  /* _newfs_H_ */
\ No newline at end of file
@@ -11,6 +11,17 @@ typedef enum newfs_file_type {
 
 struct custom_options {
 	const char*        device;
+	int                debug;       /* --debug: 挂载时打印位图，跟踪以DEBUG级别记录并打印 */
+	int                cache_mb;    /* --cache_mb: inode缓存内存上限(MB) */
+	int                blksize;     /* --blksize: 格式化时的逻辑块大小(B)，0为默认 */
+	int                trace;       /* --trace: 跟踪记录级别(1~4)，0为默认 */
+	int                trace_mask;  /* --trace_mask: 跟踪分类掩码(NEWFS_TC_*)，0为全部 */
+	const char*        record;      /* --record: 把每个FUSE操作记录到该文件，供newfs_replay回放 */
+	int                compress;    /* --compress: 写回时按簇压缩文件数据，见newfs_comp.c */
+	int                dedup;       /* --dedup: 写回时按内容去重整块数据，见newfs_dedup.c */
+	int                data_csum;   /* --data_csum: 记录文件数据块的CRC32C，读入时校验，见newfs_csum.c */
+	const char*        snapshot;    /* --snapshot: 只读挂载该名字的快照，见newfs_snap.c */
+	int                prefetch_mb; /* --prefetch_mb: 目录预取的内存预算(MB)，0为inode缓存上限的1/4，负数关闭，见newfs_prefetch.c */
 };
 
 /******************************************************************************
@@ -21,9 +32,43 @@ struct custom_options {
 
 #define NEWFS_ROOT_INO          0
 
+#define NEWFS_STATE_CLEAN       0x1     /* 正常卸载，计数与分配提示可信 */
+#define NEWFS_STATE_DIRTY       0x2     /* 已挂载或异常退出，需要按位图重建 */
+
+#define NEWFS_FEAT_CSUM         0x1     /* 超级块、位图、inode与目录块带CRC32C校验，格式化时设置 */
+#define NEWFS_FEAT_SNAP         0x2     /* 超级块含snap_ino，格式化或第一次创建快照时设置 */
+#define NEWFS_FEAT_XATTR        0x4     /* inode槽位含扩展属性区，格式化时设置 */
+
 #define MAX_NAME_LEN            128
 #define NEWFS_INODE_PER_FILE    1 
 #define NEWFS_DATA_PER_FILE     1024    /* 每个文件最多使用的数据块数 */
+#define NEWFS_ICACHE_DEFAULT_MB 64      /* inode缓存默认内存上限 */
+#define NEWFS_BLKS_SZ_MIN       1024    /* 逻辑块大小范围 */
+#define NEWFS_BLKS_SZ_MAX       65536
+#define NEWFS_BYTES_PER_INODE   32768   /* 格式化时每多少字节磁盘分配一个inode */
+#define NEWFS_MIN_INODES        16
+#define NEWFS_STATS_PATH        "/.newfs_stats"    /* 只读统计虚拟文件 */
+#define NEWFS_STAT_BUCKETS      40      /* 延迟直方图桶数，第b桶为[2^(b-1), 2^b) ns */
+#define NEWFS_TRACE_ENTRIES     4096    /* 跟踪环形缓冲区记录数，2的幂 */
+#define NEWFS_TRACE_MSG_SZ      96      /* 单条跟踪消息最大长度 */
+#define NEWFS_TRACE_BURST       10      /* 每个调用点每秒最多记录条数 */
+#define NEWFS_REC_MAGIC         0x5254464e  /* 操作记录文件幻数"NFTR" */
+#define NEWFS_REC_VERSION       1           /* 记录格式发布后改动时加1 */
+#define NEWFS_RA_MIN            4       /* 顺序读时的初始预读块数 */
+#define NEWFS_RA_MAX            32      /* 最大预读块数 */
+#define NEWFS_RECLAIM_DELAY_MS  10      /* 删除后延迟回收，凑批释放位图 */
+#define NEWFS_PF_STREAK         3       /* 同一目录中先后打开这么多个不同文件即视为在扫描该目录 */
+#define NEWFS_PF_DIRS           8       /* 同时跟踪打开模式的目录数 */
+#define NEWFS_COMP_CLUSTER      8       /* 压缩单位(块数)，文件内按簇对齐 */
+#define NEWFS_DEDUP_PROBE       16      /* 去重索引线性探测的最大步数 */
+#define NEWFS_SNAP_NAME_LEN     32      /* 快照名最大长度(含'\0') */
+#define NEWFS_SNAP_MAX          32      /* 最多保留的快照数 */
+#define NEWFS_SNAP_ABSENT       0       /* 快照映射的slot取此值表示inode当时不存在；0号槽位是根目录，不会用来保存旧inode */
+#define NEWFS_SYMLINK_INLINE    128     /* 不超过该长度的符号链接目标直接存放在inode的data[]中，否则占用一个数据块 */
+#define NEWFS_LINK_MAX          65000   /* 单个inode的最大硬链接数 */
+#define NEWFS_XATTR_INLINE      244     /* inode槽位内的扩展属性区字节数，放不下的属性存放在一个数据块中 */
+#define NEWFS_XATTR_NAME_MAX    255     /* 扩展属性名最大长度(含名字空间前缀) */
+#define NEWFS_XATTR_MAGIC       0x5841464e  /* 扩展属性块幻数"NFAX" */
 
 #define NEWFS_ERROR_NONE        0
 #define NEWFS_ERROR_NOSPACE     ENOSPC
@@ -33,29 +78,137 @@ struct custom_options {
 #define NEWFS_ERROR_NOTFOUND    ENOENT  /* No such file or directory */
 #define NEWFS_ERROR_ACCESS      EACCES  /* Permission denied */
 #define NEWFS_ERROR_ISDIR       EISDIR  /* Is a directory */
+#define NEWFS_ERROR_NOTDIR      ENOTDIR /* Not a directory */
+#define NEWFS_ERROR_NOTEMPTY    ENOTEMPTY /* Directory not empty */
+#define NEWFS_ERROR_BUSY        EBUSY   /* Device or resource busy */
+#define NEWFS_ERROR_INVAL       EINVAL  /* Invalid argument */
+#define NEWFS_ERROR_FBIG        EFBIG   /* File too large */
+#define NEWFS_ERROR_NOTSUP      EOPNOTSUPP /* Operation not supported */
+#define NEWFS_ERROR_BADF        EBADF   /* Bad file descriptor */
+#define NEWFS_ERROR_NXIO        ENXIO   /* No data/hole past offset */
+#define NEWFS_ERROR_NOTTY       ENOTTY  /* Inappropriate ioctl */
+#define NEWFS_ERROR_ROFS        EROFS   /* Read-only file system */
+#define NEWFS_ERROR_NAMETOOLONG ENAMETOOLONG /* File name too long */
+#define NEWFS_ERROR_MLINK       EMLINK  /* Too many links */
+#define NEWFS_ERROR_PERM        EPERM   /* Operation not permitted */
+#define NEWFS_ERROR_LOOP        ELOOP   /* Too many symbolic links */
+#define NEWFS_ERROR_NODATA      ENODATA /* No such attribute */
+#define NEWFS_ERROR_RANGE       ERANGE  /* Buffer too small */
+
+/* FUSE 2不转发lseek，SEEK_DATA/SEEK_HOLE改用ioctl：参数为off_t，传入起始偏移，返回找到的偏移 */
+#define NEWFS_IOC_MAGIC         'N'
+#define NEWFS_IOC_SEEK_DATA     _IOWR(NEWFS_IOC_MAGIC, 1, off_t)
+#define NEWFS_IOC_SEEK_HOLE     _IOWR(NEWFS_IOC_MAGIC, 2, off_t)
+/* FUSE 2没有copy_file_range，服务端复制改用ioctl：对目标文件调用，源文件按挂载点内的路径给出 */
+#define NEWFS_IOC_CLONE_RANGE   _IOWR(NEWFS_IOC_MAGIC, 3, struct newfs_clone_range)
+#define NEWFS_CLONE_PATH_MAX    1024
+
+struct newfs_clone_range {
+    char     src[NEWFS_CLONE_PATH_MAX];     /* 源文件路径，如"/data/a" */
+    int64_t  src_off;
+    int64_t  dst_off;
+    uint64_t len;
+    int64_t  copied;                        /* 返回实际复制的字节数 */
+};
+/* 快照的创建与删除：对挂载点内任一打开的文件或目录调用，参数为快照名 */
+#define NEWFS_IOC_SNAP_CREATE   _IOW(NEWFS_IOC_MAGIC, 4, struct newfs_snap_arg)
+#define NEWFS_IOC_SNAP_DELETE   _IOW(NEWFS_IOC_MAGIC, 5, struct newfs_snap_arg)
+
+struct newfs_snap_arg {
+    char     name[NEWFS_SNAP_NAME_LEN];
+};
+/* 目录预取提示：对打开的目录调用则预取该目录，对打开的文件调用则预取其所在目录，无参数 */
+#define NEWFS_IOC_PREFETCH      _IO(NEWFS_IOC_MAGIC, 6)
 
 /******************************************************************************
 * SECTION: Macro Function
 *******************************************************************************/
 #define NEWFS_IO_SZ()                     (super.blks_size)
 #define NEWFS_DISK_SZ()                   (super.disk_size)
-#define NEWFS_DRIVER()                    (super.fd)
+#define NEWFS_DRIVER()                    (super.bdev)
 
 #define NEWFS_BLKS_SZ(blks)               ((blks) * NEWFS_IO_SZ())
 #define NEWFS_ASSIGN_FNAME(psfs_dentry, _fname)     memcpy(psfs_dentry->name, _fname, strlen(_fname))
 
 #define NEWFS_DATA_OFS(p)                 (super.data_offset + (p) * NEWFS_IO_SZ())
+#define NEWFS_INO_OFS(ino)                (super.inode_offset + (ino) * super.ino_sz)
+#define NEWFS_CSUM_ON()                   (super.features & NEWFS_FEAT_CSUM)
+#define NEWFS_XATTR_ON()                  (super.features & NEWFS_FEAT_XATTR)
+
+#define NEWFS_BLK_DIRTY(pinode, i)        ((pinode)->blk_dirty[(i) / UINT8_BITS] & (0x1 << ((i) % UINT8_BITS)))
+#define NEWFS_BLK_SET_DIRTY(pinode, i)    ((pinode)->blk_dirty[(i) / UINT8_BITS] |= (0x1 << ((i) % UINT8_BITS)))
+#define NEWFS_BLK_CLEAR_DIRTY(pinode, i)  ((pinode)->blk_dirty[(i) / UINT8_BITS] &= ~(0x1 << ((i) % UINT8_BITS)))
+
+/* data[]的取值：-1为空洞；最高位为1表示已预分配(fallocate)但未写入，读出为0，首次写入时清除；
+ * 次高位为1表示该块可能与其他文件共享(克隆)，写入前查引用计数决定是否复制；
+ * 第三位为1表示该块存放所在簇的压缩数据，簇的第一项带此标记时整簇按压缩格式读取 */
+#define NEWFS_BLK_UNWRITTEN               0x80000000u
+#define NEWFS_BLK_SHARED                  0x40000000u
+#define NEWFS_BLK_COMPRESSED              0x20000000u
+#define NEWFS_BLK_HOLE(b)                 ((uint32_t)(b) == (uint32_t)-1)
+#define NEWFS_BLK_IS_UNWRITTEN(b)         (!NEWFS_BLK_HOLE(b) && ((b) & NEWFS_BLK_UNWRITTEN))
+#define NEWFS_BLK_IS_SHARED(b)            (!NEWFS_BLK_HOLE(b) && ((b) & NEWFS_BLK_SHARED))
+#define NEWFS_BLK_IS_COMP(b)              (!NEWFS_BLK_HOLE(b) && ((b) & NEWFS_BLK_COMPRESSED))
+#define NEWFS_BLK_WRITTEN(b)              (!NEWFS_BLK_HOLE(b) && !((b) & NEWFS_BLK_UNWRITTEN))
+#define NEWFS_BLKNO(b)                    ((uint32_t)(b) & ~(NEWFS_BLK_UNWRITTEN | NEWFS_BLK_SHARED | NEWFS_BLK_COMPRESSED))
+
+#define NEWFS_FILE(fi)                    ((struct newfs_file *)(uintptr_t)(fi)->fh)
 
 #define NEWFS_IS_DIR(pinode)              (pinode->ftype == NEWFS_DIR)
 #define NEWFS_IS_REG(pinode)              (pinode->ftype == NEWFS_REG_FILE)
 #define NEWFS_IS_SYM_LINK(pinode)         (pinode->ftype == NEWFS_SYM_LINK)
+/* 短目标的符号链接：inode_d的data[]中存放目标字符串而不是块号，内存inode的目标在data_blks[0]中 */
+#define NEWFS_IS_INLINE_LINK(pinode)      ((pinode)->ftype == NEWFS_SYM_LINK && (pinode)->size <= NEWFS_SYMLINK_INLINE)
 
 /******************************************************************************
 * SECTION: FS Specific Structure - In memory structure
 *******************************************************************************/
+struct newfs_bdev;
+
+#define NEWFS_BIO_READ          0
+#define NEWFS_BIO_WRITE         1
+
+struct newfs_bio {
+    int      rw;                                    /* NEWFS_BIO_READ / NEWFS_BIO_WRITE */
+    long     offset;                                /* 按io_sz对齐 */
+    void*    buf;
+    int      size;                                  /* 按io_sz对齐 */
+    int      res;                                   /* 完成后为0或负错误码 */
+    void   (*end_io)(struct newfs_bio*);            /* 完成回调，可能在后端线程中调用 */
+    void*    priv;
+    struct iovec      iov;                          /* 后端私有 */
+    struct newfs_bio* next;                         /* 后端私有，提交队列 */
+};
+
+struct newfs_bdev_ops {
+    const char* scheme;                                                     /* --device=<scheme>:<path> */
+    int   (*open)(struct newfs_bdev*, const char*);
+    int   (*read)(struct newfs_bdev*, long, void*, int);                    /* offset/size按io_sz对齐 */
+    int   (*write)(struct newfs_bdev*, long, const void*, int);
+    void* (*map)(struct newfs_bdev*, long, int);                            /* 零拷贝访问，可为NULL */
+    int   (*flush)(struct newfs_bdev*);                                     /* 可为NULL */
+    int   (*submit)(struct newfs_bdev*, struct newfs_bio*);                 /* 异步提交，可为NULL */
+    void  (*drain)(struct newfs_bdev*);                                     /* 等待所有在途请求完成 */
+    int   (*ioctl)(struct newfs_bdev*, unsigned long, void*);
+    void  (*close)(struct newfs_bdev*);
+};
+
+struct newfs_bdev {
+    const struct newfs_bdev_ops* ops;
+    int      fd;                // ddriver句柄或镜像文件描述符
+    int      io_sz;             // 单次IO大小
+    long     size;              // 设备大小
+    uint8_t* map;               // mmap后端的映射地址
+    long     dirty_lo;          // mmap后端未msync的脏区间[dirty_lo, dirty_hi)
+    long     dirty_hi;
+    struct ddriver_state stat;  // 非ddriver后端自行统计的读写次数
+    int      io_err;            // 上次drain以来异步请求的第一个错误
+    void*    priv;              // 后端私有数据
+};
+
 struct newfs_super {
     uint32_t magic;
-    int      fd;
+    struct newfs_bdev* bdev;    // 块设备，见newfs_bdev.c
     /* TODO: Define yourself */
     int disk_size;        // 磁盘大小
     /* 逻辑块信息 */
@@ -83,26 +236,79 @@ struct newfs_super {
     int ino_max;            // 最大支持inode数
     int file_max;           // 支持文件最大大小
 
+    /* 空闲计数，随分配/释放O(1)维护，供statfs使用 */
+    int free_ino_cnt;       // 空闲inode数
+    int free_blk_cnt;       // 空闲数据块数
+
+    /* 分配提示，下次从该位置开始查找空闲位 */
+    int ino_hint;
+    int blk_hint;
+
+    /* 脏状态，卸载时只刷写脏的部分 */
+    uint32_t state;         // 磁盘上的挂载状态 NEWFS_STATE_*
+    int  ino_map_lo;        // inode位图中尚未写回的位范围[lo, hi)，lo >= hi表示未修改
+    int  ino_map_hi;
+    int  dat_map_lo;        // 数据块位图中尚未写回的位范围
+    int  dat_map_hi;
+    struct newfs_inode* dirty_list;    // 脏inode链表
+
     /* 根目录索引 */
     int root_ino;           // 根目录对应的inode
     struct newfs_dentry* root_dentry;  // 根目录对应的dentry
 
+    /* 跨目录重命名意图，见newfs_rename */
+    int rename_ino;         // 被移动的inode
+    int rename_src;         // 原父目录inode，与rename_dst相同表示没有进行中的重命名
+    int rename_dst;         // 新父目录inode
+
+    /* 共享数据块的引用计数表所在的隐藏inode，0表示没有共享块，见newfs_share.c */
+    int share_ino;
+    /* 去重索引所在的隐藏inode，0表示没有索引，见newfs_dedup.c */
+    int dedup_ino;
+    /* 数据块校验表所在的隐藏inode，0表示没有，见newfs_csum.c */
+    int csum_ino;
+    /* 快照表所在的隐藏inode，0表示没有快照，见newfs_snap.c */
+    int snap_ino;
+
+    /* 校验，见newfs_csum.c */
+    uint32_t features;      // NEWFS_FEAT_*
+    int ino_sz;             // inode槽位大小，旧镜像的inode_d不含csum
+    uint32_t ino_map_csum;  // 磁盘上两张位图的CRC32C，写回位图时更新
+    uint32_t dat_map_csum;
+
     /* 其他信息 */
     bool is_mounted;        // 是否已挂载
+    pthread_mutex_t lock;   // 全局锁，见NEWFS_LOCK
 
 };
 
 struct newfs_inode {
     uint32_t ino;
     /* TODO: Define yourself */
-    int                size;                          /* 文件已占用空间 */
-    // char               target_path[MAX_NAME_LEN];     /* store target path when it is a symlink */
+    int                size;                          /* 文件已占用空间，符号链接为目标路径长度 */
     int                dir_cnt;                       /* 目录项个数，当文件类型为目录时有效 */
+    int                nlink;                         /* 硬链接数，目录恒为1 */
     NEWFS_FILE_TYPE    ftype;                         /* 文件类型 */
-    struct newfs_dentry* dentry;                      /* 指向该inode的dentry，即inode的母目录 */
+    struct newfs_dentry* dentry;                      /* 最近一次经其访问的dentry，即inode的母目录；其余硬链接的dentry->inode为NULL */
     struct newfs_dentry* dentrys;                     /* 如果文件类型为目录，它的所有目录项 */
+    bool               dirty;                         /* 是否有未写回的修改 */
+    struct newfs_inode* dirty_next;                   /* 脏inode链表 */
+    bool               dir_loaded;                    /* 目录项是否已从磁盘读入 */
+    bool               unlinked;                      /* 已从目录树删除，最后一个引用释放后回收 */
+    bool               csum_bad;                      /* 磁盘上的inode或目录块校验失败，内容按空处理，拒绝访问且不写回 */
+    uint32_t           snap_gen;                      /* 已为该编号的快照保存过旧版本(或在其后创建)，0为未知 */
+    struct newfs_inode* reclaim_next;                 /* 回收队列 */
+    int                ref;                           /* 引用计数，非0不可淘汰 */
+    int                nr_cached;                     /* 在内存中的子inode数，非0不可淘汰 */
+    struct newfs_inode* lru_prev;                     /* inode缓存LRU链表 */
+    struct newfs_inode* lru_next;
+    struct newfs_inode* hash_next;                    /* inode缓存哈希链 */
     uint8_t*           data_blks[NEWFS_DATA_PER_FILE];/* 指向数据块的指针 */
+    uint8_t            blk_dirty[NEWFS_DATA_PER_FILE / UINT8_BITS]; /* 数据块缓冲是否被修改 */
     uint32_t           data[NEWFS_DATA_PER_FILE];     /* 数据块号 */
+    uint32_t           xattr_blk;                     /* 扩展属性块，-1为没有，见newfs_xattr.c */
+    int                xattr_len;                     /* xattr[]已用字节数 */
+    uint8_t            xattr[NEWFS_XATTR_INLINE];     /* inode内的扩展属性，随inode读入 */
 };
 
 struct newfs_dentry {
@@ -115,17 +321,185 @@ struct newfs_dentry {
     struct newfs_dentry* brother;
 };
 
-static inline struct newfs_dentry* new_dentry(char * fname, NEWFS_FILE_TYPE ftype) {
-    struct newfs_dentry * dentry = (struct newfs_dentry *)malloc(sizeof(struct newfs_dentry));
-    memset(dentry, 0, sizeof(struct newfs_dentry));
-    NEWFS_ASSIGN_FNAME(dentry, fname);
-    dentry->ino     = -1;
-    dentry->ftype   = ftype;
-    dentry->inode   = NULL;
-    dentry->parent  = NULL;
-    dentry->brother = NULL;
-    return dentry;                                       
-}
+struct newfs_ra;
+
+struct newfs_file {
+    struct newfs_inode*  inode;                       /* 打开时解析一次，持有inode引用 */
+    int                  ref;                         /* 句柄引用计数 */
+    int                  flags;                       /* open标志 */
+    /* 顺序读预读状态 */
+    long                 ra_next;                     /* 预期的下一次读偏移，命中即视为顺序读 */
+    int                  ra_size;                     /* 当前预读窗口块数，0表示随机读 */
+    int                  ra_end;                      /* 已提交预读的块号上界（不含） */
+    struct newfs_ra*     ra_list;                     /* 在途或未收割的预读请求 */
+    char*                snap;                        /* /.newfs_stats打开时的统计快照，普通文件为NULL */
+    size_t               snap_len;
+};
+
+struct newfs_slab_stat {
+    long allocs;            // 累计分配次数
+    long frees;             // 累计释放次数
+    long in_use;            // 当前在用对象数
+    long chunks;            // 向系统申请的chunk数
+    long bytes;             // 向系统申请的总字节数
+};
+
+struct newfs_slab {
+    const char*     name;
+    int             id;         // 线程缓存下标
+    unsigned        gen;        // 重建次数，用于作废线程缓存
+    size_t          obj_size;
+    size_t          align;
+    int             per_chunk;  // 每个chunk的对象数
+    pthread_mutex_t lock;
+    void*           free_list;  // 全局空闲链表
+    struct newfs_slab_stat stat;
+};
+
+enum newfs_op {
+    NEWFS_OP_GETATTR,
+    NEWFS_OP_READDIR,
+    NEWFS_OP_LOOKUP,
+    NEWFS_OP_READ,
+    NEWFS_OP_WRITE,
+    NEWFS_OP_MKNOD,
+    NEWFS_OP_MKDIR,
+    NEWFS_OP_SYNC,
+    NEWFS_OP_UNLINK,
+    NEWFS_OP_RMDIR,
+    NEWFS_OP_RENAME,
+    NEWFS_OP_TRUNCATE,
+    NEWFS_OP_FALLOCATE,
+    NEWFS_OP_IOCTL,
+    NEWFS_OP_CLONE,
+    NEWFS_OP_SNAP,
+    NEWFS_OP_LINK,
+    NEWFS_OP_SYMLINK,
+    NEWFS_OP_READLINK,
+    NEWFS_OP_SETXATTR,
+    NEWFS_OP_GETXATTR,
+    NEWFS_OP_LISTXATTR,
+    NEWFS_OP_REMOVEXATTR,
+    NEWFS_OP_NR
+};
+
+struct newfs_op_stat {
+    uint64_t count;
+    uint64_t errors;
+    uint64_t bytes;         // 读写字节数
+    uint64_t total_ns;
+    uint64_t hist[NEWFS_STAT_BUCKETS];
+};
+
+/* 跟踪级别，数值越大越详细 */
+enum newfs_trace_level {
+    NEWFS_TL_OFF,
+    NEWFS_TL_ERR,
+    NEWFS_TL_WARN,
+    NEWFS_TL_INFO,
+    NEWFS_TL_DEBUG,
+};
+
+/* 跟踪分类，按子系统划分，可用--trace_mask组合 */
+#define NEWFS_TC_SUPER          (1 << 0)
+#define NEWFS_TC_INODE          (1 << 1)
+#define NEWFS_TC_DENTRY         (1 << 2)
+#define NEWFS_TC_DATA           (1 << 3)
+#define NEWFS_TC_BDEV           (1 << 4)
+#define NEWFS_TC_CACHE          (1 << 5)
+#define NEWFS_TC_FUSE           (1 << 6)
+#define NEWFS_TC_ALL            0x7f
+
+struct newfs_trace_rec {
+    uint64_t    seq;        // 序号+1，0表示正在写入
+    uint64_t    ts;         // 单调时钟(ns)
+    const char* func;
+    uint16_t    cat;
+    uint8_t     level;
+    uint8_t     len;
+    char        msg[NEWFS_TRACE_MSG_SZ];
+};
+
+struct newfs_ratelimit {
+    uint64_t window;        // 当前计数所在的秒
+    uint32_t count;
+    uint32_t missed;        // 本窗口被丢弃的条数
+};
+
+struct newfs_icache_stat {
+    long nr_inodes;         // 缓存中的inode数
+    long hits;              // 命中次数
+    long misses;            // 未命中（从磁盘读入）次数
+    long evictions;         // 淘汰次数
+    long mem_used;          // 当前内存占用（字节）
+};
+
+struct newfs_reclaim_stat {
+    long queued;            // 等待回收的inode数
+    long inodes;            // 累计回收的inode数
+    long blks;              // 累计释放的数据块数
+    long runs;              // 累计清除的位图连续段数
+    long batches;           // 回收批次数
+};
+
+struct newfs_comp_stat {
+    long     clusters;      // 压缩写回的簇数
+    long     fallbacks;     // 不可压缩、按原样写回的簇数
+    long     loads;         // 解压次数
+    long     expands;       // 为写入展开的簇数
+    uint64_t raw_bytes;     // 压缩簇的原始字节数
+    uint64_t stored_bytes;  // 压缩簇实际占用的字节数
+    uint64_t comp_ns;       // 压缩耗时(含不可压缩的尝试)
+    uint64_t decomp_ns;     // 解压耗时(含读设备)
+};
+
+struct newfs_dedup_stat {
+    long     hits;          // 与已有块内容相同、改为共享的块数
+    long     inserts;       // 写回并加入索引的块数
+    long     mismatches;    // 指纹相同但内容不同的次数
+    long     evictions;     // 索引探测满、覆盖旧项的次数
+    uint64_t hash_ns;       // 计算指纹耗时
+    uint64_t verify_ns;     // 读出候选块比较内容的耗时
+};
+
+struct newfs_csum_stat {
+    long     meta_verifies; // 校验的超级块、位图、inode与目录块数
+    long     meta_failures;
+    long     data_verifies; // 读入时校验的数据块数(表中没有记录的块不计)
+    long     data_failures;
+    long     data_updates;  // 写回时更新的数据块校验和
+    uint64_t bytes;         // 计算CRC32C的总字节数
+    uint64_t ns;            // 计算CRC32C的总耗时
+};
+
+struct newfs_snap_stat {
+    long     creates;       // 创建的快照数
+    long     deletes;       // 删除的快照数
+    long     inodes;        // 首次修改前保存旧版本的inode数
+    long     shared_blks;   // 保存文件时改为共享的数据块数
+    long     dir_blks;      // 保存目录时复制的目录块数
+    long     freed_blks;    // 删除快照时释放的数据块数
+    uint64_t create_ns;     // 创建快照耗时(含刷写脏数据)
+    uint64_t cow_ns;        // 保存旧版本耗时
+};
+
+struct newfs_xattr_stat {
+    long     gets;          // 读取的属性数(含列出)
+    long     inline_hits;   // 在inode内找到、没有额外IO的次数
+    long     blk_reads;     // 读属性块的次数
+    long     blk_writes;    // 写属性块的次数
+    long     spills;        // inode内放不下、写入属性块的属性数
+};
+
+struct newfs_prefetch_stat {
+    long     budget;        // 预算(字节)，0为关闭
+    long     jobs;          // 开始预取的目录数
+    long     epochs;        // 同一目录重新开始的轮数
+    long     files;         // 预取的文件数
+    long     blks;          // 预取的数据块数
+    long     hits;          // 打开时数据已由预取读入或留在缓存中的文件数
+    long     ahead;         // 当前已预取而未打开的字节数
+};
 
 /******************************************************************************
 * SECTION: FS Specific Structure - Disk structure
@@ -154,27 +528,165 @@ struct newfs_super_d {
     int ino_max;            // 最大支持inode数
     int file_max;           // 支持文件最大大小
 
+    /* 空闲计数，挂载时与位图校验 */
+    int free_ino_cnt;       // 空闲inode数
+    int free_blk_cnt;       // 空闲数据块数
+
+    /* 分配提示 */
+    int ino_hint;
+    int blk_hint;
+
+    uint32_t state;         // NEWFS_STATE_CLEAN表示上次正常卸载
+
     /* 根目录索引 */
     int root_ino;           // 根目录对应的inode
 
     /* 其他信息 */
+    int blks_size;          // 逻辑块大小，格式化时确定；旧镜像为0，按默认值处理
 
+    /* 跨目录重命名意图，写回两个目录期间有效；旧镜像为0，即没有进行中的重命名 */
+    int rename_ino;
+    int rename_src;
+    int rename_dst;
+
+    /* 引用计数表所在的隐藏inode；旧镜像为0，即没有共享块 */
+    int share_ino;
+
+    /* 去重索引所在的隐藏inode，只在正常卸载后可信；旧镜像为0，即没有索引 */
+    int dedup_ino;
+
+    /* 以下为校验，旧镜像为0，即不校验。features带NEWFS_FEAT_CSUM时inode槽位含csum */
+    uint32_t features;
+    uint32_t ino_map_csum;  // 磁盘上两张位图(整块)的CRC32C
+    uint32_t dat_map_csum;
+    int      csum_ino;      // 数据块校验表所在的隐藏inode，只在正常卸载后可信
+
+    /* 快照表所在的隐藏inode。features不带NEWFS_FEAT_SNAP的镜像没有这一项，校验和存放在它的位置上 */
+    int      snap_ino;
+
+    uint32_t csum;          // 以上全部字段的CRC32C，必须是最后一项
 };
 
 struct newfs_inode_d {
     uint32_t ino;
     /* TODO: Define yourself */
-    int                size;                          /* 文件已占用空间 */
-    // char               target_path[MAX_NAME_LEN];     /* store target path when it is a symlink */
-    int                dir_cnt;                       /* 目录项个数，当文件类型为目录时有效 */
+    int                size;                          /* 文件已占用空间，符号链接为目标路径长度 */
+    union {
+        int            dir_cnt;                       /* 目录项个数，当文件类型为目录时有效 */
+        int            nlink;                         /* 硬链接数，其他类型有效；旧镜像为0，按1处理 */
+    };
     NEWFS_FILE_TYPE    ftype;                         /* 文件类型 */
-    uint32_t           data[NEWFS_DATA_PER_FILE];     /* 数据块号 */
+    uint32_t           data[NEWFS_DATA_PER_FILE];     /* 数据块号，短目标的符号链接为目标字符串 */
+    /* 扩展属性，只有带NEWFS_FEAT_XATTR的镜像的槽位含这几项 */
+    uint32_t           xattr_blk;                     /* 放不进xattr[]的属性所在的数据块，-1为没有 */
+    uint16_t           xattr_len;                     /* xattr[]已用字节数 */
+    uint16_t           xattr_pad;
+    uint8_t            xattr[NEWFS_XATTR_INLINE];     /* 扩展属性条目，格式见newfs_xattr_ent_d */
+    uint32_t           csum;                          /* 槽位中此前全部内容的CRC32C，总在槽位的最后4字节，旧镜像的槽位不含此项 */
 };
 
+/* 扩展属性条目：头部之后紧跟名字(不含'\0')与值，条目首尾相接，不对齐 */
+struct newfs_xattr_ent_d {
+    uint8_t            name_len;
+    uint8_t            pad;
+    uint16_t           value_len;
+};
+
+/* 扩展属性块：头部之后是与inode内相同格式的条目 */
+struct newfs_xattr_blk_d {
+    uint32_t           magic;                         /* NEWFS_XATTR_MAGIC */
+    uint32_t           len;                           /* 条目总字节数 */
+    uint32_t           csum;                          /* 条目的CRC32C，不带NEWFS_FEAT_CSUM时为0 */
+};
+
+struct newfs_comp_hdr_d {
+    uint32_t clen;                                    /* 压缩数据长度，紧随本头部 */
+    uint32_t rlen;                                    /* 原始长度 */
+};
+
+struct newfs_share_d {
+    uint32_t blkno;
+    uint32_t ref;                                     /* 引用数，表中的块总是>=2 */
+};
+
+/* 快照表按创建顺序存放，编号递增；map_ino中是该快照保存的旧inode，按ino排序 */
+struct newfs_snap_d {
+    char     name[NEWFS_SNAP_NAME_LEN];
+    uint32_t id;
+    int      map_ino;                                 /* 保存的旧inode表所在的隐藏inode，0表示没有 */
+    int64_t  ctime;                                   /* 创建时间(秒) */
+};
+
+/* 快照时刻的inode ino在slot槽位中；slot为NEWFS_SNAP_ABSENT时该inode当时不存在 */
+struct newfs_snap_map_d {
+    uint32_t ino;
+    uint32_t slot;
+};
+
+struct newfs_dedup_d {
+    uint64_t hash;                                    /* 块内容指纹 */
+    uint32_t blkno;                                   /* 内容为该指纹的数据块，-1为空项 */
+    uint32_t pad;
+};
+
+/* 目录块按newfs_dentry_d依次存放，带校验时块的最后4字节为前面内容的CRC32C；
+ * 1K~64K的块放满目录项后总会余下至少8字节，每块的目录项数不受影响 */
 struct newfs_dentry_d {
     char     name[MAX_NAME_LEN];
     uint32_t ino;
     NEWFS_FILE_TYPE      ftype;
 };
 
+/* 操作记录文件格式：文件头之后是变长记录，每条为newfs_rec_d加path_len字节路径(不含'\0') */
+enum newfs_rec_op {
+    NEWFS_REC_GETATTR = 1,
+    NEWFS_REC_READDIR,
+    NEWFS_REC_OPEN,
+    NEWFS_REC_OPENDIR,
+    NEWFS_REC_READ,
+    NEWFS_REC_WRITE,
+    NEWFS_REC_MKNOD,
+    NEWFS_REC_MKDIR,
+    NEWFS_REC_FLUSH,
+    NEWFS_REC_RELEASE,
+    NEWFS_REC_RELEASEDIR,
+    NEWFS_REC_STATFS,
+    NEWFS_REC_UTIMENS,
+    NEWFS_REC_UNLINK,
+    NEWFS_REC_RMDIR,
+    NEWFS_REC_RENAME,       // 路径为"from\0to"
+    NEWFS_REC_TRUNCATE,     // offset为新大小
+    NEWFS_REC_FALLOCATE,    // offset/size为范围，pad为mode
+    NEWFS_REC_IOCTL,        // offset为传入的偏移，size为cmd
+    NEWFS_REC_CLONE,        // 路径为"dst\0src\0"加8字节src_off，offset为dst_off，size为长度
+    NEWFS_REC_SNAP,         // 路径为"path\0name"，size为cmd
+    NEWFS_REC_LINK,         // 路径为"from\0to"
+    NEWFS_REC_SYMLINK,      // 路径为"target\0linkpath"
+    NEWFS_REC_READLINK,     // size为缓冲区大小
+    NEWFS_REC_SETXATTR,     // 路径为"path\0name"，size为值长度(值不记录)，pad为flags
+    NEWFS_REC_GETXATTR,     // 路径为"path\0name"，size为缓冲区大小
+    NEWFS_REC_LISTXATTR,    // size为缓冲区大小
+    NEWFS_REC_REMOVEXATTR,  // 路径为"path\0name"
+    NEWFS_REC_NR
+};
+
+struct newfs_rec_hdr_d {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t rec_size;      // sizeof(struct newfs_rec_d)
+    uint64_t start;         // 开始记录时的CLOCK_REALTIME(ns)
+};
+
+struct newfs_rec_d {
+    uint64_t ts;            // 操作开始时间，相对开始记录(ns)
+    uint64_t fh;            // 文件句柄，回放时据此对应open与read/write/release
+    int64_t  offset;        // 读写偏移
+    uint32_t size;          // 读写长度；open为flags，mknod/mkdir为mode
+    int32_t  ret;           // 返回值
+    uint32_t lat;           // 耗时(ns)
+    uint16_t path_len;
+    uint8_t  op;            // NEWFS_REC_*
+    uint8_t  pad;
+};
+
 #endif /* _TYPES_H_ */
\ No newline at end of file
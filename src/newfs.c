@@ -2,6 +2,7 @@
 
 #include "newfs.h"
 #include <stdbool.h>
+#include <limits.h>
 
 /******************************************************************************
 * SECTION: 宏定义
@@ -11,13 +12,28 @@
 /******************************************************************************
 * SECTION: 全局变量
 *******************************************************************************/
+#ifndef NEWFS_NO_MAIN
 static const struct fuse_opt option_spec[] = {		/* 用于FUSE文件系统解析参数 */
 	OPTION("--device=%s", device),
+	OPTION("--debug", debug),
+	OPTION("--cache_mb=%d", cache_mb),
+	OPTION("--blksize=%d", blksize),
+	OPTION("--trace=%d", trace),
+	OPTION("--trace_mask=%i", trace_mask),
+	OPTION("--record=%s", record),
+	OPTION("--compress", compress),
+	OPTION("--dedup", dedup),
+	OPTION("--data_csum", data_csum),
+	OPTION("--snapshot=%s", snapshot),
+	OPTION("--prefetch_mb=%d", prefetch_mb),
 	FUSE_OPT_END
 };
+#endif
 
 struct custom_options newfs_options;			 /* 全局选项 */
 struct newfs_super super;
+extern struct newfs_csum_stat csum_stat;
+extern struct newfs_xattr_stat xattr_stat;
 
 /******************************************************************************
 * SECTION: FUSE操作定义
@@ -29,37 +45,90 @@ static struct fuse_operations operations = {
 	.getattr = newfs_getattr,				 /* 获取文件属性，类似stat，必须完成 */
 	.readdir = newfs_readdir,				 /* 填充dentrys */
 	.mknod = newfs_mknod,					 /* 创建文件，touch相关 */
-	.write = NULL,								  	 /* 写入文件 */
-	.read = NULL,								  	 /* 读文件 */
+	.write = newfs_write,					 /* 写入文件 */
+	.read = newfs_read,						 /* 读文件 */
 	.utimens = newfs_utimens,				 /* 修改时间，忽略，避免touch报错 */
-	.truncate = NULL,						  		 /* 改变文件大小 */
-	.unlink = NULL,							  		 /* 删除文件 */
-	.rmdir	= NULL,							  		 /* 删除目录， rm -r */
-	.rename = NULL,							  		 /* 重命名，mv */
-
-	.open = NULL,							
-	.opendir = NULL,
+	.statfs = newfs_statfs,					 /* 文件系统容量，df相关 */
+	.truncate = newfs_truncate,				 /* 改变文件大小 */
+	.ftruncate = newfs_ftruncate,			 /* 改变已打开文件的大小 */
+	.fallocate = newfs_fallocate,			 /* 预分配空间 */
+	.ioctl = newfs_ioctl,					 /* SEEK_DATA/SEEK_HOLE */
+	.unlink = newfs_unlink,					 /* 删除文件 */
+	.rmdir	= newfs_rmdir,					 /* 删除目录， rm -r */
+	.rename = newfs_rename,					 /* 重命名，mv */
+	.link = newfs_link,						 /* 硬链接，ln */
+	.symlink = newfs_symlink,				 /* 符号链接，ln -s */
+	.readlink = newfs_readlink,				 /* 读符号链接目标 */
+	.setxattr = newfs_setxattr,				 /* 扩展属性，setfattr */
+	.getxattr = newfs_getxattr,				 /* 读扩展属性，getfattr */
+	.listxattr = newfs_listxattr,			 /* 列出扩展属性名 */
+	.removexattr = newfs_removexattr,		 /* 删除扩展属性 */
+
+	.open = newfs_open,						 /* 打开文件，句柄存入fi->fh */
+	.opendir = newfs_opendir,				 /* 打开目录，句柄存入fi->fh */
+	.flush = newfs_flush,					 /* close时写回 */
+	.release = newfs_release,				 /* 关闭文件，释放句柄 */
+	.releasedir = newfs_release,			 /* 关闭目录，释放句柄 */
 	.access = NULL
 };
 /******************************************************************************
 * SECTION: 必做函数实现
 *******************************************************************************/
 /**
- * @brief 文件系统布局:
- * 磁盘容量为4MB，逻辑块大小为1024B，那么逻辑块数为4MB / 1024B = 4096块
- * 假设每个文件最多直接索引(*5)个逻辑块来填写文件数据，每个文件数据上限是 5 * 1024B = 5KB。
- * 假设一个文件的索引节点大小为(*36B)，那么每个逻辑块可以存放1024B / (*36B) = (*28)个索引节点。
- * @attention 文件索引结点大小最后根据数据结构体struct inode_d的实际大小来定！！！
- * 维护一个文件所需要的存储容量是，那么4MB磁盘，最多可以存放的文件数是4MB / (5KB + (*36B)) = (*812)。
+ * @brief 文件系统布局，格式化时按磁盘大小与逻辑块大小计算(newfs_calc_layout):
+ * 逻辑块大小由--blksize指定(1K~64K，2的幂，默认1024B)，写入超级块，之后挂载沿用。
  * super block: 1个逻辑块
- * 索引结点位图：1个逻辑块（位图可以记录8192个索引结点的使用情况，远大于(*812)个）
- * 数据块位图：1个逻辑块（位图可以记录8192个数据块的使用情况，远大于(*4065)个）
- * 索引结点区：(*29)个逻辑块。一个逻辑块放(*28)个索引节点struct inode_d，(*812)个文件，也就是 (*812) / (*28) = (*29)个逻辑块。
- * 数据块区：剩余的逻辑块，即4096 - 1 - 1 - 1 - (*29) = (*4064)个逻辑块
- * 
- * 其中目录项为136B大小，那么每个逻辑块可以存放1024B / 136B = 7个目录项。一个inode最多5*7=35个目录项。
+ * 索引结点位图：ceil(ino_max / (8 * BSIZE))个逻辑块
+ * 数据块位图：ceil(数据块数 / (8 * BSIZE))个逻辑块
+ * 索引结点区：按每NEWFS_BYTES_PER_INODE字节磁盘一个inode估算，inode_d按槽位连续存放，
+ *            区域向上取整到整块后，剩余空间也用作inode槽位
+ * 数据块区：剩余的逻辑块
+ *
+ * 以4MB磁盘、1024B逻辑块为例(与include/fs.layout一致)：inode_d为4368B(含256B扩展属性区)，4MB / 32KB = 128个inode，
+ * 128 * 4368B / 1024B = 546个逻辑块；数据块区 4096 - 1 - 1 - 1 - 546 = 3547个逻辑块。
+ * 目录项为136B大小，每个逻辑块可以存放BSIZE / 136B个目录项，块末尾4字节为校验和。
+ * 格式化时设置NEWFS_FEAT_CSUM与NEWFS_FEAT_XATTR；没有前者的旧镜像inode槽位为4112B，不校验，
+ * 只有前者的为4116B，两者都不含扩展属性区，不支持扩展属性。
 */
 
+/**
+ * @brief 按磁盘大小与逻辑块大小计算磁盘布局，填入内存超级块
+ * 
+ * @param blk 逻辑块大小
+ */
+static void newfs_calc_layout(int blk) {
+	int total_blks = super.disk_size / blk;
+	int bits_per_blk = blk * UINT8_BITS;
+	int ino_max = super.disk_size / NEWFS_BYTES_PER_INODE;
+
+	if (ino_max < NEWFS_MIN_INODES) {
+		ino_max = NEWFS_MIN_INODES;
+	}
+	super.inode_blks   = (ino_max * super.ino_sz + blk - 1) / blk;
+	super.ino_max      = NEWFS_BLKS_SZ(super.inode_blks) / super.ino_sz; /* 用满取整后的inode区 */
+	super.sb_blks      = 1;
+	super.ino_map_blks = (super.ino_max + bits_per_blk - 1) / bits_per_blk;
+	/* 数据块位图大小取决于数据块数，而数据块数又扣除了位图本身，迭代到稳定 */
+	super.dat_map_blks = 1;
+	for (;;) {
+		int data_blks = total_blks - super.sb_blks - super.ino_map_blks
+						- super.dat_map_blks - super.inode_blks;
+		int need = (data_blks + bits_per_blk - 1) / bits_per_blk;
+		if (need <= super.dat_map_blks) {
+			super.data_blks = data_blks;
+			break;
+		}
+		super.dat_map_blks = need;
+	}
+
+	super.sb_offset      = 0;
+	super.ino_map_offset = NEWFS_BLKS_SZ(super.sb_blks);
+	super.dat_map_offset = super.ino_map_offset + NEWFS_BLKS_SZ(super.ino_map_blks);
+	super.inode_offset   = super.dat_map_offset + NEWFS_BLKS_SZ(super.dat_map_blks);
+	super.data_offset    = super.inode_offset + NEWFS_BLKS_SZ(super.inode_blks);
+	super.file_max       = NEWFS_DATA_PER_FILE * blk; // 支持文件最大大小
+}
+
 /**
  * @brief 挂载（mount）文件系统
  * 
@@ -69,70 +138,101 @@ static struct fuse_operations operations = {
 void* newfs_init(struct fuse_conn_info * conn_info) {
 	/* TODO: 在这里进行挂载 */
 	/*定义磁盘各部分结构*/
-    int                 	driver_fd;
     struct newfs_super_d  	newfs_super_d; 
     struct newfs_dentry*  	root_dentry;
     struct newfs_inode*   	root_inode;
 
-    super.is_mounted = false;
-
-	// 打开设备
-	driver_fd = ddriver_open((char*)newfs_options.device);
-	if (driver_fd < 0) {
+    newfs_trace_init();
+    memset(&csum_stat, 0, sizeof(csum_stat));
+    memset(&xattr_stat, 0, sizeof(xattr_stat));
+    super.is_mounted    = false;
+    super.dirty_list    = NULL;
+    pthread_mutex_init(&super.lock, NULL);
+    newfs_icache_init((long)newfs_options.cache_mb * 1024 * 1024);
+    super.ino_map_lo    = super.ino_map_hi = 0;
+    super.dat_map_lo    = super.dat_map_hi = 0;
+
+	// 打开设备，按--device的scheme选择ddriver或镜像文件后端
+	super.bdev = newfs_bdev_open(newfs_options.device);
+	if (super.bdev == NULL) {
 		// 错误处理：无法打开设备
 		return NULL;
 	}
 
-	// 向内存超级块中标记驱动并写入磁盘大小和单次IO大小
-	super.fd = driver_fd;
-	ddriver_ioctl(super.fd, IOC_REQ_DEVICE_SIZE,  &super.disk_size); // 4MB
-	int disk_io_sz;
-	ddriver_ioctl(super.fd, IOC_REQ_DEVICE_IO_SZ, &disk_io_sz);
-	super.blks_size = 2 * disk_io_sz; // 逻辑块大小1024B
+	// 向内存超级块中写入磁盘大小和单次IO大小
+	super.disk_size = (int)super.bdev->size; // 4MB
+	int disk_io_sz = super.bdev->io_sz;
    	// 读取磁盘超级块到内存
 	your_read(0, &newfs_super_d, sizeof(struct newfs_super_d));
+
+	// 逻辑块大小：已格式化的磁盘以超级块为准，否则取--blksize，缺省为两个IO单位(1024B)
+	if (newfs_super_d.magic == NEWFS_MAGIC) {
+		super.blks_size = newfs_super_d.blks_size ? newfs_super_d.blks_size : 2 * disk_io_sz;
+	} else {
+		super.blks_size = newfs_options.blksize ? newfs_options.blksize : 2 * disk_io_sz;
+	}
+	if (super.blks_size % disk_io_sz != 0) {
+		NEWFS_TRACE(NEWFS_TC_SUPER, NEWFS_TL_ERR, "block size %d is not a multiple of device io size %d",
+					super.blks_size, disk_io_sz);
+		newfs_bdev_close(super.bdev);
+		super.bdev = NULL;
+		return NULL;
+	}
+	newfs_slab_init();				 /* 块缓冲池按逻辑块大小建立 */
+	if (newfs_super_d.magic == NEWFS_MAGIC && (newfs_super_d.features & NEWFS_FEAT_CSUM)
+		&& !newfs_csum_super_ok(&newfs_super_d)) {
+		NEWFS_TRACE(NEWFS_TC_SUPER, NEWFS_TL_ERR, "superblock checksum mismatch, run fsck.newfs");
+		newfs_bdev_close(super.bdev);
+		super.bdev = NULL;
+		return NULL;
+	}
+ 
+	if (newfs_super_d.magic != NEWFS_MAGIC && newfs_options.snapshot != NULL) {
+		NEWFS_TRACE(NEWFS_TC_SUPER, NEWFS_TL_ERR, "no snapshot on unformatted device");
+		newfs_bdev_close(super.bdev);
+		super.bdev = NULL;
+		return NULL;
+	}
  
 	if(newfs_super_d.magic != NEWFS_MAGIC) {
 		/* 第一次挂载 */
         /* 将上述估算思路用代码实现 */
 
         /* 填充超级块的磁盘布局信息字段 */ 
-		// step 1: 重新估计磁盘布局信息 
-		int blk = super.blks_size;   // 逻辑块大小1024B
-        super.sb_offset = 0;           // 超级块于磁盘中的偏移，默认为0
-        super.sb_blks = 1;             // 超级块于磁盘中的逻辑块数
-
-        super.ino_map_offset = blk;      // 索引节点位图于磁盘中的偏移(1个逻辑块)
-        super.ino_map_blks = 1;        // 索引节点位图于磁盘中的块数
-
-        super.dat_map_offset = 2*blk;      // 数据块位图于磁盘中的偏移(2个逻辑块)
-		super.dat_map_blks = 1;        // 数据块位图于磁盘中的块数
-
-		super.inode_offset = 3*blk;       // 索引节点区于磁盘中的偏移(3个逻辑块)
-		super.inode_blks = 29;         // 索引节点区于磁盘中的块数
+		// step 1: 按逻辑块大小计算磁盘布局信息，新格式化的文件系统总是带校验
+		super.features = NEWFS_FEAT_CSUM | NEWFS_FEAT_SNAP | NEWFS_FEAT_XATTR;
+		super.ino_sz   = newfs_inode_d_size(super.features);
+		newfs_calc_layout(super.blks_size);
 
-		super.data_offset = 32*blk;        // 数据块区于磁盘中的偏移(29个逻辑块)
-		super.data_blks = 4064;        // 数据块区于磁盘中的块数
-
-		/* 计算支持的最大inode数和文件大小 */
-		super.ino_max = super.inode_blks * (super.blks_size / sizeof(struct newfs_inode)); // 最大支持inode数
-		super.file_max = NEWFS_DATA_PER_FILE * super.blks_size; // 支持文件最大大小
+		/* 全新磁盘，全部空闲 */
+		super.free_ino_cnt = super.ino_max;
+		super.free_blk_cnt = super.data_blks;
+		super.ino_hint     = 0;
+		super.blk_hint     = 0;
 
 		/* 根目录对应的inode */
 		super.root_ino = 0; // 根目录对应的inode编号为0
+		super.rename_ino = super.rename_src = super.rename_dst = 0;
+		super.share_ino  = 0;
+		super.dedup_ino  = 0;
+		super.csum_ino   = 0;
+		super.snap_ino   = 0;
+		newfs_snap_destroy();	 /* 没有快照 */
 
 		// 幻数初始化
 		super.magic = NEWFS_MAGIC;
 
 		// step 2: 清零索引结点、数据块位图
 		// 数据块位图全0
-		super.ino_bitmap = (uint8_t *)malloc(super.blks_size);
-		memset(super.ino_bitmap, 0, super.blks_size);
-		your_write(super.ino_map_offset, super.ino_bitmap, super.blks_size);
+		super.ino_bitmap = (uint8_t *)malloc(NEWFS_BLKS_SZ(super.ino_map_blks));
+		memset(super.ino_bitmap, 0, NEWFS_BLKS_SZ(super.ino_map_blks));
+		your_write(super.ino_map_offset, super.ino_bitmap, NEWFS_BLKS_SZ(super.ino_map_blks));
+		super.ino_map_csum = newfs_csum_map(super.ino_bitmap, NEWFS_BLKS_SZ(super.ino_map_blks));
 
-		super.data_bitmap = (uint8_t *)malloc(super.blks_size);
-		memset(super.data_bitmap, 0, super.blks_size);  
-		your_write(super.dat_map_offset, super.data_bitmap, super.blks_size);
+		super.data_bitmap = (uint8_t *)malloc(NEWFS_BLKS_SZ(super.dat_map_blks));
+		memset(super.data_bitmap, 0, NEWFS_BLKS_SZ(super.dat_map_blks));  
+		your_write(super.dat_map_offset, super.data_bitmap, NEWFS_BLKS_SZ(super.dat_map_blks));
+		super.dat_map_csum = newfs_csum_map(super.data_bitmap, NEWFS_BLKS_SZ(super.dat_map_blks));
 
 		// step 3: 创建空根目inode和dentry
 		// 创建根目录dentry
@@ -141,7 +241,7 @@ void* newfs_init(struct fuse_conn_info * conn_info) {
 		root_dentry->parent = NULL; /* 根目录没有父目录 */
         root_inode = newfs_alloc_inode(root_dentry);
 		if (root_inode == NULL) {
-    		NEWFS_DBG("alloc root inode failed\n");
+    		NEWFS_TRACE(NEWFS_TC_SUPER, NEWFS_TL_ERR, "alloc root inode failed");
     		/* 释放并返回错误 */
     		return NULL;
 		}
@@ -152,6 +252,10 @@ void* newfs_init(struct fuse_conn_info * conn_info) {
     }else {
 		/* 非第一次挂载 */
 		/* 读取超级块的磁盘布局信息字段到内存超级块 */
+		super.features         = newfs_super_d.features;
+		super.ino_sz           = newfs_inode_d_size(super.features);
+		super.ino_map_csum     = newfs_super_d.ino_map_csum;
+		super.dat_map_csum     = newfs_super_d.dat_map_csum;
 		super.sb_offset        = newfs_super_d.sb_offset;
 		super.sb_blks          = newfs_super_d.sb_blks;
 
@@ -161,10 +265,10 @@ void* newfs_init(struct fuse_conn_info * conn_info) {
 		super.dat_map_offset   = newfs_super_d.dat_map_offset;
 		super.dat_map_blks     = newfs_super_d.dat_map_blks;
 
-		super.ino_bitmap = (uint8_t *)malloc(super.blks_size);
-		super.data_bitmap = (uint8_t *)malloc(super.blks_size);
-		your_read(super.ino_map_offset, super.ino_bitmap, NEWFS_IO_SZ());
-		your_read(super.dat_map_offset, super.data_bitmap, NEWFS_IO_SZ());
+		super.ino_bitmap = (uint8_t *)malloc(NEWFS_BLKS_SZ(super.ino_map_blks));
+		super.data_bitmap = (uint8_t *)malloc(NEWFS_BLKS_SZ(super.dat_map_blks));
+		your_read(super.ino_map_offset, super.ino_bitmap, NEWFS_BLKS_SZ(super.ino_map_blks));
+		your_read(super.dat_map_offset, super.data_bitmap, NEWFS_BLKS_SZ(super.dat_map_blks));
 
 		super.inode_offset     = newfs_super_d.inode_offset;
 		super.inode_blks       = newfs_super_d.inode_blks;
@@ -176,20 +280,97 @@ void* newfs_init(struct fuse_conn_info * conn_info) {
 		super.file_max         = newfs_super_d.file_max;
 		super.root_ino         = newfs_super_d.root_ino;
 
+		super.free_ino_cnt     = newfs_super_d.free_ino_cnt;
+		super.free_blk_cnt     = newfs_super_d.free_blk_cnt;
+		super.ino_hint         = newfs_super_d.ino_hint;
+		super.blk_hint         = newfs_super_d.blk_hint;
+		super.rename_ino       = newfs_super_d.rename_ino;
+		super.rename_src       = newfs_super_d.rename_src;
+		super.rename_dst       = newfs_super_d.rename_dst;
+		super.share_ino        = newfs_super_d.share_ino;
+		super.dedup_ino        = newfs_super_d.dedup_ino;
+		super.csum_ino         = newfs_super_d.csum_ino;
+		super.snap_ino         = (super.features & NEWFS_FEAT_SNAP) ? newfs_super_d.snap_ino : 0;
+
+		/* 位图只在卸载时写回：正常卸载后校验不符说明已损坏，拒绝挂载；
+		 * 异常退出时可能正写到一半，计数随后按位图重建 */
+		if (NEWFS_CSUM_ON()
+			&& (!newfs_csum_map_ok(super.ino_map_csum, super.ino_bitmap, NEWFS_BLKS_SZ(super.ino_map_blks))
+				|| !newfs_csum_map_ok(super.dat_map_csum, super.data_bitmap, NEWFS_BLKS_SZ(super.dat_map_blks)))) {
+			if (newfs_super_d.state == NEWFS_STATE_CLEAN) {
+				NEWFS_TRACE(NEWFS_TC_SUPER, NEWFS_TL_ERR, "bitmap checksum mismatch, run fsck.newfs");
+				free(super.ino_bitmap);
+				free(super.data_bitmap);
+				super.ino_bitmap = super.data_bitmap = NULL;
+				newfs_bdev_close(super.bdev);
+				super.bdev = NULL;
+				return NULL;
+			}
+			NEWFS_TRACE(NEWFS_TC_SUPER, NEWFS_TL_WARN, "bitmap checksum mismatch after unclean unmount");
+			super.ino_map_csum = newfs_csum_map(super.ino_bitmap, NEWFS_BLKS_SZ(super.ino_map_blks));
+			super.dat_map_csum = newfs_csum_map(super.data_bitmap, NEWFS_BLKS_SZ(super.dat_map_blks));
+		}
+
+		/* 读入快照表；--snapshot时只读挂载其中一个，此后读入的inode都按快照重定向 */
+		if (newfs_snap_load() != NEWFS_ERROR_NONE) {
+			NEWFS_TRACE(NEWFS_TC_SUPER, NEWFS_TL_ERR, "snapshot table lost, run fsck.newfs");
+		}
+		if (newfs_options.snapshot != NULL && newfs_snap_mount(newfs_options.snapshot) != NEWFS_ERROR_NONE) {
+			NEWFS_TRACE(NEWFS_TC_SUPER, NEWFS_TL_ERR, "snapshot %s not found", newfs_options.snapshot);
+			newfs_snap_destroy();
+			free(super.ino_bitmap);
+			free(super.data_bitmap);
+			super.ino_bitmap = super.data_bitmap = NULL;
+			newfs_bdev_close(super.bdev);
+			super.bdev = NULL;
+			return NULL;
+		}
+
+		if (newfs_super_d.state != NEWFS_STATE_CLEAN) {
+			/* 上次没有正常卸载：计数以位图为准，分配提示作废 */
+			int free_ino = super.ino_max - newfs_bitmap_count(super.ino_bitmap, super.ino_max);
+			int free_blk = super.data_blks - newfs_bitmap_count(super.data_bitmap, super.data_blks);
+			if (free_ino != super.free_ino_cnt || free_blk != super.free_blk_cnt) {
+				NEWFS_TRACE(NEWFS_TC_SUPER, NEWFS_TL_WARN, "free counters mismatch: ino %d/%d, blk %d/%d, fixed from bitmap",
+							super.free_ino_cnt, free_ino, super.free_blk_cnt, free_blk);
+				super.free_ino_cnt = free_ino;
+				super.free_blk_cnt = free_blk;
+			}
+			super.ino_hint = 0;
+			super.blk_hint = 0;
+			/* 上次跨目录重命名写到一半时补完，只读挂载快照时不写磁盘 */
+			if (!newfs_snap_readonly() && newfs_rename_recover() != NEWFS_ERROR_NONE) {
+				NEWFS_TRACE(NEWFS_TC_SUPER, NEWFS_TL_ERR, "rename recovery failed");
+			}
+		}
+
 		root_dentry            = new_dentry("/", NEWFS_DIR);
 		root_dentry->ino       = super.root_ino;
 		root_dentry->parent    = NULL;
-		root_inode             = newfs_read_inode(root_dentry, NEWFS_ROOT_INO);  /* 读取根目录 */
-		root_dentry->inode     = root_inode;
+		root_inode             = newfs_iget(root_dentry);  /* 读取根目录inode，目录项在首次查找时读入 */
 	}
 
 	super.root_dentry 	  = root_dentry;
 	super.is_mounted      = true;
+	if (newfs_share_load() != NEWFS_ERROR_NONE) {
+		NEWFS_TRACE(NEWFS_TC_SUPER, NEWFS_TL_ERR, "block refcount table lost, run fsck.newfs");
+	}
+	newfs_dedup_load(newfs_super_d.magic == NEWFS_MAGIC && newfs_super_d.state == NEWFS_STATE_CLEAN);
+	newfs_csum_load(newfs_super_d.magic == NEWFS_MAGIC && newfs_super_d.state == NEWFS_STATE_CLEAN);
+	newfs_reclaim_start();
+	newfs_prefetch_start();
+
+	/* 挂载期间磁盘上标记为脏，异常退出后下次挂载会按位图重建 */
+	if (!newfs_snap_readonly()) {
+		newfs_sync_super(NEWFS_STATE_DIRTY);
+	}
 	
-	printf("ino bitmap:\n");
-	newfs_dump_map(super.ino_bitmap); /* 调试：打印位图 */
-	printf("data bitmap:\n");
-	newfs_dump_map(super.data_bitmap);
+	if (newfs_options.debug) {
+		printf("ino bitmap:\n");
+		newfs_dump_map(super.ino_bitmap); /* 调试：打印位图 */
+		printf("data bitmap:\n");
+		newfs_dump_map(super.data_bitmap);
+	}
 	return NULL;
 }
 
@@ -201,7 +382,6 @@ void* newfs_init(struct fuse_conn_info * conn_info) {
  */
 void newfs_destroy(void* p) {
 	/* TODO: 在这里进行卸载 */
-	struct newfs_super_d  	newfs_super_d;
 	int ret; 
 	/* 将超级块写入磁盘 */
 	// 将内存超级块信息复制到磁盘超级块
@@ -209,50 +389,57 @@ void newfs_destroy(void* p) {
         return ;
     }
 
-	/* 1）刷写所有inode & 数据 */
-	if (super.root_dentry && super.root_dentry->inode) {
-		ret = newfs_sync_inode(super.root_dentry->inode);
-		if (ret < 0) {
-			NEWFS_DBG("[%s] newfs_destroy: sync root inode failed\n", __func__);
-		}
+	/* 0）停止目录预取与后台回收，释放队列中剩余的inode与数据块 */
+	newfs_prefetch_stop();
+	newfs_reclaim_stop();
+
+	/* 1）只刷写脏inode & 数据 */
+	ret = newfs_flush_dirty();
+	if (ret < 0) {
+		NEWFS_TRACE(NEWFS_TC_SUPER, NEWFS_TL_ERR, "flush dirty inodes failed");
 	}
 	
-	/* 2）写回位图 */
-	ret = your_write(super.ino_map_offset, super.ino_bitmap, NEWFS_IO_SZ());
-	if (ret < 0) {
-        NEWFS_DBG("[%s] newfs_destroy: write ino_bitmap failed\n", __func__);
-    }
+	/* 2）写回快照表、去重索引、数据块校验表与共享块引用计数表，它们的分配会修改位图。
+	 *    只读挂载快照时什么都不写 */
+	if (newfs_snap_sync() != NEWFS_ERROR_NONE) {
+		NEWFS_TRACE(NEWFS_TC_SUPER, NEWFS_TL_ERR, "write snapshot table failed");
+	}
+	if (!newfs_snap_readonly() && newfs_dedup_sync() != NEWFS_ERROR_NONE) {
+		NEWFS_TRACE(NEWFS_TC_SUPER, NEWFS_TL_ERR, "write dedup index failed");
+	}
+	newfs_dedup_destroy();
+	if (!newfs_snap_readonly() && newfs_csum_sync() != NEWFS_ERROR_NONE) {
+		NEWFS_TRACE(NEWFS_TC_SUPER, NEWFS_TL_ERR, "write data checksum table failed");
+	}
+	newfs_csum_destroy();
+	if (newfs_share_sync() != NEWFS_ERROR_NONE) {
+		NEWFS_TRACE(NEWFS_TC_SUPER, NEWFS_TL_ERR, "write block refcount table failed");
+	}
+	newfs_share_destroy();
 
-	ret = your_write(super.dat_map_offset, super.data_bitmap, NEWFS_IO_SZ());
-	if (ret < 0) {
-        NEWFS_DBG("[%s] newfs_destroy: write data_bitmap failed\n", __func__);
-    }
+	/* 3）写回被修改过的位图块 */
+	newfs_sync_maps();
 
-	/* 3）写回超级块 */
-	memset(&newfs_super_d, 0, sizeof(newfs_super_d));
-	newfs_super_d.magic = NEWFS_MAGIC;
-	newfs_super_d.sb_offset = super.sb_offset;
-	newfs_super_d.sb_blks = super.sb_blks;
-	newfs_super_d.ino_map_offset = super.ino_map_offset;
-	newfs_super_d.ino_map_blks = super.ino_map_blks;
-	newfs_super_d.dat_map_offset = super.dat_map_offset;
-	newfs_super_d.dat_map_blks = super.dat_map_blks;
-	newfs_super_d.inode_offset = super.inode_offset;
-	newfs_super_d.inode_blks = super.inode_blks;
-	newfs_super_d.data_offset = super.data_offset;
-	newfs_super_d.data_blks = super.data_blks;
-	newfs_super_d.ino_max = super.ino_max;
-	newfs_super_d.file_max = super.file_max;
-	newfs_super_d.root_ino = super.root_ino;
-	ret = your_write(0, &newfs_super_d, sizeof(struct newfs_super_d));
+	/* 4）写回超级块，标记为正常卸载 */
+	ret = newfs_snap_readonly() ? NEWFS_ERROR_NONE : newfs_sync_super(NEWFS_STATE_CLEAN);
 	if (ret < 0) {
-        NEWFS_DBG("[%s] newfs_destroy: write super block failed\n", __func__);
+        NEWFS_TRACE(NEWFS_TC_SUPER, NEWFS_TL_ERR, "write super block failed");
     }
+	newfs_snap_destroy();
+
+	/* 5）落盘并关闭设备 */
+	newfs_bdev_flush(super.bdev);
+	newfs_bdev_close(super.bdev);
 
-	/* 4）关闭设备 */
-	ddriver_close(super.fd);
+	/* 6）释放内存中的inode与目录项 */
+	newfs_icache_destroy();
+	free_dentry(super.root_dentry);
 
-	/* 5）释放内存 */
+	if (newfs_options.debug) {
+		newfs_dump_stats();			 /* 调试：打印缓存与分配器统计 */
+	}
+
+	/* 7）释放位图 */
 	if (super.ino_bitmap) {
 		free(super.ino_bitmap);
 		super.ino_bitmap = NULL;
@@ -263,11 +450,21 @@ void newfs_destroy(void* p) {
 	}
 	super.is_mounted = false;
 	super.root_dentry = NULL;
-	super.fd = -1;
+	super.bdev = NULL;
 
 	return;
 }
 
+/**
+ * @brief 目录是否还能再加一个目录项：未到单目录上限，且需要新块时还有空闲块
+ */
+static bool newfs_dir_room(struct newfs_inode* dir) {
+	const int per_blk = NEWFS_IO_SZ() / sizeof(struct newfs_dentry_d);
+
+	return dir->dir_cnt < NEWFS_DATA_PER_FILE * per_blk
+		   && (dir->dir_cnt % per_blk != 0 || super.free_blk_cnt > 0);
+}
+
 /**
  * @brief 创建目录
  * 
@@ -280,16 +477,37 @@ int newfs_mkdir(const char* path, mode_t mode) {
 	// step 1: 解析路径，找到父目录的inode
 	bool is_find, is_root;
 	char* fname;
-	struct newfs_dentry* last_dentry = newfs_lookup(path, &is_find, &is_root);
+	struct newfs_dentry* last_dentry;
 	struct newfs_dentry* dentry;
 	struct newfs_inode*  inode;
+	int    ret;
 
+	uint64_t start = newfs_stat_now();
+	if (newfs_is_stats_path(path)) {
+		return newfs_stat_end(NEWFS_OP_MKDIR, start, -NEWFS_ERROR_EXISTS);
+	}
+	NEWFS_LOCK();
+	last_dentry = newfs_lookup(path, &is_find, &is_root);
+	if (last_dentry->inode->csum_bad) {			/* 父目录校验失败，内容未知 */
+		NEWFS_UNLOCK();
+		return newfs_stat_end(NEWFS_OP_MKDIR, start, -NEWFS_ERROR_IO);
+	}
 	if (is_find) {
-		return -NEWFS_ERROR_EXISTS;
+		NEWFS_UNLOCK();
+		return newfs_stat_end(NEWFS_OP_MKDIR, start, -NEWFS_ERROR_EXISTS);
 	}
 
-	if (NEWFS_IS_REG(last_dentry->inode)) {
-		return -NEWFS_ERROR_UNSUPPORTED;
+	if (!NEWFS_IS_DIR(last_dentry->inode)) {
+		NEWFS_UNLOCK();
+		return newfs_stat_end(NEWFS_OP_MKDIR, start, -NEWFS_ERROR_UNSUPPORTED);
+	}
+	if (!newfs_dir_room(last_dentry->inode)) {
+		NEWFS_UNLOCK();
+		return newfs_stat_end(NEWFS_OP_MKDIR, start, -NEWFS_ERROR_NOSPACE);
+	}
+	if ((ret = newfs_snap_cow(last_dentry->inode)) != NEWFS_ERROR_NONE) {	/* 父目录的旧版本先留给快照 */
+		NEWFS_UNLOCK();
+		return newfs_stat_end(NEWFS_OP_MKDIR, start, ret);
 	}
 
 	fname  = newfs_get_fname(path);
@@ -297,16 +515,24 @@ int newfs_mkdir(const char* path, mode_t mode) {
 	dentry = new_dentry(fname, NEWFS_DIR); 
 	dentry->parent = last_dentry;
 	// step 3: 分配新的索引节点inode
-	inode = newfs_alloc_inode(dentry);
-	newfs_alloc_dentry(last_dentry->inode, dentry);
+	if ((inode = newfs_alloc_inode(dentry)) == NULL) {
+		free_dentry(dentry);
+		NEWFS_UNLOCK();
+		return newfs_stat_end(NEWFS_OP_MKDIR, start, -NEWFS_ERROR_NOSPACE);
+	}
+	if ((ret = newfs_alloc_dentry(last_dentry->inode, dentry)) < 0) {
+		newfs_reclaim_unlink(inode);			/* 交给后台回收，归还inode号 */
+		free_dentry(dentry);
+		NEWFS_UNLOCK();
+		return newfs_stat_end(NEWFS_OP_MKDIR, start, ret);
+	}
 
-	// 使用 inode 变量：同步到磁盘
-    if (inode != NULL) {
-        newfs_sync_inode(inode);           // 同步新创建的目录inode
-        newfs_sync_inode(last_dentry->inode); // 同步父目录inode（因为添加了新的dentry）
-    }
+	// 标记为脏，卸载时统一写回
+	newfs_mark_dirty(inode);              // 新创建的目录inode
+	newfs_mark_dirty(last_dentry->inode); // 父目录inode（因为添加了新的dentry）
+	NEWFS_UNLOCK();
 
-	return NEWFS_ERROR_NONE;
+	return newfs_stat_end(NEWFS_OP_MKDIR, start, NEWFS_ERROR_NONE);
 }
 
 /**
@@ -319,9 +545,30 @@ int newfs_mkdir(const char* path, mode_t mode) {
 int newfs_getattr(const char* path, struct stat * newfs_stat) {
 	/* TODO: 解析路径，获取Inode，填充newfs_stat，可参考/fs/simplefs/sfs.c的sfs_getattr()函数实现 */
 	bool is_find, is_root;
-	struct newfs_dentry* dentry = newfs_lookup(path, &is_find, &is_root);
+	struct newfs_dentry* dentry;
+
+	uint64_t start = newfs_stat_now();
+	if (newfs_is_stats_path(path)) {
+		size_t len;
+		free(newfs_stats_snapshot(&len));	/* 大小仅供参考，读取以打开时的快照为准 */
+		memset(newfs_stat, 0, sizeof(struct stat));
+		newfs_stat->st_mode  = S_IFREG | 0444;
+		newfs_stat->st_size  = len;
+		newfs_stat->st_nlink = 1;
+		newfs_stat->st_uid   = getuid();
+		newfs_stat->st_gid   = getgid();
+		newfs_stat->st_mtime = time(NULL);
+		return newfs_stat_end(NEWFS_OP_GETATTR, start, NEWFS_ERROR_NONE);
+	}
+	NEWFS_LOCK();
+	dentry = newfs_lookup(path, &is_find, &is_root);
+	if (dentry->inode->csum_bad) {				/* 自身或未找到时的父目录校验失败 */
+		NEWFS_UNLOCK();
+		return newfs_stat_end(NEWFS_OP_GETATTR, start, -NEWFS_ERROR_IO);
+	}
 	if (is_find == false) {
-		return -NEWFS_ERROR_NOTFOUND;
+		NEWFS_UNLOCK();
+		return newfs_stat_end(NEWFS_OP_GETATTR, start, -NEWFS_ERROR_NOTFOUND);
 	}
 
 	if (NEWFS_IS_DIR(dentry->inode)) {
@@ -332,25 +579,26 @@ int newfs_getattr(const char* path, struct stat * newfs_stat) {
 		newfs_stat->st_mode = S_IFREG | NEWFS_DEFAULT_PERM;
 		newfs_stat->st_size = dentry->inode->size;
 	}
-	// else if (NEWFS_IS_SYM_LINK(dentry->inode)) {
-	// 	newfs_stat->st_mode = S_IFLNK | NEWFS_DEFAULT_PERM;
-	// 	newfs_stat->st_size = dentry->inode->size;
-	// }
+	else if (NEWFS_IS_SYM_LINK(dentry->inode)) {
+		newfs_stat->st_mode = S_IFLNK | 0777;	/* 符号链接的权限位不起作用 */
+		newfs_stat->st_size = dentry->inode->size;
+	}
 
-	newfs_stat->st_nlink = 1;
+	newfs_stat->st_nlink = NEWFS_IS_DIR(dentry->inode) ? 1 : dentry->inode->nlink;
 	newfs_stat->st_uid 	 = getuid();
 	newfs_stat->st_gid 	 = getgid();
 	newfs_stat->st_atime   = time(NULL);
 	newfs_stat->st_mtime   = time(NULL);
 	newfs_stat->st_blksize = NEWFS_IO_SZ();
-	newfs_stat->st_blocks  = NEWFS_DATA_PER_FILE; /* 占用的逻辑块数 */
+	newfs_stat->st_blocks  = (blkcnt_t)newfs_file_nblks(dentry->inode) * (NEWFS_IO_SZ() / 512); /* 实际占用，单位512B，空洞不计 */
 
 	if (is_root) {
 		newfs_stat->st_size	= dentry->inode->dir_cnt * sizeof(struct newfs_dentry_d);/* 根目录大小为所有目录项之和 */
 		newfs_stat->st_blocks = NEWFS_DISK_SZ() / NEWFS_IO_SZ();
 		newfs_stat->st_nlink  = 2;		/* !特殊，根目录link数为2 */
 	}
-	return NEWFS_ERROR_NONE;
+	NEWFS_UNLOCK();
+	return newfs_stat_end(NEWFS_OP_GETATTR, start, NEWFS_ERROR_NONE);
 }
 
 /**
@@ -377,19 +625,37 @@ int newfs_readdir(const char * path, void * buf, fuse_fill_dir_t filler, off_t o
 	bool  	is_find, is_root;
 	int		cur_dir = offset;
 
-	struct newfs_dentry* dentry = newfs_lookup(path, &is_find, &is_root);
+	struct newfs_dentry* dentry;
 	struct newfs_dentry* sub_dentry;
 	struct newfs_inode* inode;
-	if (is_find) {
+
+	uint64_t start = newfs_stat_now();
+	NEWFS_LOCK();
+	if (fi && fi->fh) {
+		inode = NEWFS_FILE(fi)->inode;			/* opendir时已解析 */
+	} else {
+		dentry = newfs_lookup(path, &is_find, &is_root);
+		if (!is_find) {
+			NEWFS_UNLOCK();
+			NEWFS_TRACE(NEWFS_TC_FUSE, NEWFS_TL_DEBUG, "path not found %s", path);
+			return newfs_stat_end(NEWFS_OP_READDIR, start, -NEWFS_ERROR_NOTFOUND);
+		}
 		inode = dentry->inode;
-		sub_dentry = newfs_get_dentry(inode, cur_dir);
-		if (sub_dentry) {
-			filler(buf, sub_dentry->name, NULL, ++offset);
+	}
+	if (newfs_dir_load(inode) < 0 || inode->csum_bad) {	/* 子目录项按需读入 */
+		NEWFS_UNLOCK();
+		return newfs_stat_end(NEWFS_OP_READDIR, start, -NEWFS_ERROR_IO);
+	}
+	/* 从第offset个目录项开始，一次填满buf */
+	sub_dentry = newfs_get_dentry(inode, cur_dir);
+	while (sub_dentry) {
+		if (filler(buf, sub_dentry->name, NULL, ++cur_dir)) {
+			break;
 		}
-		return NEWFS_ERROR_NONE;
+		sub_dentry = sub_dentry->brother;
 	}
-	NEWFS_DBG("[%s] readdir: path not found %s\n", __func__, path);
-	return -NEWFS_ERROR_NOTFOUND;
+	NEWFS_UNLOCK();
+	return newfs_stat_end(NEWFS_OP_READDIR, start, NEWFS_ERROR_NONE);
 }
 
 
@@ -406,16 +672,37 @@ int newfs_mknod(const char* path, mode_t mode, dev_t dev) {
 	// step 1: 解析路径，找到父目录的inode
 	bool is_find, is_root;
 	char* fname;
-	struct newfs_dentry* last_dentry = newfs_lookup(path, &is_find, &is_root);
+	struct newfs_dentry* last_dentry;
 	struct newfs_dentry* dentry;
 	struct newfs_inode*  inode;
+	int    ret;
 
+	uint64_t start = newfs_stat_now();
+	if (newfs_is_stats_path(path)) {
+		return newfs_stat_end(NEWFS_OP_MKNOD, start, -NEWFS_ERROR_EXISTS);
+	}
+	NEWFS_LOCK();
+	last_dentry = newfs_lookup(path, &is_find, &is_root);
+	if (last_dentry->inode->csum_bad) {
+		NEWFS_UNLOCK();
+		return newfs_stat_end(NEWFS_OP_MKNOD, start, -NEWFS_ERROR_IO);
+	}
 	if (is_find) {
-		return -NEWFS_ERROR_EXISTS;
+		NEWFS_UNLOCK();
+		return newfs_stat_end(NEWFS_OP_MKNOD, start, -NEWFS_ERROR_EXISTS);
 	}
 
-	if (NEWFS_IS_REG(last_dentry->inode)) {
-		return -NEWFS_ERROR_UNSUPPORTED;
+	if (!NEWFS_IS_DIR(last_dentry->inode)) {
+		NEWFS_UNLOCK();
+		return newfs_stat_end(NEWFS_OP_MKNOD, start, -NEWFS_ERROR_UNSUPPORTED);
+	}
+	if (!newfs_dir_room(last_dentry->inode)) {
+		NEWFS_UNLOCK();
+		return newfs_stat_end(NEWFS_OP_MKNOD, start, -NEWFS_ERROR_NOSPACE);
+	}
+	if ((ret = newfs_snap_cow(last_dentry->inode)) != NEWFS_ERROR_NONE) {	/* 父目录的旧版本先留给快照 */
+		NEWFS_UNLOCK();
+		return newfs_stat_end(NEWFS_OP_MKNOD, start, ret);
 	}
 
 	fname  = newfs_get_fname(path);
@@ -423,15 +710,48 @@ int newfs_mknod(const char* path, mode_t mode, dev_t dev) {
 	dentry = new_dentry(fname, NEWFS_REG_FILE); 
 	dentry->parent = last_dentry;
 	// step 3: 分配新的索引节点inode
-	inode  = newfs_alloc_inode(dentry);
-	newfs_alloc_dentry(last_dentry->inode, dentry);
-
-	// 使用 inode 变量：同步到磁盘
-	if (inode != NULL) {
-		newfs_sync_inode(inode);           // 同步新创建的文件inode
-		newfs_sync_inode(last_dentry->inode); // 同步父目录inode（因为添加了新的dentry）
+	if ((inode = newfs_alloc_inode(dentry)) == NULL) {
+		free_dentry(dentry);
+		NEWFS_UNLOCK();
+		return newfs_stat_end(NEWFS_OP_MKNOD, start, -NEWFS_ERROR_NOSPACE);
 	}
+	if ((ret = newfs_alloc_dentry(last_dentry->inode, dentry)) < 0) {
+		newfs_reclaim_unlink(inode);			/* 交给后台回收，归还inode号 */
+		free_dentry(dentry);
+		NEWFS_UNLOCK();
+		return newfs_stat_end(NEWFS_OP_MKNOD, start, ret);
+	}
+
+	// 标记为脏，卸载时统一写回
+	newfs_mark_dirty(inode);              // 新创建的文件inode
+	newfs_mark_dirty(last_dentry->inode); // 父目录inode（因为添加了新的dentry）
+	NEWFS_UNLOCK();
 	
+	return newfs_stat_end(NEWFS_OP_MKNOD, start, NEWFS_ERROR_NONE);
+}
+
+/**
+ * @brief 获取文件系统容量信息，df等工具使用
+ * 
+ * 直接读取超级块中的空闲计数，无需扫描位图
+ * 
+ * @param path 相对于挂载点的路径，可忽略
+ * @param newfs_statvfs 返回的容量信息
+ * @return int 0成功，否则返回对应错误号
+ */
+int newfs_statfs(const char* path, struct statvfs* newfs_statvfs) {
+	(void)path;
+	memset(newfs_statvfs, 0, sizeof(struct statvfs));
+	newfs_statvfs->f_bsize   = NEWFS_IO_SZ();
+	newfs_statvfs->f_frsize  = NEWFS_IO_SZ();
+	newfs_statvfs->f_blocks  = super.data_blks;
+	newfs_statvfs->f_bfree   = super.free_blk_cnt;
+	newfs_statvfs->f_bavail  = super.free_blk_cnt;
+	newfs_statvfs->f_files   = super.ino_max;
+	newfs_statvfs->f_ffree   = super.free_ino_cnt;
+	newfs_statvfs->f_favail  = super.free_ino_cnt;
+	newfs_statvfs->f_fsid    = NEWFS_MAGIC;
+	newfs_statvfs->f_namemax = MAX_NAME_LEN;
 	return NEWFS_ERROR_NONE;
 }
 
@@ -456,13 +776,18 @@ int newfs_utimens(const char* path, const struct timespec tv[2]) {
  * @param buf 写入的内容
  * @param size 写入的字节数
  * @param offset 相对文件的偏移
- * @param fi 可忽略
+ * @param fi open时保存的句柄
  * @return int 写入大小
  */
 int newfs_write(const char* path, const char* buf, size_t size, off_t offset,
 		        struct fuse_file_info* fi) {
-	/* 选做 */
-	return size;
+	int ret;
+
+	uint64_t start = newfs_stat_now();
+	NEWFS_LOCK();
+	ret = newfs_file_write(NEWFS_FILE(fi), buf, size, offset);
+	NEWFS_UNLOCK();
+	return newfs_stat_end(NEWFS_OP_WRITE, start, ret);
 }
 
 /**
@@ -472,13 +797,68 @@ int newfs_write(const char* path, const char* buf, size_t size, off_t offset,
  * @param buf 读取的内容
  * @param size 读取的字节数
  * @param offset 相对文件的偏移
- * @param fi 可忽略
+ * @param fi open时保存的句柄
  * @return int 读取大小
  */
 int newfs_read(const char* path, char* buf, size_t size, off_t offset,
 		      struct fuse_file_info* fi) {
-	/* 选做 */
-	return size;			   
+	int ret;
+
+	uint64_t start = newfs_stat_now();
+	NEWFS_LOCK();
+	ret = newfs_file_read(NEWFS_FILE(fi), buf, size, offset);
+	NEWFS_UNLOCK();
+	return newfs_stat_end(NEWFS_OP_READ, start, ret);
+}
+
+/**
+ * @brief 删除文件或空目录：从父目录摘除目录项并写回父目录，
+ * inode与数据块由后台回收线程批量释放(见newfs_reclaim.c)
+ * 
+ * @param path 相对于挂载点的路径
+ * @param is_dir 是否为rmdir
+ * @return int 0成功，否则返回对应错误号
+ */
+static int newfs_remove(const char* path, bool is_dir) {
+	bool is_find, is_root;
+	struct newfs_dentry* dentry;
+	struct newfs_inode*  inode;
+	struct newfs_inode*  parent;
+	int    ret;
+
+	if (newfs_is_stats_path(path)) {
+		return -NEWFS_ERROR_ACCESS;
+	}
+	dentry = newfs_lookup(path, &is_find, &is_root);
+	if (dentry->inode->csum_bad) {
+		return -NEWFS_ERROR_IO;					/* 校验失败的inode不能安全释放其数据块 */
+	}
+	if (!is_find) {
+		return -NEWFS_ERROR_NOTFOUND;
+	}
+	if (is_root) {
+		return -NEWFS_ERROR_BUSY;
+	}
+	inode = dentry->inode;
+	if (is_dir && !NEWFS_IS_DIR(inode)) {
+		return -NEWFS_ERROR_NOTDIR;
+	}
+	if (!is_dir && NEWFS_IS_DIR(inode)) {
+		return -NEWFS_ERROR_ISDIR;
+	}
+	if (is_dir && inode->dir_cnt > 0) {
+		return -NEWFS_ERROR_NOTEMPTY;
+	}
+
+	parent = dentry->parent->inode;
+	if ((ret = newfs_snap_cow(parent)) != NEWFS_ERROR_NONE || (ret = newfs_snap_cow(inode)) != NEWFS_ERROR_NONE) {
+		return ret;								/* 快照仍引用两者的旧版本 */
+	}
+	newfs_drop_dentry(parent, dentry);
+	newfs_mark_dirty(parent);					/* 父目录少了一个目录项 */
+	newfs_drop_link(inode, dentry);				/* 还有其他硬链接时只减少链接数 */
+	free_dentry(dentry);
+	return NEWFS_ERROR_NONE;
 }
 
 /**
@@ -488,8 +868,13 @@ int newfs_read(const char* path, char* buf, size_t size, off_t offset,
  * @return int 0成功，否则返回对应错误号
  */
 int newfs_unlink(const char* path) {
-	/* 选做 */
-	return 0;
+	int ret;
+
+	uint64_t start = newfs_stat_now();
+	NEWFS_LOCK();
+	ret = newfs_remove(path, false);
+	NEWFS_UNLOCK();
+	return newfs_stat_end(NEWFS_OP_UNLINK, start, ret);
 }
 
 /**
@@ -499,40 +884,527 @@ int newfs_unlink(const char* path) {
  * rm ./tests/mnt/j/ -r
  *  1) Step 1. rm ./tests/mnt/j/j
  *  2) Step 2. rm ./tests/mnt/j
- * 即，先删除最深层的文件，再删除目录文件本身
+ * 即，先删除最深层的文件，再删除目录文件本身。
+ * 每一步只摘除目录项，空间在后台成批释放，rm -r不等待位图更新
  * 
  * @param path 相对于挂载点的路径
  * @return int 0成功，否则返回对应错误号
  */
 int newfs_rmdir(const char* path) {
-	/* 选做 */
-	return 0;
+	int ret;
+
+	uint64_t start = newfs_stat_now();
+	NEWFS_LOCK();
+	ret = newfs_remove(path, true);
+	NEWFS_UNLOCK();
+	return newfs_stat_end(NEWFS_OP_RMDIR, start, ret);
+}
+
+/**
+ * @brief 在已加载的目录中按名字查找目录项
+ */
+static struct newfs_dentry* newfs_dir_find(struct newfs_inode* dir, const char* fname) {
+	struct newfs_dentry* dentry_cursor;
+
+	newfs_dir_load(dir);
+	for (dentry_cursor = dir->dentrys; dentry_cursor; dentry_cursor = dentry_cursor->brother) {
+		if (strcmp(dentry_cursor->name, fname) == 0) {
+			return dentry_cursor;
+		}
+	}
+	return NULL;
+}
+
+/**
+ * @brief 重命名的主体，调用者持有全局锁，并已持有被移动inode的引用
+ */
+static int newfs_move(struct newfs_dentry* src, const char* to) {
+	bool   is_find, is_root;
+	char*  ppath = strdup(to);
+	char*  fname = newfs_get_fname(to);
+	struct newfs_dentry* dst_parent;
+	struct newfs_dentry* old;
+	struct newfs_inode*  inode = src->inode;
+	struct newfs_inode*  sdir  = src->parent->inode;
+	struct newfs_inode*  ddir;
+	bool   linked = !NEWFS_IS_DIR(inode) && inode->nlink > 1;
+	int    ret;
+
+	if (fname[0] == '\0' || strlen(fname) >= MAX_NAME_LEN) {
+		free(ppath);
+		return -NEWFS_ERROR_INVAL;
+	}
+	// step 1: 找到目标的父目录与同名目录项
+	ppath[fname - to - 1] = '\0';			/* 去掉最后一级，如"/a/b"得到"/a" */
+	dst_parent = newfs_lookup(ppath[0] ? ppath : "/", &is_find, &is_root);
+	free(ppath);
+	if (dst_parent->inode->csum_bad) {
+		return -NEWFS_ERROR_IO;
+	}
+	if (!is_find) {
+		return -NEWFS_ERROR_NOTFOUND;
+	}
+	ddir = dst_parent->inode;
+	if (!NEWFS_IS_DIR(ddir)) {
+		return -NEWFS_ERROR_NOTDIR;
+	}
+	for (struct newfs_dentry* p = dst_parent; p; p = p->parent) {
+		if (p == src) {
+			return -NEWFS_ERROR_INVAL;			/* 不能移动到自己的子树中 */
+		}
+	}
+	old = newfs_dir_find(ddir, fname);
+	if (old == src || (old != NULL && old->ino == src->ino)) {
+		return NEWFS_ERROR_NONE;				/* 同一inode的两个硬链接之间重命名什么也不做 */
+	}
+	if (old != NULL) {
+		struct newfs_inode* victim = newfs_iget(old);
+		if (victim->csum_bad) {
+			return -NEWFS_ERROR_IO;
+		}
+		if (NEWFS_IS_DIR(inode) && !NEWFS_IS_DIR(victim)) {
+			return -NEWFS_ERROR_NOTDIR;
+		}
+		if (!NEWFS_IS_DIR(inode) && NEWFS_IS_DIR(victim)) {
+			return -NEWFS_ERROR_ISDIR;
+		}
+		if (NEWFS_IS_DIR(victim) && victim->dir_cnt > 0) {
+			return -NEWFS_ERROR_NOTEMPTY;
+		}
+	} else if (sdir != ddir && !newfs_dir_room(ddir)) {
+		return -NEWFS_ERROR_NOSPACE;
+	}
+
+	// step 2: 在内存目录树中移动dentry，被覆盖的目标交给后台回收。两个父目录和被覆盖的目标先留给快照
+	if ((ret = newfs_snap_cow(sdir)) != NEWFS_ERROR_NONE || (ret = newfs_snap_cow(ddir)) != NEWFS_ERROR_NONE
+		|| (old != NULL && (ret = newfs_snap_cow(old->inode)) != NEWFS_ERROR_NONE)) {
+		return ret;
+	}
+	if (old != NULL) {
+		newfs_drop_link(old->inode, old);
+	}
+	newfs_drop_dentry(sdir, src);
+	if (sdir != ddir) {
+		newfs_icache_reparent(src, dst_parent);
+	}
+	memset(src->name, 0, MAX_NAME_LEN);
+	NEWFS_ASSIGN_FNAME(src, fname);
+	if (old != NULL) {
+		newfs_replace_dentry(ddir, old, src);	/* 占用目标原来的位置 */
+		free_dentry(old);
+	} else {
+		newfs_alloc_dentry(ddir, src);
+	}
+
+	// step 3: 落盘。跨目录时先在超级块记下意图，再先写新父目录、后写原父目录，
+	// 中途崩溃由挂载时的newfs_rename_recover补完，文件不会丢失或同时出现在两处。
+	// 有多个硬链接的文件不记意图：恢复按ino删除原目录的目录项，会连同其他链接一起删掉，
+	// 崩溃后两处都有目录项，由fsck修正链接数
+	if (sdir != ddir && !linked) {
+		super.rename_ino = inode->ino;
+		super.rename_src = sdir->ino;
+		super.rename_dst = ddir->ino;
+		ret = newfs_sync_super(NEWFS_STATE_DIRTY);
+	} else {
+		ret = NEWFS_ERROR_NONE;
+	}
+	newfs_mark_dirty(ddir);
+	newfs_mark_dirty(sdir);
+	/* 被移动的普通文件连同数据先落盘，崩溃后新名字下不会读到未写入的块（先写临时文件再
+	 * 重命名的检查点依赖这一点）；其余只写元数据：目录项引用的尚未落盘的inode先于目录写回 */
+	if (NEWFS_IS_REG(inode)) {
+		ret |= newfs_flush_inode(inode);
+	}
+	ret |= newfs_flush_meta(ddir);
+	ret |= newfs_flush_meta(sdir);
+	if (sdir != ddir && !linked) {
+		super.rename_ino = super.rename_src = super.rename_dst = 0;
+		ret |= newfs_sync_super(NEWFS_STATE_DIRTY);
+	}
+	return ret ? -NEWFS_ERROR_IO : NEWFS_ERROR_NONE;
 }
 
 /**
- * @brief 重命名文件 
+ * @brief 重命名文件或目录，只移动目录项、不复制数据。被移动的普通文件的脏数据随之落盘。
+ * 目标已存在时原子地替换：目标的inode交给后台回收
  * 
  * @param from 源文件路径
  * @param to 目标文件路径
  * @return int 0成功，否则返回对应错误号
  */
 int newfs_rename(const char* from, const char* to) {
-	/* 选做 */
-	return 0;
+	bool is_find, is_root;
+	struct newfs_dentry* src;
+	struct newfs_inode*  inode;
+	int ret;
+
+	uint64_t start = newfs_stat_now();
+	if (newfs_is_stats_path(from) || newfs_is_stats_path(to)) {
+		return newfs_stat_end(NEWFS_OP_RENAME, start, -NEWFS_ERROR_ACCESS);
+	}
+	NEWFS_LOCK();
+	src = newfs_lookup(from, &is_find, &is_root);
+	if (src->inode->csum_bad) {
+		NEWFS_UNLOCK();
+		return newfs_stat_end(NEWFS_OP_RENAME, start, -NEWFS_ERROR_IO);
+	}
+	if (!is_find || is_root) {
+		NEWFS_UNLOCK();
+		return newfs_stat_end(NEWFS_OP_RENAME, start,
+							  is_root ? -NEWFS_ERROR_BUSY : -NEWFS_ERROR_NOTFOUND);
+	}
+	inode = src->inode;
+	newfs_iref(inode);							/* 查找目标时的缓存回收不能淘汰源 */
+	ret = newfs_move(src, to);
+	newfs_iput(inode);
+	NEWFS_UNLOCK();
+	return newfs_stat_end(NEWFS_OP_RENAME, start, ret);
+}
+
+/**
+ * @brief 为link/symlink解析新目录项的路径，调用者持有全局锁
+ *
+ * @param path 新目录项的路径
+ * @param parent 返回父目录的dentry
+ * @return int 0成功，否则返回对应错误号
+ */
+static int newfs_link_parent(const char* path, struct newfs_dentry** parent) {
+	bool is_find, is_root;
+	struct newfs_dentry* last_dentry;
+	int    ret;
+
+	if (newfs_is_stats_path(path)) {
+		return -NEWFS_ERROR_EXISTS;
+	}
+	last_dentry = newfs_lookup(path, &is_find, &is_root);
+	if (last_dentry->inode->csum_bad) {
+		return -NEWFS_ERROR_IO;
+	}
+	if (is_find) {
+		return -NEWFS_ERROR_EXISTS;
+	}
+	if (!NEWFS_IS_DIR(last_dentry->inode)) {
+		return -NEWFS_ERROR_NOTDIR;
+	}
+	if (strlen(newfs_get_fname(path)) >= MAX_NAME_LEN) {
+		return -NEWFS_ERROR_NAMETOOLONG;
+	}
+	if (!newfs_dir_room(last_dentry->inode)) {
+		return -NEWFS_ERROR_NOSPACE;
+	}
+	if ((ret = newfs_snap_cow(last_dentry->inode)) != NEWFS_ERROR_NONE) {	/* 父目录的旧版本先留给快照 */
+		return ret;
+	}
+	*parent = last_dentry;
+	return NEWFS_ERROR_NONE;
+}
+
+/**
+ * @brief 创建硬链接：新目录项指向同一inode，链接数加一，目录不能建硬链接
+ *
+ * @param from 已存在的文件
+ * @param to 新目录项的路径
+ * @return int 0成功，否则返回对应错误号
+ */
+int newfs_link(const char* from, const char* to) {
+	bool is_find, is_root;
+	struct newfs_dentry* src;
+	struct newfs_dentry* parent;
+	struct newfs_dentry* dentry;
+	struct newfs_inode*  inode;
+	int    ret;
+
+	uint64_t start = newfs_stat_now();
+	if (newfs_is_stats_path(from)) {
+		return newfs_stat_end(NEWFS_OP_LINK, start, -NEWFS_ERROR_ACCESS);
+	}
+	NEWFS_LOCK();
+	src = newfs_lookup(from, &is_find, &is_root);
+	if (src->inode->csum_bad) {
+		NEWFS_UNLOCK();
+		return newfs_stat_end(NEWFS_OP_LINK, start, -NEWFS_ERROR_IO);
+	}
+	if (!is_find) {
+		NEWFS_UNLOCK();
+		return newfs_stat_end(NEWFS_OP_LINK, start, -NEWFS_ERROR_NOTFOUND);
+	}
+	inode = src->inode;
+	if (NEWFS_IS_DIR(inode)) {
+		NEWFS_UNLOCK();
+		return newfs_stat_end(NEWFS_OP_LINK, start, -NEWFS_ERROR_PERM);
+	}
+	if (inode->nlink >= NEWFS_LINK_MAX) {
+		NEWFS_UNLOCK();
+		return newfs_stat_end(NEWFS_OP_LINK, start, -NEWFS_ERROR_MLINK);
+	}
+
+	newfs_iref(inode);							/* 查找目标时的缓存回收不能淘汰源 */
+	ret = newfs_link_parent(to, &parent);
+	if (ret == NEWFS_ERROR_NONE) {
+		ret = newfs_snap_cow(inode);			/* 链接数变化，旧版本先留给快照 */
+	}
+	if (ret == NEWFS_ERROR_NONE) {
+		dentry = new_dentry(newfs_get_fname(to), inode->ftype);
+		dentry->ino    = inode->ino;
+		dentry->parent = parent;
+		newfs_alloc_dentry(parent->inode, dentry);
+		inode->nlink++;
+		newfs_mark_dirty(inode);
+		newfs_mark_dirty(parent->inode);
+	}
+	newfs_iput(inode);
+	NEWFS_UNLOCK();
+	return newfs_stat_end(NEWFS_OP_LINK, start, ret);
 }
 
 /**
- * @brief 打开文件，可以在这里维护fi的信息，例如，fi->fh可以理解为一个64位指针，可以把自己想保存的数据结构
- * 保存在fh中
+ * @brief 创建符号链接，目标只保存不解析，可以指向不存在的路径
+ *
+ * @param target 链接目标
+ * @param path 新符号链接的路径
+ * @return int 0成功，否则返回对应错误号
+ */
+int newfs_symlink(const char* target, const char* path) {
+	const int per_blk = NEWFS_IO_SZ() / sizeof(struct newfs_dentry_d);
+	struct newfs_dentry* parent;
+	struct newfs_dentry* dentry;
+	struct newfs_inode*  inode;
+	size_t len = strlen(target);
+	int    ret;
+
+	uint64_t start = newfs_stat_now();
+	if (len == 0) {
+		return newfs_stat_end(NEWFS_OP_SYMLINK, start, -NEWFS_ERROR_NOTFOUND);
+	}
+	if (len >= (size_t)NEWFS_IO_SZ() || len >= PATH_MAX) {
+		return newfs_stat_end(NEWFS_OP_SYMLINK, start, -NEWFS_ERROR_NAMETOOLONG);	/* 长目标只占一个块 */
+	}
+	NEWFS_LOCK();
+	if ((ret = newfs_link_parent(path, &parent)) != NEWFS_ERROR_NONE) {
+		NEWFS_UNLOCK();
+		return newfs_stat_end(NEWFS_OP_SYMLINK, start, ret);
+	}
+	/* 长目标还需要一个数据块，父目录可能也要一个新块 */
+	if (len > NEWFS_SYMLINK_INLINE && super.free_blk_cnt < 1 + (parent->inode->dir_cnt % per_blk == 0)) {
+		NEWFS_UNLOCK();
+		return newfs_stat_end(NEWFS_OP_SYMLINK, start, -NEWFS_ERROR_NOSPACE);
+	}
+
+	dentry = new_dentry(newfs_get_fname(path), NEWFS_SYM_LINK);
+	dentry->parent = parent;
+	if ((inode = newfs_alloc_inode(dentry)) == NULL) {
+		free_dentry(dentry);
+		NEWFS_UNLOCK();
+		return newfs_stat_end(NEWFS_OP_SYMLINK, start, -NEWFS_ERROR_NOSPACE);
+	}
+	newfs_alloc_dentry(parent->inode, dentry);
+	ret = newfs_symlink_init(inode, target, len);
+	newfs_mark_dirty(parent->inode);
+	NEWFS_UNLOCK();
+	return newfs_stat_end(NEWFS_OP_SYMLINK, start, ret);
+}
+
+/**
+ * @brief 读符号链接的目标，超出缓冲区的部分截断，结果总以'\0'结尾
+ *
+ * @param path 符号链接的路径
+ * @param buf 输出缓冲区
+ * @param size 缓冲区大小
+ * @return int 0成功，否则返回对应错误号
+ */
+int newfs_readlink(const char* path, char* buf, size_t size) {
+	bool is_find, is_root;
+	struct newfs_dentry* dentry;
+	const char* target;
+	size_t len;
+	int    ret = NEWFS_ERROR_NONE;
+
+	uint64_t start = newfs_stat_now();
+	if (size == 0) {
+		return newfs_stat_end(NEWFS_OP_READLINK, start, -NEWFS_ERROR_INVAL);
+	}
+	NEWFS_LOCK();
+	dentry = newfs_lookup(path, &is_find, &is_root);
+	if (dentry->inode->csum_bad) {
+		ret = -NEWFS_ERROR_IO;
+	} else if (!is_find) {
+		ret = -NEWFS_ERROR_NOTFOUND;
+	} else if (!NEWFS_IS_SYM_LINK(dentry->inode)) {
+		ret = -NEWFS_ERROR_INVAL;
+	} else if ((target = newfs_symlink_target(dentry->inode)) == NULL) {
+		ret = -NEWFS_ERROR_IO;
+	} else {
+		len = (size_t)dentry->inode->size < size - 1 ? (size_t)dentry->inode->size : size - 1;
+		memcpy(buf, target, len);
+		buf[len] = '\0';
+	}
+	NEWFS_UNLOCK();
+	return newfs_stat_end(NEWFS_OP_READLINK, start, ret);
+}
+
+/**
+ * @brief 解析扩展属性操作的目标，文件、目录与符号链接都可以带属性
+ *
+ * @param inode 返回目标inode
+ * @return int 0成功，否则返回对应错误号
+ */
+static int newfs_xattr_inode(const char* path, struct newfs_inode** inode) {
+	bool is_find, is_root;
+	struct newfs_dentry* dentry;
+
+	if (newfs_is_stats_path(path)) {
+		return -NEWFS_ERROR_NOTSUP;
+	}
+	dentry = newfs_lookup(path, &is_find, &is_root);
+	if (dentry->inode->csum_bad) {
+		return -NEWFS_ERROR_IO;
+	}
+	if (!is_find) {
+		return -NEWFS_ERROR_NOTFOUND;
+	}
+	*inode = dentry->inode;
+	return NEWFS_ERROR_NONE;
+}
+
+/**
+ * @brief 设置扩展属性，小属性放在inode内，见newfs_xattr.c
+ *
+ * @param path 相对于挂载点的路径
+ * @param name 属性名，含名字空间前缀
+ * @param value 属性值
+ * @param size 值的长度
+ * @param flags XATTR_CREATE/XATTR_REPLACE
+ * @return int 0成功，否则返回对应错误号
+ */
+int newfs_setxattr(const char* path, const char* name, const char* value, size_t size, int flags) {
+	struct newfs_inode* inode;
+	int    ret;
+
+	uint64_t start = newfs_stat_now();
+	NEWFS_LOCK();
+	if ((ret = newfs_xattr_inode(path, &inode)) == NEWFS_ERROR_NONE) {
+		ret = newfs_xattr_set(inode, name, value, size, flags);
+	}
+	NEWFS_UNLOCK();
+	return newfs_stat_end(NEWFS_OP_SETXATTR, start, ret);
+}
+
+/**
+ * @brief 读扩展属性，inode已在缓存中且属性在inode内时不访问设备
+ *
+ * @param path 相对于挂载点的路径
+ * @param name 属性名
+ * @param buf 输出缓冲区
+ * @param size 缓冲区大小，0表示只查询值的长度
+ * @return int 值的长度，否则返回对应错误号
+ */
+int newfs_getxattr(const char* path, const char* name, char* buf, size_t size) {
+	struct newfs_inode* inode;
+	int    ret;
+
+	uint64_t start = newfs_stat_now();
+	NEWFS_LOCK();
+	if ((ret = newfs_xattr_inode(path, &inode)) == NEWFS_ERROR_NONE) {
+		ret = newfs_xattr_get(inode, name, buf, size);
+	}
+	NEWFS_UNLOCK();
+	return newfs_stat_end(NEWFS_OP_GETXATTR, start, ret);
+}
+
+/**
+ * @brief 列出扩展属性名，每个以'\0'结尾
+ *
+ * @param path 相对于挂载点的路径
+ * @param list 输出缓冲区
+ * @param size 缓冲区大小，0表示只查询所需长度
+ * @return int 名字的总长度，否则返回对应错误号
+ */
+int newfs_listxattr(const char* path, char* list, size_t size) {
+	struct newfs_inode* inode;
+	int    ret;
+
+	uint64_t start = newfs_stat_now();
+	NEWFS_LOCK();
+	if ((ret = newfs_xattr_inode(path, &inode)) == NEWFS_ERROR_NONE) {
+		ret = newfs_xattr_list(inode, list, size);
+	}
+	NEWFS_UNLOCK();
+	return newfs_stat_end(NEWFS_OP_LISTXATTR, start, ret);
+}
+
+/**
+ * @brief 删除扩展属性
+ *
+ * @param path 相对于挂载点的路径
+ * @param name 属性名
+ * @return int 0成功，否则返回对应错误号
+ */
+int newfs_removexattr(const char* path, const char* name) {
+	struct newfs_inode* inode;
+	int    ret;
+
+	uint64_t start = newfs_stat_now();
+	NEWFS_LOCK();
+	if ((ret = newfs_xattr_inode(path, &inode)) == NEWFS_ERROR_NONE) {
+		ret = newfs_xattr_remove(inode, name);
+	}
+	NEWFS_UNLOCK();
+	return newfs_stat_end(NEWFS_OP_REMOVEXATTR, start, ret);
+}
+
+/**
+ * @brief 打开文件，解析一次路径，把句柄struct newfs_file保存在fi->fh中，
+ * 之后的read/write/flush/release直接使用句柄
  * 
  * @param path 相对于挂载点的路径
  * @param fi 文件信息
  * @return int 0成功，否则返回对应错误号
  */
 int newfs_open(const char* path, struct fuse_file_info* fi) {
-	/* 选做 */
+	bool is_find, is_root;
+	struct newfs_dentry* dentry;
 
-	return 0;
+	if (newfs_is_stats_path(path)) {
+		size_t len;
+		char*  snap;
+		if ((fi->flags & O_ACCMODE) != O_RDONLY) {
+			return -NEWFS_ERROR_ACCESS;
+		}
+		if ((snap = newfs_stats_snapshot(&len)) == NULL) {
+			return -NEWFS_ERROR_NOSPACE;
+		}
+		fi->fh        = (uint64_t)(uintptr_t)newfs_file_open_snap(snap, len);
+		fi->direct_io = 1;					/* 不走页缓存，每次打开都是新快照 */
+		return NEWFS_ERROR_NONE;
+	}
+	NEWFS_LOCK();
+	dentry = newfs_lookup(path, &is_find, &is_root);
+	if (dentry->inode->csum_bad) {
+		NEWFS_UNLOCK();
+		return -NEWFS_ERROR_IO;
+	}
+	if (!is_find) {
+		NEWFS_UNLOCK();
+		return -NEWFS_ERROR_NOTFOUND;
+	}
+	if (NEWFS_IS_DIR(dentry->inode)) {
+		NEWFS_UNLOCK();
+		return -NEWFS_ERROR_ISDIR;
+	}
+	if (NEWFS_IS_SYM_LINK(dentry->inode)) {
+		NEWFS_UNLOCK();
+		return -NEWFS_ERROR_LOOP;				/* 内核已解析符号链接，到这里说明是O_NOFOLLOW */
+	}
+	if (newfs_snap_readonly() && (fi->flags & O_ACCMODE) != O_RDONLY) {
+		NEWFS_UNLOCK();
+		return -NEWFS_ERROR_ROFS;				/* 只读挂载的快照 */
+	}
+	fi->fh = (uint64_t)(uintptr_t)newfs_file_open(dentry->inode, fi->flags);
+	if ((fi->flags & O_ACCMODE) == O_RDONLY) {
+		newfs_prefetch_open(dentry);			/* 识别按目录扫描数据集，预取其余文件 */
+	}
+	NEWFS_UNLOCK();
+	return NEWFS_ERROR_NONE;
 }
 
 /**
@@ -543,8 +1415,90 @@ int newfs_open(const char* path, struct fuse_file_info* fi) {
  * @return int 0成功，否则返回对应错误号
  */
 int newfs_opendir(const char* path, struct fuse_file_info* fi) {
-	/* 选做 */
-	return 0;
+	bool is_find, is_root;
+	struct newfs_dentry* dentry;
+
+	NEWFS_LOCK();
+	dentry = newfs_lookup(path, &is_find, &is_root);
+	if (dentry->inode->csum_bad) {
+		NEWFS_UNLOCK();
+		return -NEWFS_ERROR_IO;
+	}
+	if (!is_find) {
+		NEWFS_UNLOCK();
+		return -NEWFS_ERROR_NOTFOUND;
+	}
+	if (!NEWFS_IS_DIR(dentry->inode)) {
+		NEWFS_UNLOCK();
+		return -ENOTDIR;
+	}
+	fi->fh = (uint64_t)(uintptr_t)newfs_file_open(dentry->inode, fi->flags);
+	NEWFS_UNLOCK();
+	return NEWFS_ERROR_NONE;
+}
+
+/**
+ * @brief close时调用（每个dup出的fd各一次），写回该文件的修改
+ * 
+ * @param path 相对于挂载点的路径
+ * @param fi open时保存的句柄
+ * @return int 0成功，否则返回对应错误号
+ */
+int newfs_flush(const char* path, struct fuse_file_info* fi) {
+	int ret;
+
+	uint64_t start = newfs_stat_now();
+	if (fi->fh == 0) {
+		return newfs_stat_end(NEWFS_OP_SYNC, start, NEWFS_ERROR_NONE);
+	}
+	NEWFS_LOCK();
+	ret = newfs_file_flush(NEWFS_FILE(fi));
+	NEWFS_UNLOCK();
+	return newfs_stat_end(NEWFS_OP_SYNC, start, ret);
+}
+
+/**
+ * @brief 文件或目录的最后一个引用关闭，释放句柄
+ * 
+ * @param path 相对于挂载点的路径
+ * @param fi open/opendir时保存的句柄
+ * @return int 0成功
+ */
+int newfs_release(const char* path, struct fuse_file_info* fi) {
+	if (fi->fh == 0) {
+		return NEWFS_ERROR_NONE;
+	}
+	NEWFS_LOCK();
+	newfs_file_put(NEWFS_FILE(fi));
+	fi->fh = 0;
+	NEWFS_UNLOCK();
+	return NEWFS_ERROR_NONE;
+}
+
+/**
+ * @brief 查找普通文件并改变大小，调用者持有全局锁
+ */
+static int newfs_resize(const char* path, off_t size) {
+	bool is_find, is_root;
+	struct newfs_dentry* dentry;
+
+	if (newfs_is_stats_path(path)) {
+		return -NEWFS_ERROR_ACCESS;
+	}
+	dentry = newfs_lookup(path, &is_find, &is_root);
+	if (dentry->inode->csum_bad) {
+		return -NEWFS_ERROR_IO;
+	}
+	if (!is_find) {
+		return -NEWFS_ERROR_NOTFOUND;
+	}
+	if (NEWFS_IS_DIR(dentry->inode)) {
+		return -NEWFS_ERROR_ISDIR;
+	}
+	if (NEWFS_IS_SYM_LINK(dentry->inode)) {
+		return -NEWFS_ERROR_INVAL;
+	}
+	return newfs_file_truncate(dentry->inode, size);
 }
 
 /**
@@ -555,30 +1509,171 @@ int newfs_opendir(const char* path, struct fuse_file_info* fi) {
  * @return int 0成功，否则返回对应错误号
  */
 int newfs_truncate(const char* path, off_t offset) {
-	/* 选做 */
-	// bool   is_find, is_root;
-	// struct newfs_dentry* dentry = newfs_lookup(path, &is_find, &is_root);
-	// struct newfs_inode*  inode;
-	
-	// if (is_find == false) {
-	// 	return -NEWFS_ERROR_NOTFOUND;
-	// }
-	
-	// inode = dentry->inode;
+	int ret;
+
+	uint64_t start = newfs_stat_now();
+	NEWFS_LOCK();
+	ret = newfs_resize(path, offset);
+	NEWFS_UNLOCK();
+	return newfs_stat_end(NEWFS_OP_TRUNCATE, start, ret);
+}
+
+/**
+ * @brief 改变已打开文件的大小(O_TRUNC打开、ftruncate)，直接使用句柄
+ * 
+ * @param path 相对于挂载点的路径
+ * @param offset 改变后文件大小
+ * @param fi open时保存的句柄
+ * @return int 0成功，否则返回对应错误号
+ */
+int newfs_ftruncate(const char* path, off_t offset, struct fuse_file_info* fi) {
+	int ret;
+
+	uint64_t start = newfs_stat_now();
+	NEWFS_LOCK();
+	if (fi->fh == 0) {
+		ret = newfs_resize(path, offset);
+	} else if (NEWFS_FILE(fi)->inode == NULL) {
+		ret = -NEWFS_ERROR_ACCESS;				/* 统计快照只读 */
+	} else {
+		ret = newfs_file_truncate(NEWFS_FILE(fi)->inode, offset);
+	}
+	NEWFS_UNLOCK();
+	return newfs_stat_end(NEWFS_OP_TRUNCATE, start, ret);
+}
 
-	// if (NEWFS_IS_DIR(inode)) {
-	// 	return -NEWFS_ERROR_ISDIR;
-	// }
+/**
+ * @brief 预分配文件空间，之后顺序写入的数据在磁盘上连续
+ * 
+ * @param path 相对于挂载点的路径
+ * @param mode 0或FALLOC_FL_KEEP_SIZE，其他模式不支持
+ * @param offset 起始偏移
+ * @param length 长度
+ * @param fi open时保存的句柄
+ * @return int 0成功，否则返回对应错误号
+ */
+int newfs_fallocate(const char* path, int mode, off_t offset, off_t length,
+					struct fuse_file_info* fi) {
+	int ret;
 
-	// if(offset > super.file_max) {
-	// 	return -NEWFS_ERROR_NOSPACE;
-	// }
+	uint64_t start = newfs_stat_now();
+	if (fi == NULL || fi->fh == 0 || NEWFS_FILE(fi)->inode == NULL) {
+		return newfs_stat_end(NEWFS_OP_FALLOCATE, start, -NEWFS_ERROR_ACCESS);
+	}
+	/* fallocate请求不带open标志，以open时保存在句柄中的为准 */
+	if ((NEWFS_FILE(fi)->flags & O_ACCMODE) == O_RDONLY) {
+		return newfs_stat_end(NEWFS_OP_FALLOCATE, start, -NEWFS_ERROR_BADF);
+	}
+	NEWFS_LOCK();
+	ret = newfs_file_fallocate(NEWFS_FILE(fi)->inode, mode, offset, length);
+	NEWFS_UNLOCK();
+	return newfs_stat_end(NEWFS_OP_FALLOCATE, start, ret);
+}
 
-	// inode->size = offset;
+/**
+ * @brief 服务端复制(NEWFS_IOC_CLONE_RANGE)，调用者持有全局锁
+ * 
+ * @param dst 目标文件句柄，需以可写方式打开
+ * @param arg 源路径与范围，成功时写回copied
+ * @return int 0成功，否则返回对应错误号
+ */
+static int newfs_clone_range(struct newfs_file* dst, struct newfs_clone_range* arg) {
+	bool is_find, is_root;
+	struct newfs_dentry* dentry;
+	struct newfs_inode*  src;
+	int ret;
 
+	if ((dst->flags & O_ACCMODE) == O_RDONLY) {		/* ioctl请求不带open标志，以句柄中保存的为准 */
+		return -NEWFS_ERROR_BADF;
+	}
+	arg->src[NEWFS_CLONE_PATH_MAX - 1] = '\0';
+	if (newfs_is_stats_path(arg->src)) {
+		return -NEWFS_ERROR_ACCESS;
+	}
+	dentry = newfs_lookup(arg->src, &is_find, &is_root);
+	if (!is_find) {
+		return -NEWFS_ERROR_NOTFOUND;
+	}
+	if (dentry->inode->csum_bad) {
+		return -NEWFS_ERROR_IO;
+	}
+	src = dentry->inode;
+	newfs_iref(src);							/* 复制期间块缓冲的分配可能触发缓存回收 */
+	ret = newfs_file_clone(src, arg->src_off, dst->inode, arg->dst_off, arg->len);
+	newfs_iput(src);
+	if (ret < 0) {
+		return ret;
+	}
+	arg->copied = ret;
 	return NEWFS_ERROR_NONE;
 }
 
+/**
+ * @brief 文件ioctl。FUSE 2没有lseek与copy_file_range操作，
+ * SEEK_DATA/SEEK_HOLE与服务端复制通过ioctl提供；快照的创建与删除也经由文件系统内任一文件的句柄，
+ * 目录预取提示对目录或其中的文件调用
+ * 
+ * @param path 相对于挂载点的路径
+ * @param cmd NEWFS_IOC_SEEK_DATA、NEWFS_IOC_SEEK_HOLE、NEWFS_IOC_CLONE_RANGE、
+ *            NEWFS_IOC_SNAP_CREATE、NEWFS_IOC_SNAP_DELETE或NEWFS_IOC_PREFETCH
+ * @param arg 用户态参数地址，不使用
+ * @param fi open时保存的句柄
+ * @param flags FUSE_IOCTL_*
+ * @param data SEEK为off_t，传入起始偏移，成功时写回找到的偏移；
+ *             CLONE_RANGE为struct newfs_clone_range，SNAP_*为struct newfs_snap_arg，PREFETCH无参数
+ * @return int 0成功，否则返回对应错误号
+ */
+int newfs_ioctl(const char* path, int cmd, void* arg, struct fuse_file_info* fi,
+				unsigned int flags, void* data) {
+	off_t pos;
+	int   ret;
+
+	uint64_t start = newfs_stat_now();
+	if (fi == NULL || fi->fh == 0 || NEWFS_FILE(fi)->inode == NULL) {
+		return newfs_stat_end(NEWFS_OP_IOCTL, start, -NEWFS_ERROR_NOTTY);
+	}
+	/* 带参数的命令：进程内直接调用(如newfs_replay)时data可能为NULL */
+	if (data == NULL && ((unsigned int)cmd == NEWFS_IOC_SEEK_DATA || (unsigned int)cmd == NEWFS_IOC_SEEK_HOLE
+						 || (unsigned int)cmd == NEWFS_IOC_CLONE_RANGE
+						 || (unsigned int)cmd == NEWFS_IOC_SNAP_CREATE || (unsigned int)cmd == NEWFS_IOC_SNAP_DELETE)) {
+		return newfs_stat_end(NEWFS_OP_IOCTL, start, -NEWFS_ERROR_INVAL);
+	}
+	if ((unsigned int)cmd == NEWFS_IOC_CLONE_RANGE) {
+		NEWFS_LOCK();
+		ret = newfs_clone_range(NEWFS_FILE(fi), (struct newfs_clone_range *)data);
+		NEWFS_UNLOCK();
+		return newfs_stat_end(NEWFS_OP_CLONE, start, ret);
+	}
+	if ((unsigned int)cmd == NEWFS_IOC_SNAP_CREATE || (unsigned int)cmd == NEWFS_IOC_SNAP_DELETE) {
+		struct newfs_snap_arg* snap = (struct newfs_snap_arg *)data;
+		if (memchr(snap->name, '\0', NEWFS_SNAP_NAME_LEN) == NULL) {
+			return newfs_stat_end(NEWFS_OP_SNAP, start, -NEWFS_ERROR_INVAL);	/* 名字过长 */
+		}
+		NEWFS_LOCK();
+		ret = (unsigned int)cmd == NEWFS_IOC_SNAP_CREATE ? newfs_snap_create(snap->name)
+														 : newfs_snap_delete(snap->name);
+		NEWFS_UNLOCK();
+		return newfs_stat_end(NEWFS_OP_SNAP, start, ret);
+	}
+	if ((unsigned int)cmd == NEWFS_IOC_PREFETCH) {
+		NEWFS_LOCK();
+		ret = newfs_prefetch_hint(NEWFS_FILE(fi)->inode);
+		NEWFS_UNLOCK();
+		return newfs_stat_end(NEWFS_OP_IOCTL, start, ret);
+	}
+	if ((unsigned int)cmd != NEWFS_IOC_SEEK_DATA && (unsigned int)cmd != NEWFS_IOC_SEEK_HOLE) {
+		return newfs_stat_end(NEWFS_OP_IOCTL, start, -NEWFS_ERROR_NOTTY);
+	}
+	NEWFS_LOCK();
+	pos = newfs_file_seek(NEWFS_FILE(fi)->inode, *(off_t *)data,
+						  (unsigned int)cmd == NEWFS_IOC_SEEK_DATA);
+	NEWFS_UNLOCK();
+	if (pos < 0) {
+		return newfs_stat_end(NEWFS_OP_IOCTL, start, (int)pos);
+	}
+	*(off_t *)data = pos;
+	return newfs_stat_end(NEWFS_OP_IOCTL, start, NEWFS_ERROR_NONE);
+}
 
 /**
  * @brief 访问文件，因为读写文件时需要查看权限
@@ -599,18 +1694,42 @@ int newfs_access(const char* path, int type) {
 
 /******************************************************************************
 * SECTION: FUSE入口
+* 定义NEWFS_NO_MAIN时(如tools/newfs_bench)不生成main，改为导出操作表，
+* 由调用者在进程内直接按FUSE的方式调用各操作
 *******************************************************************************/
+#ifdef NEWFS_NO_MAIN
+const struct fuse_operations* newfs_operations(void) {
+	return &operations;
+}
+#else
 int main(int argc, char **argv)
 {
     int ret;
 	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	const struct fuse_operations* ops = &operations;
 
 	newfs_options.device = strdup("/home/students/2023311819/user-land-filesystem/driver/user_ddriver/bin/ddriver");
+	newfs_options.cache_mb = NEWFS_ICACHE_DEFAULT_MB;
 
 	if (fuse_opt_parse(&args, &newfs_options, option_spec, NULL) == -1)
 		return -1;
-	
-	ret = fuse_main(args.argc, args.argv, &operations, NULL);
+	if (newfs_options.blksize != 0 && (newfs_options.blksize < NEWFS_BLKS_SZ_MIN
+		|| newfs_options.blksize > NEWFS_BLKS_SZ_MAX
+		|| (newfs_options.blksize & (newfs_options.blksize - 1)) != 0)) {
+		fprintf(stderr, "newfs: --blksize must be a power of two between %d and %d\n",
+				NEWFS_BLKS_SZ_MIN, NEWFS_BLKS_SZ_MAX);
+		return -1;
+	}
+	if (newfs_options.record != NULL) {
+		ops = newfs_record_operations(&operations, newfs_options.record);
+		if (ops == NULL) {
+			fprintf(stderr, "newfs: cannot open record file %s\n", newfs_options.record);
+			return -1;
+		}
+	}
+
+	ret = fuse_main(args.argc, args.argv, ops, NULL);
 	fuse_opt_free_args(&args);
 	return ret;
-}
\ No newline at end of file
+}
+#endif /* NEWFS_NO_MAIN */
\ No newline at end of file
@@ -0,0 +1,435 @@
+#include "newfs.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/fs.h>
+#include <linux/io_uring.h>
+
+extern struct custom_options newfs_options;
+extern struct newfs_super    super;
+
+/******************************************************************************
+* SECTION: 异步块设备后端
+* 面向镜像文件或块设备(如loop设备)，同步读写用pread/pwrite，
+* 异步请求优先交给io_uring，内核不支持时退回到pread/pwrite线程池。
+* 请求完成后在后端线程中调用bio->end_io。
+*******************************************************************************/
+#define NEWFS_AIO_IO_SZ         512                 /* 与ddriver一致 */
+#define NEWFS_AIO_DEFAULT_SZ    (4 * 1024 * 1024)   /* 新建镜像文件的默认大小 */
+#define NEWFS_AIO_DEPTH         64                  /* 最大在途请求数 */
+#define NEWFS_AIO_WORKERS       4                   /* 线程池线程数 */
+
+struct aio_uring {
+    int                  fd;
+    unsigned             entries;
+    void*                sq_ptr;
+    size_t               sq_sz;
+    void*                cq_ptr;
+    size_t               cq_sz;
+    struct io_uring_sqe* sqes;
+    unsigned*            sq_tail;
+    unsigned*            sq_mask;
+    unsigned*            sq_array;
+    unsigned*            cq_head;
+    unsigned*            cq_tail;
+    unsigned*            cq_mask;
+    struct io_uring_cqe* cqes;
+};
+
+struct aio_ctx {
+    bool              use_uring;
+    struct aio_uring  ring;
+    pthread_t         threads[NEWFS_AIO_WORKERS];
+    int               nr_threads;
+    pthread_mutex_t   lock;
+    pthread_cond_t    cond;         /* 队列非空、在途数减少、退出 */
+    struct newfs_bio* queue_head;   /* 线程池提交队列 */
+    struct newfs_bio* queue_tail;
+    int               inflight;
+    bool              stopping;
+};
+
+/**
+ * @brief 同步读写整段，处理短读写
+ */
+static int aio_rw_full(int fd, int rw, long offset, void* buf, int size) {
+    char* p = (char *)buf;
+    while (size > 0) {
+        ssize_t n = rw == NEWFS_BIO_READ ? pread(fd, p, size, offset)
+                                         : pwrite(fd, p, size, offset);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            return -NEWFS_ERROR_IO;
+        }
+        p += n;
+        offset += n;
+        size -= n;
+    }
+    return NEWFS_ERROR_NONE;
+}
+
+/**
+ * @brief 一个请求完成：回调并减少在途计数
+ */
+static void aio_complete(struct aio_ctx* ctx, struct newfs_bio* bio) {
+    bio->end_io(bio);
+    pthread_mutex_lock(&ctx->lock);
+    ctx->inflight--;
+    pthread_cond_broadcast(&ctx->cond);
+    pthread_mutex_unlock(&ctx->lock);
+}
+
+/******************************************************************************
+* SECTION: io_uring
+*******************************************************************************/
+static int uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+/**
+ * @brief 建立io_uring并映射SQ/CQ环
+ *
+ * @return int 0成功，内核不支持或无权限时返回错误码
+ */
+static int uring_setup(struct aio_uring* ring, unsigned entries) {
+    struct io_uring_params p;
+
+    memset(&p, 0, sizeof(p));
+    ring->fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+    if (ring->fd < 0) {
+        return -NEWFS_ERROR_UNSUPPORTED;
+    }
+    ring->entries = p.sq_entries;
+    ring->sq_sz   = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_sz   = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->sq_sz = ring->cq_sz = ring->sq_sz > ring->cq_sz ? ring->sq_sz : ring->cq_sz;
+    }
+    ring->sq_ptr = mmap(NULL, ring->sq_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ptr == MAP_FAILED) {
+        close(ring->fd);
+        return -NEWFS_ERROR_IO;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ptr = ring->sq_ptr;
+    } else {
+        ring->cq_ptr = mmap(NULL, ring->cq_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                            ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ptr == MAP_FAILED) {
+            munmap(ring->sq_ptr, ring->sq_sz);
+            close(ring->fd);
+            return -NEWFS_ERROR_IO;
+        }
+    }
+    ring->sqes = (struct io_uring_sqe *)mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+                                             PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                             ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        if (ring->cq_ptr != ring->sq_ptr) {
+            munmap(ring->cq_ptr, ring->cq_sz);
+        }
+        munmap(ring->sq_ptr, ring->sq_sz);
+        close(ring->fd);
+        return -NEWFS_ERROR_IO;
+    }
+    ring->sq_tail  = (unsigned *)((char *)ring->sq_ptr + p.sq_off.tail);
+    ring->sq_mask  = (unsigned *)((char *)ring->sq_ptr + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)((char *)ring->sq_ptr + p.sq_off.array);
+    ring->cq_head  = (unsigned *)((char *)ring->cq_ptr + p.cq_off.head);
+    ring->cq_tail  = (unsigned *)((char *)ring->cq_ptr + p.cq_off.tail);
+    ring->cq_mask  = (unsigned *)((char *)ring->cq_ptr + p.cq_off.ring_mask);
+    ring->cqes     = (struct io_uring_cqe *)((char *)ring->cq_ptr + p.cq_off.cqes);
+    return NEWFS_ERROR_NONE;
+}
+
+static void uring_teardown(struct aio_uring* ring) {
+    munmap(ring->sqes, ring->entries * sizeof(struct io_uring_sqe));
+    if (ring->cq_ptr != ring->sq_ptr) {
+        munmap(ring->cq_ptr, ring->cq_sz);
+    }
+    munmap(ring->sq_ptr, ring->sq_sz);
+    close(ring->fd);
+}
+
+/**
+ * @brief 填一个SQE并提交，调用时持有ctx->lock。bio为NULL时提交NOP，用于唤醒完成线程退出
+ */
+static int uring_queue(struct aio_ctx* ctx, int fd, struct newfs_bio* bio) {
+    struct aio_uring*    ring = &ctx->ring;
+    unsigned             tail = *ring->sq_tail;
+    unsigned             idx  = tail & *ring->sq_mask;
+    struct io_uring_sqe* sqe  = &ring->sqes[idx];
+
+    memset(sqe, 0, sizeof(*sqe));
+    if (bio == NULL) {
+        sqe->opcode = IORING_OP_NOP;
+    } else {
+        bio->iov.iov_base = bio->buf;
+        bio->iov.iov_len  = bio->size;
+        sqe->opcode = bio->rw == NEWFS_BIO_READ ? IORING_OP_READV : IORING_OP_WRITEV;
+        sqe->fd     = fd;
+        sqe->off    = bio->offset;
+        sqe->addr   = (unsigned long)&bio->iov;
+        sqe->len    = 1;
+    }
+    sqe->user_data     = (unsigned long)bio;
+    ring->sq_array[idx] = idx;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    return uring_enter(ring->fd, 1, 0, 0) == 1 ? NEWFS_ERROR_NONE : -NEWFS_ERROR_IO;
+}
+
+/**
+ * @brief 完成线程：收割CQE并回调，收到NOP时退出
+ */
+static void* uring_reaper(void* arg) {
+    struct newfs_bdev* bdev = (struct newfs_bdev *)arg;
+    struct aio_ctx*    ctx  = (struct aio_ctx *)bdev->priv;
+    struct aio_uring*  ring = &ctx->ring;
+
+    for (;;) {
+        unsigned head = *ring->cq_head;
+        struct io_uring_cqe* cqe;
+        struct newfs_bio*    bio;
+        int res;
+
+        if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+            uring_enter(ring->fd, 0, 1, IORING_ENTER_GETEVENTS);
+            continue;
+        }
+        cqe = &ring->cqes[head & *ring->cq_mask];
+        bio = (struct newfs_bio *)(unsigned long)cqe->user_data;
+        res = cqe->res;
+        __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+        if (bio == NULL) {
+            break;
+        }
+        if (res == bio->size) {
+            bio->res = NEWFS_ERROR_NONE;
+        } else if (res >= 0) {
+            /* 短读写(不应出现于对齐的镜像文件)，剩余部分同步补齐 */
+            bio->res = aio_rw_full(bdev->fd, bio->rw, bio->offset + res,
+                                   (char *)bio->buf + res, bio->size - res);
+        } else {
+            bio->res = -NEWFS_ERROR_IO;
+        }
+        aio_complete(ctx, bio);
+    }
+    return NULL;
+}
+
+/******************************************************************************
+* SECTION: 线程池
+*******************************************************************************/
+static void* aio_worker(void* arg) {
+    struct newfs_bdev* bdev = (struct newfs_bdev *)arg;
+    struct aio_ctx*    ctx  = (struct aio_ctx *)bdev->priv;
+
+    for (;;) {
+        struct newfs_bio* bio;
+
+        pthread_mutex_lock(&ctx->lock);
+        while (ctx->queue_head == NULL && !ctx->stopping) {
+            pthread_cond_wait(&ctx->cond, &ctx->lock);
+        }
+        if (ctx->queue_head == NULL) {
+            pthread_mutex_unlock(&ctx->lock);
+            break;
+        }
+        bio = ctx->queue_head;
+        ctx->queue_head = bio->next;
+        if (ctx->queue_head == NULL) {
+            ctx->queue_tail = NULL;
+        }
+        pthread_mutex_unlock(&ctx->lock);
+
+        bio->res = aio_rw_full(bdev->fd, bio->rw, bio->offset, bio->buf, bio->size);
+        aio_complete(ctx, bio);
+    }
+    return NULL;
+}
+
+/******************************************************************************
+* SECTION: 后端接口
+*******************************************************************************/
+static int aio_bdev_open_common(struct newfs_bdev* bdev, const char* path, bool try_uring) {
+    struct aio_ctx* ctx;
+    struct stat     st;
+    void* (*fn)(void*);
+
+    bdev->fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (bdev->fd < 0 || fstat(bdev->fd, &st) < 0) {
+        return -NEWFS_ERROR_IO;
+    }
+    if (S_ISBLK(st.st_mode)) {
+        uint64_t bytes;
+        if (ioctl(bdev->fd, BLKGETSIZE64, &bytes) < 0) {
+            close(bdev->fd);
+            return -NEWFS_ERROR_IO;
+        }
+        bdev->size = (long)bytes;
+    } else {
+        if (st.st_size == 0 && ftruncate(bdev->fd, NEWFS_AIO_DEFAULT_SZ) == 0) {
+            st.st_size = NEWFS_AIO_DEFAULT_SZ;        /* 新镜像，按ddriver默认大小建立 */
+        }
+        bdev->size = st.st_size;
+    }
+    bdev->io_sz = NEWFS_AIO_IO_SZ;
+
+    ctx = (struct aio_ctx *)calloc(1, sizeof(struct aio_ctx));
+    pthread_mutex_init(&ctx->lock, NULL);
+    pthread_cond_init(&ctx->cond, NULL);
+    ctx->use_uring = try_uring && uring_setup(&ctx->ring, NEWFS_AIO_DEPTH) == NEWFS_ERROR_NONE;
+    bdev->priv = ctx;
+
+    fn = ctx->use_uring ? uring_reaper : aio_worker;
+    for (int i = 0; i < (ctx->use_uring ? 1 : NEWFS_AIO_WORKERS); i++) {
+        if (pthread_create(&ctx->threads[i], NULL, fn, bdev) != 0) {
+            break;
+        }
+        ctx->nr_threads++;
+    }
+    if (ctx->nr_threads == 0) {
+        if (ctx->use_uring) {
+            uring_teardown(&ctx->ring);
+        }
+        free(ctx);
+        close(bdev->fd);
+        return -NEWFS_ERROR_IO;
+    }
+    return NEWFS_ERROR_NONE;
+}
+
+static int uring_bdev_open(struct newfs_bdev* bdev, const char* path) {
+    return aio_bdev_open_common(bdev, path, true);
+}
+
+static int aio_bdev_open(struct newfs_bdev* bdev, const char* path) {
+    return aio_bdev_open_common(bdev, path, false);
+}
+
+static int aio_bdev_read(struct newfs_bdev* bdev, long offset, void* buf, int size) {
+    __atomic_add_fetch(&bdev->stat.read_cnt, size / bdev->io_sz, __ATOMIC_RELAXED);
+    return aio_rw_full(bdev->fd, NEWFS_BIO_READ, offset, buf, size);
+}
+
+static int aio_bdev_write(struct newfs_bdev* bdev, long offset, const void* buf, int size) {
+    __atomic_add_fetch(&bdev->stat.write_cnt, size / bdev->io_sz, __ATOMIC_RELAXED);
+    return aio_rw_full(bdev->fd, NEWFS_BIO_WRITE, offset, (void *)buf, size);
+}
+
+/**
+ * @brief 异步提交，在途请求达到上限时等待
+ */
+static int aio_bdev_submit(struct newfs_bdev* bdev, struct newfs_bio* bio) {
+    struct aio_ctx* ctx = (struct aio_ctx *)bdev->priv;
+    int ret = NEWFS_ERROR_NONE;
+
+    if (bio->rw == NEWFS_BIO_READ) {
+        __atomic_add_fetch(&bdev->stat.read_cnt, bio->size / bdev->io_sz, __ATOMIC_RELAXED);
+    } else {
+        __atomic_add_fetch(&bdev->stat.write_cnt, bio->size / bdev->io_sz, __ATOMIC_RELAXED);
+    }
+
+    pthread_mutex_lock(&ctx->lock);
+    while (ctx->inflight >= NEWFS_AIO_DEPTH) {
+        pthread_cond_wait(&ctx->cond, &ctx->lock);
+    }
+    ctx->inflight++;
+    if (ctx->use_uring) {
+        ret = uring_queue(ctx, bdev->fd, bio);
+        if (ret != NEWFS_ERROR_NONE) {
+            ctx->inflight--;
+        }
+    } else {
+        bio->next = NULL;
+        if (ctx->queue_tail) ctx->queue_tail->next = bio;
+        else                 ctx->queue_head = bio;
+        ctx->queue_tail = bio;
+        pthread_cond_broadcast(&ctx->cond);
+    }
+    pthread_mutex_unlock(&ctx->lock);
+    return ret;
+}
+
+static void aio_bdev_drain(struct newfs_bdev* bdev) {
+    struct aio_ctx* ctx = (struct aio_ctx *)bdev->priv;
+
+    pthread_mutex_lock(&ctx->lock);
+    while (ctx->inflight > 0) {
+        pthread_cond_wait(&ctx->cond, &ctx->lock);
+    }
+    pthread_mutex_unlock(&ctx->lock);
+}
+
+static int aio_bdev_flush(struct newfs_bdev* bdev) {
+    aio_bdev_drain(bdev);
+    return fdatasync(bdev->fd) == 0 ? NEWFS_ERROR_NONE : -NEWFS_ERROR_IO;
+}
+
+static int aio_bdev_ioctl(struct newfs_bdev* bdev, unsigned long cmd, void* arg) {
+    if (cmd == IOC_REQ_DEVICE_SIZE) {
+        *(int *)arg = (int)bdev->size;
+    } else if (cmd == IOC_REQ_DEVICE_IO_SZ) {
+        *(int *)arg = bdev->io_sz;
+    } else if (cmd == IOC_REQ_DEVICE_STATE) {
+        memcpy(arg, &bdev->stat, sizeof(struct ddriver_state));
+    } else if (cmd == IOC_REQ_DEVICE_RESET) {
+        memset(&bdev->stat, 0, sizeof(struct ddriver_state));
+    } else {
+        return -NEWFS_ERROR_UNSUPPORTED;
+    }
+    return NEWFS_ERROR_NONE;
+}
+
+static void aio_bdev_close(struct newfs_bdev* bdev) {
+    struct aio_ctx* ctx = (struct aio_ctx *)bdev->priv;
+
+    aio_bdev_drain(bdev);
+    pthread_mutex_lock(&ctx->lock);
+    ctx->stopping = true;
+    if (ctx->use_uring) {
+        uring_queue(ctx, bdev->fd, NULL);       /* NOP唤醒完成线程退出 */
+    }
+    pthread_cond_broadcast(&ctx->cond);
+    pthread_mutex_unlock(&ctx->lock);
+    for (int i = 0; i < ctx->nr_threads; i++) {
+        pthread_join(ctx->threads[i], NULL);
+    }
+    if (ctx->use_uring) {
+        uring_teardown(&ctx->ring);
+    }
+    pthread_cond_destroy(&ctx->cond);
+    pthread_mutex_destroy(&ctx->lock);
+    free(ctx);
+    close(bdev->fd);
+}
+
+const struct newfs_bdev_ops newfs_uring_bdev_ops = {
+    .scheme = "uring",
+    .open   = uring_bdev_open,
+    .read   = aio_bdev_read,
+    .write  = aio_bdev_write,
+    .map    = NULL,
+    .flush  = aio_bdev_flush,
+    .submit = aio_bdev_submit,
+    .drain  = aio_bdev_drain,
+    .ioctl  = aio_bdev_ioctl,
+    .close  = aio_bdev_close,
+};
+
+const struct newfs_bdev_ops newfs_aio_bdev_ops = {
+    .scheme = "aio",
+    .open   = aio_bdev_open,
+    .read   = aio_bdev_read,
+    .write  = aio_bdev_write,
+    .map    = NULL,
+    .flush  = aio_bdev_flush,
+    .submit = aio_bdev_submit,
+    .drain  = aio_bdev_drain,
+    .ioctl  = aio_bdev_ioctl,
+    .close  = aio_bdev_close,
+};
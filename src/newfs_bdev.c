@@ -0,0 +1,328 @@
+#include "newfs.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+extern struct custom_options newfs_options;
+extern struct newfs_super    super;
+
+/******************************************************************************
+* SECTION: 块设备后端
+* --device=<scheme>:<path> 选择后端：
+*   ddriver:/path   ddriver设备(缺省，不带scheme时也按ddriver处理)
+*   mmap:/path      普通镜像文件，mmap后直接在映射上读写，读取可零拷贝
+*   uring:/path     镜像文件或块设备，io_uring异步IO，不可用时退回线程池(见newfs_aio.c)
+*   aio:/path       同上，固定使用线程池
+*******************************************************************************/
+#define NEWFS_BDEV_IO_SZ        512                 /* 镜像文件后端的单次IO大小，与ddriver一致 */
+#define NEWFS_BDEV_DEFAULT_SZ   (4 * 1024 * 1024)   /* 新建镜像文件的默认大小，与ddriver一致 */
+
+/******************************************************************************
+* SECTION: ddriver后端
+*******************************************************************************/
+static int ddriver_bdev_open(struct newfs_bdev* bdev, const char* path) {
+    int size;
+
+    bdev->fd = ddriver_open((char *)path);
+    if (bdev->fd < 0) {
+        return -NEWFS_ERROR_IO;
+    }
+    ddriver_ioctl(bdev->fd, IOC_REQ_DEVICE_SIZE,  &size);
+    bdev->size = size;
+    ddriver_ioctl(bdev->fd, IOC_REQ_DEVICE_IO_SZ, &bdev->io_sz);
+    return NEWFS_ERROR_NONE;
+}
+
+static int ddriver_bdev_read(struct newfs_bdev* bdev, long offset, void* buf, int size) {
+    ddriver_seek(bdev->fd, offset, SEEK_SET);
+    for (int i = 0; i < size / bdev->io_sz; i++) {
+        if (ddriver_read(bdev->fd, (char *)buf + i * bdev->io_sz, bdev->io_sz) < 0) {
+            return -NEWFS_ERROR_IO;
+        }
+    }
+    return NEWFS_ERROR_NONE;
+}
+
+static int ddriver_bdev_write(struct newfs_bdev* bdev, long offset, const void* buf, int size) {
+    ddriver_seek(bdev->fd, offset, SEEK_SET);
+    for (int i = 0; i < size / bdev->io_sz; i++) {
+        if (ddriver_write(bdev->fd, (char *)buf + i * bdev->io_sz, bdev->io_sz) < 0) {
+            return -NEWFS_ERROR_IO;
+        }
+    }
+    return NEWFS_ERROR_NONE;
+}
+
+static int ddriver_bdev_ioctl(struct newfs_bdev* bdev, unsigned long cmd, void* arg) {
+    return ddriver_ioctl(bdev->fd, cmd, arg);
+}
+
+static void ddriver_bdev_close(struct newfs_bdev* bdev) {
+    ddriver_close(bdev->fd);
+}
+
+static const struct newfs_bdev_ops ddriver_bdev_ops = {
+    .scheme = "ddriver",
+    .open   = ddriver_bdev_open,
+    .read   = ddriver_bdev_read,
+    .write  = ddriver_bdev_write,
+    .map    = NULL,
+    .flush  = NULL,
+    .ioctl  = ddriver_bdev_ioctl,
+    .close  = ddriver_bdev_close,
+};
+
+/******************************************************************************
+* SECTION: mmap镜像文件后端
+*******************************************************************************/
+static int mmap_bdev_open(struct newfs_bdev* bdev, const char* path) {
+    struct stat st;
+
+    bdev->fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (bdev->fd < 0 || fstat(bdev->fd, &st) < 0) {
+        return -NEWFS_ERROR_IO;
+    }
+    if (st.st_size == 0) {                          /* 新镜像，按ddriver默认大小建立 */
+        if (ftruncate(bdev->fd, NEWFS_BDEV_DEFAULT_SZ) < 0) {
+            close(bdev->fd);
+            return -NEWFS_ERROR_IO;
+        }
+        st.st_size = NEWFS_BDEV_DEFAULT_SZ;
+    }
+    bdev->size  = st.st_size;
+    bdev->io_sz = NEWFS_BDEV_IO_SZ;
+    bdev->map   = (uint8_t *)mmap(NULL, bdev->size, PROT_READ | PROT_WRITE, MAP_SHARED, bdev->fd, 0);
+    if (bdev->map == MAP_FAILED) {
+        bdev->map = NULL;
+        close(bdev->fd);
+        return -NEWFS_ERROR_IO;
+    }
+    bdev->dirty_lo = bdev->size;
+    bdev->dirty_hi = 0;
+    return NEWFS_ERROR_NONE;
+}
+
+static int mmap_bdev_read(struct newfs_bdev* bdev, long offset, void* buf, int size) {
+    memcpy(buf, bdev->map + offset, size);
+    bdev->stat.read_cnt += size / bdev->io_sz;
+    return NEWFS_ERROR_NONE;
+}
+
+static int mmap_bdev_write(struct newfs_bdev* bdev, long offset, const void* buf, int size) {
+    memcpy(bdev->map + offset, buf, size);
+    bdev->stat.write_cnt += size / bdev->io_sz;
+    /* 记录脏区间，flush时只msync这一段 */
+    if (offset < bdev->dirty_lo)        bdev->dirty_lo = offset;
+    if (offset + size > bdev->dirty_hi) bdev->dirty_hi = offset + size;
+    return NEWFS_ERROR_NONE;
+}
+
+static void* mmap_bdev_map(struct newfs_bdev* bdev, long offset, int size) {
+    if (offset < 0 || offset + size > bdev->size) {
+        return NULL;
+    }
+    bdev->stat.read_cnt += (size + bdev->io_sz - 1) / bdev->io_sz;
+    return bdev->map + offset;
+}
+
+static int mmap_bdev_flush(struct newfs_bdev* bdev) {
+    long page = sysconf(_SC_PAGESIZE);
+    long lo, hi;
+
+    if (bdev->dirty_hi <= bdev->dirty_lo) {
+        return NEWFS_ERROR_NONE;
+    }
+    lo = bdev->dirty_lo / page * page;                  /* msync要求页对齐 */
+    hi = bdev->dirty_hi;
+    bdev->dirty_lo = bdev->size;
+    bdev->dirty_hi = 0;
+    return msync(bdev->map + lo, hi - lo, MS_SYNC) == 0 ? NEWFS_ERROR_NONE : -NEWFS_ERROR_IO;
+}
+
+static int mmap_bdev_ioctl(struct newfs_bdev* bdev, unsigned long cmd, void* arg) {
+    if (cmd == IOC_REQ_DEVICE_SIZE) {
+        *(int *)arg = (int)bdev->size;
+    } else if (cmd == IOC_REQ_DEVICE_IO_SZ) {
+        *(int *)arg = bdev->io_sz;
+    } else if (cmd == IOC_REQ_DEVICE_STATE) {
+        memcpy(arg, &bdev->stat, sizeof(struct ddriver_state));
+    } else if (cmd == IOC_REQ_DEVICE_RESET) {
+        memset(&bdev->stat, 0, sizeof(struct ddriver_state));
+    } else {
+        return -NEWFS_ERROR_UNSUPPORTED;
+    }
+    return NEWFS_ERROR_NONE;
+}
+
+static void mmap_bdev_close(struct newfs_bdev* bdev) {
+    mmap_bdev_flush(bdev);
+    munmap(bdev->map, bdev->size);
+    close(bdev->fd);
+    bdev->map = NULL;
+}
+
+static const struct newfs_bdev_ops mmap_bdev_ops = {
+    .scheme = "mmap",
+    .open   = mmap_bdev_open,
+    .read   = mmap_bdev_read,
+    .write  = mmap_bdev_write,
+    .map    = mmap_bdev_map,
+    .flush  = mmap_bdev_flush,
+    .ioctl  = mmap_bdev_ioctl,
+    .close  = mmap_bdev_close,
+};
+
+/******************************************************************************
+* SECTION: 通用接口
+*******************************************************************************/
+static const struct newfs_bdev_ops* bdev_backends[] = {
+    &ddriver_bdev_ops,
+    &mmap_bdev_ops,
+    &newfs_uring_bdev_ops,
+    &newfs_aio_bdev_ops,
+};
+
+/**
+ * @brief 按--device的scheme选择后端并打开设备
+ *
+ * @param uri 形如"mmap:/tmp/newfs.img"，不带scheme时按ddriver路径处理
+ * @return struct newfs_bdev* 失败返回NULL
+ */
+struct newfs_bdev* newfs_bdev_open(const char* uri) {
+    const struct newfs_bdev_ops* ops = &ddriver_bdev_ops;
+    const char* path = uri;
+    const char* colon = strchr(uri, ':');
+    struct newfs_bdev* bdev;
+
+    if (colon != NULL) {
+        for (size_t i = 0; i < sizeof(bdev_backends) / sizeof(bdev_backends[0]); i++) {
+            size_t len = strlen(bdev_backends[i]->scheme);
+            if ((size_t)(colon - uri) == len && strncmp(uri, bdev_backends[i]->scheme, len) == 0) {
+                ops  = bdev_backends[i];
+                path = colon + 1;
+                if (strncmp(path, "//", 2) == 0) {
+                    path += 2;                          /* 兼容 mmap:///path 写法 */
+                }
+                break;
+            }
+        }
+    }
+
+    bdev = (struct newfs_bdev *)calloc(1, sizeof(struct newfs_bdev));
+    bdev->ops = ops;
+    if (ops->open(bdev, path) != NEWFS_ERROR_NONE) {
+        NEWFS_TRACE(NEWFS_TC_BDEV, NEWFS_TL_ERR, "open %s device %s failed", ops->scheme, path);
+        free(bdev);
+        return NULL;
+    }
+    return bdev;
+}
+
+/**
+ * @brief 按设备IO单位对齐的读，offset和size都必须是io_sz的整数倍
+ */
+int newfs_bdev_read(struct newfs_bdev* bdev, long offset, void* buf, int size) {
+    return bdev->ops->read(bdev, offset, buf, size);
+}
+
+/**
+ * @brief 按设备IO单位对齐的写，offset和size都必须是io_sz的整数倍
+ */
+int newfs_bdev_write(struct newfs_bdev* bdev, long offset, const void* buf, int size) {
+    return bdev->ops->write(bdev, offset, buf, size);
+}
+
+/**
+ * @brief 零拷贝访问设备内容，后端不支持时返回NULL，调用者改走newfs_bdev_read
+ */
+void* newfs_bdev_map(struct newfs_bdev* bdev, long offset, int size) {
+    return bdev->ops->map ? bdev->ops->map(bdev, offset, size) : NULL;
+}
+
+/**
+ * @brief 把已写入的数据持久化到介质
+ */
+int newfs_bdev_flush(struct newfs_bdev* bdev) {
+    return bdev->ops->flush ? bdev->ops->flush(bdev) : NEWFS_ERROR_NONE;
+}
+
+/**
+ * @brief 异步提交一个块请求，完成后调用bio->end_io。
+ * 后端不支持异步时同步完成并立即回调。
+ *
+ * @param bdev
+ * @param bio offset和size按io_sz对齐
+ * @return int 0成功提交，否则返回错误码
+ */
+int newfs_bdev_submit(struct newfs_bdev* bdev, struct newfs_bio* bio) {
+    if (bdev->ops->submit) {
+        return bdev->ops->submit(bdev, bio);
+    }
+    if (bio->rw == NEWFS_BIO_READ) {
+        bio->res = bdev->ops->read(bdev, bio->offset, bio->buf, bio->size);
+    } else {
+        bio->res = bdev->ops->write(bdev, bio->offset, bio->buf, bio->size);
+    }
+    bio->end_io(bio);
+    return NEWFS_ERROR_NONE;
+}
+
+/**
+ * @brief 异步写的完成回调：记录第一个错误，释放bio
+ */
+static void bdev_end_write(struct newfs_bio* bio) {
+    struct newfs_bdev* bdev = (struct newfs_bdev *)bio->priv;
+    int expected = NEWFS_ERROR_NONE;
+
+    if (bio->res != NEWFS_ERROR_NONE) {
+        __atomic_compare_exchange_n(&bdev->io_err, &expected, bio->res, false,
+                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+    }
+    free(bio);
+}
+
+/**
+ * @brief 提交一次异步写(写回用)，buf在newfs_bdev_drain返回前必须保持有效且不被修改
+ *
+ * @return int 0成功提交，错误在newfs_bdev_drain时返回
+ */
+int newfs_bdev_write_async(struct newfs_bdev* bdev, long offset, void* buf, int size) {
+    struct newfs_bio* bio = (struct newfs_bio *)calloc(1, sizeof(struct newfs_bio));
+
+    bio->rw     = NEWFS_BIO_WRITE;
+    bio->offset = offset;
+    bio->buf    = buf;
+    bio->size   = size;
+    bio->end_io = bdev_end_write;
+    bio->priv   = bdev;
+    return newfs_bdev_submit(bdev, bio);
+}
+
+/**
+ * @brief 等待所有在途异步请求完成
+ *
+ * @return int 上次drain以来异步写的第一个错误
+ */
+int newfs_bdev_drain(struct newfs_bdev* bdev) {
+    if (bdev->ops->drain) {
+        bdev->ops->drain(bdev);
+    }
+    return __atomic_exchange_n(&bdev->io_err, NEWFS_ERROR_NONE, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief 只等待在途请求完成，错误仍留给下一次newfs_bdev_drain返回
+ */
+void newfs_bdev_wait(struct newfs_bdev* bdev) {
+    if (bdev->ops->drain) {
+        bdev->ops->drain(bdev);
+    }
+}
+
+int newfs_bdev_ioctl(struct newfs_bdev* bdev, unsigned long cmd, void* arg) {
+    return bdev->ops->ioctl(bdev, cmd, arg);
+}
+
+void newfs_bdev_close(struct newfs_bdev* bdev) {
+    bdev->ops->close(bdev);
+    free(bdev);
+}
@@ -0,0 +1,447 @@
+#include "newfs.h"
+
+extern struct custom_options newfs_options;
+extern struct newfs_super    super;
+
+/******************************************************************************
+* SECTION: LZ编解码
+* LZ4风格的字节流：每个序列为token(高4位字面量长度、低4位匹配长度-4)、
+* 长度为15时的扩展字节(逐字节累加，直到不为255)、字面量、2字节小端匹配偏移、匹配长度扩展字节。
+* 最后一个序列只有字面量。压缩用4字节哈希找最近一次出现的位置，不做多候选搜索。
+*******************************************************************************/
+#define LZ_MIN_MATCH            4
+#define LZ_HASH_BITS            12
+#define LZ_MAX_OFFSET           65535
+
+static uint32_t lz_read32(const uint8_t* p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static int lz_hash(uint32_t v) {
+    return (int)((v * 2654435761u) >> (32 - LZ_HASH_BITS));
+}
+
+/**
+ * @brief 写长度的扩展字节
+ *
+ * @return uint8_t* 写入后的位置，输出空间不足返回NULL
+ */
+static uint8_t* lz_put_len(uint8_t* op, const uint8_t* oend, int len) {
+    while (len >= 255) {
+        if (op >= oend) {
+            return NULL;
+        }
+        *op++ = 255;
+        len  -= 255;
+    }
+    if (op >= oend) {
+        return NULL;
+    }
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+/**
+ * @brief 输出一个序列，mlen为0时只有字面量(最后一个序列)
+ */
+static uint8_t* lz_emit(uint8_t* op, const uint8_t* oend, const uint8_t* lit, int nlit, int off, int mlen) {
+    uint8_t* token;
+
+    if (op >= oend) {
+        return NULL;
+    }
+    token  = op++;
+    *token = (uint8_t)((nlit >= 15 ? 15 : nlit) << 4);
+    if (nlit >= 15 && (op = lz_put_len(op, oend, nlit - 15)) == NULL) {
+        return NULL;
+    }
+    if (oend - op < nlit) {
+        return NULL;
+    }
+    memcpy(op, lit, nlit);
+    op += nlit;
+    if (mlen == 0) {
+        return op;
+    }
+    if (oend - op < 2) {
+        return NULL;
+    }
+    *op++   = (uint8_t)(off & 0xff);
+    *op++   = (uint8_t)(off >> 8);
+    mlen   -= LZ_MIN_MATCH;
+    *token |= (uint8_t)(mlen >= 15 ? 15 : mlen);
+    if (mlen >= 15 && (op = lz_put_len(op, oend, mlen - 15)) == NULL) {
+        return NULL;
+    }
+    return op;
+}
+
+/**
+ * @brief 压缩src[0, len)
+ *
+ * @param dst 输出缓冲
+ * @param cap 输出缓冲大小
+ * @return int 压缩后的字节数，cap装不下时返回0
+ */
+static int lz_compress(const uint8_t* src, int len, uint8_t* dst, int cap) {
+    int            table[1 << LZ_HASH_BITS];
+    const uint8_t* ip     = src;
+    const uint8_t* anchor = src;
+    const uint8_t* iend   = src + len;
+    uint8_t*       op     = dst;
+    const uint8_t* oend   = dst + cap;
+
+    memset(table, 0xFF, sizeof(table));
+    while (iend - ip >= LZ_MIN_MATCH) {
+        uint32_t v   = lz_read32(ip);
+        int      h   = lz_hash(v);
+        int      ref = table[h];
+
+        table[h] = (int)(ip - src);
+        if (ref >= 0 && ip - src - ref <= LZ_MAX_OFFSET && lz_read32(src + ref) == v) {
+            const uint8_t* m = src + ref + LZ_MIN_MATCH;
+            const uint8_t* p = ip + LZ_MIN_MATCH;
+
+            while (p < iend && *p == *m) {
+                p++;
+                m++;
+            }
+            op = lz_emit(op, oend, anchor, (int)(ip - anchor), (int)(ip - src - ref), (int)(p - ip));
+            if (op == NULL) {
+                return 0;
+            }
+            ip = anchor = p;
+        } else {
+            ip++;
+        }
+    }
+    op = lz_emit(op, oend, anchor, (int)(iend - anchor), 0, 0);
+    return op ? (int)(op - dst) : 0;
+}
+
+/**
+ * @brief 读长度的扩展字节并累加到*len
+ */
+static const uint8_t* lz_get_len(const uint8_t* ip, const uint8_t* iend, int* len) {
+    int b;
+
+    do {
+        if (ip >= iend) {
+            return NULL;
+        }
+        b     = *ip++;
+        *len += b;
+    } while (b == 255);
+    return ip;
+}
+
+/**
+ * @brief 解压，逐项检查边界，损坏的输入不会越界
+ *
+ * @return int 解压后的字节数，输入损坏返回-1
+ */
+static int lz_decompress(const uint8_t* src, int clen, uint8_t* dst, int cap) {
+    const uint8_t* ip   = src;
+    const uint8_t* iend = src + clen;
+    uint8_t*       op   = dst;
+    const uint8_t* oend = dst + cap;
+
+    while (ip < iend) {
+        int token = *ip++;
+        int nlit  = token >> 4;
+        int mlen  = token & 15;
+        int off;
+        const uint8_t* m;
+
+        if (nlit == 15 && (ip = lz_get_len(ip, iend, &nlit)) == NULL) {
+            return -1;
+        }
+        if (iend - ip < nlit || oend - op < nlit) {
+            return -1;
+        }
+        memcpy(op, ip, nlit);
+        op += nlit;
+        ip += nlit;
+        if (ip == iend) {
+            break;                                  /* 最后一个序列 */
+        }
+        if (iend - ip < 2) {
+            return -1;
+        }
+        off = ip[0] | ip[1] << 8;
+        ip += 2;
+        if (mlen == 15 && (ip = lz_get_len(ip, iend, &mlen)) == NULL) {
+            return -1;
+        }
+        mlen += LZ_MIN_MATCH;
+        if (off == 0 || off > op - dst || oend - op < mlen) {
+            return -1;
+        }
+        for (m = op - off; mlen > 0; mlen--) {       /* 可能与输出重叠，逐字节复制 */
+            *op++ = *m++;
+        }
+    }
+    return (int)(op - dst);
+}
+
+/******************************************************************************
+* SECTION: 簇压缩
+* 文件按NEWFS_COMP_CLUSTER块对齐分簇，--compress时写回整簇压缩：
+* 压缩结果(newfs_comp_hdr_d加LZ字节流)至少省下一块才采用，存入该簇原有的前k块，
+* 这k项带NEWFS_BLK_COMPRESSED标记，其余项成为空洞并释放原来的块；省不下一块时按原样写回。
+* 簇是否压缩只看第一项，释放、fsck等只关心块号的代码不需要区分。
+* 读时整簇解压进块缓存；写入、截断等改动簇内容前先展开为普通块。
+*******************************************************************************/
+struct newfs_comp_stat comp_stat;
+
+/**
+ * @brief 第blk块所在的簇是否已压缩
+ */
+bool newfs_comp_cluster(struct newfs_inode* inode, int blk) {
+    return NEWFS_BLK_IS_COMP(inode->data[blk - blk % NEWFS_COMP_CLUSTER]);
+}
+
+/**
+ * @brief 压缩簇占用的块数，即开头带标记的项数
+ */
+static int comp_nr_blks(struct newfs_inode* inode, int first) {
+    int k = 0;
+
+    while (k < NEWFS_COMP_CLUSTER && NEWFS_BLK_IS_COMP(inode->data[first + k])) {
+        k++;
+    }
+    return k;
+}
+
+/**
+ * @brief 读入并解压一个压缩簇
+ *
+ * @param raw 输出，至少NEWFS_COMP_CLUSTER块
+ * @return int 原始长度，失败返回-NEWFS_ERROR_IO
+ */
+static int comp_read(struct newfs_inode* inode, int first, uint8_t* raw) {
+    int      blk_sz = NEWFS_IO_SZ();
+    int      k      = comp_nr_blks(inode, first);
+    uint8_t* buf    = (uint8_t *)malloc((size_t)k * blk_sz);
+    struct newfs_comp_hdr_d hdr;
+    uint64_t start  = newfs_stat_now();
+    int      rlen;
+
+    for (int j = 0; j < k; j++) {
+        if (your_read(NEWFS_DATA_OFS(NEWFS_BLKNO(inode->data[first + j])), buf + (size_t)j * blk_sz,
+                      blk_sz) != NEWFS_ERROR_NONE
+            || !newfs_csum_verify(NEWFS_BLKNO(inode->data[first + j]), buf + (size_t)j * blk_sz)) {
+            free(buf);
+            return -NEWFS_ERROR_IO;
+        }
+    }
+    memcpy(&hdr, buf, sizeof(hdr));
+    if (hdr.clen > (uint32_t)(k * blk_sz - (int)sizeof(hdr)) || hdr.rlen > (uint32_t)(NEWFS_COMP_CLUSTER * blk_sz)
+        || (rlen = lz_decompress(buf + sizeof(hdr), hdr.clen, raw, hdr.rlen)) != (int)hdr.rlen) {
+        NEWFS_TRACE(NEWFS_TC_DATA, NEWFS_TL_ERR, "inode %d: corrupt compressed cluster at block %d",
+                    inode->ino, first);
+        free(buf);
+        return -NEWFS_ERROR_IO;
+    }
+    free(buf);
+    __atomic_add_fetch(&comp_stat.loads, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&comp_stat.decomp_ns, newfs_stat_now() - start, __ATOMIC_RELAXED);
+    return rlen;
+}
+
+/**
+ * @brief 把压缩簇解压进块缓存，簇内尚未缓存的每一块都得到缓冲(原始长度之后填0)，簇仍保持压缩
+ *
+ * @param blk 簇内任一块
+ * @return int 0成功，否则返回对应错误号
+ */
+int newfs_comp_load(struct newfs_inode* inode, int blk) {
+    int      blk_sz = NEWFS_IO_SZ();
+    int      first  = blk - blk % NEWFS_COMP_CLUSTER;
+    uint8_t* raw    = (uint8_t *)calloc(NEWFS_COMP_CLUSTER, blk_sz);
+    int      rlen   = comp_read(inode, first, raw);
+
+    if (rlen < 0) {
+        free(raw);
+        return rlen;
+    }
+    for (int j = 0; j < NEWFS_COMP_CLUSTER; j++) {
+        if (inode->data_blks[first + j] == NULL) {
+            inode->data_blks[first + j] = newfs_buf_alloc();
+            memcpy(inode->data_blks[first + j], raw + (size_t)j * blk_sz, blk_sz);
+            newfs_icache_charge(blk_sz);
+        }
+    }
+    free(raw);
+    return NEWFS_ERROR_NONE;
+}
+
+/**
+ * @brief 把压缩簇展开为普通块：保留原有的k块、补分配其余块，原始长度内的块全部标记为脏，
+ * 原始长度之后的项保持空洞并丢弃其缓冲。仍与快照共享的块不能改写，换成新块后释放一个引用
+ *
+ * @param blk 簇内任一块
+ * @return int 0成功，否则返回对应错误号
+ */
+int newfs_comp_expand(struct newfs_inode* inode, int blk) {
+    int      blk_sz = NEWFS_IO_SZ();
+    int      first  = blk - blk % NEWFS_COMP_CLUSTER;
+    int      k      = comp_nr_blks(inode, first);
+    uint8_t* raw    = (uint8_t *)calloc(NEWFS_COMP_CLUSTER, blk_sz);
+    int      rlen   = comp_read(inode, first, raw);
+    int      nb, got = 0;
+    uint32_t blknos[NEWFS_COMP_CLUSTER];
+    bool     fresh[NEWFS_COMP_CLUSTER];
+
+    if (rlen < 0) {
+        free(raw);
+        return rlen;
+    }
+    nb = (rlen + blk_sz - 1) / blk_sz;
+    if (nb < k) {
+        nb = k;
+    }
+    for (got = 0; got < nb; got++) {
+        uint32_t old = got < k ? inode->data[first + got] : (uint32_t)-1;
+        int      b;
+
+        fresh[got] = got >= k || (NEWFS_BLK_IS_SHARED(old) && newfs_share_ref(NEWFS_BLKNO(old)) > 1);
+        b = fresh[got] ? newfs_alloc_blk() : (int)NEWFS_BLKNO(old);
+        if (b < 0) {
+            for (int j = 0; j < got; j++) {
+                if (fresh[j]) {
+                    newfs_free_blk(blknos[j]);
+                }
+            }
+            free(raw);
+            return -NEWFS_ERROR_NOSPACE;
+        }
+        blknos[got] = b;
+    }
+    for (int j = 0; j < k; j++) {
+        if (fresh[j]) {
+            newfs_share_put(NEWFS_BLKNO(inode->data[first + j]));
+        }
+    }
+    for (int j = 0; j < NEWFS_COMP_CLUSTER; j++) {
+        int b = first + j;
+        if (j >= nb) {
+            if (inode->data_blks[b] != NULL) {
+                newfs_buf_free(inode->data_blks[b]);
+                newfs_icache_charge(-(long)blk_sz);
+                inode->data_blks[b] = NULL;
+            }
+            continue;
+        }
+        if (inode->data_blks[b] == NULL) {              /* 已缓存的块可能比磁盘上新，保留 */
+            inode->data_blks[b] = newfs_buf_alloc();
+            memcpy(inode->data_blks[b], raw + (size_t)j * blk_sz, blk_sz);
+            newfs_icache_charge(blk_sz);
+        }
+        inode->data[b] = blknos[j];
+        NEWFS_BLK_SET_DIRTY(inode, b);
+    }
+    free(raw);
+    newfs_mark_dirty(inode);
+    __atomic_add_fetch(&comp_stat.expands, 1, __ATOMIC_RELAXED);
+    return NEWFS_ERROR_NONE;
+}
+
+/**
+ * @brief 写回时尝试压缩一个簇。簇内有脏块、原始长度内全是已写入的独占块、之后全是空洞时才压缩，
+ * 未缓存的块先读入。压缩结果写到新分配的块上，写成功后才切换data[]，脏标记清除；
+ * 原来的块由调用者在新块的位图落盘后释放，崩溃时磁盘上的旧inode仍指向完整的原始块
+ *
+ * @param first 簇的第一块
+ * @param stale 追加被替换下来的原始块号，至少能再放NEWFS_COMP_CLUSTER个
+ * @param nstale stale中的块数
+ * @return bool 为true时已压缩写回，否则由调用者按普通块写回
+ */
+bool newfs_comp_writeback(struct newfs_inode* inode, int first, uint32_t* stale, int* nstale) {
+    int      blk_sz = NEWFS_IO_SZ();
+    long     rlen   = inode->size - (long)first * blk_sz;
+    int      nb, k, got, clen, cap;
+    bool     dirty  = false;
+    bool     ok     = true;
+    uint8_t* raw;
+    uint8_t* out;
+    uint64_t start;
+    int      blknos[NEWFS_COMP_CLUSTER];
+    struct newfs_comp_hdr_d hdr;
+
+    if (!newfs_options.compress || rlen <= 0 || NEWFS_BLK_IS_COMP(inode->data[first])) {
+        return false;
+    }
+    if (rlen > (long)NEWFS_COMP_CLUSTER * blk_sz) {
+        rlen = (long)NEWFS_COMP_CLUSTER * blk_sz;
+    }
+    nb = (rlen + blk_sz - 1) / blk_sz;
+    if (nb < 2) {
+        return false;                                   /* 一块省不下空间 */
+    }
+    for (int j = 0; j < NEWFS_COMP_CLUSTER; j++) {
+        uint32_t b = inode->data[first + j];
+        if (j < nb ? (!NEWFS_BLK_WRITTEN(b) || NEWFS_BLK_IS_SHARED(b)) : !NEWFS_BLK_HOLE(b)) {
+            return false;
+        }
+        dirty |= j < nb && NEWFS_BLK_DIRTY(inode, first + j);
+    }
+    if (!dirty) {
+        return false;
+    }
+
+    start = newfs_stat_now();
+    cap   = (nb - 1) * blk_sz;
+    raw   = (uint8_t *)malloc((size_t)nb * blk_sz);
+    out   = (uint8_t *)calloc(1, cap);
+    for (int j = 0; j < nb; j++) {
+        uint8_t* data = newfs_file_block(inode, first + j, false);
+        if (data == NULL) {
+            free(raw);
+            free(out);
+            return false;
+        }
+        memcpy(raw + (size_t)j * blk_sz, data, blk_sz);
+    }
+    clen = lz_compress(raw, (int)rlen, out + sizeof(hdr), cap - (int)sizeof(hdr));
+    __atomic_add_fetch(&comp_stat.comp_ns, newfs_stat_now() - start, __ATOMIC_RELAXED);
+    if (clen == 0) {
+        __atomic_add_fetch(&comp_stat.fallbacks, 1, __ATOMIC_RELAXED);
+        free(raw);
+        free(out);
+        return false;                                   /* 不可压缩，按原样写回 */
+    }
+    hdr.clen = clen;
+    hdr.rlen = (uint32_t)rlen;
+    memcpy(out, &hdr, sizeof(hdr));
+    k = ((int)sizeof(hdr) + clen + blk_sz - 1) / blk_sz;
+    for (got = 0; ok && got < k; got++) {
+        if ((blknos[got] = newfs_alloc_blk()) < 0) {
+            break;
+        }
+        newfs_csum_update(blknos[got], out + (size_t)got * blk_sz);
+        ok = your_write(NEWFS_DATA_OFS(blknos[got]), out + (size_t)got * blk_sz, blk_sz) == NEWFS_ERROR_NONE;
+    }
+    if (!ok || got < k) {
+        while (got-- > 0) {
+            newfs_free_blk(blknos[got]);                /* 原始块未动，仍按普通块写回 */
+        }
+        free(raw);
+        free(out);
+        return false;
+    }
+    for (int j = 0; j < nb; j++) {
+        stale[(*nstale)++] = NEWFS_BLKNO(inode->data[first + j]);
+        /* 新块之后的缓冲保留，读时不必再解压 */
+        inode->data[first + j] = j < k ? ((uint32_t)blknos[j] | NEWFS_BLK_COMPRESSED) : (uint32_t)-1;
+        NEWFS_BLK_CLEAR_DIRTY(inode, first + j);
+    }
+    free(raw);
+    free(out);
+    __atomic_add_fetch(&comp_stat.clusters, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&comp_stat.raw_bytes, (uint64_t)nb * blk_sz, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&comp_stat.stored_bytes, (uint64_t)k * blk_sz, __ATOMIC_RELAXED);
+    return true;
+}
@@ -0,0 +1,346 @@
+#include "newfs.h"
+
+extern struct custom_options newfs_options;
+extern struct newfs_super    super;
+
+/******************************************************************************
+* SECTION: CRC32C
+* Castagnoli多项式(反射形式0x82F63B78)。x86-64上CPU支持SSE4.2时用crc32指令每次处理8字节，
+* 否则用slice-by-8查表：每次取8字节，8张表各查一次后异或，没有逐字节的依赖链。
+* 实现在第一次调用时选定，fsck等工具与newfs共用。
+*******************************************************************************/
+#define CRC32C_POLY         0x82F63B78u
+
+static uint32_t        crc_table[8][256];
+static uint32_t      (*crc_fn)(uint32_t, const uint8_t*, size_t);
+static const char*     crc_impl = "none";
+static pthread_once_t  crc_once = PTHREAD_ONCE_INIT;
+
+static uint32_t crc_sw(uint32_t crc, const uint8_t* p, size_t len) {
+    while (len > 0 && ((uintptr_t)p & 7) != 0) {
+        crc = crc_table[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+        len--;
+    }
+    while (len >= 8) {
+        uint64_t w;
+        memcpy(&w, p, sizeof(w));                   /* 小端：最低字节离结果最远，查第7张表 */
+        w  ^= crc;
+        crc = crc_table[7][w & 0xFF]         ^ crc_table[6][(w >> 8) & 0xFF]
+            ^ crc_table[5][(w >> 16) & 0xFF] ^ crc_table[4][(w >> 24) & 0xFF]
+            ^ crc_table[3][(w >> 32) & 0xFF] ^ crc_table[2][(w >> 40) & 0xFF]
+            ^ crc_table[1][(w >> 48) & 0xFF] ^ crc_table[0][w >> 56];
+        p   += 8;
+        len -= 8;
+    }
+    while (len-- > 0) {
+        crc = crc_table[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc_hw(uint32_t crc, const uint8_t* p, size_t len) {
+    uint64_t c = crc;
+
+    while (len > 0 && ((uintptr_t)p & 7) != 0) {
+        c = __builtin_ia32_crc32qi((uint32_t)c, *p++);
+        len--;
+    }
+    while (len >= 8) {
+        uint64_t w;
+        memcpy(&w, p, sizeof(w));
+        c    = __builtin_ia32_crc32di(c, w);
+        p   += 8;
+        len -= 8;
+    }
+    while (len-- > 0) {
+        c = __builtin_ia32_crc32qi((uint32_t)c, *p++);
+    }
+    return (uint32_t)c;
+}
+#endif
+
+static void crc_init(void) {
+    for (int i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) {
+            c = (c & 1) ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+        }
+        crc_table[0][i] = c;
+    }
+    for (int i = 0; i < 256; i++) {
+        for (int t = 1; t < 8; t++) {
+            crc_table[t][i] = (crc_table[t - 1][i] >> 8) ^ crc_table[0][crc_table[t - 1][i] & 0xFF];
+        }
+    }
+    crc_fn   = crc_sw;
+    crc_impl = "slice-by-8";
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2")) {
+        crc_fn   = crc_hw;
+        crc_impl = "sse4.2";
+    }
+#endif
+}
+
+/**
+ * @brief 计算buf的CRC32C(初值与结果各取反一次，与iSCSI/ext4一致)
+ */
+uint32_t newfs_crc32c(const void* buf, size_t len) {
+    pthread_once(&crc_once, crc_init);
+    return ~crc_fn(~0u, (const uint8_t *)buf, len);
+}
+
+/**
+ * @brief 当前使用的实现，统计输出用
+ */
+const char* newfs_crc32c_impl(void) {
+    pthread_once(&crc_once, crc_init);
+    return crc_impl;
+}
+
+/******************************************************************************
+* SECTION: 元数据校验
+* 校验和存放在超级块的最后一项、inode槽位或目录块的最后4字节，覆盖它前面的全部内容。
+* 只有带NEWFS_FEAT_CSUM的文件系统才调用，由调用者判断。这些函数只依赖参数，fsck同样使用。
+*******************************************************************************/
+struct newfs_csum_stat csum_stat;
+
+/**
+ * @brief 计算并计入统计
+ */
+static uint32_t csum_calc(const void* buf, size_t len) {
+    uint64_t start = newfs_stat_now();
+    uint32_t crc   = newfs_crc32c(buf, len);
+
+    __atomic_add_fetch(&csum_stat.bytes, len, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&csum_stat.ns, newfs_stat_now() - start, __ATOMIC_RELAXED);
+    return crc;
+}
+
+static bool csum_check(uint32_t expect, const void* buf, size_t len) {
+    bool ok = csum_calc(buf, len) == expect;
+
+    __atomic_add_fetch(&csum_stat.meta_verifies, 1, __ATOMIC_RELAXED);
+    if (!ok) {
+        __atomic_add_fetch(&csum_stat.meta_failures, 1, __ATOMIC_RELAXED);
+    }
+    return ok;
+}
+
+/**
+ * @brief 超级块校验和的位置：没有NEWFS_FEAT_SNAP的镜像不含snap_ino，校验和在它的位置上
+ */
+static size_t super_csum_ofs(const struct newfs_super_d* sb) {
+    return (sb->features & NEWFS_FEAT_SNAP) ? offsetof(struct newfs_super_d, csum)
+                                            : offsetof(struct newfs_super_d, snap_ino);
+}
+
+void newfs_csum_super_seal(struct newfs_super_d* sb) {
+    size_t   ofs = super_csum_ofs(sb);
+    uint32_t crc = csum_calc(sb, ofs);
+
+    memcpy((uint8_t *)sb + ofs, &crc, sizeof(crc));
+}
+
+bool newfs_csum_super_ok(const struct newfs_super_d* sb) {
+    size_t   ofs = super_csum_ofs(sb);
+    uint32_t crc;
+
+    memcpy(&crc, (const uint8_t *)sb + ofs, sizeof(crc));
+    return csum_check(crc, sb, ofs);
+}
+
+/**
+ * @brief inode：校验和在槽位的最后4字节。不带NEWFS_FEAT_XATTR的镜像槽位不含扩展属性区，
+ * 校验和落在xattr_blk的位置上
+ *
+ * @param ino_sz 槽位大小，见newfs_inode_d_size
+ */
+void newfs_csum_inode_seal(struct newfs_inode_d* inode_d, int ino_sz) {
+    size_t   ofs = ino_sz - sizeof(uint32_t);
+    uint32_t crc = csum_calc(inode_d, ofs);
+
+    memcpy((uint8_t *)inode_d + ofs, &crc, sizeof(crc));
+}
+
+bool newfs_csum_inode_ok(const struct newfs_inode_d* inode_d, int ino_sz) {
+    size_t   ofs = ino_sz - sizeof(uint32_t);
+    uint32_t crc;
+
+    memcpy(&crc, (const uint8_t *)inode_d + ofs, sizeof(crc));
+    return csum_check(crc, inode_d, ofs);
+}
+
+/**
+ * @brief 目录块：最后4字节存放前面内容的CRC32C
+ *
+ * @param blk 整个目录块
+ * @param blk_sz 逻辑块大小
+ */
+void newfs_csum_dirblk_seal(void* blk, int blk_sz) {
+    uint32_t crc = csum_calc(blk, blk_sz - sizeof(uint32_t));
+    memcpy((uint8_t *)blk + blk_sz - sizeof(uint32_t), &crc, sizeof(crc));
+}
+
+bool newfs_csum_dirblk_ok(const void* blk, int blk_sz) {
+    uint32_t crc;
+
+    memcpy(&crc, (const uint8_t *)blk + blk_sz - sizeof(uint32_t), sizeof(crc));
+    return csum_check(crc, blk, blk_sz - sizeof(uint32_t));
+}
+
+/**
+ * @brief 位图：覆盖磁盘上的整块，与写回位图的范围一致
+ */
+uint32_t newfs_csum_map(const uint8_t* map, int len) {
+    return csum_calc(map, len);
+}
+
+bool newfs_csum_map_ok(uint32_t expect, const uint8_t* map, int len) {
+    return csum_check(expect, map, len);
+}
+
+/******************************************************************************
+* SECTION: 数据块校验
+* --data_csum时为每个数据块记一个CRC32C，0表示未知(未写过或记录已作废)，不校验。
+* 数据块写回时更新，读入块缓存(含预读、解压与写时复制)时校验，不符时读返回EIO。
+* 块被释放时记录清零，块的下一个使用者重新写入后才有记录。
+* 表卸载时写入隐藏inode(super.csum_ino)，只有正常卸载后挂载才读入；
+* 异常退出后表可能过时，丢弃重建，没有--data_csum挂载时表在卸载时删除。
+*******************************************************************************/
+static uint32_t* csum_tab;                          /* 每个数据块一项 */
+static bool      csum_on;
+static bool      csum_dirty;
+
+/**
+ * @brief 表最多能记录的块数，受隐藏inode的数据块数限制
+ */
+static int csum_max(void) {
+    return (NEWFS_DATA_PER_FILE * NEWFS_IO_SZ() - (int)sizeof(uint32_t)) / (int)sizeof(uint32_t);
+}
+
+/**
+ * @brief 挂载时读入数据块校验表
+ *
+ * @param clean 上次是否正常卸载，否则磁盘上的表可能过时，丢弃
+ */
+void newfs_csum_load(bool clean) {
+    void* buf;
+    int   len;
+
+    csum_on    = newfs_options.data_csum;
+    csum_dirty = super.csum_ino != 0 && !csum_on;   /* 不校验时卸载时删除旧表 */
+    if (!csum_on) {
+        return;
+    }
+    if (super.data_blks > csum_max()) {
+        NEWFS_TRACE(NEWFS_TC_SUPER, NEWFS_TL_WARN, "%d data blocks exceed checksum table limit %d, data checksums off",
+                    super.data_blks, csum_max());
+        csum_on    = false;
+        csum_dirty = super.csum_ino != 0;
+        return;
+    }
+    csum_tab = (uint32_t *)calloc(super.data_blks, sizeof(uint32_t));
+    if (super.csum_ino == 0) {
+        return;
+    }
+    if (!clean) {
+        NEWFS_TRACE(NEWFS_TC_SUPER, NEWFS_TL_WARN, "data checksum table dropped after unclean unmount");
+        csum_dirty = true;
+        return;
+    }
+    if (newfs_hidden_read(super.csum_ino, &buf, &len) != NEWFS_ERROR_NONE
+        || len != super.data_blks * (int)sizeof(uint32_t)) {
+        NEWFS_TRACE(NEWFS_TC_SUPER, NEWFS_TL_ERR, "cannot read data checksum table, starting empty");
+        free(buf);
+        csum_dirty = true;
+        return;
+    }
+    memcpy(csum_tab, buf, len);
+    free(buf);
+}
+
+/**
+ * @brief 数据块blkno即将写入buf，更新记录
+ */
+void newfs_csum_update(uint32_t blkno, const void* buf) {
+    if (!csum_on || blkno >= (uint32_t)super.data_blks) {
+        return;
+    }
+    csum_tab[blkno] = csum_calc(buf, NEWFS_IO_SZ());
+    csum_dirty      = true;
+    __atomic_add_fetch(&csum_stat.data_updates, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief 校验从数据块blkno读出的buf，没有记录时视为通过
+ *
+ * @return bool 是否通过
+ */
+bool newfs_csum_verify(uint32_t blkno, const void* buf) {
+    if (!csum_on || blkno >= (uint32_t)super.data_blks || csum_tab[blkno] == 0) {
+        return true;
+    }
+    __atomic_add_fetch(&csum_stat.data_verifies, 1, __ATOMIC_RELAXED);
+    if (csum_calc(buf, NEWFS_IO_SZ()) != csum_tab[blkno]) {
+        __atomic_add_fetch(&csum_stat.data_failures, 1, __ATOMIC_RELAXED);
+        NEWFS_TRACE(NEWFS_TC_DATA, NEWFS_TL_ERR, "data block %u checksum mismatch", blkno);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief 块已释放，记录作废
+ */
+void newfs_csum_forget(uint32_t blkno) {
+    if (csum_tab != NULL && blkno < (uint32_t)super.data_blks && csum_tab[blkno] != 0) {
+        csum_tab[blkno] = 0;
+        csum_dirty      = true;
+    }
+}
+
+/**
+ * @brief 卸载时写回校验表，不校验时删除旧表
+ *
+ * @return int 0成功，否则返回错误码
+ */
+int newfs_csum_sync(void) {
+    int ret;
+
+    if (!csum_dirty) {
+        return NEWFS_ERROR_NONE;
+    }
+    ret = newfs_hidden_write(&super.csum_ino, csum_on ? csum_tab : NULL,
+                             csum_on ? super.data_blks * (int)sizeof(uint32_t) : 0);
+    if (ret != NEWFS_ERROR_NONE) {
+        NEWFS_TRACE(NEWFS_TC_SUPER, NEWFS_TL_ERR, "write data checksum table failed");
+        return -NEWFS_ERROR_IO;
+    }
+    csum_dirty = false;
+    return NEWFS_ERROR_NONE;
+}
+
+/**
+ * @brief 卸载时释放内存中的表
+ */
+void newfs_csum_destroy(void) {
+    free(csum_tab);
+    csum_tab = NULL;
+    csum_on  = false;
+}
+
+/**
+ * @brief 有记录的数据块数，统计输出用
+ */
+int newfs_csum_count(void) {
+    int n = 0;
+
+    for (int i = 0; csum_tab != NULL && i < super.data_blks; i++) {
+        n += csum_tab[i] != 0;
+    }
+    return n;
+}
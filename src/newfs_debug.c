@@ -30,4 +30,11 @@ void newfs_dump_map(uint8_t* map) {
         }
         printf("\n");
     }
-}
\ No newline at end of file
+}
+
+/**
+ * @brief 卸载时打印统计(--debug)，内容与/.newfs_stats相同
+ */
+void newfs_dump_stats(void) {
+    newfs_stats_print(stdout);
+}
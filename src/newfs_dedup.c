@@ -0,0 +1,322 @@
+#include "newfs.h"
+
+extern struct custom_options newfs_options;
+extern struct newfs_super    super;
+
+/******************************************************************************
+* SECTION: 块去重
+* --dedup时，写回前对普通文件的脏整块计算64位指纹，在索引中查找内容相同的已有块：
+* 读出候选块逐字节比较确认后，这一项改为引用候选块(带NEWFS_BLK_SHARED，计数记入共享表)，
+* 释放自己的块、不再写回；未命中则把本块加入索引并立即提交写回。
+* 被索引的块在引用处都带共享标记，即使只有一个引用者：写入时经file_unshare复制或清除标记，
+* 这里同时把块移出索引，索引中的块内容因此不会在原地改变；块被释放时同样移出。
+* 移出只清除dedup_map中的位，索引中的旧项在查找、覆盖或写回时跳过。
+* 索引为开放寻址哈希表，卸载时把仍有效的项写入隐藏inode(super.dedup_ino)，
+* 只有正常卸载后挂载才读入，否则丢弃重建。没有--dedup挂载时索引在卸载时删除。
+*******************************************************************************/
+struct newfs_dedup_stat dedup_stat;
+
+static struct newfs_dedup_d* dedup_tab;
+static int                   dedup_size;            /* 表的项数，2的幂 */
+static int                   dedup_used;            /* 已占用的项数，含已失效的旧项 */
+static uint8_t*              dedup_map;             /* 每个数据块一位，置位表示块在索引中 */
+static uint8_t*              dedup_last;            /* 上次比较时读出的候选块，同一块反复命中时不再读 */
+static uint32_t              dedup_last_blk = (uint32_t)-1;
+static bool                  dedup_on;
+static bool                  dedup_dirty;
+
+/**
+ * @brief 索引最多能记录的块数，受隐藏inode的数据块数限制，末尾留出内容校验和
+ */
+static int dedup_max(void) {
+    return (NEWFS_DATA_PER_FILE * NEWFS_IO_SZ() - (int)sizeof(uint32_t)) / (int)sizeof(struct newfs_dedup_d);
+}
+
+/**
+ * @brief 块内容指纹：按8字节字乘加混合，最后做一次雪崩。块大小总是8的倍数
+ */
+static uint64_t dedup_hash(const uint8_t* buf, int len) {
+    uint64_t h = 0x9E3779B97F4A7C15ULL ^ (uint64_t)len;
+
+    for (int i = 0; i < len; i += 8) {
+        uint64_t w;
+        memcpy(&w, buf + i, sizeof(w));
+        w *= 0x87C37B91114253D5ULL;
+        w  = (w << 31) | (w >> 33);
+        w *= 0x4CF5AD432745937FULL;
+        h ^= w;
+        h  = ((h << 27) | (h >> 37)) * 5 + 0x52DCE729;
+    }
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDULL;
+    h ^= h >> 33;
+    h *= 0xC4CEB9FE1A85EC53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static bool dedup_indexed(uint32_t blkno) {
+    return blkno < (uint32_t)super.data_blks && (dedup_map[blkno / UINT8_BITS] & (0x1 << (blkno % UINT8_BITS)));
+}
+
+/**
+ * @brief 记录hash对应的块。探测范围内有空项、同指纹项或已失效的旧项时放入，否则覆盖起始项
+ */
+static void dedup_insert(uint64_t hash, uint32_t blkno) {
+    uint32_t mask = dedup_size - 1;
+    struct newfs_dedup_d* e = NULL;
+
+    for (int p = 0; p < NEWFS_DEDUP_PROBE; p++) {
+        struct newfs_dedup_d* cur = &dedup_tab[(hash + p) & mask];
+        if (cur->blkno == (uint32_t)-1) {
+            if (dedup_used >= dedup_max()) {
+                break;
+            }
+            dedup_used++;
+            e = cur;
+            break;
+        }
+        if (cur->hash == hash || !dedup_indexed(cur->blkno)) {
+            e = cur;
+            break;
+        }
+    }
+    if (e == NULL) {
+        e = &dedup_tab[hash & mask];
+        dedup_stat.evictions++;
+    }
+    e->hash  = hash;
+    e->blkno = blkno;
+    dedup_map[blkno / UINT8_BITS] |= (0x1 << (blkno % UINT8_BITS));
+    dedup_dirty = true;
+}
+
+/**
+ * @brief 查找指纹为hash的块
+ *
+ * @return int 块号，没有返回-1
+ */
+static int dedup_lookup(uint64_t hash) {
+    uint32_t mask = dedup_size - 1;
+
+    for (int p = 0; p < NEWFS_DEDUP_PROBE; p++) {
+        struct newfs_dedup_d* cur = &dedup_tab[(hash + p) & mask];
+        if (cur->blkno == (uint32_t)-1) {
+            break;
+        }
+        if (cur->hash == hash && dedup_indexed(cur->blkno)) {
+            return (int)cur->blkno;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief 读出候选块与data比较。先等在途的异步写完成，候选块可能刚在本轮写回中提交。
+ * 块在索引中时内容不变，与上次读出的是同一块时直接比较
+ */
+static bool dedup_verify(uint32_t blkno, const uint8_t* data) {
+    uint64_t start = newfs_stat_now();
+    bool     same  = true;
+
+    if (blkno != dedup_last_blk) {
+        newfs_bdev_wait(NEWFS_DRIVER());
+        same = your_read(NEWFS_DATA_OFS(blkno), dedup_last, NEWFS_IO_SZ()) == NEWFS_ERROR_NONE;
+        dedup_last_blk = same ? blkno : (uint32_t)-1;
+    }
+    same = same && memcmp(dedup_last, data, NEWFS_IO_SZ()) == 0;
+    dedup_stat.verify_ns += newfs_stat_now() - start;
+    return same;
+}
+
+/**
+ * @brief 挂载时建立索引
+ *
+ * @param clean 上次是否正常卸载，否则磁盘上的索引可能过时，丢弃
+ */
+void newfs_dedup_load(bool clean) {
+    struct newfs_dedup_d* ents;
+    void* buf;
+    int   len, want;
+
+    memset(&dedup_stat, 0, sizeof(dedup_stat));
+    dedup_on    = newfs_options.dedup;
+    dedup_dirty = super.dedup_ino != 0 && !dedup_on;   /* 不去重时卸载时删除旧索引 */
+    dedup_used  = 0;
+    if (!dedup_on) {
+        return;
+    }
+    want = super.data_blks < dedup_max() ? super.data_blks : dedup_max();
+    for (dedup_size = 64; dedup_size < 2 * want; dedup_size *= 2) {
+    }
+    dedup_tab = (struct newfs_dedup_d *)malloc(sizeof(*dedup_tab) * dedup_size);
+    memset(dedup_tab, 0xFF, sizeof(*dedup_tab) * dedup_size);
+    dedup_map = (uint8_t *)calloc((super.data_blks + UINT8_BITS - 1) / UINT8_BITS, 1);
+    dedup_last     = newfs_buf_alloc();
+    dedup_last_blk = (uint32_t)-1;
+    if (super.dedup_ino == 0) {
+        return;
+    }
+    if (!clean) {
+        NEWFS_TRACE(NEWFS_TC_SUPER, NEWFS_TL_WARN, "dedup index dropped after unclean unmount");
+        dedup_dirty = true;
+        return;
+    }
+    if (newfs_hidden_read(super.dedup_ino, &buf, &len) != NEWFS_ERROR_NONE) {
+        NEWFS_TRACE(NEWFS_TC_SUPER, NEWFS_TL_ERR, "cannot read dedup index, starting empty");
+        dedup_dirty = true;
+        return;
+    }
+    ents = (struct newfs_dedup_d *)buf;
+    for (int i = 0; i < len / (int)sizeof(*ents); i++) {
+        uint32_t blkno = ents[i].blkno;
+        if (blkno < (uint32_t)super.data_blks
+            && (super.data_bitmap[blkno / UINT8_BITS] & (0x1 << (blkno % UINT8_BITS)))) {
+            dedup_insert(ents[i].hash, blkno);
+        }
+    }
+    free(buf);
+    dedup_dirty = false;
+}
+
+/**
+ * @brief 写回前对inode的脏整块去重，调用者持有全局锁。
+ * 命中的项改为共享并清除脏标记；未命中的块加入索引并异步提交写回，同样清除脏标记。
+ * 有命中时先写回共享表，之后才能写inode
+ *
+ * @return int 0成功，否则返回错误码
+ */
+int newfs_dedup_writeback(struct newfs_inode* inode) {
+    int      blk_sz = NEWFS_IO_SZ();
+    int      hits   = 0;
+    int      ret    = NEWFS_ERROR_NONE;
+
+    if (!dedup_on || !NEWFS_IS_REG(inode)) {
+        return NEWFS_ERROR_NONE;
+    }
+    for (int i = 0; i < NEWFS_DATA_PER_FILE && (long)i * blk_sz < inode->size; i++) {
+        uint32_t b = inode->data[i];
+        uint32_t own = NEWFS_BLKNO(b);
+        uint64_t hash, start;
+        int      cand;
+
+        if (!NEWFS_BLK_WRITTEN(b) || NEWFS_BLK_IS_SHARED(b) || NEWFS_BLK_IS_COMP(b)
+            || inode->data_blks[i] == NULL || !NEWFS_BLK_DIRTY(inode, i)
+            || (long)(i + 1) * blk_sz > inode->size) {
+            continue;                                   /* 文件末尾不满一块的数据不去重 */
+        }
+        start = newfs_stat_now();
+        hash  = dedup_hash(inode->data_blks[i], blk_sz);
+        dedup_stat.hash_ns += newfs_stat_now() - start;
+
+        cand = dedup_lookup(hash);
+        if (cand >= 0 && (uint32_t)cand != own) {
+            if (!dedup_verify(cand, inode->data_blks[i])) {
+                dedup_stat.mismatches++;
+            } else if (newfs_share_get(cand) == NEWFS_ERROR_NONE) {
+                newfs_free_blk(own);
+                inode->data[i] = (uint32_t)cand | NEWFS_BLK_SHARED;
+                NEWFS_BLK_CLEAR_DIRTY(inode, i);        /* 缓冲与候选块内容相同，保留 */
+                dedup_stat.hits++;
+                hits++;
+                continue;
+            }
+        }
+        dedup_insert(hash, own);
+        inode->data[i] = own | NEWFS_BLK_SHARED;
+        dedup_stat.inserts++;
+        /* 立即提交写回，同一轮中后面内容相同的块比较时读到的是新内容 */
+        NEWFS_BLK_CLEAR_DIRTY(inode, i);
+        newfs_csum_update(own, inode->data_blks[i]);
+        if (newfs_bdev_write_async(NEWFS_DRIVER(), NEWFS_DATA_OFS(own), inode->data_blks[i],
+                                   blk_sz) != NEWFS_ERROR_NONE) {
+            ret = -NEWFS_ERROR_IO;
+            break;
+        }
+    }
+    if (hits && newfs_share_sync() != NEWFS_ERROR_NONE) {
+        ret = -NEWFS_ERROR_IO;
+    }
+    return ret;
+}
+
+/**
+ * @brief 块将被原地改写或已释放，移出索引
+ */
+void newfs_dedup_forget(uint32_t blkno) {
+    if (dedup_map != NULL && dedup_indexed(blkno)) {
+        dedup_map[blkno / UINT8_BITS] &= ~(0x1 << (blkno % UINT8_BITS));
+        dedup_dirty = true;
+        if (blkno == dedup_last_blk) {
+            dedup_last_blk = (uint32_t)-1;
+        }
+    }
+}
+
+/**
+ * @brief 卸载时把仍有效的项写入隐藏inode，不去重时删除旧索引
+ *
+ * @return int 0成功，否则返回错误码
+ */
+int newfs_dedup_sync(void) {
+    struct newfs_dedup_d* ents = NULL;
+    int n = 0, ret;
+
+    if (!dedup_dirty) {
+        return NEWFS_ERROR_NONE;
+    }
+    if (dedup_on) {
+        ents = (struct newfs_dedup_d *)malloc(sizeof(*ents) * dedup_size);
+        for (int i = 0; i < dedup_size && n < dedup_max(); i++) {
+            if (dedup_tab[i].blkno != (uint32_t)-1 && dedup_indexed(dedup_tab[i].blkno)) {
+                ents[n++] = dedup_tab[i];
+            }
+        }
+    }
+    ret = newfs_hidden_write(&super.dedup_ino, ents, n * (int)sizeof(*ents));
+    free(ents);
+    if (ret != NEWFS_ERROR_NONE) {
+        NEWFS_TRACE(NEWFS_TC_SUPER, NEWFS_TL_ERR, "write dedup index failed");
+        return -NEWFS_ERROR_IO;
+    }
+    dedup_dirty = false;
+    return NEWFS_ERROR_NONE;
+}
+
+/**
+ * @brief 卸载时释放内存中的索引
+ */
+void newfs_dedup_destroy(void) {
+    free(dedup_tab);
+    free(dedup_map);
+    if (dedup_last != NULL) {
+        newfs_buf_free(dedup_last);
+    }
+    dedup_tab  = NULL;
+    dedup_map  = NULL;
+    dedup_last = NULL;
+    dedup_size = dedup_used = 0;
+    dedup_on   = false;
+}
+
+/**
+ * @brief 索引中仍有效的项数，统计输出用
+ */
+int newfs_dedup_count(void) {
+    int n = 0;
+
+    for (int i = 0; i < dedup_size; i++) {
+        n += dedup_tab[i].blkno != (uint32_t)-1 && dedup_indexed(dedup_tab[i].blkno);
+    }
+    return n;
+}
+
+/**
+ * @brief 索引占用的内存(B)，统计输出用
+ */
+long newfs_dedup_mem(void) {
+    if (dedup_tab == NULL) {
+        return 0;
+    }
+    return (long)sizeof(*dedup_tab) * dedup_size + (super.data_blks + UINT8_BITS - 1) / UINT8_BITS + NEWFS_IO_SZ();
+}
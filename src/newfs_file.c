@@ -0,0 +1,830 @@
+#include "newfs.h"
+
+extern struct custom_options newfs_options;
+extern struct newfs_super    super;
+
+/******************************************************************************
+* SECTION: 打开文件句柄
+* open/opendir时解析一次路径，句柄保存在fi->fh中，读写不再走newfs_lookup。
+* 句柄持有inode引用，打开期间inode不会被缓存淘汰。
+*******************************************************************************/
+struct newfs_ra {
+    struct newfs_bio bio;
+    int              blk;           /* 起始文件内块号 */
+    int              nr;            /* 块数，磁盘上连续的块合并为一次读 */
+    uint32_t         blkno;         /* 提交时的起始磁盘块号，收割时校验未被改动 */
+    int              done;          /* 完成回调置位 */
+    struct newfs_ra* next;
+};
+
+/**
+ * @brief 打开inode，返回引用计数为1的句柄
+ *
+ * @param inode
+ * @param flags open标志
+ * @return struct newfs_file*
+ */
+struct newfs_file* newfs_file_open(struct newfs_inode* inode, int flags) {
+    struct newfs_file* file = (struct newfs_file *)calloc(1, sizeof(struct newfs_file));
+
+    newfs_iref(inode);
+    file->inode = inode;
+    file->ref   = 1;
+    file->flags = flags;
+    return file;
+}
+
+/**
+ * @brief 打开只读快照句柄(不对应inode)，读取时返回打开时刻的文本，用于/.newfs_stats
+ *
+ * @param snap 快照内容，句柄释放时free
+ * @param len 快照长度
+ * @return struct newfs_file*
+ */
+struct newfs_file* newfs_file_open_snap(char* snap, size_t len) {
+    struct newfs_file* file = (struct newfs_file *)calloc(1, sizeof(struct newfs_file));
+
+    file->ref      = 1;
+    file->flags    = O_RDONLY;
+    file->snap     = snap;
+    file->snap_len = len;
+    return file;
+}
+
+void newfs_file_get(struct newfs_file* file) {
+    file->ref++;
+}
+
+/**
+ * @brief 预读完成回调，在后端线程中调用，只置完成标记，由读路径收割
+ */
+static void ra_end_io(struct newfs_bio* bio) {
+    struct newfs_ra* ra = (struct newfs_ra *)bio->priv;
+    __atomic_store_n(&ra->done, 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief 收割已完成的预读：逐块检查，成功且块未被改动、缓存中尚无该块时装入inode，否则丢弃
+ *
+ * @param file
+ * @param wait 为true时先等待全部在途预读完成
+ */
+static void ra_reap(struct newfs_file* file, bool wait) {
+    struct newfs_inode* inode = file->inode;
+    struct newfs_ra**   pp    = &file->ra_list;
+
+    if (wait && file->ra_list) {
+        newfs_bdev_drain(NEWFS_DRIVER());
+    }
+    while (*pp) {
+        struct newfs_ra* ra = *pp;
+        if (!__atomic_load_n(&ra->done, __ATOMIC_ACQUIRE)) {
+            pp = &ra->next;
+            continue;
+        }
+        *pp = ra->next;
+        for (int i = 0; i < ra->nr; i++) {
+            int blk = ra->blk + i;
+            uint8_t* buf;
+
+            if (ra->bio.res != NEWFS_ERROR_NONE || !NEWFS_BLK_WRITTEN(inode->data[blk])
+                || NEWFS_BLK_IS_COMP(inode->data[blk]) || NEWFS_BLKNO(inode->data[blk]) != ra->blkno + i
+                || inode->data_blks[blk] != NULL) {
+                continue;
+            }
+            if (!newfs_csum_verify(ra->blkno + i, (uint8_t *)ra->bio.buf + (size_t)i * NEWFS_IO_SZ())) {
+                continue;                           /* 不装入，读到该块时同步重读并报错 */
+            }
+            if (ra->nr == 1) {
+                buf = (uint8_t *)ra->bio.buf;       /* 单块直接接管缓冲 */
+                ra->bio.buf = NULL;
+            } else {
+                buf = newfs_buf_alloc();
+                memcpy(buf, (uint8_t *)ra->bio.buf + (size_t)i * NEWFS_IO_SZ(), NEWFS_IO_SZ());
+            }
+            inode->data_blks[blk] = buf;
+            newfs_icache_charge(NEWFS_IO_SZ());
+        }
+        if (ra->nr == 1) {
+            if (ra->bio.buf) {
+                newfs_buf_free((uint8_t *)ra->bio.buf);
+            }
+        } else {
+            free(ra->bio.buf);
+        }
+        free(ra);
+    }
+}
+
+/**
+ * @brief 块blk是否有在途预读
+ */
+static bool ra_pending(struct newfs_file* file, int blk) {
+    for (struct newfs_ra* ra = file->ra_list; ra; ra = ra->next) {
+        if (blk >= ra->blk && blk < ra->blk + ra->nr) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief 块blk能否预读：已写入、未压缩、未缓存且不在途
+ */
+static bool ra_wanted(struct newfs_file* file, int blk) {
+    struct newfs_inode* inode = file->inode;
+    return NEWFS_BLK_WRITTEN(inode->data[blk]) && !NEWFS_BLK_IS_COMP(inode->data[blk])
+           && inode->data_blks[blk] == NULL && !ra_pending(file, blk);
+}
+
+/**
+ * @brief 异步预读[start, end)中未缓存的块，完成后由ra_reap装入。
+ * 文件内相邻且磁盘上也相邻的块(如fallocate预分配的区段)合并为一个bio
+ */
+static void ra_submit(struct newfs_file* file, int start, int end) {
+    struct newfs_inode* inode = file->inode;
+
+    if (end > NEWFS_DATA_PER_FILE) {
+        end = NEWFS_DATA_PER_FILE;
+    }
+    for (int blk = start; blk < end; blk++) {
+        struct newfs_ra* ra;
+        int nr = 1;
+
+        if (!ra_wanted(file, blk)) {
+            continue;                               /* 空洞、未写入、已缓存或已在途 */
+        }
+        while (blk + nr < end && ra_wanted(file, blk + nr)
+               && NEWFS_BLKNO(inode->data[blk + nr]) == NEWFS_BLKNO(inode->data[blk]) + nr) {
+            nr++;
+        }
+        ra = (struct newfs_ra *)calloc(1, sizeof(struct newfs_ra));
+        ra->blk         = blk;
+        ra->nr          = nr;
+        ra->blkno       = NEWFS_BLKNO(inode->data[blk]);
+        ra->bio.rw      = NEWFS_BIO_READ;
+        ra->bio.offset  = NEWFS_DATA_OFS(ra->blkno);
+        ra->bio.size    = (size_t)nr * NEWFS_IO_SZ();
+        if (nr == 1) {
+            ra->bio.buf = newfs_buf_alloc();
+        } else if (posix_memalign(&ra->bio.buf, NEWFS_IO_SZ(), ra->bio.size) != 0) {
+            free(ra);
+            return;
+        }
+        ra->bio.end_io  = ra_end_io;
+        ra->bio.priv    = ra;
+        ra->next        = file->ra_list;
+        file->ra_list   = ra;
+        if (newfs_bdev_submit(NEWFS_DRIVER(), &ra->bio) != NEWFS_ERROR_NONE) {
+            ra->bio.res = -NEWFS_ERROR_IO;
+            ra->done    = 1;
+        }
+        blk += nr - 1;
+    }
+}
+
+/**
+ * @brief 目录预取(newfs_prefetch.c)用：对句柄提交[start, end)的预读，
+ * 完成的块在newfs_file_put时收割
+ */
+void newfs_file_prefetch(struct newfs_file* file, int start, int end) {
+    ra_submit(file, start, end);
+}
+
+/**
+ * @brief 释放句柄引用，归零时收割预读并释放inode引用
+ */
+void newfs_file_put(struct newfs_file* file) {
+    if (--file->ref > 0) {
+        return;
+    }
+    if (file->inode) {
+        ra_reap(file, true);
+        newfs_iput(file->inode);
+    }
+    free(file->snap);
+    free(file);
+}
+
+/**
+ * @brief 写入共享块之前调用：仍被其他文件引用时换到新分配的块(写时复制)，
+ * 缓冲内容不变、标记为脏，写回时落到新块；已是唯一引用时只清除共享标记
+ *
+ * @return int 0成功，否则返回对应错误号
+ */
+static int file_unshare(struct newfs_inode* inode, int blk) {
+    uint32_t blkno = NEWFS_BLKNO(inode->data[blk]);
+    int      copy;
+
+    if (newfs_share_ref(blkno) > 1) {
+        if (inode->data_blks[blk] == NULL) {
+            uint8_t* buf = newfs_buf_alloc();
+            if (your_read(NEWFS_DATA_OFS(blkno), buf, NEWFS_IO_SZ()) != NEWFS_ERROR_NONE
+                || !newfs_csum_verify(blkno, buf)) {
+                newfs_buf_free(buf);
+                return -NEWFS_ERROR_IO;
+            }
+            inode->data_blks[blk] = buf;
+            newfs_icache_charge(NEWFS_IO_SZ());
+        }
+        if ((copy = newfs_alloc_blk()) < 0) {
+            return -NEWFS_ERROR_NOSPACE;
+        }
+        newfs_share_put(blkno);
+        blkno = copy;
+        NEWFS_BLK_SET_DIRTY(inode, blk);
+    } else {
+        newfs_dedup_forget(blkno);              /* 将原地改写，移出去重索引 */
+    }
+    inode->data[blk] = blkno;
+    newfs_mark_dirty(inode);
+    return NEWFS_ERROR_NONE;
+}
+
+/**
+ * @brief 取inode第blk个数据块的缓冲，未读入时从磁盘读入
+ *
+ * @param inode
+ * @param blk 文件内块号
+ * @param alloc 为true时为空洞分配新块、把未写入的预分配块转为已写入、复制共享块、
+ *              展开压缩簇(写路径)，否则空洞和未写入块返回NULL，压缩簇解压进缓存
+ * @param bufp 块缓冲，空洞、未写入或失败时为NULL
+ * @return int 0成功(含不分配时的空洞)，没有空闲块返回-NEWFS_ERROR_NOSPACE，读失败或校验失败返回-NEWFS_ERROR_IO
+ */
+static int file_block_get(struct newfs_inode* inode, int blk, bool alloc, uint8_t** bufp) {
+    uint8_t* buf;
+    int      ret;
+
+    *bufp = NULL;
+    if (newfs_comp_cluster(inode, blk)) {
+        if (alloc) {
+            if ((ret = newfs_comp_expand(inode, blk)) != NEWFS_ERROR_NONE) {
+                return ret;
+            }
+        } else {
+            if (inode->data_blks[blk] == NULL && (ret = newfs_comp_load(inode, blk)) != NEWFS_ERROR_NONE) {
+                return ret;
+            }
+            *bufp = inode->data_blks[blk];
+            return NEWFS_ERROR_NONE;
+        }
+    }
+
+    if (alloc && NEWFS_BLK_IS_SHARED(inode->data[blk]) && (ret = file_unshare(inode, blk)) != NEWFS_ERROR_NONE) {
+        return ret;
+    }
+    if (inode->data_blks[blk] != NULL) {
+        *bufp = inode->data_blks[blk];
+        return NEWFS_ERROR_NONE;
+    }
+    if (!NEWFS_BLK_WRITTEN(inode->data[blk])) {
+        int blkno;
+        if (!alloc) {
+            return NEWFS_ERROR_NONE;
+        }
+        if (NEWFS_BLK_IS_UNWRITTEN(inode->data[blk])) {
+            blkno = NEWFS_BLKNO(inode->data[blk]);  /* 磁盘上是旧内容，不读，按0填充 */
+        } else if ((blkno = newfs_alloc_blk()) < 0) {
+            return -NEWFS_ERROR_NOSPACE;
+        }
+        buf = newfs_buf_alloc();
+        memset(buf, 0, NEWFS_IO_SZ());
+        inode->data[blk] = blkno;
+        NEWFS_BLK_SET_DIRTY(inode, blk);
+    } else {
+        buf = newfs_buf_alloc();
+        if (your_read(NEWFS_DATA_OFS(NEWFS_BLKNO(inode->data[blk])), buf, NEWFS_IO_SZ()) != NEWFS_ERROR_NONE
+            || !newfs_csum_verify(NEWFS_BLKNO(inode->data[blk]), buf)) {
+            newfs_buf_free(buf);
+            return -NEWFS_ERROR_IO;
+        }
+    }
+    inode->data_blks[blk] = buf;
+    newfs_icache_charge(NEWFS_IO_SZ());
+    *bufp = buf;
+    return NEWFS_ERROR_NONE;
+}
+
+/**
+ * @brief 取inode第blk个数据块的缓冲，参数同file_block_get
+ *
+ * @return uint8_t* 块缓冲，空洞、未写入或失败返回NULL
+ */
+uint8_t* newfs_file_block(struct newfs_inode* inode, int blk, bool alloc) {
+    uint8_t* buf;
+
+    file_block_get(inode, blk, alloc, &buf);
+    return buf;
+}
+
+/**
+ * @brief 读文件，连续顺序读时预读窗口逐次翻倍，随机读时关闭预读
+ *
+ * @return int 读取字节数或负错误码
+ */
+int newfs_file_read(struct newfs_file* file, char* buf, size_t size, off_t offset) {
+    struct newfs_inode* inode = file->inode;
+    int    blk_sz = NEWFS_IO_SZ();
+    size_t done   = 0;
+    int    last;
+
+    if (file->snap) {
+        if (offset >= (off_t)file->snap_len) {
+            return 0;
+        }
+        if (offset + size > file->snap_len) {
+            size = file->snap_len - offset;
+        }
+        memcpy(buf, file->snap + offset, size);
+        return (int)size;
+    }
+    if (offset >= inode->size) {
+        return 0;
+    }
+    if (offset + (off_t)size > inode->size) {
+        size = inode->size - offset;
+    }
+
+    /* 更新预读窗口 */
+    last = (offset + size - 1) / blk_sz;
+    if (offset == file->ra_next) {
+        file->ra_size = file->ra_size ? file->ra_size * 2 : NEWFS_RA_MIN;
+        if (file->ra_size > NEWFS_RA_MAX) {
+            file->ra_size = NEWFS_RA_MAX;
+        }
+    } else {
+        file->ra_size = 0;
+        file->ra_end  = 0;
+    }
+    file->ra_next = offset + size;
+
+    ra_reap(file, false);
+    while (done < size) {
+        int      blk = (offset + done) / blk_sz;
+        int      off = (offset + done) % blk_sz;
+        size_t   len = blk_sz - off < size - done ? blk_sz - off : size - done;
+        uint8_t* data;
+
+        if (ra_pending(file, blk)) {
+            ra_reap(file, true);                    /* 需要的块正在预读，等它完成 */
+        }
+        data = newfs_file_block(inode, blk, false);
+        if (data == NULL && (NEWFS_BLK_WRITTEN(inode->data[blk]) || newfs_comp_cluster(inode, blk))) {
+            return -NEWFS_ERROR_IO;                 /* 不能返回读到的部分：FUSE把短读当作文件结束，坏块会被静默截掉 */
+        }
+        if (data == NULL) {
+            memset(buf + done, 0, len);             /* 空洞与未写入块读出0 */
+        } else {
+            memcpy(buf + done, data + off, len);
+        }
+        done += len;
+    }
+
+    if (file->ra_size > 0) {
+        int start = file->ra_end > last + 1 ? file->ra_end : last + 1;
+        int limit = (inode->size + blk_sz - 1) / blk_sz;
+        int end   = last + 1 + file->ra_size;
+        if (end > limit) {
+            end = limit;
+        }
+        if (start < end) {
+            ra_submit(file, start, end);
+            file->ra_end = end;
+        }
+    }
+    return (int)done;
+}
+
+/**
+ * @brief 写文件，按需为空洞分配数据块，修改只落在块缓冲中，由写回统一刷盘
+ *
+ * @return int 写入字节数或负错误码
+ */
+int newfs_file_write(struct newfs_file* file, const char* buf, size_t size, off_t offset) {
+    struct newfs_inode* inode = file->inode;
+    int    blk_sz = NEWFS_IO_SZ();
+    size_t done   = 0;
+    int    ret;
+
+    if (inode == NULL) {
+        return -NEWFS_ERROR_ACCESS;                 /* 快照句柄只读 */
+    }
+    if (file->flags & O_APPEND) {
+        offset = inode->size;
+    }
+    if (offset + (off_t)size > super.file_max) {
+        return -NEWFS_ERROR_FBIG;
+    }
+    if ((ret = newfs_snap_cow(inode)) != NEWFS_ERROR_NONE) {
+        return ret;                                 /* 旧版本先留给快照，见newfs_snap.c */
+    }
+    ra_reap(file, true);                            /* 避免预读旧内容覆盖本次写入 */
+
+    while (done < size) {
+        int      blk = (offset + done) / blk_sz;
+        int      off = (offset + done) % blk_sz;
+        size_t   len = blk_sz - off < size - done ? blk_sz - off : size - done;
+        uint8_t* data;
+
+        if ((ret = file_block_get(inode, blk, true, &data)) != NEWFS_ERROR_NONE) {
+            break;
+        }
+        memcpy(data + off, buf + done, len);
+        NEWFS_BLK_SET_DIRTY(inode, blk);
+        done += len;
+    }
+    if (done == 0 && size > 0) {
+        return ret;                                 /* 空间不足，或改写部分块时读旧内容失败 */
+    }
+    if (offset + (off_t)done > inode->size) {
+        inode->size = offset + done;
+    }
+    newfs_mark_dirty(inode);
+    return (int)done;
+}
+
+/**
+ * @brief close时写回该文件的修改
+ */
+int newfs_file_flush(struct newfs_file* file) {
+    if (file->inode == NULL) {
+        return NEWFS_ERROR_NONE;
+    }
+    return newfs_flush_inode(file->inode);
+}
+
+/******************************************************************************
+* SECTION: 改变文件大小与预分配
+*******************************************************************************/
+/**
+ * @brief 解除第blk块的映射，丢弃其缓冲
+ *
+ * @param blkno 返回需要释放的磁盘块号
+ * @return bool 为true时调用者应释放*blkno；空洞或仍被其他文件共享时为false
+ */
+static bool file_unmap(struct newfs_inode* inode, int blk, uint32_t* blkno) {
+    uint32_t b = inode->data[blk];
+
+    if (inode->data_blks[blk] != NULL) {
+        newfs_buf_free(inode->data_blks[blk]);
+        newfs_icache_charge(-(long)NEWFS_IO_SZ());
+        inode->data_blks[blk] = NULL;
+    }
+    NEWFS_BLK_CLEAR_DIRTY(inode, blk);
+    inode->data[blk] = (uint32_t)-1;
+    if (NEWFS_BLK_HOLE(b)) {
+        return false;
+    }
+    *blkno = NEWFS_BLKNO(b);
+    return !NEWFS_BLK_IS_SHARED(b) || newfs_share_put(*blkno);
+}
+
+/**
+ * @brief 改变文件大小。变大只改size，新增部分是空洞；
+ * 变小时清零保留的最后一块的尾部，其后的数据块成批释放
+ *
+ * @param inode 普通文件
+ * @param size 新大小
+ * @return int 0成功，否则返回对应错误号
+ */
+int newfs_file_truncate(struct newfs_inode* inode, off_t size) {
+    int       blk_sz = NEWFS_IO_SZ();
+    int       keep   = (size + blk_sz - 1) / blk_sz;
+    uint32_t  blks[NEWFS_DATA_PER_FILE];
+    int       nblks  = 0;
+    int       ret;
+
+    if (size < 0) {
+        return -NEWFS_ERROR_INVAL;
+    }
+    if (size > super.file_max) {
+        return -NEWFS_ERROR_FBIG;
+    }
+    if ((ret = newfs_snap_cow(inode)) != NEWFS_ERROR_NONE) {
+        return ret;
+    }
+    if (size < inode->size) {
+        if (keep % NEWFS_COMP_CLUSTER != 0 && newfs_comp_cluster(inode, keep - 1)) {
+            ret = newfs_comp_expand(inode, keep - 1);       /* 截断点在压缩簇中间，先展开 */
+            if (ret != NEWFS_ERROR_NONE) {
+                return ret;
+            }
+        }
+        if (size % blk_sz != 0
+            && (NEWFS_BLK_WRITTEN(inode->data[keep - 1]) || newfs_comp_cluster(inode, keep - 1))) {
+            uint8_t* data = newfs_file_block(inode, keep - 1, true);    /* 共享块先复制，压缩簇先展开 */
+            if (data == NULL) {
+                return -NEWFS_ERROR_IO;
+            }
+            memset(data + size % blk_sz, 0, blk_sz - size % blk_sz);  /* 再次变大时读出0 */
+            NEWFS_BLK_SET_DIRTY(inode, keep - 1);
+        }
+        for (int blk = keep; blk < NEWFS_DATA_PER_FILE; blk++) {
+            if (file_unmap(inode, blk, &blks[nblks])) {
+                nblks++;
+            }
+        }
+        newfs_free_blks(blks, nblks);
+    }
+    inode->size = size;
+    newfs_mark_dirty(inode);
+    return NEWFS_ERROR_NONE;
+}
+
+/**
+ * @brief 第blk块是否为真正的空洞，压缩簇中不占块的项不算
+ */
+static bool file_hole(struct newfs_inode* inode, int blk) {
+    return NEWFS_BLK_HOLE(inode->data[blk]) && !newfs_comp_cluster(inode, blk);
+}
+
+/**
+ * @brief 为[offset, offset + len)中的空洞预分配数据块。
+ * 一段连续的空洞一次从位图取连续的块，文件在磁盘上尽量连续；
+ * 新块标记为未写入，读出为0，首次写入时才清除标记，不需要预先清零磁盘
+ *
+ * @param inode 普通文件
+ * @param mode 0或FALLOC_FL_KEEP_SIZE
+ * @param offset 起始偏移
+ * @param len 长度
+ * @return int 0成功，否则返回对应错误号
+ */
+int newfs_file_fallocate(struct newfs_inode* inode, int mode, off_t offset, off_t len) {
+    int blk_sz = NEWFS_IO_SZ();
+    int first, last, holes = 0, ret;
+
+    if (mode & ~FALLOC_FL_KEEP_SIZE) {
+        return -NEWFS_ERROR_NOTSUP;
+    }
+    if (offset < 0 || len <= 0) {
+        return -NEWFS_ERROR_INVAL;
+    }
+    if (offset > super.file_max || len > super.file_max - offset) {
+        return -NEWFS_ERROR_FBIG;
+    }
+    if ((ret = newfs_snap_cow(inode)) != NEWFS_ERROR_NONE) {
+        return ret;
+    }
+    first = offset / blk_sz;
+    last  = (offset + len - 1) / blk_sz;
+    for (int blk = first; blk <= last; blk++) {
+        holes += file_hole(inode, blk);
+    }
+    if (holes > super.free_blk_cnt) {
+        return -NEWFS_ERROR_NOSPACE;            /* 先检查总量，不会只分配一部分 */
+    }
+
+    for (int blk = first; blk <= last; ) {
+        int n = 0, got, start;
+
+        while (blk + n <= last && file_hole(inode, blk + n)) {
+            n++;
+        }
+        if (n == 0) {
+            blk++;
+            continue;
+        }
+        while (n > 0) {
+            start = newfs_alloc_run(n, &got);
+            if (start < 0) {
+                return -NEWFS_ERROR_NOSPACE;
+            }
+            for (int i = 0; i < got; i++) {
+                inode->data[blk + i] = (uint32_t)(start + i) | NEWFS_BLK_UNWRITTEN;
+            }
+            blk += got;
+            n   -= got;
+        }
+    }
+    if (!(mode & FALLOC_FL_KEEP_SIZE) && offset + len > inode->size) {
+        inode->size = offset + len;
+    }
+    newfs_mark_dirty(inode);
+    return NEWFS_ERROR_NONE;
+}
+
+/******************************************************************************
+* SECTION: 稀疏文件
+* 只有写过的块才占用数据块，空洞与未写入的预分配块读出为0且不访问设备。
+*******************************************************************************/
+/**
+ * @brief 文件占用的数据块数(含未写入的预分配块与属性块)，用于st_blocks
+ */
+int newfs_file_nblks(struct newfs_inode* inode) {
+    int n = !NEWFS_BLK_HOLE(inode->xattr_blk);
+
+    for (int i = 0; i < NEWFS_DATA_PER_FILE; i++) {
+        n += !NEWFS_BLK_HOLE(inode->data[i]);
+    }
+    return n;
+}
+
+/**
+ * @brief SEEK_DATA/SEEK_HOLE：从offset起查找下一段数据或空洞。
+ * 未写入的预分配块读出为0，按空洞处理；压缩簇整簇按数据处理；文件末尾视为一个空洞
+ *
+ * @param inode 普通文件
+ * @param offset 起始偏移
+ * @param data 为true时找数据，否则找空洞
+ * @return off_t 找到的偏移；offset越过文件末尾或其后没有数据时返回-NEWFS_ERROR_NXIO
+ */
+off_t newfs_file_seek(struct newfs_inode* inode, off_t offset, bool data) {
+    int blk_sz = NEWFS_IO_SZ();
+    int last   = (inode->size + blk_sz - 1) / blk_sz;
+
+    if (offset < 0 || offset >= inode->size) {
+        return -NEWFS_ERROR_NXIO;
+    }
+    for (int blk = offset / blk_sz; blk < last; blk++) {
+        if ((NEWFS_BLK_WRITTEN(inode->data[blk]) || newfs_comp_cluster(inode, blk)) == data) {
+            off_t pos = (off_t)blk * blk_sz;
+            return pos > offset ? pos : offset;
+        }
+    }
+    return data ? -NEWFS_ERROR_NXIO : inode->size;
+}
+
+/******************************************************************************
+* SECTION: 服务端复制
+* 源与目标偏移都按块对齐的整块直接共享数据块(克隆)，只增加引用计数、不复制数据；
+* 其余部分在守护进程内经块缓存逐块复制，数据不经过内核与用户态缓冲区往返。
+*******************************************************************************/
+/**
+ * @brief 目标第bo块改为共享源第bi块，调用者已写回源文件
+ *
+ * @return int 0成功，否则返回对应错误号
+ */
+static int file_clone_blk(struct newfs_inode* src, int bi, struct newfs_inode* dst, int bo) {
+    uint32_t sb = src->data[bi];
+    uint32_t old;
+
+    if (NEWFS_BLK_WRITTEN(sb)) {
+        int ret = newfs_share_get(NEWFS_BLKNO(sb));
+        if (ret != NEWFS_ERROR_NONE) {
+            return ret;
+        }
+    }
+    if (file_unmap(dst, bo, &old)) {
+        newfs_free_blk(old);
+    }
+    if (!NEWFS_BLK_WRITTEN(sb)) {
+        return NEWFS_ERROR_NONE;                    /* 空洞与未写入块在目标中也是空洞 */
+    }
+    src->data[bi] = NEWFS_BLKNO(sb) | NEWFS_BLK_SHARED;
+    dst->data[bo] = NEWFS_BLKNO(sb) | NEWFS_BLK_SHARED;
+    if (src->data_blks[bi] != NULL) {               /* 源块已缓存，目标直接带上干净的副本 */
+        dst->data_blks[bo] = newfs_buf_alloc();
+        memcpy(dst->data_blks[bo], src->data_blks[bi], NEWFS_IO_SZ());
+        newfs_icache_charge(NEWFS_IO_SZ());
+    }
+    return NEWFS_ERROR_NONE;
+}
+
+/**
+ * @brief 把src的[off_in, off_in + len)复制到dst的off_out处，语义同copy_file_range：
+ * 超出源文件末尾的部分不复制，目标按需变大
+ *
+ * @param src 源文件
+ * @param off_in 源偏移
+ * @param dst 目标文件，可以与src相同，但范围不能重叠
+ * @param off_out 目标偏移
+ * @param len 长度
+ * @return int 复制的字节数，否则返回对应错误号
+ */
+int newfs_file_clone(struct newfs_inode* src, off_t off_in, struct newfs_inode* dst, off_t off_out,
+                     size_t len) {
+    int    blk_sz = NEWFS_IO_SZ();
+    size_t done   = 0;
+    int    ret    = NEWFS_ERROR_NONE;
+    bool   cloned = false;
+
+    if (NEWFS_IS_DIR(src) || NEWFS_IS_DIR(dst)) {
+        return -NEWFS_ERROR_ISDIR;
+    }
+    if (off_in < 0 || off_out < 0) {
+        return -NEWFS_ERROR_INVAL;
+    }
+    if (off_in >= src->size) {
+        return 0;
+    }
+    if (len > (size_t)(src->size - off_in)) {
+        len = src->size - off_in;
+    }
+    if (off_out > super.file_max || len > (size_t)(super.file_max - off_out)) {
+        return -NEWFS_ERROR_FBIG;
+    }
+    if (src == dst && off_in < off_out + (off_t)len && off_out < off_in + (off_t)len) {
+        return -NEWFS_ERROR_INVAL;
+    }
+    /* 克隆的块由目标从磁盘读取，源的脏缓冲先落盘；目标的旧版本先留给快照 */
+    if ((ret = newfs_snap_cow(dst)) != NEWFS_ERROR_NONE || (ret = newfs_flush_inode(src)) != NEWFS_ERROR_NONE) {
+        return ret;
+    }
+
+    while (done < len) {
+        off_t  pos_in  = off_in + done;
+        off_t  pos_out = off_out + done;
+        int    bi = pos_in / blk_sz, bo = pos_out / blk_sz;
+        size_t rest = len - done;
+
+        /* 整块对齐；源的最后一块不满时，只有目标也复制到末尾才能整块共享；压缩簇不共享 */
+        if (pos_in % blk_sz == 0 && pos_out % blk_sz == 0
+            && !newfs_comp_cluster(src, bi) && !newfs_comp_cluster(dst, bo)
+            && (rest >= (size_t)blk_sz || (pos_in + (off_t)rest >= src->size
+                                           && pos_out + (off_t)rest >= dst->size))) {
+            if ((ret = file_clone_blk(src, bi, dst, bo)) != NEWFS_ERROR_NONE) {
+                break;
+            }
+            cloned = true;
+            done  += rest < (size_t)blk_sz ? rest : (size_t)blk_sz;
+        } else {
+            int      oi = pos_in % blk_sz, oo = pos_out % blk_sz;
+            size_t   n  = blk_sz - oi < blk_sz - oo ? blk_sz - oi : blk_sz - oo;
+            uint8_t* s;
+            uint8_t* d;
+
+            if (n > rest) {
+                n = rest;
+            }
+            s = newfs_file_block(src, bi, false);
+            if (s == NULL && (NEWFS_BLK_WRITTEN(src->data[bi]) || newfs_comp_cluster(src, bi))) {
+                ret = -NEWFS_ERROR_IO;
+                break;
+            }
+            if (s == NULL && file_hole(dst, bo)) {
+                done += n;                          /* 空洞复制到空洞，不分配 */
+                continue;
+            }
+            if ((d = newfs_file_block(dst, bo, true)) == NULL) {
+                ret = -NEWFS_ERROR_NOSPACE;
+                break;
+            }
+            if (s == NULL) {
+                memset(d + oo, 0, n);
+            } else {
+                memcpy(d + oo, s + oi, n);
+            }
+            NEWFS_BLK_SET_DIRTY(dst, bo);
+            done += n;
+        }
+    }
+    if (off_out + (off_t)done > dst->size) {
+        dst->size = off_out + done;
+    }
+    newfs_mark_dirty(dst);
+    if (cloned) {
+        /* 引用计数先于引用它的inode落盘，崩溃后计数只会偏大 */
+        newfs_mark_dirty(src);
+        if (newfs_share_sync() != NEWFS_ERROR_NONE
+            || newfs_flush_inode(src) != NEWFS_ERROR_NONE
+            || newfs_flush_inode(dst) != NEWFS_ERROR_NONE) {
+            return -NEWFS_ERROR_IO;
+        }
+    }
+    if (done == 0 && ret != NEWFS_ERROR_NONE) {
+        return ret;
+    }
+    return (int)done;
+}
+
+/******************************************************************************
+* SECTION: 符号链接
+* 目标不超过NEWFS_SYMLINK_INLINE字节时直接存放在磁盘inode的data[]中，不占数据块；
+* 更长的目标占用一个数据块。两种情况下内存中的目标都在data_blks[0]缓冲里。
+*******************************************************************************/
+/**
+ * @brief 为新分配的符号链接inode写入目标
+ *
+ * @param inode 新分配的inode
+ * @param target 目标路径
+ * @param len 目标长度，不含'\0'，调用者已检查不超过一个块
+ * @return int 0成功，否则返回对应错误号
+ */
+int newfs_symlink_init(struct newfs_inode* inode, const char* target, int len) {
+    uint8_t* buf;
+
+    inode->size = len;
+    if (NEWFS_IS_INLINE_LINK(inode)) {
+        buf = newfs_buf_alloc();
+        memset(buf, 0, NEWFS_IO_SZ());
+        inode->data_blks[0] = buf;
+        newfs_icache_charge(NEWFS_IO_SZ());
+    } else if ((buf = newfs_file_block(inode, 0, true)) == NULL) {
+        return -NEWFS_ERROR_NOSPACE;
+    }
+    memcpy(buf, target, len);
+    newfs_mark_dirty(inode);
+    return NEWFS_ERROR_NONE;
+}
+
+/**
+ * @brief 取符号链接的目标，不以'\0'结尾，长度为inode->size
+ *
+ * @return const char* 目标，读数据块失败返回NULL
+ */
+const char* newfs_symlink_target(struct newfs_inode* inode) {
+    if (NEWFS_IS_INLINE_LINK(inode)) {
+        return (const char *)inode->data_blks[0];
+    }
+    return (const char *)newfs_file_block(inode, 0, false);
+}
@@ -0,0 +1,321 @@
+#include "newfs.h"
+
+extern struct custom_options newfs_options;
+extern struct newfs_super    super;
+extern struct newfs_slab     newfs_inode_slab;
+
+/******************************************************************************
+* SECTION: inode缓存
+* 按ino哈希索引所有内存inode，并维护一条LRU链表（表头最近使用）。
+* 内存占用超过上限时，从表尾开始淘汰干净、无引用、且没有子inode在内存中的inode。
+*******************************************************************************/
+#define NEWFS_ICACHE_HASH       256
+#define NEWFS_ICACHE_BUCKET(ino) ((ino) % NEWFS_ICACHE_HASH)
+
+static struct newfs_inode* icache_hash[NEWFS_ICACHE_HASH];
+static struct newfs_inode* lru_head;
+static struct newfs_inode* lru_tail;
+static long                mem_used;
+static long                mem_cap;
+
+struct newfs_icache_stat   icache_stat;
+
+static void lru_unlink(struct newfs_inode* inode) {
+    if (inode->lru_prev) inode->lru_prev->lru_next = inode->lru_next;
+    else                 lru_head = inode->lru_next;
+    if (inode->lru_next) inode->lru_next->lru_prev = inode->lru_prev;
+    else                 lru_tail = inode->lru_prev;
+    inode->lru_prev = inode->lru_next = NULL;
+}
+
+static void lru_push_head(struct newfs_inode* inode) {
+    inode->lru_prev = NULL;
+    inode->lru_next = lru_head;
+    if (lru_head) lru_head->lru_prev = inode;
+    lru_head = inode;
+    if (lru_tail == NULL) lru_tail = inode;
+}
+
+/**
+ * @brief 获取inode所在目录的inode，根目录返回NULL
+ */
+static struct newfs_inode* icache_parent(struct newfs_inode* inode) {
+    if (inode->dentry == NULL || inode->dentry->parent == NULL) {
+        return NULL;
+    }
+    return inode->dentry->parent->inode;
+}
+
+/**
+ * @brief 初始化inode缓存
+ *
+ * @param cap 内存上限（字节）
+ */
+void newfs_icache_init(long cap) {
+    memset(icache_hash, 0, sizeof(icache_hash));
+    memset(&icache_stat, 0, sizeof(icache_stat));
+    lru_head = lru_tail = NULL;
+    mem_used = 0;
+    mem_cap  = cap;
+}
+
+/**
+ * @brief 调整缓存内存计数，数据块缓冲、目录项的分配释放都要记账
+ *
+ * @param bytes 正数为增加，负数为减少
+ */
+void newfs_icache_charge(long bytes) {
+    mem_used += bytes;
+    icache_stat.mem_used = mem_used;
+}
+
+/**
+ * @brief 将新读入或新分配的inode加入缓存
+ *
+ * @param inode
+ */
+void newfs_icache_insert(struct newfs_inode* inode) {
+    struct newfs_inode* parent = icache_parent(inode);
+    int bucket = NEWFS_ICACHE_BUCKET(inode->ino);
+
+    inode->hash_next    = icache_hash[bucket];
+    icache_hash[bucket] = inode;
+    lru_push_head(inode);
+    if (parent) {
+        parent->nr_cached++;
+    }
+    icache_stat.nr_inodes++;
+    newfs_icache_charge(sizeof(struct newfs_inode));
+}
+
+/**
+ * @brief 按ino在缓存中查找inode
+ *
+ * @param ino
+ * @return struct newfs_inode* 未命中返回NULL
+ */
+struct newfs_inode* newfs_icache_find(uint32_t ino) {
+    struct newfs_inode* inode = icache_hash[NEWFS_ICACHE_BUCKET(ino)];
+    while (inode && inode->ino != ino) {
+        inode = inode->hash_next;
+    }
+    return inode;
+}
+
+/**
+ * @brief 取得dentry对应的内存inode，不在内存则从磁盘读入，并移到LRU表头
+ *
+ * @param dentry
+ * @return struct newfs_inode*
+ */
+struct newfs_inode* newfs_iget(struct newfs_dentry* dentry) {
+    struct newfs_inode* inode = dentry->inode;
+
+    if (inode == NULL) {
+        inode = newfs_icache_find(dentry->ino);
+    }
+    if (inode != NULL) {
+        icache_stat.hits++;
+        lru_unlink(inode);
+        lru_push_head(inode);
+        if (inode->dentry != dentry) {
+            /* 经另一个硬链接访问：改以该dentry为主，父目录的子inode计数随之转移 */
+            newfs_icache_detach(inode, inode->dentry);
+            inode->dentry = dentry;
+            if (dentry->parent && dentry->parent->inode) {
+                dentry->parent->inode->nr_cached++;
+            }
+        }
+    } else {
+        icache_stat.misses++;
+        inode = newfs_read_inode(dentry, dentry->ino);
+    }
+    dentry->inode = inode;
+    return inode;
+}
+
+/**
+ * @brief 增加inode引用，有引用的inode不会被淘汰
+ */
+void newfs_iref(struct newfs_inode* inode) {
+    inode->ref++;
+}
+
+/**
+ * @brief 释放inode引用，已删除的inode在最后一个引用释放后交给后台回收
+ */
+void newfs_iput(struct newfs_inode* inode) {
+    if (inode->ref > 0) {
+        inode->ref--;
+    }
+    if (inode->ref == 0 && inode->unlinked) {
+        newfs_reclaim_queue(inode);
+    }
+}
+
+/**
+ * @brief 判断inode能否被淘汰
+ */
+static bool icache_evictable(struct newfs_inode* inode) {
+    return inode->ref == 0 && !inode->dirty && inode->nr_cached == 0
+           && inode->ino != (uint32_t)super.root_ino;
+}
+
+/**
+ * @brief 将inode移出哈希表与LRU链表，之后不会再被查找到或淘汰
+ *
+ * @param inode
+ */
+static void icache_unhash(struct newfs_inode* inode) {
+    struct newfs_inode** pp     = &icache_hash[NEWFS_ICACHE_BUCKET(inode->ino)];
+    struct newfs_inode*  parent = icache_parent(inode);
+
+    while (*pp != inode) {
+        pp = &(*pp)->hash_next;
+    }
+    *pp = inode->hash_next;
+    inode->hash_next = NULL;
+    lru_unlink(inode);
+    if (parent) {
+        parent->nr_cached--;
+    }
+    icache_stat.nr_inodes--;
+}
+
+/**
+ * @brief 释放已移出缓存的inode：释放数据块缓冲与已加载的子目录项
+ *
+ * @param inode
+ */
+static void icache_free(struct newfs_inode* inode) {
+    struct newfs_dentry* dentry_cursor;
+
+    /* 子目录项此时都没有内存inode，可以直接释放 */
+    dentry_cursor = inode->dentrys;
+    while (dentry_cursor) {
+        struct newfs_dentry* next = dentry_cursor->brother;
+        free_dentry(dentry_cursor);
+        newfs_icache_charge(-(long)sizeof(struct newfs_dentry));
+        dentry_cursor = next;
+    }
+    for (int i = 0; i < NEWFS_DATA_PER_FILE; i++) {
+        if (inode->data_blks[i]) {
+            newfs_buf_free(inode->data_blks[i]);
+            newfs_icache_charge(-(long)NEWFS_IO_SZ());
+        }
+    }
+    if (inode->dentry) {
+        inode->dentry->inode = NULL;
+    }
+    newfs_slab_free(&newfs_inode_slab, inode);
+    newfs_icache_charge(-(long)sizeof(struct newfs_inode));
+}
+
+/**
+ * @brief 从缓存中移除并释放一个inode
+ *
+ * @param inode
+ */
+static void icache_evict(struct newfs_inode* inode) {
+    icache_unhash(inode);
+    icache_free(inode);
+    icache_stat.evictions++;
+}
+
+/**
+ * @brief 跨目录重命名时调用：dentry改挂到新父目录，若dentry有内存inode，同时转移父目录的子inode计数
+ *
+ * @param dentry 被移动的dentry
+ * @param parent 新父目录的dentry
+ */
+void newfs_icache_reparent(struct newfs_dentry* dentry, struct newfs_dentry* parent) {
+    if (dentry->inode && dentry->parent && dentry->parent->inode) {
+        dentry->parent->inode->nr_cached--;
+    }
+    dentry->parent = parent;
+    if (dentry->inode && parent->inode) {
+        parent->inode->nr_cached++;
+    }
+}
+
+/**
+ * @brief 断开inode与其主dentry的关联，用于删除硬链接之一或改经其他链接访问。
+ * dentry不是主dentry时什么也不做
+ *
+ * @param inode
+ * @param dentry
+ */
+void newfs_icache_detach(struct newfs_inode* inode, struct newfs_dentry* dentry) {
+    struct newfs_inode* parent;
+
+    if (dentry == NULL || inode->dentry != dentry) {
+        return;
+    }
+    parent = icache_parent(inode);
+    if (parent) {
+        parent->nr_cached--;
+    }
+    dentry->inode = NULL;
+    inode->dentry = NULL;
+}
+
+/**
+ * @brief 删除文件时调用：inode移出缓存，但内存保留到最后一个引用释放、
+ * 由后台回收线程调用newfs_icache_free释放，期间已打开的句柄仍可读写
+ *
+ * @param inode
+ */
+void newfs_icache_remove(struct newfs_inode* inode) {
+    icache_unhash(inode);
+}
+
+/**
+ * @brief 释放newfs_icache_remove移出的inode
+ *
+ * @param inode
+ */
+void newfs_icache_free(struct newfs_inode* inode) {
+    icache_free(inode);
+}
+
+/**
+ * @brief 内存超过上限时，从LRU表尾开始淘汰可淘汰的inode。
+ *
+ * 目录只有在其子inode都被淘汰后才可淘汰，因此循环多轮直到低于上限或无进展。
+ * 只能在操作之间调用，保证不会淘汰当前操作正在使用的inode。
+ */
+void newfs_icache_shrink(void) {
+    bool progress = true;
+
+    while (mem_used > mem_cap && progress) {
+        struct newfs_inode* inode = lru_tail;
+        progress = false;
+        while (inode && mem_used > mem_cap) {
+            struct newfs_inode* prev = inode->lru_prev;
+            if (icache_evictable(inode)) {
+                icache_evict(inode);
+                progress = true;
+            }
+            inode = prev;
+        }
+    }
+}
+
+/**
+ * @brief 卸载时释放缓存中的全部inode，调用前应已写回脏数据。
+ * 先释放叶子，保证释放目录项时其子inode都已不在内存。
+ */
+void newfs_icache_destroy(void) {
+    while (lru_head) {
+        struct newfs_inode* inode = lru_head;
+        while (inode) {
+            struct newfs_inode* next = inode->lru_next;
+            if (inode->nr_cached == 0) {
+                inode->ref   = 0;
+                inode->dirty = false;
+                icache_evict(inode);
+            }
+            inode = next;
+        }
+    }
+}
@@ -0,0 +1,462 @@
+#include "newfs.h"
+
+extern struct custom_options newfs_options;
+extern struct newfs_super    super;
+
+/******************************************************************************
+* SECTION: 目录预取
+* 训练任务每个epoch把数据集目录下的文件逐个打开读完。同一目录中先后打开NEWFS_PF_STREAK个
+* 不同文件即视为在扫描该目录(也可用NEWFS_IOC_PREFETCH显式提示)，此后预取线程按目录项顺序
+* 把尚未打开的文件读入inode缓存，已预取而未打开的数据不超过--prefetch_mb，打开一个再补一个。
+* 扫描过的目录及其父目录记为数据集：之后的epoch、或同一数据集的其他子目录，第一次打开就开始预取。
+* 同一时刻只预取一个目录；同一文件在本轮中被再次打开视为新的epoch，从头重建列表。
+* 预取线程与FUSE操作共用全局锁，只在等待I/O时放锁，装入缓存的规则与顺序读预读(ra_reap)一致。
+*******************************************************************************/
+struct newfs_prefetch_stat prefetch_stat;
+
+struct pf_scan {
+    uint32_t ino;           /* 目录ino，-1为空闲 */
+    uint32_t seen[NEWFS_PF_STREAK]; /* 最近打开的不同文件ino，开始预取时这些文件不再预取 */
+    int      streak;        /* 先后打开的不同文件数 */
+    bool     dataset;       /* 扫描过或被提示过，再打开其中或其子目录中的文件立即预取 */
+    uint64_t used;          /* 最近使用时刻，表满时替换最久未用的 */
+};
+
+struct pf_ent {
+    struct newfs_dentry* dentry;    /* 目录项被摘除时置NULL */
+    struct newfs_inode*  inode;     /* 已预取而未打开时持有引用，打开前不会被淘汰 */
+    int                  bytes;     /* 预取读入并计入预算的字节数 */
+    bool                 opened;    /* 本轮已被打开 */
+    bool                 loaded;    /* 已预取，或已打开而无需预取 */
+};
+
+static struct pf_scan      pf_scans[NEWFS_PF_DIRS];
+static uint64_t            pf_clock;
+static struct newfs_inode* pf_dir;          /* 正在预取的目录，持有引用，NULL为没有任务 */
+static struct pf_ent*      pf_ents;         /* 目录中的普通文件，按目录项顺序 */
+static int                 pf_nr;
+static int                 pf_next;         /* 下一个待预取的下标 */
+static int                 pf_opened;       /* 本轮已打开(或已删除)的项数，全部打开即一轮结束 */
+static int                 pf_hit;          /* 上一次打开的下标，顺序扫描时下一次就是它的后一个 */
+static pthread_cond_t      pf_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t           pf_thread;
+static bool                pf_running;
+static bool                pf_stopping;
+
+/**
+ * @brief 在跟踪表中查找目录
+ *
+ * @param ino 目录ino
+ * @param create 不在表中时是否替换最久未用的一项
+ * @return struct pf_scan* 未找到且不创建时返回NULL
+ */
+static struct pf_scan* pf_scan_get(uint32_t ino, bool create) {
+    struct pf_scan* victim = &pf_scans[0];
+
+    for (int i = 0; i < NEWFS_PF_DIRS; i++) {
+        if (pf_scans[i].ino == ino) {
+            pf_scans[i].used = ++pf_clock;
+            return &pf_scans[i];
+        }
+        if (pf_scans[i].used < victim->used) {
+            victim = &pf_scans[i];
+        }
+    }
+    if (!create) {
+        return NULL;
+    }
+    memset(victim, 0xff, sizeof(*victim));
+    victim->ino     = ino;
+    victim->streak  = 0;
+    victim->dataset = false;
+    victim->used    = ++pf_clock;
+    return victim;
+}
+
+/**
+ * @brief 目录的父目录inode，根目录或父目录不在内存时返回NULL
+ */
+static struct newfs_inode* pf_parent(struct newfs_inode* dir) {
+    if (dir->dentry == NULL || dir->dentry->parent == NULL) {
+        return NULL;
+    }
+    return dir->dentry->parent->inode;
+}
+
+/**
+ * @brief 把目录及其父目录记为数据集
+ */
+static void pf_mark_dataset(struct newfs_inode* dir) {
+    struct newfs_inode* parent = pf_parent(dir);
+
+    pf_scan_get(dir->ino, true)->dataset = true;
+    if (parent) {
+        pf_scan_get(parent->ino, true)->dataset = true;
+    }
+}
+
+/**
+ * @brief 放弃预取项持有的inode引用，之后可以正常淘汰
+ */
+static void pf_release(struct pf_ent* ent) {
+    if (ent->inode) {
+        newfs_iput(ent->inode);
+        ent->inode = NULL;
+    }
+}
+
+/**
+ * @brief 释放任务列表，已读入的数据留在缓存中
+ */
+static void pf_ents_free(void) {
+    for (int i = 0; i < pf_nr; i++) {
+        pf_release(&pf_ents[i]);
+    }
+    free(pf_ents);
+}
+
+/**
+ * @brief 结束当前预取任务
+ */
+static void pf_job_drop(void) {
+    if (pf_dir == NULL) {
+        return;
+    }
+    newfs_iput(pf_dir);
+    pf_ents_free();
+    pf_dir  = NULL;
+    pf_ents = NULL;
+    pf_nr   = pf_next = pf_opened = 0;
+    prefetch_stat.ahead = 0;
+}
+
+/**
+ * @brief 对目录开始(或重新开始)一轮预取：按目录项顺序列出其中的普通文件
+ *
+ * @param dir
+ * @return int 0成功，否则返回错误码
+ */
+static int pf_job_start(struct newfs_inode* dir) {
+    struct pf_ent* ents;
+    int nr = 0;
+
+    if (newfs_dir_load(dir) < 0 || dir->csum_bad || dir->unlinked) {
+        return -NEWFS_ERROR_IO;
+    }
+    for (struct newfs_dentry* d = dir->dentrys; d; d = d->brother) {
+        nr += d->ftype == NEWFS_REG_FILE;
+    }
+    ents = (struct pf_ent *)calloc(nr > 0 ? nr : 1, sizeof(struct pf_ent));
+    if (ents == NULL) {
+        return -NEWFS_ERROR_NOSPACE;
+    }
+    nr = 0;
+    for (struct newfs_dentry* d = dir->dentrys; d; d = d->brother) {
+        if (d->ftype == NEWFS_REG_FILE) {
+            ents[nr++].dentry = d;
+        }
+    }
+
+    if (pf_dir == dir) {
+        pf_ents_free();
+        prefetch_stat.epochs++;
+    } else {
+        pf_job_drop();
+        newfs_iref(dir);
+        pf_dir = dir;
+        prefetch_stat.jobs++;
+    }
+    pf_ents   = ents;
+    pf_nr     = nr;
+    pf_next   = 0;
+    pf_opened = 0;
+    pf_hit    = -1;
+    prefetch_stat.ahead = 0;
+    pthread_cond_signal(&pf_cond);
+    return NEWFS_ERROR_NONE;
+}
+
+/**
+ * @brief 在任务列表中查找目录项，从上一次打开的下一个开始找
+ *
+ * @return int 下标，不在列表中返回-1
+ */
+static int pf_find(struct newfs_dentry* dentry) {
+    for (int n = 0; n < pf_nr; n++) {
+        int i = (pf_hit + 1 + n) % pf_nr;
+        if (pf_ents[i].dentry == dentry) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief 第i项被打开：预取过的从预算中扣除，没预取的不再预取
+ */
+static void pf_consume(int i) {
+    struct pf_ent* ent = &pf_ents[i];
+
+    pf_hit = i;
+    if (ent->opened) {
+        return;
+    }
+    ent->opened = true;
+    pf_opened++;
+    if (ent->loaded && ent->bytes > 0) {
+        prefetch_stat.ahead -= ent->bytes;
+        prefetch_stat.hits++;
+    }
+    ent->loaded = true;
+    pf_release(ent);                                /* 调用者已打开该文件，句柄持有引用 */
+    pthread_cond_signal(&pf_cond);
+}
+
+/**
+ * @brief 块blk是否由预取负责：已写入且未压缩，压缩簇留给读路径整簇解压
+ */
+static bool pf_wanted(struct newfs_inode* inode, int blk) {
+    return NEWFS_BLK_WRITTEN(inode->data[blk]) && !NEWFS_BLK_IS_COMP(inode->data[blk]);
+}
+
+/**
+ * @brief 预取第i项：持锁提交读请求，放锁等待完成后再持锁装入缓存。
+ * 已在缓存中的块不再读，但同样计入预算；打开前任务持有inode引用，预取的数据不会被淘汰
+ *
+ * @return bool 预算不够放下这个文件时返回false，等已预取的文件被打开后再试
+ */
+static bool pf_load(int i) {
+    struct pf_ent*      ent = &pf_ents[i];
+    struct newfs_inode* inode;
+    struct newfs_file*  file;
+    long room = (prefetch_stat.budget - prefetch_stat.ahead) / NEWFS_IO_SZ();
+    int  nblks, end, need = 0, want = 0;
+
+    inode = newfs_iget(ent->dentry);
+    ent->loaded = true;
+    if (inode == NULL || inode->csum_bad || !NEWFS_IS_REG(inode)) {
+        return true;
+    }
+    nblks = (inode->size + NEWFS_IO_SZ() - 1) / NEWFS_IO_SZ();
+    if (nblks > NEWFS_DATA_PER_FILE) {
+        nblks = NEWFS_DATA_PER_FILE;
+    }
+    for (end = 0; end < nblks; end++) {
+        if (pf_wanted(inode, end)) {
+            if (need == room) {
+                break;
+            }
+            need++;
+            want += inode->data_blks[end] == NULL;
+        }
+    }
+    if (end < nblks && prefetch_stat.ahead > 0) {
+        ent->loaded = false;
+        return false;
+    }
+
+    /* 放锁前先记账，等待期间该文件被打开时能正确扣除 */
+    ent->bytes = need * NEWFS_IO_SZ();
+    prefetch_stat.ahead += ent->bytes;
+    if (need > 0) {
+        newfs_iref(inode);
+        ent->inode = inode;
+    }
+    if (want == 0) {
+        return true;                                /* 空文件或已在缓存中 */
+    }
+    prefetch_stat.files++;
+    prefetch_stat.blks += want;
+    file = newfs_file_open(inode, O_RDONLY);
+    newfs_file_prefetch(file, 0, end);
+    NEWFS_UNLOCK();
+    newfs_bdev_wait(NEWFS_DRIVER());
+    NEWFS_LOCK();
+    newfs_file_put(file);                           /* 收割：块号未变且仍未缓存的才装入 */
+    return true;
+}
+
+static void* pf_main(void* arg) {
+    (void)arg;
+    NEWFS_LOCK();
+    while (!pf_stopping) {
+        while (pf_next < pf_nr && pf_ents[pf_next].loaded) {
+            pf_next++;
+        }
+        if (pf_nr > 0 && pf_opened == pf_nr) {
+            /* 本轮已全部打开：下一个epoch多半从头再读一遍，提前从头预取 */
+            if (pf_job_start(pf_dir) == NEWFS_ERROR_NONE) {
+                continue;
+            }
+        }
+        if (pf_next >= pf_nr || prefetch_stat.ahead >= prefetch_stat.budget || !pf_load(pf_next)) {
+            pthread_cond_wait(&pf_cond, &super.lock);
+        }
+    }
+    NEWFS_UNLOCK();
+    return NULL;
+}
+
+/**
+ * @brief 挂载时按--prefetch_mb确定预算并启动预取线程，预算为0时不预取
+ */
+void newfs_prefetch_start(void) {
+    memset(&prefetch_stat, 0, sizeof(prefetch_stat));
+    memset(pf_scans, 0, sizeof(pf_scans));
+    for (int i = 0; i < NEWFS_PF_DIRS; i++) {
+        pf_scans[i].ino = -1;
+    }
+    pf_clock    = 0;
+    pf_stopping = false;
+    if (newfs_options.prefetch_mb > 0) {
+        prefetch_stat.budget = (long)newfs_options.prefetch_mb * 1024 * 1024;
+    } else if (newfs_options.prefetch_mb == 0) {
+        prefetch_stat.budget = (long)newfs_options.cache_mb * 1024 * 1024 / 4;
+    }
+    if (prefetch_stat.budget < NEWFS_IO_SZ()) {
+        prefetch_stat.budget = 0;
+        pf_running = false;
+        return;
+    }
+    pf_running = pthread_create(&pf_thread, NULL, pf_main, NULL) == 0;
+    if (!pf_running) {
+        prefetch_stat.budget = 0;
+        NEWFS_TRACE(NEWFS_TC_SUPER, NEWFS_TL_WARN, "cannot start prefetch thread, prefetch disabled");
+    }
+}
+
+/**
+ * @brief 卸载时停止预取线程并结束当前任务，在刷写脏数据之前调用
+ */
+void newfs_prefetch_stop(void) {
+    if (!pf_running) {
+        return;
+    }
+    NEWFS_LOCK();
+    pf_stopping = true;
+    pthread_cond_signal(&pf_cond);
+    NEWFS_UNLOCK();
+    pthread_join(pf_thread, NULL);
+    pf_running = false;
+    NEWFS_LOCK();
+    pf_job_drop();
+    NEWFS_UNLOCK();
+}
+
+/**
+ * @brief 只读打开普通文件时调用，调用者持有全局锁：识别目录扫描，推进或开始预取
+ *
+ * @param dentry 被打开文件的目录项
+ */
+void newfs_prefetch_open(struct newfs_dentry* dentry) {
+    struct newfs_inode* dir;
+    struct newfs_inode* parent;
+    struct pf_scan*     scan;
+    bool dataset;
+    int  i;
+
+    if (!pf_running || dentry->parent == NULL || (dir = dentry->parent->inode) == NULL) {
+        return;
+    }
+    if (dir == pf_dir) {
+        i = pf_find(dentry);
+        if (i >= 0 && pf_ents[i].opened) {
+            /* 本轮已打开过的文件再次被打开：新的epoch */
+            if (pf_job_start(dir) != NEWFS_ERROR_NONE) {
+                return;
+            }
+            i = pf_find(dentry);
+        }
+        if (i >= 0) {
+            pf_consume(i);
+        }
+        return;
+    }
+
+    parent  = pf_parent(dir);
+    scan    = parent ? pf_scan_get(parent->ino, false) : NULL;
+    dataset = scan && scan->dataset;
+    scan    = pf_scan_get(dir->ino, true);
+    if (dataset || scan->dataset) {
+        /* 已知的数据集：第一次打开就开始，只有本文件不需要预取 */
+        pf_mark_dataset(dir);
+        if (pf_job_start(dir) == NEWFS_ERROR_NONE && (i = pf_find(dentry)) >= 0) {
+            pf_consume(i);
+        }
+        return;
+    }
+    for (i = 0; i < NEWFS_PF_STREAK && i < scan->streak; i++) {
+        if (scan->seen[i] == dentry->ino) {
+            return;                                 /* 反复打开同一个文件不算扫描 */
+        }
+    }
+    scan->seen[scan->streak++ % NEWFS_PF_STREAK] = dentry->ino;
+    if (scan->streak < NEWFS_PF_STREAK) {
+        return;
+    }
+    /* 刚识别出扫描：最近打开过的几个文件都不再预取 */
+    pf_mark_dataset(dir);
+    if (pf_job_start(dir) != NEWFS_ERROR_NONE) {
+        return;
+    }
+    for (i = 0; i < pf_nr; i++) {
+        for (int k = 0; k < NEWFS_PF_STREAK; k++) {
+            if (pf_ents[i].dentry->ino == scan->seen[k]) {
+                pf_consume(i);
+                break;
+            }
+        }
+    }
+    if ((i = pf_find(dentry)) >= 0) {
+        pf_hit = i;
+    }
+}
+
+/**
+ * @brief NEWFS_IOC_PREFETCH：从头预取目录，调用者持有全局锁
+ *
+ * @param inode 打开的目录，或打开的文件(预取其所在目录)
+ * @return int 0成功，否则返回错误码；未开启预取时什么也不做
+ */
+int newfs_prefetch_hint(struct newfs_inode* inode) {
+    struct newfs_inode* dir = inode;
+
+    if (!pf_running) {
+        return NEWFS_ERROR_NONE;
+    }
+    if (!NEWFS_IS_DIR(inode)) {
+        if (inode->dentry == NULL || inode->dentry->parent == NULL) {
+            return -NEWFS_ERROR_INVAL;
+        }
+        dir = inode->dentry->parent->inode;
+    }
+    pf_mark_dataset(dir);
+    return pf_job_start(dir);
+}
+
+/**
+ * @brief 目录项从目录中摘除时调用，调用者持有全局锁：从预取列表中去掉该项
+ *
+ * @param dir
+ * @param dentry
+ */
+void newfs_prefetch_forget(struct newfs_inode* dir, struct newfs_dentry* dentry) {
+    if (dir != pf_dir) {
+        return;
+    }
+    for (int i = 0; i < pf_nr; i++) {
+        if (pf_ents[i].dentry == dentry) {
+            if (pf_ents[i].loaded && !pf_ents[i].opened) {
+                prefetch_stat.ahead -= pf_ents[i].bytes;
+            }
+            if (!pf_ents[i].opened) {
+                pf_opened++;
+            }
+            pf_release(&pf_ents[i]);
+            pf_ents[i].dentry = NULL;
+            pf_ents[i].opened = true;
+            pf_ents[i].loaded = true;
+            return;
+        }
+    }
+}
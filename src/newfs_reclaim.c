@@ -0,0 +1,210 @@
+#include "newfs.h"
+#include <time.h>
+
+extern struct newfs_super    super;
+
+/******************************************************************************
+* SECTION: 后台回收
+* unlink/rmdir只把目录项从父目录中摘除，inode交给回收线程释放：
+* 入队后等待NEWFS_RECLAIM_DELAY_MS，让rm -r等连续删除凑成一批，
+* 一批中所有inode的数据块号(含属性块)排序后合并为连续段，每段一次清除数据块位图，inode号同样批量清除。
+* 仍被打开的inode在最后一个句柄关闭(newfs_iput)时才入队。
+* 与其他文件共享的块只减少引用计数，最后一个引用者释放时才清除位图。
+* 回收线程与FUSE操作共用全局锁，位图与计数的修改都在锁内完成。
+*******************************************************************************/
+struct newfs_reclaim_stat reclaim_stat;
+
+static struct newfs_inode* reclaim_list;
+static pthread_cond_t      reclaim_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t           reclaim_thread;
+static bool                reclaim_running;
+static bool                reclaim_stopping;
+
+/**
+ * @brief data[]中的一项是否应释放：空洞不释放，共享块只在去掉最后一个引用时释放
+ */
+static bool reclaim_last_ref(uint32_t blk) {
+    if (NEWFS_BLK_HOLE(blk)) {
+        return false;
+    }
+    return !NEWFS_BLK_IS_SHARED(blk) || newfs_share_put(NEWFS_BLKNO(blk));
+}
+
+/**
+ * @brief 回收队列中的全部inode，调用者持有全局锁
+ */
+static void reclaim_batch(void) {
+    struct newfs_inode* list = reclaim_list;
+    uint32_t* blks;
+    uint32_t* inos;
+    int nblks = 0, ninos = 0, runs;
+
+    if (list == NULL) {
+        return;
+    }
+    reclaim_list = NULL;
+    for (struct newfs_inode* inode = list; inode; inode = inode->reclaim_next) {
+        for (int i = 0; i < NEWFS_DATA_PER_FILE; i++) {
+            nblks += inode->data[i] != (uint32_t)-1;
+        }
+        nblks += !NEWFS_BLK_HOLE(inode->xattr_blk);
+        ninos++;
+    }
+    blks = (uint32_t *)malloc(sizeof(uint32_t) * (nblks + 1));
+    inos = (uint32_t *)malloc(sizeof(uint32_t) * ninos);
+    if (blks == NULL || inos == NULL) {
+        /* 内存不足时退回逐位释放，保证不泄漏空间 */
+        free(blks);
+        free(inos);
+        while (list) {
+            struct newfs_inode* next = list->reclaim_next;
+            for (int i = 0; i < NEWFS_DATA_PER_FILE; i++) {
+                if (reclaim_last_ref(list->data[i])) {
+                    newfs_free_blk(NEWFS_BLKNO(list->data[i]));
+                }
+            }
+            if (!NEWFS_BLK_HOLE(list->xattr_blk)) {
+                newfs_free_blk(list->xattr_blk);
+            }
+            newfs_free_ino(list->ino);
+            newfs_icache_free(list);
+            reclaim_stat.queued--;
+            reclaim_stat.inodes++;
+            list = next;
+        }
+        return;
+    }
+
+    nblks = ninos = 0;
+    while (list) {
+        struct newfs_inode* next = list->reclaim_next;
+        for (int i = 0; i < NEWFS_DATA_PER_FILE; i++) {
+            if (reclaim_last_ref(list->data[i])) {
+                blks[nblks++] = NEWFS_BLKNO(list->data[i]);
+            }
+        }
+        if (!NEWFS_BLK_HOLE(list->xattr_blk)) {
+            blks[nblks++] = list->xattr_blk;            /* 属性块只有一个引用 */
+        }
+        inos[ninos++] = list->ino;
+        newfs_icache_free(list);
+        list = next;
+    }
+    runs = newfs_free_blks(blks, nblks);
+    newfs_free_inos(inos, ninos);
+    NEWFS_TRACE(NEWFS_TC_INODE, NEWFS_TL_DEBUG, "reclaimed %d inodes, %d blocks in %d runs",
+                ninos, nblks, runs);
+
+    reclaim_stat.queued  -= ninos;
+    reclaim_stat.inodes  += ninos;
+    reclaim_stat.blks    += nblks;
+    reclaim_stat.runs    += runs;
+    reclaim_stat.batches++;
+    free(blks);
+    free(inos);
+}
+
+static void* reclaim_main(void* arg) {
+    (void)arg;
+    NEWFS_LOCK();
+    while (!reclaim_stopping) {
+        struct timespec deadline;
+
+        if (reclaim_list == NULL) {
+            pthread_cond_wait(&reclaim_cond, &super.lock);
+            continue;
+        }
+        /* 延迟一小段时间再回收，期间的删除并入同一批 */
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += NEWFS_RECLAIM_DELAY_MS * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        while (!reclaim_stopping
+               && pthread_cond_timedwait(&reclaim_cond, &super.lock, &deadline) != ETIMEDOUT) {
+        }
+        reclaim_batch();
+    }
+    NEWFS_UNLOCK();
+    return NULL;
+}
+
+/**
+ * @brief 挂载时启动回收线程
+ */
+void newfs_reclaim_start(void) {
+    reclaim_list     = NULL;
+    reclaim_stopping = false;
+    memset(&reclaim_stat, 0, sizeof(reclaim_stat));
+    reclaim_running  = pthread_create(&reclaim_thread, NULL, reclaim_main, NULL) == 0;
+    if (!reclaim_running) {
+        NEWFS_TRACE(NEWFS_TC_SUPER, NEWFS_TL_WARN, "cannot start reclaim thread, freeing synchronously");
+    }
+}
+
+/**
+ * @brief 卸载时停止回收线程，并同步回收队列中剩余的inode，之后再写回位图
+ */
+void newfs_reclaim_stop(void) {
+    if (reclaim_running) {
+        NEWFS_LOCK();
+        reclaim_stopping = true;
+        pthread_cond_signal(&reclaim_cond);
+        NEWFS_UNLOCK();
+        pthread_join(reclaim_thread, NULL);
+        reclaim_running = false;
+    }
+    NEWFS_LOCK();
+    reclaim_batch();
+    NEWFS_UNLOCK();
+}
+
+/**
+ * @brief inode的最后一个引用已释放，加入回收队列，调用者持有全局锁
+ *
+ * @param inode 已由newfs_reclaim_unlink摘除的inode
+ */
+void newfs_reclaim_queue(struct newfs_inode* inode) {
+    inode->reclaim_next = reclaim_list;
+    reclaim_list        = inode;
+    reclaim_stat.queued++;
+    if (reclaim_running) {
+        pthread_cond_signal(&reclaim_cond);
+    } else {
+        reclaim_batch();
+    }
+}
+
+/**
+ * @brief 目录项已删除，把inode移出脏链表与inode缓存，不再写回。
+ * 没有打开的句柄时立即入队，否则等最后一个句柄关闭
+ *
+ * @param inode
+ */
+void newfs_reclaim_unlink(struct newfs_inode* inode) {
+    newfs_clear_dirty(inode);
+    newfs_icache_remove(inode);
+    inode->dentry   = NULL;
+    inode->unlinked = true;
+    if (inode->ref == 0) {
+        newfs_reclaim_queue(inode);
+    }
+}
+
+/**
+ * @brief 删除指向inode的一个目录项：还有其他硬链接时只减少链接数，
+ * 否则同newfs_reclaim_unlink交给后台回收
+ *
+ * @param inode
+ * @param dentry 被删除的目录项
+ */
+void newfs_drop_link(struct newfs_inode* inode, struct newfs_dentry* dentry) {
+    if (!NEWFS_IS_DIR(inode) && inode->nlink > 1) {
+        inode->nlink--;
+        newfs_icache_detach(inode, dentry);
+        newfs_mark_dirty(inode);
+        return;
+    }
+    newfs_reclaim_unlink(inode);
+}
@@ -0,0 +1,388 @@
+#include "newfs.h"
+#include <time.h>
+
+/******************************************************************************
+* SECTION: 操作记录
+* --record=<file>时在操作表外包一层：每个操作执行后把路径、偏移、长度、返回值和
+* 时间戳追加到记录文件，格式见types.h中的newfs_rec_d，由tools/newfs_replay回放。
+* 不记录时使用原操作表，没有任何开销。
+*******************************************************************************/
+static const struct fuse_operations* rec_base;
+static struct fuse_operations        rec_ops;
+static FILE*                         rec_fp;
+static uint64_t                      rec_start;
+static pthread_mutex_t               rec_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @brief 追加一条记录
+ *
+ * @param op NEWFS_REC_*
+ * @param start 操作开始时的newfs_stat_now()
+ * @param path 路径，可以含'\0'(如rename的两个路径)，长度由path_len给出
+ * @param pad 操作相关的附加参数(如fallocate的mode)
+ */
+static void rec_append_n(int op, uint64_t start, const char* path, size_t path_len, uint64_t fh,
+                         off_t offset, uint32_t size, int ret, uint8_t pad) {
+    uint64_t end = newfs_stat_now();
+    struct newfs_rec_d rec;
+
+    memset(&rec, 0, sizeof(rec));
+    rec.ts       = start - rec_start;
+    rec.fh       = fh;
+    rec.offset   = offset;
+    rec.size     = size;
+    rec.ret      = ret;
+    rec.lat      = end - start > UINT32_MAX ? UINT32_MAX : (uint32_t)(end - start);
+    rec.path_len = path_len;
+    rec.op       = op;
+    rec.pad      = pad;
+
+    pthread_mutex_lock(&rec_lock);
+    if (rec_fp) {
+        fwrite(&rec, sizeof(rec), 1, rec_fp);
+        fwrite(path, rec.path_len, 1, rec_fp);
+    }
+    pthread_mutex_unlock(&rec_lock);
+}
+
+static void rec_append(int op, uint64_t start, const char* path, uint64_t fh,
+                       off_t offset, uint32_t size, int ret) {
+    rec_append_n(op, start, path, strlen(path), fh, offset, size, ret, 0);
+}
+
+static int rec_getattr(const char* path, struct stat* st) {
+    uint64_t start = newfs_stat_now();
+    int ret = rec_base->getattr(path, st);
+    rec_append(NEWFS_REC_GETATTR, start, path, 0, 0, 0, ret);
+    return ret;
+}
+
+static int rec_readdir(const char* path, void* buf, fuse_fill_dir_t filler, off_t offset,
+                       struct fuse_file_info* fi) {
+    uint64_t start = newfs_stat_now();
+    int ret = rec_base->readdir(path, buf, filler, offset, fi);
+    rec_append(NEWFS_REC_READDIR, start, path, fi ? fi->fh : 0, offset, 0, ret);
+    return ret;
+}
+
+static int rec_open(const char* path, struct fuse_file_info* fi) {
+    uint64_t start = newfs_stat_now();
+    int ret = rec_base->open(path, fi);
+    rec_append(NEWFS_REC_OPEN, start, path, fi->fh, 0, fi->flags, ret);
+    return ret;
+}
+
+static int rec_opendir(const char* path, struct fuse_file_info* fi) {
+    uint64_t start = newfs_stat_now();
+    int ret = rec_base->opendir(path, fi);
+    rec_append(NEWFS_REC_OPENDIR, start, path, fi->fh, 0, fi->flags, ret);
+    return ret;
+}
+
+static int rec_read(const char* path, char* buf, size_t size, off_t offset,
+                    struct fuse_file_info* fi) {
+    uint64_t start = newfs_stat_now();
+    int ret = rec_base->read(path, buf, size, offset, fi);
+    rec_append(NEWFS_REC_READ, start, path, fi->fh, offset, size, ret);
+    return ret;
+}
+
+static int rec_write(const char* path, const char* buf, size_t size, off_t offset,
+                     struct fuse_file_info* fi) {
+    uint64_t start = newfs_stat_now();
+    int ret = rec_base->write(path, buf, size, offset, fi);
+    rec_append(NEWFS_REC_WRITE, start, path, fi->fh, offset, size, ret);
+    return ret;
+}
+
+static int rec_mknod(const char* path, mode_t mode, dev_t dev) {
+    uint64_t start = newfs_stat_now();
+    int ret = rec_base->mknod(path, mode, dev);
+    rec_append(NEWFS_REC_MKNOD, start, path, 0, 0, mode, ret);
+    return ret;
+}
+
+static int rec_mkdir(const char* path, mode_t mode) {
+    uint64_t start = newfs_stat_now();
+    int ret = rec_base->mkdir(path, mode);
+    rec_append(NEWFS_REC_MKDIR, start, path, 0, 0, mode, ret);
+    return ret;
+}
+
+static int rec_unlink(const char* path) {
+    uint64_t start = newfs_stat_now();
+    int ret = rec_base->unlink(path);
+    rec_append(NEWFS_REC_UNLINK, start, path, 0, 0, 0, ret);
+    return ret;
+}
+
+static int rec_rmdir(const char* path) {
+    uint64_t start = newfs_stat_now();
+    int ret = rec_base->rmdir(path);
+    rec_append(NEWFS_REC_RMDIR, start, path, 0, 0, 0, ret);
+    return ret;
+}
+
+/**
+ * @brief 记录带两个路径的操作，路径为"first\0second"
+ */
+static void rec_append_pair(int op, uint64_t start, const char* first, const char* second, int ret) {
+    size_t first_len = strlen(first), second_len = strlen(second);
+    char*  path = (char *)malloc(first_len + 1 + second_len);
+
+    memcpy(path, first, first_len + 1);
+    memcpy(path + first_len + 1, second, second_len);
+    rec_append_n(op, start, path, first_len + 1 + second_len, 0, 0, 0, ret, 0);
+    free(path);
+}
+
+static int rec_rename(const char* from, const char* to) {
+    uint64_t start = newfs_stat_now();
+    int ret = rec_base->rename(from, to);
+    rec_append_pair(NEWFS_REC_RENAME, start, from, to, ret);
+    return ret;
+}
+
+static int rec_link(const char* from, const char* to) {
+    uint64_t start = newfs_stat_now();
+    int ret = rec_base->link(from, to);
+    rec_append_pair(NEWFS_REC_LINK, start, from, to, ret);
+    return ret;
+}
+
+static int rec_symlink(const char* target, const char* path) {
+    uint64_t start = newfs_stat_now();
+    int ret = rec_base->symlink(target, path);
+    rec_append_pair(NEWFS_REC_SYMLINK, start, target, path, ret);
+    return ret;
+}
+
+static int rec_readlink(const char* path, char* buf, size_t size) {
+    uint64_t start = newfs_stat_now();
+    int ret = rec_base->readlink(path, buf, size);
+    rec_append(NEWFS_REC_READLINK, start, path, 0, 0, size > UINT32_MAX ? UINT32_MAX : (uint32_t)size, ret);
+    return ret;
+}
+
+/**
+ * @brief 记录扩展属性操作，路径为"path\0name"
+ */
+static void rec_append_xattr(int op, uint64_t start, const char* path, const char* name, size_t size,
+                             int ret, uint8_t flags) {
+    size_t path_len = strlen(path), name_len = strlen(name);
+    char*  rec_path = (char *)malloc(path_len + 1 + name_len);
+
+    memcpy(rec_path, path, path_len + 1);
+    memcpy(rec_path + path_len + 1, name, name_len);
+    rec_append_n(op, start, rec_path, path_len + 1 + name_len, 0, 0,
+                 size > UINT32_MAX ? UINT32_MAX : (uint32_t)size, ret, flags);
+    free(rec_path);
+}
+
+static int rec_setxattr(const char* path, const char* name, const char* value, size_t size, int flags) {
+    uint64_t start = newfs_stat_now();
+    int ret = rec_base->setxattr(path, name, value, size, flags);
+    rec_append_xattr(NEWFS_REC_SETXATTR, start, path, name, size, ret, (uint8_t)flags);
+    return ret;
+}
+
+static int rec_getxattr(const char* path, const char* name, char* value, size_t size) {
+    uint64_t start = newfs_stat_now();
+    int ret = rec_base->getxattr(path, name, value, size);
+    rec_append_xattr(NEWFS_REC_GETXATTR, start, path, name, size, ret, 0);
+    return ret;
+}
+
+static int rec_listxattr(const char* path, char* list, size_t size) {
+    uint64_t start = newfs_stat_now();
+    int ret = rec_base->listxattr(path, list, size);
+    rec_append(NEWFS_REC_LISTXATTR, start, path, 0, 0, size > UINT32_MAX ? UINT32_MAX : (uint32_t)size, ret);
+    return ret;
+}
+
+static int rec_removexattr(const char* path, const char* name) {
+    uint64_t start = newfs_stat_now();
+    int ret = rec_base->removexattr(path, name);
+    rec_append_xattr(NEWFS_REC_REMOVEXATTR, start, path, name, 0, ret, 0);
+    return ret;
+}
+
+static int rec_truncate(const char* path, off_t size) {
+    uint64_t start = newfs_stat_now();
+    int ret = rec_base->truncate(path, size);
+    rec_append(NEWFS_REC_TRUNCATE, start, path, 0, size, 0, ret);
+    return ret;
+}
+
+static int rec_ftruncate(const char* path, off_t size, struct fuse_file_info* fi) {
+    uint64_t start = newfs_stat_now();
+    int ret = rec_base->ftruncate(path, size, fi);
+    rec_append(NEWFS_REC_TRUNCATE, start, path, fi ? fi->fh : 0, size, 0, ret);
+    return ret;
+}
+
+static int rec_fallocate(const char* path, int mode, off_t offset, off_t len,
+                         struct fuse_file_info* fi) {
+    uint64_t start = newfs_stat_now();
+    int ret = rec_base->fallocate(path, mode, offset, len, fi);
+    rec_append_n(NEWFS_REC_FALLOCATE, start, path, strlen(path), fi ? fi->fh : 0, offset,
+                 len > UINT32_MAX ? UINT32_MAX : (uint32_t)len, ret, (uint8_t)mode);
+    return ret;
+}
+
+static int rec_ioctl(const char* path, int cmd, void* arg, struct fuse_file_info* fi,
+                     unsigned int flags, void* data) {
+    uint64_t start = newfs_stat_now();
+    off_t    offset = 0;
+    int ret;
+
+    if ((unsigned int)cmd == NEWFS_IOC_CLONE_RANGE) {
+        struct newfs_clone_range* cr = (struct newfs_clone_range *)data;
+        size_t dst_len = strlen(path), src_len = strnlen(cr->src, NEWFS_CLONE_PATH_MAX - 1);
+        char*  rec_path = (char *)malloc(dst_len + src_len + 2 + sizeof(int64_t));
+        int64_t src_off = cr->src_off;
+
+        memcpy(rec_path, path, dst_len + 1);
+        memcpy(rec_path + dst_len + 1, cr->src, src_len);
+        rec_path[dst_len + 1 + src_len] = '\0';
+        memcpy(rec_path + dst_len + src_len + 2, &src_off, sizeof(src_off));
+        ret = rec_base->ioctl(path, cmd, arg, fi, flags, data);
+        rec_append_n(NEWFS_REC_CLONE, start, rec_path, dst_len + src_len + 2 + sizeof(int64_t),
+                     fi ? fi->fh : 0, cr->dst_off, cr->len > UINT32_MAX ? UINT32_MAX : (uint32_t)cr->len,
+                     ret, 0);
+        free(rec_path);
+        return ret;
+    }
+    if ((unsigned int)cmd == NEWFS_IOC_SNAP_CREATE || (unsigned int)cmd == NEWFS_IOC_SNAP_DELETE) {
+        struct newfs_snap_arg* snap = (struct newfs_snap_arg *)data;
+        size_t path_len = strlen(path), name_len = strnlen(snap->name, NEWFS_SNAP_NAME_LEN - 1);
+        char*  rec_path = (char *)malloc(path_len + name_len + 2);
+
+        memcpy(rec_path, path, path_len + 1);
+        memcpy(rec_path + path_len + 1, snap->name, name_len);
+        rec_path[path_len + 1 + name_len] = '\0';
+        ret = rec_base->ioctl(path, cmd, arg, fi, flags, data);
+        rec_append_n(NEWFS_REC_SNAP, start, rec_path, path_len + name_len + 1, fi ? fi->fh : 0, 0,
+                     (uint32_t)cmd, ret, 0);
+        free(rec_path);
+        return ret;
+    }
+    offset = data ? *(off_t *)data : 0;
+    ret = rec_base->ioctl(path, cmd, arg, fi, flags, data);
+    rec_append(NEWFS_REC_IOCTL, start, path, fi ? fi->fh : 0, offset, (uint32_t)cmd, ret);
+    return ret;
+}
+
+static int rec_flush(const char* path, struct fuse_file_info* fi) {
+    uint64_t start = newfs_stat_now();
+    int ret = rec_base->flush(path, fi);
+    rec_append(NEWFS_REC_FLUSH, start, path, fi->fh, 0, 0, ret);
+    return ret;
+}
+
+static int rec_release(const char* path, struct fuse_file_info* fi) {
+    uint64_t start = newfs_stat_now();
+    uint64_t fh    = fi->fh;
+    int ret = rec_base->release(path, fi);
+    rec_append(NEWFS_REC_RELEASE, start, path, fh, 0, 0, ret);
+    return ret;
+}
+
+static int rec_releasedir(const char* path, struct fuse_file_info* fi) {
+    uint64_t start = newfs_stat_now();
+    uint64_t fh    = fi->fh;
+    int ret = rec_base->releasedir(path, fi);
+    rec_append(NEWFS_REC_RELEASEDIR, start, path, fh, 0, 0, ret);
+    return ret;
+}
+
+static int rec_statfs(const char* path, struct statvfs* st) {
+    uint64_t start = newfs_stat_now();
+    int ret = rec_base->statfs(path, st);
+    rec_append(NEWFS_REC_STATFS, start, path, 0, 0, 0, ret);
+    return ret;
+}
+
+static int rec_utimens(const char* path, const struct timespec tv[2]) {
+    uint64_t start = newfs_stat_now();
+    int ret = rec_base->utimens(path, tv);
+    rec_append(NEWFS_REC_UTIMENS, start, path, 0, 0, 0, ret);
+    return ret;
+}
+
+/**
+ * @brief 卸载时先完成原卸载流程，再关闭记录文件
+ */
+static void rec_destroy(void* p) {
+    if (rec_base->destroy) {
+        rec_base->destroy(p);
+    }
+    pthread_mutex_lock(&rec_lock);
+    if (rec_fp) {
+        fclose(rec_fp);
+        rec_fp = NULL;
+    }
+    pthread_mutex_unlock(&rec_lock);
+}
+
+/**
+ * @brief 生成带记录的操作表：复制base，替换其中已实现的操作
+ *
+ * @param base 原操作表
+ * @param path 记录文件路径，已存在时覆盖
+ * @return const struct fuse_operations* 失败返回NULL
+ */
+const struct fuse_operations* newfs_record_operations(const struct fuse_operations* base,
+                                                      const char* path) {
+    struct newfs_rec_hdr_d hdr;
+    struct timespec ts;
+
+    rec_fp = fopen(path, "w");
+    if (rec_fp == NULL) {
+        return NULL;
+    }
+    setvbuf(rec_fp, NULL, _IOFBF, 1 << 20);         /* 记录量大，整块写出 */
+    clock_gettime(CLOCK_REALTIME, &ts);
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic    = NEWFS_REC_MAGIC;
+    hdr.version  = NEWFS_REC_VERSION;
+    hdr.rec_size = sizeof(struct newfs_rec_d);
+    hdr.start    = (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+    fwrite(&hdr, sizeof(hdr), 1, rec_fp);
+    fflush(rec_fp);                                 /* fuse_main转入后台前写出文件头 */
+    rec_start = newfs_stat_now();
+
+    rec_base = base;
+    rec_ops  = *base;
+#define REC_WRAP(name) do { if (base->name) rec_ops.name = rec_##name; } while (0)
+    REC_WRAP(getattr);
+    REC_WRAP(readdir);
+    REC_WRAP(open);
+    REC_WRAP(opendir);
+    REC_WRAP(read);
+    REC_WRAP(write);
+    REC_WRAP(mknod);
+    REC_WRAP(mkdir);
+    REC_WRAP(unlink);
+    REC_WRAP(rmdir);
+    REC_WRAP(rename);
+    REC_WRAP(link);
+    REC_WRAP(symlink);
+    REC_WRAP(readlink);
+    REC_WRAP(setxattr);
+    REC_WRAP(getxattr);
+    REC_WRAP(listxattr);
+    REC_WRAP(removexattr);
+    REC_WRAP(truncate);
+    REC_WRAP(ftruncate);
+    REC_WRAP(fallocate);
+    REC_WRAP(ioctl);
+    REC_WRAP(flush);
+    REC_WRAP(release);
+    REC_WRAP(releasedir);
+    REC_WRAP(statfs);
+    REC_WRAP(utimens);
+#undef REC_WRAP
+    rec_ops.destroy = rec_destroy;
+    return &rec_ops;
+}
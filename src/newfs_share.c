@@ -0,0 +1,162 @@
+#include "newfs.h"
+
+extern struct newfs_super    super;
+
+/******************************************************************************
+* SECTION: 共享数据块
+* 克隆(newfs_file_clone)让多个文件引用同一个数据块，引用处在data[]中带NEWFS_BLK_SHARED标记。
+* 引用计数只为被共享的块记录，按块号排序存放在share_tab中，不在表中的块引用计数为1；
+* 写入带标记的块时先查表：仍被共享则复制一份(写时复制)，否则只清除标记。
+* 表持久化在一个不挂入目录树的隐藏inode(super.share_ino)的数据块中。
+* 克隆后立即写回表，引用计数在磁盘上只会偏大(释放时延迟写回)，崩溃后最多泄漏空间，由fsck.newfs回收。
+*******************************************************************************/
+static struct newfs_share_d* share_tab;
+static int                   share_cnt;
+static int                   share_cap;
+static bool                  share_dirty;
+
+/**
+ * @brief 表最多能记录的块数，受隐藏inode的数据块数限制，末尾留出内容校验和
+ */
+static int share_max(void) {
+    return (NEWFS_DATA_PER_FILE * NEWFS_IO_SZ() - (int)sizeof(uint32_t)) / (int)sizeof(struct newfs_share_d);
+}
+
+/**
+ * @brief 二分查找blkno，返回其下标或应插入的位置
+ */
+static int share_find(uint32_t blkno, bool* found) {
+    int lo = 0, hi = share_cnt;
+
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (share_tab[mid].blkno < blkno) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    *found = lo < share_cnt && share_tab[lo].blkno == blkno;
+    return lo;
+}
+
+/**
+ * @brief 数据块的引用数
+ */
+int newfs_share_ref(uint32_t blkno) {
+    bool found;
+    int  i = share_find(blkno, &found);
+    return found ? (int)share_tab[i].ref : 1;
+}
+
+/**
+ * @brief 数据块多一个引用
+ *
+ * @return int 0成功，表已满返回-NEWFS_ERROR_NOSPACE
+ */
+int newfs_share_get(uint32_t blkno) {
+    bool found;
+    int  i = share_find(blkno, &found);
+
+    if (found) {
+        share_tab[i].ref++;
+        share_dirty = true;
+        return NEWFS_ERROR_NONE;
+    }
+    if (share_cnt >= share_max()) {
+        return -NEWFS_ERROR_NOSPACE;
+    }
+    if (share_cnt == share_cap) {
+        int cap = share_cap ? share_cap * 2 : 256;
+        struct newfs_share_d* tab = (struct newfs_share_d *)realloc(share_tab, sizeof(*tab) * cap);
+        if (tab == NULL) {
+            return -NEWFS_ERROR_NOSPACE;
+        }
+        share_tab = tab;
+        share_cap = cap;
+    }
+    memmove(&share_tab[i + 1], &share_tab[i], sizeof(*share_tab) * (share_cnt - i));
+    share_tab[i].blkno = blkno;
+    share_tab[i].ref   = 2;
+    share_cnt++;
+    share_dirty = true;
+    return NEWFS_ERROR_NONE;
+}
+
+/**
+ * @brief 释放数据块的一个引用
+ *
+ * @return bool 为true时这是最后一个引用，调用者应释放该块
+ */
+bool newfs_share_put(uint32_t blkno) {
+    bool found;
+    int  i = share_find(blkno, &found);
+
+    if (!found) {
+        return true;
+    }
+    if (--share_tab[i].ref == 1) {
+        memmove(&share_tab[i], &share_tab[i + 1], sizeof(*share_tab) * (share_cnt - i - 1));
+        share_cnt--;
+    }
+    share_dirty = true;
+    return false;
+}
+
+/**
+ * @brief 挂载时读入引用计数表
+ *
+ * @return int 0成功，否则返回错误码
+ */
+int newfs_share_load(void) {
+    void* tab;
+    int   len;
+
+    share_tab   = NULL;
+    share_cnt   = share_cap = 0;
+    share_dirty = false;
+    if (newfs_hidden_read(super.share_ino, &tab, &len) != NEWFS_ERROR_NONE) {
+        NEWFS_TRACE(NEWFS_TC_SUPER, NEWFS_TL_ERR, "cannot read block refcount table");
+        return -NEWFS_ERROR_IO;
+    }
+    share_tab = (struct newfs_share_d *)tab;
+    share_cnt = share_cap = len / (int)sizeof(struct newfs_share_d);
+    return NEWFS_ERROR_NONE;
+}
+
+/**
+ * @brief 表有修改时写回隐藏inode，再写超级块。表为空时释放隐藏inode
+ *
+ * @return int 0成功，否则返回错误码
+ */
+int newfs_share_sync(void) {
+    int ret;
+
+    if (!share_dirty) {
+        return NEWFS_ERROR_NONE;
+    }
+    ret  = newfs_hidden_write(&super.share_ino, share_tab, share_cnt * (int)sizeof(struct newfs_share_d));
+    ret |= newfs_sync_super(super.state);
+    if (ret != NEWFS_ERROR_NONE) {
+        NEWFS_TRACE(NEWFS_TC_SUPER, NEWFS_TL_ERR, "write block refcount table failed");
+        return -NEWFS_ERROR_IO;
+    }
+    share_dirty = false;
+    return NEWFS_ERROR_NONE;
+}
+
+/**
+ * @brief 卸载时释放内存中的表
+ */
+void newfs_share_destroy(void) {
+    free(share_tab);
+    share_tab = NULL;
+    share_cnt = share_cap = 0;
+}
+
+/**
+ * @brief 被共享的块数，统计输出用
+ */
+int newfs_share_count(void) {
+    return share_cnt;
+}
@@ -0,0 +1,213 @@
+#include "newfs.h"
+
+extern struct custom_options newfs_options;
+extern struct newfs_super    super;
+
+/******************************************************************************
+* SECTION: slab分配器
+* 每种对象一个slab：对象从按页批量申请的chunk中切出，释放后进入空闲链表复用。
+* 每个线程另有一个小的本地缓存(magazine)，命中时不需要加锁；
+* 线程退出时由pthread键的析构函数把缓存中的对象归还全局空闲链表。
+*******************************************************************************/
+#define NEWFS_SLAB_MAX          8       /* 最多slab种类数 */
+#define NEWFS_SLAB_BATCH        32      /* 线程缓存与全局空闲链表之间一次搬运的对象数 */
+#define NEWFS_SLAB_CHUNK_SZ     (64 * 1024)
+
+struct slab_tcache {
+    void*    head;                      /* 本线程空闲对象链表，对象首字存next */
+    int      cnt;
+    unsigned gen;                       /* 与slab->gen不同时说明slab已重建，缓存作废 */
+};
+
+static __thread struct slab_tcache slab_tcache[NEWFS_SLAB_MAX];
+static struct newfs_slab*          slab_all[NEWFS_SLAB_MAX];   /* 按id索引，线程退出时遍历 */
+static int                         slab_cnt;
+static pthread_key_t               slab_key;                   /* 只用来在线程退出时调用slab_tcache_flush */
+static pthread_once_t              slab_key_once = PTHREAD_ONCE_INIT;
+
+struct newfs_slab newfs_dentry_slab;
+struct newfs_slab newfs_inode_slab;
+struct newfs_slab newfs_buf_slab;
+
+/**
+ * @brief 初始化一个slab，同一slab重复初始化时保持原状
+ *
+ * @param slab
+ * @param name 名字，统计输出用
+ * @param size 对象大小
+ * @param align 对象对齐
+ */
+void newfs_slab_create(struct newfs_slab* slab, const char* name, size_t size, size_t align) {
+    if (slab->obj_size == size && slab->align == align) {
+        return;                                 /* 重新挂载，沿用已有的slab */
+    }
+    if (slab->obj_size == 0) {
+        slab->id = slab_cnt++;
+        slab_all[slab->id] = slab;
+        pthread_mutex_init(&slab->lock, NULL);
+    }
+    /* 对象大小变化(如逻辑块大小不同)时丢弃旧的空闲链表，旧chunk留到进程退出 */
+    slab->name      = name;
+    slab->obj_size  = size < sizeof(void*) ? sizeof(void*) : size;
+    slab->align     = align;
+    slab->per_chunk = NEWFS_SLAB_CHUNK_SZ / slab->obj_size;
+    if (slab->per_chunk < 8) {
+        slab->per_chunk = 8;
+    }
+    slab->free_list = NULL;
+    slab->gen++;
+}
+
+/**
+ * @brief 线程退出时把本线程各slab缓存中的对象全部归还全局空闲链表，
+ * 否则FUSE工作线程退出后这些对象再也不会被分配
+ */
+static void slab_tcache_flush(void* arg) {
+    (void)arg;
+    for (int id = 0; id < slab_cnt; id++) {
+        struct newfs_slab*  slab = slab_all[id];
+        struct slab_tcache* tc   = &slab_tcache[id];
+        void* obj;
+
+        pthread_mutex_lock(&slab->lock);
+        while (tc->gen == slab->gen && tc->head != NULL) {
+            obj             = tc->head;
+            tc->head        = *(void **)obj;
+            *(void **)obj   = slab->free_list;
+            slab->free_list = obj;
+        }
+        pthread_mutex_unlock(&slab->lock);
+        tc->head = NULL;
+        tc->cnt  = 0;
+    }
+}
+
+static void slab_key_create(void) {
+    pthread_key_create(&slab_key, slab_tcache_flush);
+}
+
+/**
+ * @brief 取本线程对应slab的缓存，线程第一次使用时登记退出时的归还
+ */
+static struct slab_tcache* slab_tcache_get(struct newfs_slab* slab) {
+    struct slab_tcache* tc = &slab_tcache[slab->id];
+    if (tc->gen != slab->gen) {
+        if (tc->gen == 0) {
+            pthread_once(&slab_key_once, slab_key_create);
+            pthread_setspecific(slab_key, slab_tcache);      /* 值非NULL析构函数才会被调用 */
+        }
+        tc->head = NULL;
+        tc->cnt  = 0;
+        tc->gen  = slab->gen;
+    }
+    return tc;
+}
+
+/**
+ * @brief 申请一个新chunk并切成对象挂到全局空闲链表，调用时持有slab锁
+ */
+static int slab_grow(struct newfs_slab* slab) {
+    size_t chunk_sz = slab->obj_size * slab->per_chunk;
+    uint8_t* chunk;
+
+    if (posix_memalign((void **)&chunk, slab->align, chunk_sz) != 0) {
+        return -NEWFS_ERROR_NOSPACE;
+    }
+    for (int i = slab->per_chunk - 1; i >= 0; i--) {
+        void* obj = chunk + i * slab->obj_size;
+        *(void **)obj   = slab->free_list;
+        slab->free_list = obj;
+    }
+    slab->stat.chunks++;
+    slab->stat.bytes += chunk_sz;
+    return NEWFS_ERROR_NONE;
+}
+
+/**
+ * @brief 分配一个对象，先查线程缓存，空了再从全局空闲链表批量取
+ *
+ * @param slab
+ * @return void* 失败返回NULL
+ */
+void* newfs_slab_alloc(struct newfs_slab* slab) {
+    struct slab_tcache* tc = slab_tcache_get(slab);
+    void* obj;
+
+    if (tc->head == NULL) {
+        pthread_mutex_lock(&slab->lock);
+        for (int i = 0; i < NEWFS_SLAB_BATCH; i++) {
+            if (slab->free_list == NULL && slab_grow(slab) != NEWFS_ERROR_NONE) {
+                break;
+            }
+            obj             = slab->free_list;
+            slab->free_list = *(void **)obj;
+            *(void **)obj   = tc->head;
+            tc->head        = obj;
+            tc->cnt++;
+        }
+        pthread_mutex_unlock(&slab->lock);
+        if (tc->head == NULL) {
+            return NULL;
+        }
+    }
+    obj      = tc->head;
+    tc->head = *(void **)obj;
+    tc->cnt--;
+    __atomic_add_fetch(&slab->stat.allocs, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&slab->stat.in_use, 1, __ATOMIC_RELAXED);
+    return obj;
+}
+
+/**
+ * @brief 释放一个对象到线程缓存，缓存过多时归还一批到全局空闲链表
+ *
+ * @param slab
+ * @param obj
+ */
+void newfs_slab_free(struct newfs_slab* slab, void* obj) {
+    struct slab_tcache* tc = slab_tcache_get(slab);
+
+    if (obj == NULL) {
+        return;
+    }
+    *(void **)obj = tc->head;
+    tc->head      = obj;
+    tc->cnt++;
+    __atomic_add_fetch(&slab->stat.frees, 1, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&slab->stat.in_use, 1, __ATOMIC_RELAXED);
+
+    if (tc->cnt > 2 * NEWFS_SLAB_BATCH) {
+        pthread_mutex_lock(&slab->lock);
+        for (int i = 0; i < NEWFS_SLAB_BATCH; i++) {
+            obj             = tc->head;
+            tc->head        = *(void **)obj;
+            *(void **)obj   = slab->free_list;
+            slab->free_list = obj;
+            tc->cnt--;
+        }
+        pthread_mutex_unlock(&slab->lock);
+    }
+}
+
+/**
+ * @brief 挂载时初始化各类对象的slab，块缓冲按逻辑块大小对齐
+ */
+void newfs_slab_init(void) {
+    newfs_slab_create(&newfs_dentry_slab, "dentry", sizeof(struct newfs_dentry), sizeof(void*));
+    newfs_slab_create(&newfs_inode_slab,  "inode",  sizeof(struct newfs_inode),  sizeof(void*));
+    newfs_slab_create(&newfs_buf_slab,    "iobuf",  NEWFS_IO_SZ(), NEWFS_IO_SZ());
+}
+
+/**
+ * @brief 分配一个逻辑块大小、按块对齐的I/O缓冲
+ */
+uint8_t* newfs_buf_alloc(void) {
+    return (uint8_t *)newfs_slab_alloc(&newfs_buf_slab);
+}
+
+/**
+ * @brief 归还I/O缓冲
+ */
+void newfs_buf_free(uint8_t* buf) {
+    newfs_slab_free(&newfs_buf_slab, buf);
+}
@@ -0,0 +1,629 @@
+#include "newfs.h"
+#include <time.h>
+
+extern struct newfs_super    super;
+
+/******************************************************************************
+* SECTION: 只读快照
+* 快照是创建时刻磁盘上的目录树。创建时只刷写脏数据并在快照表末尾追加一项，与文件数无关；
+* 之后每个inode第一次被修改前(newfs_snap_cow)，把磁盘上的旧版本保存到一个新分配的inode槽位：
+* 普通文件的数据块改为共享(带NEWFS_BLK_SHARED，引用计数加一)，随后的写入经写时复制落到新块，
+* 旧块由快照继续引用；目录的目录块复制一份归快照所有。槽位记在最新快照的映射表中，
+* 创建于最新快照之后的inode记为NEWFS_SNAP_ABSENT。
+* 在快照S中读inode i：依次查S及其后各快照的映射表，第一个记录就是S时刻的版本，
+* 都没有记录说明i此后没有被修改过，直接读当前槽位。
+* 快照表与映射表持久化在隐藏inode中，映射表在任何inode写回之前落盘；保存文件后立即写回
+* 共享块引用计数表，磁盘上的计数只会偏大。--snapshot=NAME只读挂载一个快照，修改一律返回EROFS。
+* 限制：快照只能描述磁盘上的状态，创建时在全局锁内调用newfs_flush_dirty，期间所有前台操作
+* 都要等待，等待时间与尚未写回的数据量成正比(脏数据在close时已写回，主要是仍在写的文件)。
+* [snap] create_us统计这部分耗时。
+*******************************************************************************/
+struct newfs_snap {
+    struct newfs_snap_d      d;
+    struct newfs_snap_map_d* map;                     /* 按ino排序 */
+    int                      cnt;
+    int                      cap;
+    bool                     dirty;                   /* 映射表需要写回 */
+};
+
+struct newfs_snap_stat snap_stat;
+
+static struct newfs_snap* snaps;                      /* 按创建顺序，最后一项是最新快照 */
+static int                snap_cnt;
+static bool               snap_tab_dirty;
+static uint32_t           snap_next_id;               /* 编号不重复使用，inode->snap_gen才不会误判 */
+static int                snap_view = -1;             /* 只读挂载的快照下标，-1为读写挂载 */
+
+/**
+ * @brief 映射表最多能记录的inode数，受隐藏inode的数据块数限制，末尾留出内容校验和
+ */
+static int snap_map_max(void) {
+    return (NEWFS_DATA_PER_FILE * NEWFS_IO_SZ() - (int)sizeof(uint32_t)) / (int)sizeof(struct newfs_snap_map_d);
+}
+
+/**
+ * @brief 二分查找ino，返回其下标或应插入的位置
+ */
+static int snap_map_find(struct newfs_snap* s, uint32_t ino, bool* found) {
+    int lo = 0, hi = s->cnt;
+
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (s->map[mid].ino < ino) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    *found = lo < s->cnt && s->map[lo].ino == ino;
+    return lo;
+}
+
+/**
+ * @brief 保证映射表还能再记录n项，之后的插入不会失败
+ *
+ * @return int 0成功，否则返回-NEWFS_ERROR_NOSPACE
+ */
+static int snap_map_reserve(struct newfs_snap* s, int n) {
+    struct newfs_snap_map_d* map;
+    int cap = s->cap ? s->cap : 64;
+
+    if (s->cnt + n > snap_map_max()) {
+        return -NEWFS_ERROR_NOSPACE;
+    }
+    if (s->cnt + n <= s->cap) {
+        return NEWFS_ERROR_NONE;
+    }
+    while (cap < s->cnt + n) {
+        cap *= 2;
+    }
+    if ((map = (struct newfs_snap_map_d *)realloc(s->map, sizeof(*map) * cap)) == NULL) {
+        return -NEWFS_ERROR_NOSPACE;
+    }
+    s->map = map;
+    s->cap = cap;
+    return NEWFS_ERROR_NONE;
+}
+
+/**
+ * @brief 记录ino在快照中的槽位，调用前已经snap_map_reserve
+ */
+static void snap_map_insert(struct newfs_snap* s, uint32_t ino, uint32_t slot) {
+    bool found;
+    int  i = snap_map_find(s, ino, &found);
+
+    if (!found) {
+        memmove(&s->map[i + 1], &s->map[i], sizeof(*s->map) * (s->cnt - i));
+        s->cnt++;
+    }
+    s->map[i].ino  = ino;
+    s->map[i].slot = slot;
+    s->dirty       = true;
+}
+
+/**
+ * @brief 按名字查找快照
+ *
+ * @return int 下标，没有时返回-1
+ */
+static int snap_find(const char* name) {
+    for (int i = 0; i < snap_cnt; i++) {
+        if (strncmp(snaps[i].d.name, name, NEWFS_SNAP_NAME_LEN) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief 释放内存中的快照表与映射表
+ */
+void newfs_snap_destroy(void) {
+    for (int i = 0; i < snap_cnt; i++) {
+        free(snaps[i].map);
+    }
+    free(snaps);
+    snaps          = NULL;
+    snap_cnt       = 0;
+    snap_tab_dirty = false;
+    snap_next_id   = 1;
+    snap_view      = -1;
+}
+
+/**
+ * @brief 挂载时读入快照表与各快照的映射表
+ *
+ * @return int 0成功，否则返回错误码，此时当作没有快照
+ */
+int newfs_snap_load(void) {
+    struct newfs_snap_d* tab;
+    void* buf;
+    int   len, n;
+
+    newfs_snap_destroy();
+    memset(&snap_stat, 0, sizeof(snap_stat));
+    if (newfs_hidden_read(super.snap_ino, &buf, &len) != NEWFS_ERROR_NONE) {
+        NEWFS_TRACE(NEWFS_TC_SUPER, NEWFS_TL_ERR, "cannot read snapshot table");
+        return -NEWFS_ERROR_IO;
+    }
+    tab = (struct newfs_snap_d *)buf;
+    n   = len / (int)sizeof(struct newfs_snap_d);
+    if (n > NEWFS_SNAP_MAX) {
+        n = NEWFS_SNAP_MAX;
+    }
+    snaps = (struct newfs_snap *)calloc(n ? n : 1, sizeof(struct newfs_snap));
+    for (int i = 0; i < n; i++) {
+        struct newfs_snap* s = &snaps[i];
+        void* map;
+        int   map_len;
+
+        s->d = tab[i];
+        s->d.name[NEWFS_SNAP_NAME_LEN - 1] = '\0';
+        if (newfs_hidden_read(s->d.map_ino, &map, &map_len) != NEWFS_ERROR_NONE) {
+            NEWFS_TRACE(NEWFS_TC_SUPER, NEWFS_TL_ERR, "cannot read map of snapshot %s", s->d.name);
+            free(buf);
+            snap_cnt = i;
+            newfs_snap_destroy();
+            return -NEWFS_ERROR_IO;
+        }
+        s->map = (struct newfs_snap_map_d *)map;
+        s->cnt = s->cap = map_len / (int)sizeof(struct newfs_snap_map_d);
+        if (s->d.id >= snap_next_id) {
+            snap_next_id = s->d.id + 1;
+        }
+        snap_cnt = i + 1;
+    }
+    free(buf);
+    return NEWFS_ERROR_NONE;
+}
+
+/**
+ * @brief 写回有修改的映射表与快照表，映射表所在的隐藏inode变化时重写快照表与超级块
+ *
+ * @return int 0成功，否则返回错误码
+ */
+int newfs_snap_sync(void) {
+    struct newfs_snap_d* tab;
+    int ret = NEWFS_ERROR_NONE;
+
+    if (snap_view >= 0) {
+        return NEWFS_ERROR_NONE;
+    }
+    for (int i = 0; i < snap_cnt; i++) {
+        struct newfs_snap* s = &snaps[i];
+        int old = s->d.map_ino;
+
+        if (!s->dirty) {
+            continue;
+        }
+        if (newfs_hidden_write(&s->d.map_ino, s->map, s->cnt * (int)sizeof(*s->map)) != NEWFS_ERROR_NONE) {
+            ret = -NEWFS_ERROR_IO;
+            continue;
+        }
+        s->dirty = false;
+        if (s->d.map_ino != old) {
+            snap_tab_dirty = true;
+        }
+    }
+    if (snap_tab_dirty) {
+        int old = super.snap_ino;
+
+        tab = (struct newfs_snap_d *)malloc(sizeof(*tab) * (snap_cnt ? snap_cnt : 1));
+        for (int i = 0; i < snap_cnt; i++) {
+            tab[i] = snaps[i].d;
+        }
+        if (newfs_hidden_write(&super.snap_ino, tab, snap_cnt * (int)sizeof(*tab)) != NEWFS_ERROR_NONE
+            || (super.snap_ino != old && newfs_sync_super(super.state) != NEWFS_ERROR_NONE)) {
+            ret = -NEWFS_ERROR_IO;
+        } else {
+            snap_tab_dirty = false;
+        }
+        free(tab);
+    }
+    if (ret != NEWFS_ERROR_NONE) {
+        NEWFS_TRACE(NEWFS_TC_SUPER, NEWFS_TL_ERR, "write snapshot table failed");
+    }
+    return ret;
+}
+
+/**
+ * @brief 以只读方式挂载名为name的快照，在读入根目录之前调用
+ *
+ * @return int 0成功，没有该快照时返回-NEWFS_ERROR_NOTFOUND
+ */
+int newfs_snap_mount(const char* name) {
+    int i = snap_find(name);
+
+    if (i < 0) {
+        return -NEWFS_ERROR_NOTFOUND;
+    }
+    snap_view = i;
+    return NEWFS_ERROR_NONE;
+}
+
+/**
+ * @brief 是否只读挂载了一个快照
+ */
+bool newfs_snap_readonly(void) {
+    return snap_view >= 0;
+}
+
+/**
+ * @brief 快照数
+ */
+int newfs_snap_count(void) {
+    return snap_cnt;
+}
+
+/**
+ * @brief inode ino在当前视图中所在的槽位
+ *
+ * @return int 槽位号；只读挂载的快照中该inode当时不存在时返回-1
+ */
+int newfs_snap_slot(int ino) {
+    if (snap_view < 0) {
+        return ino;
+    }
+    for (int i = snap_view; i < snap_cnt; i++) {
+        bool found;
+        int  k = snap_map_find(&snaps[i], ino, &found);
+
+        if (found) {
+            return snaps[i].map[k].slot == NEWFS_SNAP_ABSENT ? -1 : (int)snaps[i].map[k].slot;
+        }
+    }
+    return ino;
+}
+
+/**
+ * @brief 新建的inode不属于最新快照，记为NEWFS_SNAP_ABSENT，修改时不再保存
+ *
+ * 映射表没有空间时不记录，之后第一次修改会多保存一份，不影响正确性
+ */
+void newfs_snap_born(struct newfs_inode* inode) {
+    struct newfs_snap* s;
+    bool found;
+
+    inode->snap_gen = 0;
+    if (snap_cnt == 0) {
+        return;
+    }
+    s = &snaps[snap_cnt - 1];
+    snap_map_find(s, inode->ino, &found);
+    if (!found && snap_map_reserve(s, 1) == NEWFS_ERROR_NONE) {
+        snap_map_insert(s, inode->ino, NEWFS_SNAP_ABSENT);
+        inode->snap_gen = s->d.id;
+    }
+}
+
+/**
+ * @brief 释放保存的旧inode的属性块，保存失败或删除快照时调用
+ */
+static void snap_free_xattr(struct newfs_inode_d* d) {
+    if (!NEWFS_BLK_HOLE(d->xattr_blk)) {
+        newfs_free_blk(d->xattr_blk);
+        d->xattr_blk = (uint32_t)-1;
+    }
+}
+
+/**
+ * @brief 把磁盘上的普通文件或符号链接inode复制到新槽位，写入过的数据块由两者共享，属性块复制一份
+ *
+ * 预分配未写入的块在快照中按空洞处理；当前inode也写回带共享标记的版本，
+ * 随后立即写回引用计数表
+ *
+ * @param inode 当前inode，内存中的data[]同样加上共享标记
+ * @param slot 返回新槽位
+ * @return int 0成功，否则返回错误码
+ */
+static int snap_save_file(struct newfs_inode* inode, uint32_t* slot) {
+    struct newfs_inode_d live, copy;
+    int ino, n = 0, ret;
+
+    if (newfs_inode_d_read(inode->ino, &live) != NEWFS_ERROR_NONE) {
+        return -NEWFS_ERROR_IO;
+    }
+    if ((ino = newfs_alloc_ino()) < 0) {
+        return -NEWFS_ERROR_NOSPACE;
+    }
+    copy = live;
+    if ((ret = newfs_xattr_copy(&copy)) != NEWFS_ERROR_NONE) {
+        newfs_free_ino(ino);
+        return ret;
+    }
+    if (NEWFS_IS_INLINE_LINK(&live)) {          /* 短目标的符号链接没有数据块，直接复制 */
+        if (newfs_inode_d_write(ino, &copy) != NEWFS_ERROR_NONE) {
+            snap_free_xattr(&copy);
+            newfs_free_ino(ino);
+            return -NEWFS_ERROR_IO;
+        }
+        *slot = ino;
+        return NEWFS_ERROR_NONE;
+    }
+    for (int i = 0; i < NEWFS_DATA_PER_FILE; i++) {
+        if (!NEWFS_BLK_WRITTEN(live.data[i])) {
+            copy.data[i] = (uint32_t)-1;
+            continue;
+        }
+        if ((ret = newfs_share_get(NEWFS_BLKNO(live.data[i]))) != NEWFS_ERROR_NONE) {
+            while (i-- > 0) {
+                if (NEWFS_BLK_WRITTEN(live.data[i])) {
+                    newfs_share_put(NEWFS_BLKNO(live.data[i]));
+                }
+            }
+            snap_free_xattr(&copy);
+            newfs_free_ino(ino);
+            return ret;
+        }
+        live.data[i] |= NEWFS_BLK_SHARED;
+        copy.data[i] |= NEWFS_BLK_SHARED;
+        n++;
+    }
+
+    ret  = newfs_inode_d_write(ino, &copy);
+    ret |= newfs_inode_d_write(inode->ino, &live);
+    ret |= newfs_share_sync();
+    if (ret != NEWFS_ERROR_NONE) {
+        for (int i = 0; i < NEWFS_DATA_PER_FILE; i++) {
+            if (NEWFS_BLK_WRITTEN(live.data[i])) {
+                newfs_share_put(NEWFS_BLKNO(live.data[i]));
+            }
+        }
+        snap_free_xattr(&copy);
+        newfs_free_ino(ino);
+        return -NEWFS_ERROR_IO;
+    }
+
+    /* 内存中的块号与磁盘一致(脏数据已在上次写回或克隆时落盘)，按块号对应加标记 */
+    for (int i = 0; i < NEWFS_DATA_PER_FILE; i++) {
+        if (NEWFS_BLK_WRITTEN(live.data[i]) && !NEWFS_BLK_HOLE(inode->data[i])
+            && NEWFS_BLKNO(inode->data[i]) == NEWFS_BLKNO(live.data[i])) {
+            inode->data[i] |= NEWFS_BLK_SHARED;
+        }
+    }
+    snap_stat.shared_blks += n;
+    *slot = ino;
+    return NEWFS_ERROR_NONE;
+}
+
+/**
+ * @brief 把磁盘上的目录inode连同目录块、属性块复制一份
+ *
+ * @param ino 目录的inode号
+ * @param slot 返回新槽位
+ * @return int 0成功，否则返回错误码
+ */
+static int snap_save_dir(int ino, uint32_t* slot) {
+    struct newfs_inode_d d;
+    uint8_t* buf;
+    int copy, n = 0, ret = NEWFS_ERROR_NONE;
+
+    if (newfs_inode_d_read(ino, &d) != NEWFS_ERROR_NONE) {
+        return -NEWFS_ERROR_IO;
+    }
+    if ((copy = newfs_alloc_ino()) < 0) {
+        return -NEWFS_ERROR_NOSPACE;
+    }
+    if ((ret = newfs_xattr_copy(&d)) != NEWFS_ERROR_NONE) {
+        newfs_free_ino(copy);
+        return ret;
+    }
+    buf = newfs_buf_alloc();
+    for (int i = 0; i < NEWFS_DATA_PER_FILE && ret == NEWFS_ERROR_NONE; i++) {
+        int blkno;
+
+        if (NEWFS_BLK_HOLE(d.data[i])) {
+            continue;
+        }
+        if ((blkno = newfs_alloc_blk()) < 0) {
+            ret = -NEWFS_ERROR_NOSPACE;
+        } else if (your_read(NEWFS_DATA_OFS(d.data[i]), buf, NEWFS_IO_SZ()) != NEWFS_ERROR_NONE
+                   || your_write(NEWFS_DATA_OFS(blkno), buf, NEWFS_IO_SZ()) != NEWFS_ERROR_NONE) {
+            newfs_free_blk(blkno);
+            ret = -NEWFS_ERROR_IO;
+        } else {
+            d.data[i] = blkno;
+            n++;
+        }
+        if (ret != NEWFS_ERROR_NONE) {
+            while (i-- > 0) {
+                if (!NEWFS_BLK_HOLE(d.data[i])) {
+                    newfs_free_blk(d.data[i]);
+                }
+            }
+        }
+    }
+    newfs_buf_free(buf);
+    if (ret == NEWFS_ERROR_NONE && newfs_inode_d_write(copy, &d) != NEWFS_ERROR_NONE) {
+        for (int i = 0; i < NEWFS_DATA_PER_FILE; i++) {
+            if (!NEWFS_BLK_HOLE(d.data[i])) {
+                newfs_free_blk(d.data[i]);
+            }
+        }
+        ret = -NEWFS_ERROR_IO;
+    }
+    if (ret != NEWFS_ERROR_NONE) {
+        snap_free_xattr(&d);
+        newfs_free_ino(copy);
+        return ret;
+    }
+    snap_stat.dir_blks += n;
+    *slot = copy;
+    return NEWFS_ERROR_NONE;
+}
+
+/**
+ * @brief 修改inode之前调用：最新快照还没有保存它时，先把磁盘上的旧版本保存下来
+ *
+ * @param inode 即将修改的inode
+ * @return int 0成功；只读挂载快照时返回-NEWFS_ERROR_ROFS，保存失败返回错误码
+ */
+int newfs_snap_cow(struct newfs_inode* inode) {
+    struct newfs_snap* s;
+    uint64_t start;
+    uint32_t slot;
+    bool     found;
+    int      ret;
+
+    if (snap_view >= 0) {
+        return -NEWFS_ERROR_ROFS;
+    }
+    if (snap_cnt == 0) {
+        return NEWFS_ERROR_NONE;
+    }
+    s = &snaps[snap_cnt - 1];
+    if (inode->snap_gen == s->d.id) {
+        return NEWFS_ERROR_NONE;
+    }
+    snap_map_find(s, inode->ino, &found);
+    if (!found) {
+        if ((ret = snap_map_reserve(s, 1)) != NEWFS_ERROR_NONE) {
+            return ret;
+        }
+        start = newfs_stat_now();
+        ret   = NEWFS_IS_DIR(inode) ? snap_save_dir(inode->ino, &slot) : snap_save_file(inode, &slot);
+        if (ret != NEWFS_ERROR_NONE) {
+            NEWFS_TRACE(NEWFS_TC_SUPER, NEWFS_TL_ERR, "preserve inode %d for snapshot %s failed: %d",
+                        inode->ino, s->d.name, ret);
+            return ret;
+        }
+        snap_map_insert(s, inode->ino, slot);
+        snap_stat.inodes++;
+        snap_stat.cow_ns += newfs_stat_now() - start;
+    }
+    inode->snap_gen = s->d.id;
+    return NEWFS_ERROR_NONE;
+}
+
+/**
+ * @brief 创建名为name的快照
+ *
+ * 先把脏inode与数据刷到磁盘，之后只在快照表末尾追加一项，旧版本在修改时才保存。
+ * 刷盘在调用者持有的全局锁内进行，会阻塞前台IO，见文件开头的限制
+ *
+ * @return int 0成功，否则返回错误码
+ */
+int newfs_snap_create(const char* name) {
+    struct newfs_snap* tab;
+    struct newfs_snap* s;
+    uint64_t start = newfs_stat_now();
+    int ret;
+
+    if (snap_view >= 0) {
+        return -NEWFS_ERROR_ROFS;
+    }
+    if (name[0] == '\0' || strlen(name) >= NEWFS_SNAP_NAME_LEN) {
+        return -NEWFS_ERROR_INVAL;
+    }
+    if (snap_find(name) >= 0) {
+        return -NEWFS_ERROR_EXISTS;
+    }
+    if (snap_cnt >= NEWFS_SNAP_MAX) {
+        return -NEWFS_ERROR_NOSPACE;
+    }
+    if ((ret = newfs_flush_dirty()) != NEWFS_ERROR_NONE) {
+        return ret;
+    }
+    if ((tab = (struct newfs_snap *)realloc(snaps, sizeof(*tab) * (snap_cnt + 1))) == NULL) {
+        return -NEWFS_ERROR_NOSPACE;
+    }
+    snaps = tab;
+    s     = &snaps[snap_cnt++];
+    memset(s, 0, sizeof(*s));
+    strncpy(s->d.name, name, NEWFS_SNAP_NAME_LEN - 1);
+    s->d.id    = snap_next_id++;
+    s->d.ctime = (int64_t)time(NULL);
+
+    super.features |= NEWFS_FEAT_SNAP;
+    snap_tab_dirty  = true;
+    if (newfs_snap_sync() != NEWFS_ERROR_NONE || newfs_sync_super(super.state) != NEWFS_ERROR_NONE) {
+        snap_cnt--;
+        snap_tab_dirty = true;
+        return -NEWFS_ERROR_IO;
+    }
+    snap_stat.creates++;
+    snap_stat.create_ns += newfs_stat_now() - start;
+    return NEWFS_ERROR_NONE;
+}
+
+/**
+ * @brief 释放快照保存的一个旧inode：文件与符号链接的数据块减一个引用，目录块与属性块直接释放
+ */
+static void snap_drop_slot(uint32_t slot) {
+    struct newfs_inode_d d;
+
+    if (slot == NEWFS_SNAP_ABSENT) {
+        return;
+    }
+    if (newfs_inode_d_read(slot, &d) != NEWFS_ERROR_NONE) {
+        NEWFS_TRACE(NEWFS_TC_SUPER, NEWFS_TL_WARN, "snapshot inode %u unreadable, blocks leaked", slot);
+        newfs_free_ino(slot);
+        return;
+    }
+    if (!NEWFS_IS_INLINE_LINK(&d)) {
+        for (int i = 0; i < NEWFS_DATA_PER_FILE; i++) {
+            uint32_t b = d.data[i];
+
+            if (NEWFS_BLK_HOLE(b)) {
+                continue;
+            }
+            if (d.ftype == NEWFS_DIR || !NEWFS_BLK_IS_SHARED(b) || newfs_share_put(NEWFS_BLKNO(b))) {
+                newfs_free_blk(NEWFS_BLKNO(b));
+                snap_stat.freed_blks++;
+            }
+        }
+    }
+    if (!NEWFS_BLK_HOLE(d.xattr_blk)) {
+        snap_stat.freed_blks++;
+    }
+    snap_free_xattr(&d);
+    newfs_free_ino(slot);
+}
+
+/**
+ * @brief 删除名为name的快照
+ *
+ * 它保存的旧inode若更早的快照也需要(更早的快照没有记录该inode)，转交给更早的快照，否则释放
+ *
+ * @return int 0成功，否则返回错误码
+ */
+int newfs_snap_delete(const char* name) {
+    struct newfs_snap* s;
+    struct newfs_snap* prev;
+    int j = snap_find(name), ret;
+
+    if (snap_view >= 0) {
+        return -NEWFS_ERROR_ROFS;
+    }
+    if (j < 0) {
+        return -NEWFS_ERROR_NOTFOUND;
+    }
+    s    = &snaps[j];
+    prev = j > 0 ? &snaps[j - 1] : NULL;
+    if (prev && (ret = snap_map_reserve(prev, s->cnt)) != NEWFS_ERROR_NONE) {
+        return ret;
+    }
+    for (int k = 0; k < s->cnt; k++) {
+        bool found = false;
+
+        if (prev) {
+            snap_map_find(prev, s->map[k].ino, &found);
+            if (!found) {
+                snap_map_insert(prev, s->map[k].ino, s->map[k].slot);
+                continue;
+            }
+        }
+        snap_drop_slot(s->map[k].slot);
+    }
+    newfs_hidden_write(&s->d.map_ino, NULL, 0);
+    free(s->map);
+    memmove(s, s + 1, sizeof(*s) * (snap_cnt - j - 1));
+    snap_cnt--;
+    snap_tab_dirty = true;
+
+    /* 先让快照从表中消失，再写回减少后的引用计数，崩溃时计数只会偏大 */
+    ret  = newfs_snap_sync();
+    ret |= newfs_share_sync();
+    snap_stat.deletes++;
+    return ret ? -NEWFS_ERROR_IO : NEWFS_ERROR_NONE;
+}
@@ -0,0 +1,228 @@
+#include "newfs.h"
+#include <time.h>
+
+extern struct custom_options    newfs_options;
+extern struct newfs_super       super;
+extern struct newfs_slab        newfs_dentry_slab;
+extern struct newfs_slab        newfs_inode_slab;
+extern struct newfs_slab        newfs_buf_slab;
+extern struct newfs_icache_stat icache_stat;
+extern struct newfs_reclaim_stat reclaim_stat;
+extern struct newfs_comp_stat    comp_stat;
+extern struct newfs_dedup_stat   dedup_stat;
+extern struct newfs_csum_stat    csum_stat;
+extern struct newfs_snap_stat    snap_stat;
+extern struct newfs_prefetch_stat prefetch_stat;
+extern struct newfs_xattr_stat    xattr_stat;
+
+/******************************************************************************
+* SECTION: 操作统计
+* 每种操作一组计数与按log2(ns)分桶的延迟直方图，全部用原子加更新，不加锁。
+* 通过只读虚拟文件/.newfs_stats导出，运行中即可读取。
+*******************************************************************************/
+struct newfs_op_stat newfs_op_stats[NEWFS_OP_NR];
+
+static const char* op_names[NEWFS_OP_NR] = {
+    [NEWFS_OP_GETATTR] = "getattr",
+    [NEWFS_OP_READDIR] = "readdir",
+    [NEWFS_OP_LOOKUP]  = "lookup",
+    [NEWFS_OP_READ]    = "read",
+    [NEWFS_OP_WRITE]   = "write",
+    [NEWFS_OP_MKNOD]   = "mknod",
+    [NEWFS_OP_MKDIR]   = "mkdir",
+    [NEWFS_OP_SYNC]    = "sync",
+    [NEWFS_OP_UNLINK]  = "unlink",
+    [NEWFS_OP_RMDIR]   = "rmdir",
+    [NEWFS_OP_RENAME]  = "rename",
+    [NEWFS_OP_TRUNCATE] = "truncate",
+    [NEWFS_OP_FALLOCATE] = "fallocate",
+    [NEWFS_OP_IOCTL]   = "ioctl",
+    [NEWFS_OP_CLONE]   = "clone",
+    [NEWFS_OP_SNAP]    = "snap",
+    [NEWFS_OP_LINK]    = "link",
+    [NEWFS_OP_SYMLINK] = "symlink",
+    [NEWFS_OP_READLINK] = "readlink",
+    [NEWFS_OP_SETXATTR] = "setxattr",
+    [NEWFS_OP_GETXATTR] = "getxattr",
+    [NEWFS_OP_LISTXATTR] = "listxattr",
+    [NEWFS_OP_REMOVEXATTR] = "removexattr",
+};
+
+/**
+ * @brief 取单调时钟(ns)，作为newfs_stat_end的起点
+ */
+uint64_t newfs_stat_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/**
+ * @brief 记录一次操作
+ *
+ * @param op NEWFS_OP_*
+ * @param start newfs_stat_now()取得的起点
+ * @param ret 操作返回值，负数计为错误，读写的正数计为字节数
+ * @return int 原样返回ret，便于直接写在return语句中
+ */
+int newfs_stat_end(int op, uint64_t start, int ret) {
+    struct newfs_op_stat* st = &newfs_op_stats[op];
+    uint64_t ns = newfs_stat_now() - start;
+    int bucket  = ns ? 64 - __builtin_clzll(ns) : 0;    /* ns落在[2^(b-1), 2^b) */
+
+    if (bucket >= NEWFS_STAT_BUCKETS) {
+        bucket = NEWFS_STAT_BUCKETS - 1;
+    }
+    __atomic_add_fetch(&st->count, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&st->total_ns, ns, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&st->hist[bucket], 1, __ATOMIC_RELAXED);
+    if (ret < 0) {
+        __atomic_add_fetch(&st->errors, 1, __ATOMIC_RELAXED);
+    } else if (op == NEWFS_OP_READ || op == NEWFS_OP_WRITE) {
+        __atomic_add_fetch(&st->bytes, ret, __ATOMIC_RELAXED);
+    }
+    return ret;
+}
+
+/**
+ * @brief 由直方图估计分位数，返回所在桶的上界(us)
+ */
+static double stat_percentile(uint64_t* hist, uint64_t count, double p) {
+    uint64_t target = (uint64_t)(count * p), seen = 0;
+
+    for (int b = 0; b < NEWFS_STAT_BUCKETS; b++) {
+        seen += hist[b];
+        if (seen > target) {
+            return (double)(1ull << b) / 1000;
+        }
+    }
+    return 0;
+}
+
+static void stat_print_slab(FILE* fp, struct newfs_slab* slab) {
+    fprintf(fp, "%-8s objsz=%-6zu allocs=%-8ld frees=%-8ld in_use=%-6ld chunks=%-4ld bytes=%ld\n",
+            slab->name ? slab->name : "-", slab->obj_size, slab->stat.allocs, slab->stat.frees,
+            slab->stat.in_use, slab->stat.chunks, slab->stat.bytes);
+}
+
+/**
+ * @brief 输出全部统计：操作计数与延迟、延迟直方图、设备计数、缓存与分配器
+ *
+ * @param fp
+ */
+void newfs_stats_print(FILE* fp) {
+    struct ddriver_state dev;
+    long lookups = icache_stat.hits + icache_stat.misses;
+
+    fprintf(fp, "[ops]\n");
+    fprintf(fp, "%-11s %7s %8s %12s %10s %10s %10s\n",
+            "#op", "count", "errors", "bytes", "avg_us", "p50_us", "p99_us");
+    for (int op = 0; op < NEWFS_OP_NR; op++) {
+        struct newfs_op_stat* st = &newfs_op_stats[op];
+        uint64_t hist[NEWFS_STAT_BUCKETS];
+        uint64_t count = __atomic_load_n(&st->count, __ATOMIC_RELAXED);
+
+        for (int b = 0; b < NEWFS_STAT_BUCKETS; b++) {
+            hist[b] = __atomic_load_n(&st->hist[b], __ATOMIC_RELAXED);
+        }
+        fprintf(fp, "%-11s %7lu %8lu %12lu %10.2f %10.2f %10.2f\n", op_names[op],
+                (unsigned long)count, (unsigned long)st->errors, (unsigned long)st->bytes,
+                count ? (double)st->total_ns / count / 1000 : 0,
+                stat_percentile(hist, count, 0.50), stat_percentile(hist, count, 0.99));
+    }
+
+    fprintf(fp, "[latency_hist]\n# <op> <upper bound ns>:<count> ...\n");
+    for (int op = 0; op < NEWFS_OP_NR; op++) {
+        fprintf(fp, "%s", op_names[op]);
+        for (int b = 0; b < NEWFS_STAT_BUCKETS; b++) {
+            uint64_t n = __atomic_load_n(&newfs_op_stats[op].hist[b], __ATOMIC_RELAXED);
+            if (n) {
+                fprintf(fp, " %llu:%lu", 1ull << b, (unsigned long)n);
+            }
+        }
+        fprintf(fp, "\n");
+    }
+
+    memset(&dev, 0, sizeof(dev));
+    if (super.bdev) {
+        newfs_bdev_ioctl(super.bdev, IOC_REQ_DEVICE_STATE, &dev);
+    }
+    fprintf(fp, "[device]\nread_cnt %d\nwrite_cnt %d\nseek_cnt %d\n",
+            dev.read_cnt, dev.write_cnt, dev.seek_cnt);
+
+    fprintf(fp, "[icache]\ninodes %ld\nhits %ld\nmisses %ld\nhit_rate %.4f\nevictions %ld\nmem_used %ld\n",
+            icache_stat.nr_inodes, icache_stat.hits, icache_stat.misses,
+            lookups ? (double)icache_stat.hits / lookups : 0,
+            icache_stat.evictions, icache_stat.mem_used);
+
+    fprintf(fp, "[reclaim]\nqueued %ld\ninodes %ld\nblks %ld\nruns %ld\nbatches %ld\n",
+            reclaim_stat.queued, reclaim_stat.inodes, reclaim_stat.blks,
+            reclaim_stat.runs, reclaim_stat.batches);
+
+    fprintf(fp, "[share]\nshared_blks %d\n", newfs_share_count());
+
+    fprintf(fp, "[compress]\nclusters %ld\nfallbacks %ld\nraw_bytes %lu\nstored_bytes %lu\nratio %.3f\n"
+                "comp_us %.1f\nloads %ld\ndecomp_us %.1f\nexpands %ld\n",
+            comp_stat.clusters, comp_stat.fallbacks, (unsigned long)comp_stat.raw_bytes,
+            (unsigned long)comp_stat.stored_bytes,
+            comp_stat.stored_bytes ? (double)comp_stat.raw_bytes / comp_stat.stored_bytes : 0,
+            comp_stat.comp_ns / 1000.0, comp_stat.loads, comp_stat.decomp_ns / 1000.0, comp_stat.expands);
+
+    fprintf(fp, "[dedup]\nentries %d\nhits %ld\ninserts %ld\nmismatches %ld\nevictions %ld\nsaved_bytes %lu\n"
+                "ratio %.3f\nhash_us %.1f\nverify_us %.1f\nindex_mem %ld\n",
+            newfs_dedup_count(), dedup_stat.hits, dedup_stat.inserts, dedup_stat.mismatches,
+            dedup_stat.evictions, (unsigned long)dedup_stat.hits * NEWFS_IO_SZ(),
+            dedup_stat.inserts ? (double)(dedup_stat.hits + dedup_stat.inserts) / dedup_stat.inserts : 0,
+            dedup_stat.hash_ns / 1000.0, dedup_stat.verify_ns / 1000.0, newfs_dedup_mem());
+
+    fprintf(fp, "[csum]\nmetadata %s\nimpl %s\nmeta_verified %ld\nmeta_failed %ld\ndata_blocks %d\n"
+                "data_verified %ld\ndata_failed %ld\ndata_updated %ld\nbytes %lu\ncrc_us %.1f\n",
+            NEWFS_CSUM_ON() ? "on" : "off", newfs_crc32c_impl(), csum_stat.meta_verifies, csum_stat.meta_failures,
+            newfs_csum_count(), csum_stat.data_verifies, csum_stat.data_failures, csum_stat.data_updates,
+            (unsigned long)csum_stat.bytes, csum_stat.ns / 1000.0);
+
+    fprintf(fp, "[snap]\nsnapshots %d\nview %s\ncreates %ld\ndeletes %ld\npreserved_inodes %ld\n"
+                "shared_blks %ld\ndir_blks %ld\nfreed_blks %ld\ncreate_us %.1f\ncow_us %.1f\n",
+            newfs_snap_count(), newfs_snap_readonly() ? newfs_options.snapshot : "-", snap_stat.creates,
+            snap_stat.deletes, snap_stat.inodes, snap_stat.shared_blks, snap_stat.dir_blks, snap_stat.freed_blks,
+            snap_stat.create_ns / 1000.0, snap_stat.cow_ns / 1000.0);
+
+    fprintf(fp, "[prefetch]\nbudget %ld\njobs %ld\nepochs %ld\nfiles %ld\nblks %ld\nhits %ld\nahead %ld\n",
+            prefetch_stat.budget, prefetch_stat.jobs, prefetch_stat.epochs, prefetch_stat.files,
+            prefetch_stat.blks, prefetch_stat.hits, prefetch_stat.ahead);
+
+    fprintf(fp, "[xattr]\ngets %ld\ninline_hits %ld\nblk_reads %ld\nblk_writes %ld\nspills %ld\n",
+            xattr_stat.gets, xattr_stat.inline_hits, xattr_stat.blk_reads, xattr_stat.blk_writes,
+            xattr_stat.spills);
+
+    fprintf(fp, "[slab]\n");
+    stat_print_slab(fp, &newfs_dentry_slab);
+    stat_print_slab(fp, &newfs_inode_slab);
+    stat_print_slab(fp, &newfs_buf_slab);
+}
+
+/**
+ * @brief 生成一份统计文本快照，/.newfs_stats打开时调用
+ *
+ * @param len 返回文本长度
+ * @return char* 需由调用者free
+ */
+char* newfs_stats_snapshot(size_t* len) {
+    char* buf = NULL;
+    FILE* fp  = open_memstream(&buf, len);
+
+    if (fp == NULL) {
+        *len = 0;
+        return NULL;
+    }
+    newfs_stats_print(fp);
+    fclose(fp);
+    return buf;
+}
+
+/**
+ * @brief 路径是否是统计虚拟文件
+ */
+bool newfs_is_stats_path(const char* path) {
+    return strcmp(path, NEWFS_STATS_PATH) == 0;
+}
@@ -0,0 +1,203 @@
+#include "newfs.h"
+#include <signal.h>
+#include <stdarg.h>
+#include <time.h>
+
+extern struct custom_options newfs_options;
+
+/******************************************************************************
+* SECTION: 调试跟踪
+* 记录写入定长记录的环形缓冲区，满后覆盖最旧的记录；占位用原子加，不加锁。
+* 级别不高于newfs_trace_echo的记录同时打印到stderr。
+* 每个调用点按秒限速，超出的条数在下一秒第一条记录前补一条汇总。
+* 环形缓冲区可随时用newfs_trace_dump导出，运行中发送SIGUSR2也会导出到stderr。
+* Release构建(NDEBUG)下NEWFS_TRACE整体编译为空。
+*******************************************************************************/
+int      newfs_trace_level = NEWFS_TL_INFO;
+int      newfs_trace_echo  = NEWFS_TL_WARN;
+unsigned newfs_trace_mask  = NEWFS_TC_ALL;
+
+static struct newfs_trace_rec trace_ring[NEWFS_TRACE_ENTRIES];
+static uint64_t               trace_head;           /* 下一条记录的序号 */
+
+static const char* level_names[] = {
+    [NEWFS_TL_OFF]   = "-",
+    [NEWFS_TL_ERR]   = "E",
+    [NEWFS_TL_WARN]  = "W",
+    [NEWFS_TL_INFO]  = "I",
+    [NEWFS_TL_DEBUG] = "D",
+};
+
+static const char* cat_names[] = {
+    "super", "inode", "dentry", "data", "bdev", "cache", "fuse",
+};
+
+static const char* trace_cat_name(unsigned cat) {
+    for (int i = 0; i < (int)(sizeof(cat_names) / sizeof(cat_names[0])); i++) {
+        if (cat & (1u << i)) {
+            return cat_names[i];
+        }
+    }
+    return "-";
+}
+
+static uint64_t trace_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/**
+ * @brief 写入一条跟踪记录，由NEWFS_TRACE在级别与分类过滤之后调用
+ *
+ * @param cat NEWFS_TC_*
+ * @param level NEWFS_TL_*
+ * @param func 调用函数名
+ * @param fmt printf格式，结尾无需换行
+ */
+void newfs_trace_emit(unsigned cat, int level, const char* func, const char* fmt, ...) {
+    uint64_t seq = __atomic_fetch_add(&trace_head, 1, __ATOMIC_RELAXED);
+    struct newfs_trace_rec* rec = &trace_ring[seq & (NEWFS_TRACE_ENTRIES - 1)];
+    va_list ap;
+    int len;
+
+    __atomic_store_n(&rec->seq, 0, __ATOMIC_RELAXED);     /* 写入期间导出时跳过 */
+    rec->ts    = trace_now();
+    rec->func  = func;
+    rec->cat   = cat;
+    rec->level = level;
+    va_start(ap, fmt);
+    len = vsnprintf(rec->msg, NEWFS_TRACE_MSG_SZ, fmt, ap);
+    va_end(ap);
+    if (len >= NEWFS_TRACE_MSG_SZ) {
+        len = NEWFS_TRACE_MSG_SZ - 1;
+    }
+    while (len > 0 && rec->msg[len - 1] == '\n') {
+        rec->msg[--len] = '\0';
+    }
+    rec->len = len;
+    __atomic_store_n(&rec->seq, seq + 1, __ATOMIC_RELEASE);
+
+    if (level <= newfs_trace_echo) {
+        fprintf(stderr, "NEWFS_%s [%s] %s: %s\n", level_names[level],
+                trace_cat_name(cat), func, rec->msg);
+    }
+}
+
+/**
+ * @brief 调用点限速，每秒最多NEWFS_TRACE_BURST条。
+ * 多线程下计数是近似的，只用于防止刷屏。
+ *
+ * @return bool 本条是否应记录
+ */
+bool newfs_ratelimit(struct newfs_ratelimit* rl, unsigned cat, int level, const char* func) {
+    uint64_t now = trace_now() / 1000000000ull;
+    uint32_t missed;
+
+    if (__atomic_load_n(&rl->window, __ATOMIC_RELAXED) != now) {
+        __atomic_store_n(&rl->window, now, __ATOMIC_RELAXED);
+        __atomic_store_n(&rl->count, 0, __ATOMIC_RELAXED);
+        missed = __atomic_exchange_n(&rl->missed, 0, __ATOMIC_RELAXED);
+        if (missed) {
+            newfs_trace_emit(cat, level, func, "%u messages suppressed", missed);
+        }
+    }
+    if (__atomic_add_fetch(&rl->count, 1, __ATOMIC_RELAXED) > NEWFS_TRACE_BURST) {
+        __atomic_add_fetch(&rl->missed, 1, __ATOMIC_RELAXED);
+        return false;
+    }
+    return true;
+}
+
+/* 以下导出路径只用write(2)与手写格式化，可在信号处理函数中调用 */
+static size_t put_str(char* buf, size_t pos, size_t cap, const char* s) {
+    while (*s && pos < cap) {
+        buf[pos++] = *s++;
+    }
+    return pos;
+}
+
+static size_t put_u64(char* buf, size_t pos, size_t cap, uint64_t v, int width) {
+    char tmp[20];
+    int  n = 0;
+
+    do {
+        tmp[n++] = '0' + v % 10;
+        v /= 10;
+    } while (v);
+    while (n < width) {
+        tmp[n++] = '0';
+    }
+    while (n > 0 && pos < cap) {
+        buf[pos++] = tmp[--n];
+    }
+    return pos;
+}
+
+/**
+ * @brief 按时间顺序导出环形缓冲区中的全部记录，格式为
+ * "[秒.微秒] 级别 分类 函数: 消息"，异步信号安全
+ *
+ * @param fd 输出文件描述符
+ */
+void newfs_trace_dump(int fd) {
+    uint64_t head  = __atomic_load_n(&trace_head, __ATOMIC_ACQUIRE);
+    uint64_t first = head > NEWFS_TRACE_ENTRIES ? head - NEWFS_TRACE_ENTRIES : 0;
+    char line[NEWFS_TRACE_MSG_SZ + 128];
+
+    for (uint64_t seq = first; seq < head; seq++) {
+        struct newfs_trace_rec* rec = &trace_ring[seq & (NEWFS_TRACE_ENTRIES - 1)];
+        size_t pos = 0, cap = sizeof(line) - 1;
+
+        if (__atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE) != seq + 1) {
+            continue;                               /* 正在写或已被覆盖 */
+        }
+        pos = put_str(line, pos, cap, "[");
+        pos = put_u64(line, pos, cap, rec->ts / 1000000000ull, 1);
+        pos = put_str(line, pos, cap, ".");
+        pos = put_u64(line, pos, cap, rec->ts % 1000000000ull / 1000, 6);
+        pos = put_str(line, pos, cap, "] ");
+        pos = put_str(line, pos, cap, level_names[rec->level]);
+        pos = put_str(line, pos, cap, " ");
+        pos = put_str(line, pos, cap, trace_cat_name(rec->cat));
+        pos = put_str(line, pos, cap, " ");
+        pos = put_str(line, pos, cap, rec->func);
+        pos = put_str(line, pos, cap, ": ");
+        if (pos + rec->len < cap) {
+            memcpy(line + pos, rec->msg, rec->len);
+            pos += rec->len;
+        }
+        line[pos++] = '\n';
+        if (write(fd, line, pos) < 0) {
+            return;
+        }
+    }
+}
+
+static void trace_sig_handler(int sig) {
+    (void)sig;
+    newfs_trace_dump(STDERR_FILENO);
+}
+
+/**
+ * @brief 挂载时调用：按选项设置级别与分类，注册SIGUSR2导出
+ */
+void newfs_trace_init(void) {
+    struct sigaction sa;
+
+    if (newfs_options.debug) {
+        newfs_trace_level = NEWFS_TL_DEBUG;
+        newfs_trace_echo  = NEWFS_TL_DEBUG;
+    }
+    if (newfs_options.trace > 0) {
+        newfs_trace_level = newfs_options.trace < NEWFS_TL_DEBUG ? newfs_options.trace : NEWFS_TL_DEBUG;
+    }
+    if (newfs_options.trace_mask != 0) {
+        newfs_trace_mask = newfs_options.trace_mask;
+    }
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = trace_sig_handler;
+    sa.sa_flags   = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGUSR2, &sa, NULL);
+}
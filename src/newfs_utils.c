@@ -3,25 +3,36 @@
 
 extern struct custom_options newfs_options;
 extern struct newfs_super    super;
+extern struct newfs_slab     newfs_dentry_slab;
+extern struct newfs_slab     newfs_inode_slab;
 
 /**
- * @brief 封装对ddriver的访问代码
+ * @brief 封装对块设备的访问代码
  * @param offset 磁盘偏移
  * @param out_content 读出/写入的内容
  * @param size 读出/写入大小
  * @return int 0成功，否则返回错误码
  */
 int your_read(int offset, void *out_content, int size) {
+	struct newfs_bdev* bdev = NEWFS_DRIVER();
+	int   io_sz = bdev->io_sz;
+	void* map   = newfs_bdev_map(bdev, offset, size);
+	// 后端支持映射时直接拷贝，不需要按IO单位对齐
+	if (map != NULL) {
+		memcpy(out_content, map, size);
+		return 0;
+	}
+	// 已对齐时直接读入调用者缓冲
+	if (offset % io_sz == 0 && size % io_sz == 0) {
+		return newfs_bdev_read(bdev, offset, out_content, size);
+	}
 	// 确定要读取的上界和下界
-    int io_sz = NEWFS_IO_SZ() / 2; //512B
 	long up = (offset + size + io_sz - 1) / io_sz * io_sz;	//向上取整
 	long down = offset / io_sz * io_sz;					//向下取整
 	// 读出从down到up的磁盘块到内存
-	ddriver_seek(super.fd, down, SEEK_SET);
 	char temp[up - down];
-	int blk_num = (up - down) / io_sz;
-	for (int i = 0; i < blk_num; i++) {
-		ddriver_read(super.fd, temp + i * io_sz, io_sz);
+	if (newfs_bdev_read(bdev, down, temp, up - down) != NEWFS_ERROR_NONE) {
+		return -NEWFS_ERROR_IO;
 	}
 	// 从内存拷贝到out_content
 	memcpy(out_content, temp + (offset - down), size);
@@ -29,27 +40,444 @@ int your_read(int offset, void *out_content, int size) {
 }
 
 int your_write(int offset, void *out_content, int size) {
+	struct newfs_bdev* bdev = NEWFS_DRIVER();
+	int io_sz = bdev->io_sz;
+	// 已对齐时整块覆盖，不需要先读
+	if (offset % io_sz == 0 && size % io_sz == 0) {
+		return newfs_bdev_write(bdev, offset, out_content, size);
+	}
 	// 确定要写的上界和下界
-    int io_sz = NEWFS_IO_SZ() / 2;
 	long up = (offset + size + io_sz - 1) / io_sz * io_sz;	//向上取整
 	long down = offset / io_sz * io_sz;					//向下取整
 	// 读出从down到up的磁盘块到内存
-	ddriver_seek(super.fd, down, SEEK_SET);
 	char temp[up - down];
-	int blk_num = (up - down) / io_sz;
-	for (int i = 0; i < blk_num; i++) {
-		ddriver_read(super.fd, temp + i * io_sz, io_sz);
+	if (newfs_bdev_read(bdev, down, temp, up - down) != NEWFS_ERROR_NONE) {
+		return -NEWFS_ERROR_IO;
 	}
 	// 修改阶段，在内存覆盖指定内容
 	memcpy(temp + (offset - down), out_content, size);
 	// 写回磁盘
-	ddriver_seek(super.fd, down, SEEK_SET);
-	for (int i = 0; i < blk_num; i++) {
-		ddriver_write(super.fd, temp + i * io_sz, io_sz);
-	}
-	return 0;
+	return newfs_bdev_write(bdev, down, temp, up - down);
 } 
 
+/**
+ * @brief 将内存超级块写回磁盘
+ * 
+ * @param state 写入的挂载状态，NEWFS_STATE_CLEAN或NEWFS_STATE_DIRTY
+ * @return int 0成功，否则返回错误码
+ */
+int newfs_sync_super(uint32_t state) {
+    struct newfs_super_d newfs_super_d;
+
+    super.state = state;
+    memset(&newfs_super_d, 0, sizeof(newfs_super_d));
+    newfs_super_d.magic          = NEWFS_MAGIC;
+    newfs_super_d.blks_size      = super.blks_size;
+    newfs_super_d.sb_offset      = super.sb_offset;
+    newfs_super_d.sb_blks        = super.sb_blks;
+    newfs_super_d.ino_map_offset = super.ino_map_offset;
+    newfs_super_d.ino_map_blks   = super.ino_map_blks;
+    newfs_super_d.dat_map_offset = super.dat_map_offset;
+    newfs_super_d.dat_map_blks   = super.dat_map_blks;
+    newfs_super_d.inode_offset   = super.inode_offset;
+    newfs_super_d.inode_blks     = super.inode_blks;
+    newfs_super_d.data_offset    = super.data_offset;
+    newfs_super_d.data_blks      = super.data_blks;
+    newfs_super_d.ino_max        = super.ino_max;
+    newfs_super_d.file_max       = super.file_max;
+    newfs_super_d.free_ino_cnt   = super.free_ino_cnt;
+    newfs_super_d.free_blk_cnt   = super.free_blk_cnt;
+    newfs_super_d.ino_hint       = super.ino_hint;
+    newfs_super_d.blk_hint       = super.blk_hint;
+    newfs_super_d.state          = super.state;
+    newfs_super_d.root_ino       = super.root_ino;
+    newfs_super_d.rename_ino     = super.rename_ino;
+    newfs_super_d.rename_src     = super.rename_src;
+    newfs_super_d.rename_dst     = super.rename_dst;
+    newfs_super_d.share_ino      = super.share_ino;
+    newfs_super_d.dedup_ino      = super.dedup_ino;
+    newfs_super_d.csum_ino       = super.csum_ino;
+    newfs_super_d.snap_ino       = super.snap_ino;
+    newfs_super_d.features       = super.features;
+    newfs_super_d.ino_map_csum   = super.ino_map_csum;
+    newfs_super_d.dat_map_csum   = super.dat_map_csum;
+    if (NEWFS_CSUM_ON()) {
+        newfs_csum_super_seal(&newfs_super_d);
+    }
+    return your_write(super.sb_offset, &newfs_super_d, sizeof(struct newfs_super_d));
+}
+
+/**
+ * @brief 从提示位置开始在位图中查找空闲位并占用，到末尾后回绕
+ * 
+ * @param bitmap 位图
+ * @param nbits 位图有效位数
+ * @param hint 起始查找位置，成功后更新为下一个位置
+ * @return int 占用的位号，无空闲位返回-1
+ */
+static int newfs_bitmap_alloc(uint8_t* bitmap, int nbits, int* hint) {
+    int start = (*hint >= 0 && *hint < nbits) ? *hint : 0;
+    int pos   = start;
+
+    for (int scanned = 0; scanned < nbits; scanned++, pos++) {
+        if (pos >= nbits) {
+            pos = 0;                                    /* 回绕 */
+        }
+        if (pos % UINT8_BITS == 0 && bitmap[pos / UINT8_BITS] == 0xFF
+            && scanned + UINT8_BITS <= nbits) {
+            pos += UINT8_BITS - 1;                      /* 整字节已满，跳过 */
+            scanned += UINT8_BITS - 1;
+            continue;
+        }
+        if ((bitmap[pos / UINT8_BITS] & (0x1 << (pos % UINT8_BITS))) == 0) {
+            bitmap[pos / UINT8_BITS] |= (0x1 << (pos % UINT8_BITS));
+            *hint = pos + 1;
+            return pos;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief 扩大位图中尚未写回的位范围
+ *
+ * @param lo 范围下界，*lo >= *hi表示原来为空
+ * @param hi 范围上界(不含)
+ * @param first 被修改的第一位
+ * @param last 被修改的最后一位
+ */
+static void newfs_map_touch(int* lo, int* hi, int first, int last) {
+    if (*lo >= *hi) {
+        *lo = first;
+        *hi = last + 1;
+        return;
+    }
+    if (first < *lo) {
+        *lo = first;
+    }
+    if (last + 1 > *hi) {
+        *hi = last + 1;
+    }
+}
+
+/**
+ * @brief 写回一个位图中覆盖[lo, hi)位的逻辑块
+ *
+ * @param offset 位图在磁盘上的偏移
+ * @param bitmap 内存中的位图
+ * @param lo 第一位
+ * @param hi 最后一位之后
+ * @return int 0成功，否则返回错误码
+ */
+static int newfs_sync_map_range(int offset, uint8_t* bitmap, int lo, int hi) {
+    int down = lo / UINT8_BITS / NEWFS_IO_SZ() * NEWFS_IO_SZ();
+    int up   = ((hi - 1) / UINT8_BITS / NEWFS_IO_SZ() + 1) * NEWFS_IO_SZ();
+
+    return your_write(offset + down, bitmap + down, up - down);
+}
+
+/**
+ * @brief 写回两个位图中被修改过的块，并重新计算位图校验和。
+ * 计数与校验和在超级块中，调用者随后写超级块。写失败时保留脏范围，下次重试
+ *
+ * @return int 0成功，否则返回错误码
+ */
+int newfs_sync_maps(void) {
+    int ret = NEWFS_ERROR_NONE;
+
+    if (super.ino_map_lo < super.ino_map_hi) {
+        if (newfs_sync_map_range(super.ino_map_offset, super.ino_bitmap,
+                                 super.ino_map_lo, super.ino_map_hi) != NEWFS_ERROR_NONE) {
+            NEWFS_TRACE(NEWFS_TC_SUPER, NEWFS_TL_ERR, "write ino_bitmap failed");
+            ret = -NEWFS_ERROR_IO;
+        } else {
+            super.ino_map_lo = super.ino_map_hi = 0;
+        }
+        super.ino_map_csum = newfs_csum_map(super.ino_bitmap, NEWFS_BLKS_SZ(super.ino_map_blks));
+    }
+    if (super.dat_map_lo < super.dat_map_hi) {
+        if (newfs_sync_map_range(super.dat_map_offset, super.data_bitmap,
+                                 super.dat_map_lo, super.dat_map_hi) != NEWFS_ERROR_NONE) {
+            NEWFS_TRACE(NEWFS_TC_SUPER, NEWFS_TL_ERR, "write data_bitmap failed");
+            ret = -NEWFS_ERROR_IO;
+        } else {
+            super.dat_map_lo = super.dat_map_hi = 0;
+        }
+        super.dat_map_csum = newfs_csum_map(super.data_bitmap, NEWFS_BLKS_SZ(super.dat_map_blks));
+    }
+    return ret;
+}
+
+/**
+ * @brief 统计位图中已占用的位数，挂载时用于校验空闲计数
+ * 
+ * @param bitmap 位图
+ * @param nbits 位图有效位数
+ * @return int 已占用位数
+ */
+int newfs_bitmap_count(uint8_t* bitmap, int nbits) {
+    int cnt = 0;
+    for (int pos = 0; pos < nbits; pos++) {
+        if (bitmap[pos / UINT8_BITS] & (0x1 << (pos % UINT8_BITS))) {
+            cnt++;
+        }
+    }
+    return cnt;
+}
+
+/**
+ * @brief 分配一个inode号，同时维护空闲inode计数
+ * 
+ * @return int inode号，无空闲返回-1
+ */
+int newfs_alloc_ino(void) {
+    int ino = newfs_bitmap_alloc(super.ino_bitmap, super.ino_max, &super.ino_hint);
+    if (ino >= 0) {
+        super.free_ino_cnt--;
+        newfs_map_touch(&super.ino_map_lo, &super.ino_map_hi, ino, ino);
+    }
+    return ino;
+}
+
+/**
+ * @brief 释放一个inode号
+ * 
+ * @param ino 
+ */
+void newfs_free_ino(int ino) {
+    if (super.ino_bitmap[ino / UINT8_BITS] & (0x1 << (ino % UINT8_BITS))) {
+        super.ino_bitmap[ino / UINT8_BITS] &= ~(0x1 << (ino % UINT8_BITS));
+        super.free_ino_cnt++;
+        newfs_map_touch(&super.ino_map_lo, &super.ino_map_hi, ino, ino);
+    }
+}
+
+/**
+ * @brief 分配一个数据块号，同时维护空闲数据块计数
+ * 
+ * @return int 数据块号，无空闲返回-1
+ */
+int newfs_alloc_blk(void) {
+    int blk = newfs_bitmap_alloc(super.data_bitmap, super.data_blks, &super.blk_hint);
+    if (blk >= 0) {
+        super.free_blk_cnt--;
+        newfs_map_touch(&super.dat_map_lo, &super.dat_map_hi, blk, blk);
+    }
+    return blk;
+}
+
+/**
+ * @brief 释放一个数据块号
+ * 
+ * @param blk 
+ */
+void newfs_free_blk(int blk) {
+    newfs_dedup_forget(blk);
+    newfs_csum_forget(blk);
+    if (super.data_bitmap[blk / UINT8_BITS] & (0x1 << (blk % UINT8_BITS))) {
+        super.data_bitmap[blk / UINT8_BITS] &= ~(0x1 << (blk % UINT8_BITS));
+        super.free_blk_cnt++;
+        newfs_map_touch(&super.dat_map_lo, &super.dat_map_hi, blk, blk);
+    }
+}
+
+/**
+ * @brief 一次查找并占用一段连续的空闲数据块，从分配提示开始，到末尾后从头再找一遍。
+ * 找不到足够长的段时占用找到的最长段，调用者按实际长度继续
+ * 
+ * @param want 希望的块数
+ * @param got 返回实际占用的块数
+ * @return int 起始块号，无空闲块返回-1
+ */
+int newfs_alloc_run(int want, int* got) {
+    uint8_t* bitmap = super.data_bitmap;
+    int nbits = super.data_blks;
+    int hint  = (super.blk_hint >= 0 && super.blk_hint < nbits) ? super.blk_hint : 0;
+    int best  = -1, best_len = 0;
+
+    for (int pass = 0; pass < 2 && best_len < want; pass++) {
+        int lo = pass ? 0 : hint, hi = pass ? hint : nbits;
+        int run = -1, len = 0;
+
+        for (int pos = lo; pos < hi && best_len < want; ) {
+            uint8_t byte = bitmap[pos / UINT8_BITS];
+            if (pos % UINT8_BITS == 0 && pos + UINT8_BITS <= hi && (byte == 0xFF || byte == 0)) {
+                if (byte == 0xFF) {
+                    len = 0;                            /* 整字节已满，跳过 */
+                } else {
+                    run  = len ? run : pos;             /* 整字节空闲，整体并入 */
+                    len += UINT8_BITS;
+                }
+                pos += UINT8_BITS;
+            } else {
+                if (byte & (0x1 << (pos % UINT8_BITS))) {
+                    len = 0;
+                } else {
+                    run = len ? run : pos;
+                    len++;
+                }
+                pos++;
+            }
+            if (len > best_len) {
+                best     = run;
+                best_len = len;
+            }
+        }
+    }
+    if (best < 0) {
+        *got = 0;
+        return -1;
+    }
+    if (best_len > want) {
+        best_len = want;
+    }
+    for (int pos = best; pos < best + best_len; pos++) {
+        bitmap[pos / UINT8_BITS] |= (0x1 << (pos % UINT8_BITS));
+    }
+    super.free_blk_cnt -= best_len;
+    newfs_map_touch(&super.dat_map_lo, &super.dat_map_hi, best, best + best_len - 1);
+    super.blk_hint      = best + best_len;
+    *got = best_len;
+    return best;
+}
+
+static int cmp_u32(const void* a, const void* b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * @brief 清除位图中[start, start + len)的全部位，首尾不足一字节的部分按掩码清除，
+ * 中间整字节直接清零
+ * 
+ * @return int 原来被占用、本次清除的位数
+ */
+static int newfs_bitmap_clear_run(uint8_t* bitmap, int start, int len) {
+    int end = start + len, cleared = 0;
+
+    while (start < end && start % UINT8_BITS != 0) {
+        uint8_t mask = 0x1 << (start % UINT8_BITS);
+        cleared += (bitmap[start / UINT8_BITS] & mask) != 0;
+        bitmap[start / UINT8_BITS] &= ~mask;
+        start++;
+    }
+    if (end - start >= UINT8_BITS) {
+        int nbytes = (end - start) / UINT8_BITS;
+        for (int i = 0; i < nbytes; i++) {
+            cleared += __builtin_popcount(bitmap[start / UINT8_BITS + i]);
+        }
+        memset(bitmap + start / UINT8_BITS, 0, nbytes);
+        start += nbytes * UINT8_BITS;
+    }
+    while (start < end) {
+        uint8_t mask = 0x1 << (start % UINT8_BITS);
+        cleared += (bitmap[start / UINT8_BITS] & mask) != 0;
+        bitmap[start / UINT8_BITS] &= ~mask;
+        start++;
+    }
+    return cleared;
+}
+
+/**
+ * @brief 批量清除位图：排序后合并为连续段，每段一次清除
+ * 
+ * @param bitmap 位图
+ * @param nbits 位图有效位数，越界的编号忽略
+ * @param nums 要清除的位号，会被原地排序
+ * @param n 位号个数
+ * @param runs 返回清除的连续段数，可为NULL
+ * @return int 实际清除的位数
+ */
+static int newfs_bitmap_clear_batch(uint8_t* bitmap, int nbits, uint32_t* nums, int n, int* runs) {
+    int cleared = 0, nr_runs = 0;
+
+    qsort(nums, n, sizeof(uint32_t), cmp_u32);
+    for (int i = 0; i < n; ) {
+        int j = i + 1;
+        if (nums[i] >= (uint32_t)nbits) {
+            i++;
+            continue;
+        }
+        while (j < n && nums[j] <= nums[j - 1] + 1 && nums[j] < (uint32_t)nbits) {
+            j++;                                /* 连续或重复的位号并入同一段 */
+        }
+        cleared += newfs_bitmap_clear_run(bitmap, nums[i], nums[j - 1] - nums[i] + 1);
+        nr_runs++;
+        i = j;
+    }
+    if (runs) {
+        *runs = nr_runs;
+    }
+    return cleared;
+}
+
+/**
+ * @brief 批量释放数据块，按连续段更新位图与空闲计数
+ * 
+ * @param blks 数据块号，会被原地排序
+ * @param n 块数
+ * @return int 清除的连续段数
+ */
+int newfs_free_blks(uint32_t* blks, int n) {
+    int runs = 0;
+    int cleared;
+
+    for (int i = 0; i < n; i++) {
+        newfs_dedup_forget(blks[i]);
+        newfs_csum_forget(blks[i]);
+    }
+    cleared = newfs_bitmap_clear_batch(super.data_bitmap, super.data_blks, blks, n, &runs);
+
+    if (cleared) {
+        super.free_blk_cnt += cleared;
+        newfs_map_touch(&super.dat_map_lo, &super.dat_map_hi, blks[0], blks[n - 1]);   /* 已排序 */
+    }
+    return runs;
+}
+
+/**
+ * @brief 批量释放inode号
+ * 
+ * @param inos inode号，会被原地排序
+ * @param n 个数
+ */
+void newfs_free_inos(uint32_t* inos, int n) {
+    int cleared = newfs_bitmap_clear_batch(super.ino_bitmap, super.ino_max, inos, n, NULL);
+
+    if (cleared) {
+        super.free_ino_cnt += cleared;
+        newfs_map_touch(&super.ino_map_lo, &super.ino_map_hi, inos[0], inos[n - 1]);
+    }
+}
+
+/**
+ * @brief 从dentry slab中分配并初始化一个目录项
+ * 
+ * @param fname 文件名
+ * @param ftype 文件类型
+ * @return struct newfs_dentry* 
+ */
+struct newfs_dentry* new_dentry(char * fname, NEWFS_FILE_TYPE ftype) {
+    struct newfs_dentry * dentry = (struct newfs_dentry *)newfs_slab_alloc(&newfs_dentry_slab);
+    memset(dentry, 0, sizeof(struct newfs_dentry));
+    NEWFS_ASSIGN_FNAME(dentry, fname);
+    dentry->ino     = -1;
+    dentry->ftype   = ftype;
+    dentry->inode   = NULL;
+    dentry->parent  = NULL;
+    dentry->brother = NULL;
+    return dentry;                                       
+}
+
+/**
+ * @brief 释放目录项
+ * 
+ * @param dentry 
+ */
+void free_dentry(struct newfs_dentry * dentry) {
+    newfs_slab_free(&newfs_dentry_slab, dentry);
+}
+
 /**
  * @brief 分配一个inode，占用位图
  * 
@@ -58,38 +486,28 @@ int your_write(int offset, void *out_content, int size) {
  */
 struct newfs_inode* newfs_alloc_inode(struct newfs_dentry * dentry) {
 	struct newfs_inode* inode;
-	int byte_cursor = 0;
-	int bit_cursor = 0;
-	int ino_cursor = 0;
-	bool is_found_free_entry = false;
 	// 在inode位图中寻找空闲的inode位置
-	for (byte_cursor = 0; byte_cursor < NEWFS_BLKS_SZ(super.ino_map_blks); 
-         byte_cursor++)
-    {
-        for (bit_cursor = 0; bit_cursor < UINT8_BITS; bit_cursor++) {
-            if((super.ino_bitmap[byte_cursor] & (0x1 << bit_cursor)) == 0) {    
-                                                      /* 当前ino_cursor位置空闲 */
-                super.ino_bitmap[byte_cursor] |= (0x1 << bit_cursor);
-				printf("allocate inode %d\n", ino_cursor);
-                is_found_free_entry = true;           
-                break;
-            }
-            ino_cursor++;
-        }
-        if (is_found_free_entry) {
-            break;
-        }
-    }
-
-	if (!is_found_free_entry || ino_cursor >= super.ino_max)
+	int ino_cursor = newfs_alloc_ino();
+	if (ino_cursor < 0)
         return NULL;    /* 未找到空闲inode位置 */
+	NEWFS_TRACE(NEWFS_TC_INODE, NEWFS_TL_DEBUG, "allocate inode %d", ino_cursor);
 
-    inode = (struct newfs_inode*)malloc(sizeof(struct newfs_inode));
+    inode = (struct newfs_inode*)newfs_slab_alloc(&newfs_inode_slab);
 
     inode->ino  = ino_cursor;
     inode->size = 0;
     inode->dir_cnt = 0;
+    inode->nlink = 1;
     inode->dentrys = NULL;
+    inode->dirty = false;
+    inode->dirty_next = NULL;
+    inode->dir_loaded = true;     /* 新目录为空，无需从磁盘读目录项 */
+    inode->unlinked = false;
+    inode->csum_bad = false;
+    inode->reclaim_next = NULL;
+    inode->ref = 0;
+    inode->nr_cached = 0;
+    inode->lru_prev = inode->lru_next = inode->hash_next = NULL;
 
     /* dentry指向inode */
     dentry->inode = inode;
@@ -102,14 +520,67 @@ struct newfs_inode* newfs_alloc_inode(struct newfs_dentry * dentry) {
 
     for (int i = 0; i < NEWFS_DATA_PER_FILE; i++){
         inode->data[i] = -1;
-        inode->data_blks[i] = (uint8_t *)malloc(NEWFS_IO_SZ());
+        inode->data_blks[i] = NULL;   /* 数据块缓冲按需分配 */
     }
+    memset(inode->blk_dirty, 0, sizeof(inode->blk_dirty));
+    inode->xattr_blk = (uint32_t)-1;
+    inode->xattr_len = 0;
+    newfs_snap_born(inode);         /* 快照中不存在，修改时无需保存 */
 
+    newfs_icache_insert(inode);
     return inode;
 }
 
 /**
- * @brief 将内存inode及其下方结构全部刷回磁盘
+ * @brief 按内存inode填充磁盘inode结构
+ * 
+ * @param inode 
+ * @param inode_d 
+ */
+static void newfs_inode_d_fill(struct newfs_inode * inode, struct newfs_inode_d * inode_d) {
+    inode_d->ino         = inode->ino;
+    inode_d->size        = inode->size;
+    inode_d->ftype       = inode->ftype;     /* 删除了其中一个硬链接的inode可能没有dentry */
+    if (NEWFS_IS_DIR(inode)) {
+        inode_d->dir_cnt = inode->dir_cnt;
+    } else {
+        inode_d->nlink   = inode->nlink;
+    }
+    if (NEWFS_IS_INLINE_LINK(inode)) {
+        memset(inode_d->data, 0, sizeof(inode_d->data));
+        memcpy(inode_d->data, inode->data_blks[0], inode->size);
+    } else {
+        for (int i = 0; i < NEWFS_DATA_PER_FILE; i++) {
+            inode_d->data[i] = inode->data[i];
+        }
+    }
+    inode_d->xattr_blk   = inode->xattr_blk;
+    inode_d->xattr_len   = inode->xattr_len;
+    inode_d->xattr_pad   = 0;
+    memset(inode_d->xattr, 0, sizeof(inode_d->xattr));
+    memcpy(inode_d->xattr, inode->xattr, inode->xattr_len);
+}
+
+/**
+ * @brief 写inode之前先写位图与超级块计数：磁盘上的inode引用的inode号和块在磁盘位图中必须已被占用，
+ * 否则异常退出后重新挂载会把它们再分配给别的文件
+ * 
+ * @return int 0成功，否则返回错误码
+ */
+static int newfs_sync_maps_first(void) {
+    if (super.ino_map_lo < super.ino_map_hi || super.dat_map_lo < super.dat_map_hi) {
+        if (newfs_sync_maps() != NEWFS_ERROR_NONE
+            || newfs_sync_super(super.state) != NEWFS_ERROR_NONE
+            || newfs_bdev_drain(NEWFS_DRIVER()) != NEWFS_ERROR_NONE) {
+            return -NEWFS_ERROR_IO;
+        }
+    }
+    return NEWFS_ERROR_NONE;
+}
+
+/**
+ * @brief 将内存inode及其目录项/数据刷回磁盘，不递归子inode。
+ * 普通文件的数据块异步提交，调用者需newfs_bdev_drain等待完成
  * 
  * @param inode 
  * @return int 
@@ -117,225 +588,753 @@ struct newfs_inode* newfs_alloc_inode(struct newfs_dentry * dentry) {
 int newfs_sync_inode(struct newfs_inode * inode) {
     struct newfs_inode_d  inode_d;
     struct newfs_dentry*  dentry_cursor;
-    struct newfs_dentry_d dentry_d;
     int offset;
     int ino             = inode->ino;
 
+    /* 快照保存的旧inode要先记入映射表，否则崩溃后快照会读到新版本 */
+    if (newfs_snap_sync() != NEWFS_ERROR_NONE) {
+        return -NEWFS_ERROR_IO;
+    }
+
+    /* 先压缩能压缩的簇，块号与标记随之改变，之后再填充inode_d。压缩簇写在新块上，
+     * 新块的位图先于inode落盘，原来的块之后才释放 */
+    if (NEWFS_IS_REG(inode) && newfs_options.compress) {
+        uint32_t stale[NEWFS_DATA_PER_FILE];
+        int      nstale = 0;
+
+        for (int first = 0; first < NEWFS_DATA_PER_FILE; first += NEWFS_COMP_CLUSTER) {
+            newfs_comp_writeback(inode, first, stale, &nstale);
+        }
+        if (nstale > 0) {
+            if (newfs_sync_maps_first() != NEWFS_ERROR_NONE) {
+                return -NEWFS_ERROR_IO;             /* 磁盘上的inode仍指向原来的块，不释放，泄漏由fsck回收 */
+            }
+            newfs_free_blks(stale, nstale);
+        }
+    }
+
+    /* 再对仍是普通块的脏整块去重，命中的项改为共享块，不再写回 */
+    if (NEWFS_IS_REG(inode) && newfs_dedup_writeback(inode) != NEWFS_ERROR_NONE) {
+        NEWFS_TRACE(NEWFS_TC_INODE, NEWFS_TL_ERR, "inode %d: write block refcount table failed", ino);
+        return -NEWFS_ERROR_IO;
+    }
+
     // 填充inode_d结构
-    inode_d.ino         = ino;
-    inode_d.size        = inode->size;
-    // memcpy(inode_d.target_path, inode->target_path, MAX_NAME_LEN);
-    inode_d.ftype       = inode->dentry->ftype;
-    inode_d.dir_cnt     = inode->dir_cnt;
-    for (int i = 0; i < NEWFS_DATA_PER_FILE; i++) {
-        inode_d.data[i] = inode->data[i];
-    }
-
-    /* 先写inode本身 */
-    int inodes_per_block = NEWFS_IO_SZ() / sizeof(struct newfs_inode_d);
-    int off = ino / inodes_per_block;
-    int idx = ino % inodes_per_block;
-    int inode_offset = super.inode_offset + off * NEWFS_IO_SZ() + idx * sizeof(struct newfs_inode_d);
-    if (your_write(inode_offset, (uint8_t *)&inode_d, 
-                    sizeof(struct newfs_inode_d)) != NEWFS_ERROR_NONE) {
-        NEWFS_DBG("[%s] inode io error\n", __func__);
+    newfs_inode_d_fill(inode, &inode_d);
+
+    /* 先写inode本身，inode_d比逻辑块大，按槽位连续存放 */
+    if (newfs_inode_d_write(ino, &inode_d) != NEWFS_ERROR_NONE) {
+        NEWFS_TRACE(NEWFS_TC_INODE, NEWFS_TL_ERR, "inode %d io error", ino);
         return -NEWFS_ERROR_IO;
     }
 	/* 再写inode下方的数据 */
-    if (NEWFS_IS_DIR(inode)) { /* 如果当前inode是目录，那么数据是目录项，且目录项的inode也要写回 */                          
-        dentry_cursor = inode->dentrys;
+    if (NEWFS_IS_DIR(inode)) { /* 如果当前inode是目录，那么数据是目录项，按块组装后整块写回 */
         int max_dentries_per_block = NEWFS_IO_SZ() / sizeof(struct newfs_dentry_d);
-
         int dentry_index = 0;
-        
-        while (dentry_cursor != NULL) {
-            int current_block = dentry_index / max_dentries_per_block;
+        uint8_t* blk_buf = newfs_buf_alloc();
+        struct newfs_dentry_d* dentry_d = (struct newfs_dentry_d *)blk_buf;
+
+        memset(blk_buf, 0, NEWFS_IO_SZ());
+        for (dentry_cursor = inode->dentrys; dentry_cursor != NULL; dentry_cursor = dentry_cursor->brother) {
+            int current_block  = dentry_index / max_dentries_per_block;
             int index_in_block = dentry_index % max_dentries_per_block;
-            
+
             if (current_block >= NEWFS_DATA_PER_FILE) {
-                NEWFS_DBG("[%s] too many data blocks\n", __func__);
+                NEWFS_TRACE(NEWFS_TC_DENTRY, NEWFS_TL_ERR, "inode %d: too many data blocks", ino);
+                newfs_buf_free(blk_buf);
                 return -NEWFS_ERROR_IO;
             }
-            
-            offset = NEWFS_DATA_OFS(inode->data[current_block]) + 
-                    index_in_block * sizeof(struct newfs_dentry_d);
-            
-            memcpy(dentry_d.name, dentry_cursor->name, MAX_NAME_LEN);
-            dentry_d.ftype = dentry_cursor->ftype;
-            dentry_d.ino   = dentry_cursor->ino;
-            
-            if (your_write(offset, (uint8_t *)&dentry_d, 
-                                sizeof(struct newfs_dentry_d)) != NEWFS_ERROR_NONE) {
-                NEWFS_DBG("[%s] dentry io error\n", __func__);
-                return -NEWFS_ERROR_IO;            
+            memcpy(dentry_d[index_in_block].name, dentry_cursor->name, MAX_NAME_LEN);
+            dentry_d[index_in_block].ftype = dentry_cursor->ftype;
+            dentry_d[index_in_block].ino   = dentry_cursor->ino;
+            dentry_index++;
+            /* 子inode若有修改，已在脏链表中，由newfs_flush_dirty写回，这里不再递归 */
+
+            if (index_in_block + 1 < max_dentries_per_block && dentry_cursor->brother != NULL) {
+                continue;                       /* 块未满且还有目录项 */
             }
-            
-            if (dentry_cursor->inode != NULL) {
-                newfs_sync_inode(dentry_cursor->inode);
+            if (NEWFS_CSUM_ON()) {
+                newfs_csum_dirblk_seal(blk_buf, NEWFS_IO_SZ());
             }
-
-            dentry_cursor = dentry_cursor->brother;
-            dentry_index++;
+            offset = NEWFS_DATA_OFS(inode->data[current_block]);
+            if (your_write(offset, blk_buf, NEWFS_IO_SZ()) != NEWFS_ERROR_NONE) {
+                NEWFS_TRACE(NEWFS_TC_DENTRY, NEWFS_TL_ERR, "inode %d: dentry io error", ino);
+                newfs_buf_free(blk_buf);
+                return -NEWFS_ERROR_IO;
+            }
+            memset(blk_buf, 0, NEWFS_IO_SZ());
         }
+        newfs_buf_free(blk_buf);
         
         // 验证目录项数量是否匹配
         if (dentry_index != inode->dir_cnt) {
-            NEWFS_DBG("[%s] dentry count mismatch: expected %d, got %d\n", 
-                    __func__, inode->dir_cnt, dentry_index);
+            NEWFS_TRACE(NEWFS_TC_DENTRY, NEWFS_TL_ERR, "inode %d: dentry count mismatch: expected %d, got %d",
+                        ino, inode->dir_cnt, dentry_index);
             return -NEWFS_ERROR_IO;
         }
-    } else if (NEWFS_IS_REG(inode)) { /* 如果当前inode是文件，那么数据是文件内容，直接写即可 */
+    } else if (NEWFS_IS_REG(inode) || NEWFS_IS_SYM_LINK(inode)) { /* 如果当前inode是文件，那么数据是文件内容，直接写即可 */
         for (int i = 0; i < NEWFS_DATA_PER_FILE; i++) {
-            if( inode->data[i] == -1 ) {
-                break;
+            if (!NEWFS_BLK_WRITTEN(inode->data[i])) {
+                continue;                       /* 空洞或未写入的预分配块之后仍可能有数据块 */
+            }
+            if (inode->data_blks[i] == NULL || !NEWFS_BLK_DIRTY(inode, i)) {
+                continue;                       /* 未读入或未修改的块磁盘上已是最新 */
+            }
+            NEWFS_BLK_CLEAR_DIRTY(inode, i);
+            newfs_csum_update(NEWFS_BLKNO(inode->data[i]), inode->data_blks[i]);
+            /* 数据块异步写回，与后续inode的写回重叠，由调用者newfs_bdev_drain等待完成 */
+            offset = NEWFS_DATA_OFS(NEWFS_BLKNO(inode->data[i]));
+            if (newfs_bdev_write_async(NEWFS_DRIVER(), offset, inode->data_blks[i], 
+                                       NEWFS_IO_SZ()) != NEWFS_ERROR_NONE) {
+                NEWFS_TRACE(NEWFS_TC_DATA, NEWFS_TL_ERR, "inode %d: data io error", ino);
+                return -NEWFS_ERROR_IO;
             }
-            offset = NEWFS_DATA_OFS(inode->data[i]);
-            your_write(offset, inode->data_blks[i], NEWFS_IO_SZ());
         }
     }
     return NEWFS_ERROR_NONE;
 }
 
 /**
- * @brief 将denry插入到inode中，采用头插法
+ * @brief 标记inode为脏，挂入脏链表，等待newfs_flush_dirty写回
  * 
  * @param inode 
- * @param dentry 
- * @return int 
  */
-int newfs_alloc_dentry(struct newfs_inode* inode, struct newfs_dentry* dentry) {
-    if (inode->dentrys == NULL) {
-        inode->dentrys = dentry;
+void newfs_mark_dirty(struct newfs_inode * inode) {
+    if (inode->dirty || inode->unlinked || inode->csum_bad) {
+        return;                                 /* 已删除或校验失败的inode不再写回 */
     }
-    else {
-        dentry->brother = inode->dentrys;
-        inode->dentrys = dentry;
+    inode->dirty      = true;
+    inode->dirty_next = super.dirty_list;
+    super.dirty_list  = inode;
+}
+
+/**
+ * @brief 将inode从脏链表摘除并清除脏标记，不写回
+ * 
+ * @param inode 
+ */
+void newfs_clear_dirty(struct newfs_inode * inode) {
+    struct newfs_inode** pp = &super.dirty_list;
+
+    if (!inode->dirty) {
+        return;
     }
+    while (*pp != inode) {
+        pp = &(*pp)->dirty_next;
+    }
+    *pp = inode->dirty_next;
+    inode->dirty      = false;
+    inode->dirty_next = NULL;
+}
+
+/**
+ * @brief 写回脏链表上的所有inode，代价只与修改量有关，与目录树大小无关
+ * 
+ * @return int 0成功，否则返回错误码
+ */
+int newfs_flush_dirty(void) {
+    struct newfs_inode* inode;
+    int ret = NEWFS_ERROR_NONE;
+    uint64_t start = newfs_stat_now();
 
-    inode->size += sizeof(struct newfs_dentry_d);
+    while (super.dirty_list != NULL) {
+        inode = super.dirty_list;
+        super.dirty_list  = inode->dirty_next;
+        inode->dirty      = false;
+        inode->dirty_next = NULL;
+        if (newfs_sync_inode(inode) != NEWFS_ERROR_NONE) {
+            ret = -NEWFS_ERROR_IO;
+        }
+    }
+    /* 等待异步提交的数据块写完 */
+    if (newfs_bdev_drain(NEWFS_DRIVER()) != NEWFS_ERROR_NONE) {
+        ret = -NEWFS_ERROR_IO;
+    }
+    return newfs_stat_end(NEWFS_OP_SYNC, start, ret);
+}
+
+/**
+ * @brief 立即写回单个inode（close时的flush），写完从脏链表摘除
+ * 
+ * @param inode 
+ * @return int 0成功，否则返回错误码
+ */
+int newfs_flush_inode(struct newfs_inode * inode) {
+    int ret;
+
+    if (!inode->dirty) {
+        return NEWFS_ERROR_NONE;
+    }
+    newfs_clear_dirty(inode);
+
+    if (newfs_sync_maps_first() != NEWFS_ERROR_NONE) {
+        newfs_mark_dirty(inode);                /* 位图未落盘，inode留在脏链表上下次重试 */
+        return -NEWFS_ERROR_IO;
+    }
+    ret = newfs_sync_inode(inode);
+    if (newfs_bdev_drain(NEWFS_DRIVER()) != NEWFS_ERROR_NONE) {
+        ret = -NEWFS_ERROR_IO;
+    }
+    return ret;
+}
+
+/**
+ * @brief 递归写回目录及其引用的脏子inode的元数据，子inode先于引用它的目录项落盘
+ * 
+ * @param inode 
+ * @return int 0成功，否则返回错误码
+ */
+static int newfs_flush_meta_tree(struct newfs_inode * inode) {
+    struct newfs_inode_d inode_d;
+    struct newfs_dentry* dentry_cursor;
+    int ret = NEWFS_ERROR_NONE;
+
+    if (!inode->dirty) {
+        return NEWFS_ERROR_NONE;                /* 干净的inode磁盘上已是最新，其子inode也都已落盘 */
+    }
+    if (!NEWFS_IS_DIR(inode)) {
+        /* 普通文件只写inode本身，脏数据块留在脏链表上由newfs_flush_dirty写回 */
+        if (newfs_snap_sync() != NEWFS_ERROR_NONE) {
+            return -NEWFS_ERROR_IO;
+        }
+        newfs_inode_d_fill(inode, &inode_d);
+        return newfs_inode_d_write(inode->ino, &inode_d);
+    }
+    for (dentry_cursor = inode->dentrys; dentry_cursor != NULL; dentry_cursor = dentry_cursor->brother) {
+        if (dentry_cursor->inode != NULL && newfs_flush_meta_tree(dentry_cursor->inode) != NEWFS_ERROR_NONE) {
+            ret = -NEWFS_ERROR_IO;
+        }
+    }
+    newfs_clear_dirty(inode);                   /* 目录的数据就是目录项，整体写回后即为干净 */
+    if (newfs_sync_inode(inode) != NEWFS_ERROR_NONE) {
+        ret = -NEWFS_ERROR_IO;
+    }
+    return ret;
+}
+
+/**
+ * @brief 只写回目录的元数据（rename用）：位图、目录本身以及目录项引用的尚未落盘的子inode，
+ * 不写普通文件的数据块，代价与文件大小无关
+ * 
+ * @param inode 目录inode
+ * @return int 0成功，否则返回错误码
+ */
+int newfs_flush_meta(struct newfs_inode * inode) {
+    int ret;
+
+    if (newfs_sync_maps_first() != NEWFS_ERROR_NONE) {
+        return -NEWFS_ERROR_IO;
+    }
+    ret = newfs_flush_meta_tree(inode);
+    if (newfs_bdev_drain(NEWFS_DRIVER()) != NEWFS_ERROR_NONE) {
+        ret = -NEWFS_ERROR_IO;
+    }
+    return ret;
+}
 
+/**
+ * @brief 将denry插入到inode中，采用头插法。失败时目录保持不变
+ * 
+ * @param inode 
+ * @param dentry 
+ * @return int 插入后的目录项个数，目录已满或没有空闲块时返回-NEWFS_ERROR_NOSPACE
+ */
+int newfs_alloc_dentry(struct newfs_inode* inode, struct newfs_dentry* dentry) {
     const int per_blk = NEWFS_IO_SZ() / sizeof(struct newfs_dentry_d);
-    int cur_dir_cnt = inode->dir_cnt; // 当前子项数量
+    int cur_dir_cnt;
 
-    if(cur_dir_cnt >= NEWFS_DATA_PER_FILE * ( NEWFS_IO_SZ() / sizeof(struct newfs_dentry_d))) {
-        return -1; /* 超过单目录支持的最大文件大小 */
+    newfs_dir_load(inode);
+    cur_dir_cnt = inode->dir_cnt; // 当前子项数量
+    if (cur_dir_cnt >= NEWFS_DATA_PER_FILE * per_blk) {
+        return -NEWFS_ERROR_NOSPACE; /* 超过单目录支持的最大文件大小 */
     }
 
     // 如果当前目录条目正好填满了现有块集合（或首次插入时需要至少一个块），则要申请新块
-    bool need_alloc_block = (cur_dir_cnt == 0) || (cur_dir_cnt % per_blk == 0);
-    if (need_alloc_block) {
-        int byte_cursor = 0;
-        int bit_cursor = 0;
-        int data_blk_cursor = 0;
-        bool is_found_free_entry = false;
+    if (cur_dir_cnt % per_blk == 0) {
         // 在数据块位图中寻找空闲的数据块位置
-        for (byte_cursor = 0; byte_cursor < NEWFS_BLKS_SZ(super.dat_map_blks); 
-             byte_cursor++)
-        {
-            for (bit_cursor = 0; bit_cursor < UINT8_BITS; bit_cursor++) {
-                if((super.data_bitmap[byte_cursor] & (0x1 << bit_cursor)) == 0) {    
-                                                          /* 当前data_blk_cursor位置空闲 */
-                    super.data_bitmap[byte_cursor] |= (0x1 << bit_cursor);
-                    is_found_free_entry = true;           
-                    break;
+        int data_blk_cursor = newfs_alloc_blk();
+        if (data_blk_cursor < 0)
+            return -NEWFS_ERROR_NOSPACE;    /* 未找到空闲数据块位置 */
+
+        // 分配新数据块给inode，目录项由newfs_sync_inode直接写盘，不需要块缓冲
+        inode->data[cur_dir_cnt / per_blk] = data_blk_cursor;
+    }
+
+    newfs_icache_charge(sizeof(struct newfs_dentry));
+    dentry->brother = inode->dentrys;
+    inode->dentrys  = dentry;
+    inode->size    += sizeof(struct newfs_dentry_d);
+    inode->dir_cnt++;
+
+    return inode->dir_cnt;
+}
+
+/**
+ * @brief 将dentry从目录inode中摘除，newfs_alloc_dentry的逆操作。
+ * 目录项按链表顺序重新写盘，摘除后末尾多出的整块立即释放
+ * 
+ * @param inode 目录inode
+ * @param dentry 要摘除的目录项，不释放
+ * @return int 剩余目录项个数，不在目录中返回-1
+ */
+int newfs_drop_dentry(struct newfs_inode* inode, struct newfs_dentry* dentry) {
+    struct newfs_dentry** pp = &inode->dentrys;
+    const int per_blk = NEWFS_IO_SZ() / sizeof(struct newfs_dentry_d);
+    int nblks;
+
+    while (*pp && *pp != dentry) {
+        pp = &(*pp)->brother;
+    }
+    if (*pp == NULL) {
+        return -1;
+    }
+    *pp = dentry->brother;
+    dentry->brother = NULL;
+    newfs_icache_charge(-(long)sizeof(struct newfs_dentry));
+    newfs_prefetch_forget(inode, dentry);
+
+    inode->size -= sizeof(struct newfs_dentry_d);
+    inode->dir_cnt--;
+
+    nblks = (inode->dir_cnt + per_blk - 1) / per_blk;
+    if (nblks < NEWFS_DATA_PER_FILE && inode->data[nblks] != (uint32_t)-1) {
+        newfs_free_blk(inode->data[nblks]);
+        inode->data[nblks] = -1;
+    }
+    return inode->dir_cnt;
+}
+
+/**
+ * @brief 用dentry替换目录中的old，保持原位置，目录项个数与数据块不变
+ * 
+ * @param inode 目录inode
+ * @param old 被替换的目录项，不释放
+ * @param dentry 新目录项
+ * @return int 0成功，old不在目录中返回-1
+ */
+int newfs_replace_dentry(struct newfs_inode* inode, struct newfs_dentry* old,
+                         struct newfs_dentry* dentry) {
+    struct newfs_dentry** pp = &inode->dentrys;
+
+    while (*pp && *pp != old) {
+        pp = &(*pp)->brother;
+    }
+    if (*pp == NULL) {
+        return -1;
+    }
+    dentry->brother = old->brother;
+    *pp = dentry;
+    old->brother = NULL;
+    newfs_prefetch_forget(inode, old);
+    return 0;
+}
+
+/**
+ * @brief 读出目录在磁盘上的全部目录项，不经过inode缓存，挂载恢复时使用
+ * 
+ * @param ino 目录inode号
+ * @param dir_d 返回目录的inode_d
+ * @return struct newfs_dentry_d* 目录项数组，需由调用者free；失败返回NULL
+ */
+static struct newfs_dentry_d* newfs_dir_read_raw(int ino, struct newfs_inode_d* dir_d) {
+    const int per_blk = NEWFS_IO_SZ() / sizeof(struct newfs_dentry_d);
+    struct newfs_dentry_d* ents;
+    uint8_t* blk_buf;
+
+    if (ino < 0 || ino >= super.ino_max
+        || newfs_inode_d_read(ino, dir_d) != NEWFS_ERROR_NONE
+        || dir_d->ftype != NEWFS_DIR || dir_d->dir_cnt < 0
+        || dir_d->dir_cnt > NEWFS_DATA_PER_FILE * per_blk) {
+        return NULL;
+    }
+    ents    = (struct newfs_dentry_d *)malloc(sizeof(struct newfs_dentry_d) * (dir_d->dir_cnt + 1));
+    blk_buf = newfs_buf_alloc();
+    for (int i = 0; i * per_blk < dir_d->dir_cnt; i++) {
+        int n = dir_d->dir_cnt - i * per_blk < per_blk ? dir_d->dir_cnt - i * per_blk : per_blk;
+        if (dir_d->data[i] >= (uint32_t)super.data_blks
+            || your_read(NEWFS_DATA_OFS(dir_d->data[i]), blk_buf, NEWFS_IO_SZ()) != NEWFS_ERROR_NONE
+            || (NEWFS_CSUM_ON() && !newfs_csum_dirblk_ok(blk_buf, NEWFS_IO_SZ()))) {
+            newfs_buf_free(blk_buf);
+            free(ents);
+            return NULL;
+        }
+        memcpy(ents + i * per_blk, blk_buf, n * sizeof(struct newfs_dentry_d));
+    }
+    newfs_buf_free(blk_buf);
+    return ents;
+}
+
+/**
+ * @brief 挂载时补完上次中断的跨目录重命名。
+ * newfs_rename先写新父目录、再写原父目录：新父目录中已有被移动的inode，说明重命名已生效，
+ * 从原父目录中删去残留的目录项；否则两个目录都还是旧状态，无需处理
+ * 
+ * @return int 0成功，否则返回错误码
+ */
+int newfs_rename_recover(void) {
+    const int per_blk = NEWFS_IO_SZ() / sizeof(struct newfs_dentry_d);
+    struct newfs_inode_d   dir_d;
+    struct newfs_dentry_d* ents;
+    bool committed = false;
+    int  ret = NEWFS_ERROR_NONE;
+
+    if (super.rename_src == super.rename_dst) {
+        return NEWFS_ERROR_NONE;
+    }
+    if ((ents = newfs_dir_read_raw(super.rename_dst, &dir_d)) != NULL) {
+        for (int i = 0; i < dir_d.dir_cnt; i++) {
+            committed |= ents[i].ino == (uint32_t)super.rename_ino;
+        }
+        free(ents);
+    }
+    if (committed) {
+        ents = newfs_dir_read_raw(super.rename_src, &dir_d);
+        if (ents == NULL) {
+            ret = -NEWFS_ERROR_IO;
+        } else {
+            int cnt = 0, old_blks = (dir_d.dir_cnt + per_blk - 1) / per_blk, nblks;
+            uint8_t* blk_buf = newfs_buf_alloc();
+
+            for (int i = 0; i < dir_d.dir_cnt; i++) {
+                if (ents[i].ino != (uint32_t)super.rename_ino) {
+                    ents[cnt++] = ents[i];
                 }
-                data_blk_cursor++;
             }
-            if (is_found_free_entry) {
-                break;
+            nblks = (cnt + per_blk - 1) / per_blk;
+            for (int b = 0; b < nblks; b++) {
+                int n = cnt - b * per_blk < per_blk ? cnt - b * per_blk : per_blk;
+                memset(blk_buf, 0, NEWFS_IO_SZ());
+                memcpy(blk_buf, ents + b * per_blk, n * sizeof(struct newfs_dentry_d));
+                if (NEWFS_CSUM_ON()) {
+                    newfs_csum_dirblk_seal(blk_buf, NEWFS_IO_SZ());
+                }
+                ret |= your_write(NEWFS_DATA_OFS(dir_d.data[b]), blk_buf, NEWFS_IO_SZ());
+            }
+            for (int b = nblks; b < old_blks; b++) {
+                newfs_free_blk(dir_d.data[b]);
+                dir_d.data[b] = -1;
             }
+            dir_d.size   -= (dir_d.dir_cnt - cnt) * sizeof(struct newfs_dentry_d);
+            dir_d.dir_cnt = cnt;
+            ret |= newfs_inode_d_write(super.rename_src, &dir_d);
+            ret  = ret ? -NEWFS_ERROR_IO : NEWFS_ERROR_NONE;
+            newfs_buf_free(blk_buf);
+            free(ents);
         }
+    }
+    NEWFS_TRACE(NEWFS_TC_SUPER, NEWFS_TL_WARN, "interrupted rename of inode %d (%d -> %d) %s",
+                super.rename_ino, super.rename_src, super.rename_dst,
+                committed ? "rolled forward" : "discarded");
+    /* 挂载流程随后写回超级块，意图在磁盘上一并清除 */
+    super.rename_ino = super.rename_src = super.rename_dst = 0;
+    return ret;
+}
 
-        if (!is_found_free_entry || data_blk_cursor >= super.data_blks)
-            return -1;    /* 未找到空闲数据块位置 */
+/**
+ * @brief inode槽位大小：不带NEWFS_FEAT_XATTR的镜像不含扩展属性区，不带NEWFS_FEAT_CSUM的不含校验和
+ *
+ * @param features 超级块中的NEWFS_FEAT_*
+ */
+int newfs_inode_d_size(uint32_t features) {
+    int sz = (features & NEWFS_FEAT_XATTR) ? (int)offsetof(struct newfs_inode_d, csum)
+                                           : (int)offsetof(struct newfs_inode_d, xattr_blk);
 
-        // 分配新数据块给inode
-        int new = cur_dir_cnt / per_blk;
-        inode->data[new] = data_blk_cursor;
-        inode->data_blks[new] = (uint8_t *)malloc(NEWFS_IO_SZ());
-        memset(inode->data_blks[new], 0, NEWFS_IO_SZ());
+    return (features & NEWFS_FEAT_CSUM) ? sz + (int)sizeof(uint32_t) : sz;
+}
+
+/**
+ * @brief 读出磁盘上的inode，槽位大小见super.ino_sz；没有扩展属性区的槽位按没有属性返回
+ *
+ * @param ino inode号
+ * @param inode_d 返回内容
+ * @return int 0成功；读失败或校验不符返回-NEWFS_ERROR_IO
+ */
+int newfs_inode_d_read(int ino, struct newfs_inode_d* inode_d) {
+    if (your_read(NEWFS_INO_OFS(ino), inode_d, super.ino_sz) != NEWFS_ERROR_NONE) {
+        return -NEWFS_ERROR_IO;
     }
+    if (NEWFS_CSUM_ON() && !newfs_csum_inode_ok(inode_d, super.ino_sz)) {
+        NEWFS_TRACE(NEWFS_TC_INODE, NEWFS_TL_ERR, "inode %d checksum mismatch", ino);
+        return -NEWFS_ERROR_IO;
+    }
+    if (!NEWFS_XATTR_ON()) {
+        inode_d->xattr_blk = (uint32_t)-1;
+        inode_d->xattr_len = 0;
+    }
+    return NEWFS_ERROR_NONE;
+}
 
-    inode->dir_cnt++;
+/**
+ * @brief 写入磁盘上的inode，带校验时先在槽位末尾填入校验和
+ *
+ * @return int 0成功，否则返回错误码
+ */
+int newfs_inode_d_write(int ino, struct newfs_inode_d* inode_d) {
+    int ret;
 
-    return inode->dir_cnt;
+    if (NEWFS_CSUM_ON()) {
+        newfs_csum_inode_seal(inode_d, super.ino_sz);
+    }
+    ret = your_write(NEWFS_INO_OFS(ino), inode_d, super.ino_sz);
+    if (!NEWFS_XATTR_ON()) {
+        inode_d->xattr_blk = (uint32_t)-1;          /* 校验和写在了这个位置上 */
+    }
+    return ret;
+}
+
+/**
+ * @brief 隐藏inode内容在磁盘上的字节数：带校验时内容之后紧跟4字节CRC32C
+ */
+static int newfs_hidden_bytes(int len) {
+    return NEWFS_CSUM_ON() && len > 0 ? len + (int)sizeof(uint32_t) : len;
+}
+
+/**
+ * @brief 读出隐藏inode(不挂入目录树，由超级块记录)的全部内容
+ *
+ * @param ino 隐藏inode号，0表示不存在
+ * @param out 返回内容，需由调用者free；没有内容时为NULL
+ * @param len 返回字节数
+ * @return int 0成功，否则返回错误码
+ */
+int newfs_hidden_read(int ino, void** out, int* len) {
+    struct newfs_inode_d inode_d;
+    int      blk_sz = NEWFS_IO_SZ();
+    int      nbytes;
+    uint32_t crc;
+    uint8_t* buf;
+
+    *out = NULL;
+    *len = 0;
+    if (ino == 0) {
+        return NEWFS_ERROR_NONE;
+    }
+    if (newfs_inode_d_read(ino, &inode_d) != NEWFS_ERROR_NONE
+        || inode_d.size < 0 || newfs_hidden_bytes(inode_d.size) > NEWFS_DATA_PER_FILE * blk_sz) {
+        return -NEWFS_ERROR_IO;
+    }
+    if (inode_d.size == 0) {
+        return NEWFS_ERROR_NONE;
+    }
+    nbytes = newfs_hidden_bytes(inode_d.size);
+    buf    = (uint8_t *)malloc((nbytes + blk_sz - 1) / blk_sz * blk_sz);
+    for (int b = 0; b * blk_sz < nbytes; b++) {
+        if (NEWFS_BLK_HOLE(inode_d.data[b]) || inode_d.data[b] >= (uint32_t)super.data_blks
+            || your_read(NEWFS_DATA_OFS(inode_d.data[b]), buf + b * blk_sz, blk_sz) != NEWFS_ERROR_NONE) {
+            free(buf);
+            return -NEWFS_ERROR_IO;
+        }
+    }
+    if (NEWFS_CSUM_ON()) {
+        memcpy(&crc, buf + inode_d.size, sizeof(crc));
+        if (newfs_crc32c(buf, inode_d.size) != crc) {
+            NEWFS_TRACE(NEWFS_TC_INODE, NEWFS_TL_ERR, "hidden inode %d: content checksum mismatch", ino);
+            free(buf);
+            return -NEWFS_ERROR_IO;
+        }
+    }
+    *out = buf;
+    *len = inode_d.size;
+    return NEWFS_ERROR_NONE;
+}
+
+/**
+ * @brief 用buf覆盖隐藏inode的内容：按需分配inode、为其增减数据块，先写数据块再写inode；
+ * len为0时释放inode及其数据块。超级块中的inode号由调用者写回
+ *
+ * @param ino 隐藏inode号，0表示不存在，分配或释放后更新
+ * @return int 0成功，否则返回错误码
+ */
+int newfs_hidden_write(int* ino, const void* buf, int len) {
+    struct newfs_inode_d inode_d;
+    int      blk_sz = NEWFS_IO_SZ();
+    int      nbytes = newfs_hidden_bytes(len);
+    int      nblks  = (nbytes + blk_sz - 1) / blk_sz;
+    uint8_t* out;
+    int      ret    = NEWFS_ERROR_NONE;
+
+    if (nblks > NEWFS_DATA_PER_FILE) {
+        return -NEWFS_ERROR_NOSPACE;
+    }
+    memset(&inode_d, 0, sizeof(inode_d));
+    if (*ino != 0) {
+        if (newfs_inode_d_read(*ino, &inode_d) != NEWFS_ERROR_NONE) {
+            return -NEWFS_ERROR_IO;
+        }
+    } else if (len > 0) {
+        int new_ino = newfs_alloc_ino();
+        if (new_ino < 0) {
+            return -NEWFS_ERROR_NOSPACE;
+        }
+        *ino          = new_ino;
+        inode_d.ino   = new_ino;
+        inode_d.ftype = NEWFS_REG_FILE;
+        memset(inode_d.data, 0xFF, sizeof(inode_d.data));
+        inode_d.xattr_blk = (uint32_t)-1;
+    } else {
+        return NEWFS_ERROR_NONE;
+    }
+
+    for (int b = 0; b < NEWFS_DATA_PER_FILE; b++) {
+        if (b >= nblks && !NEWFS_BLK_HOLE(inode_d.data[b])) {
+            newfs_free_blk(inode_d.data[b]);                /* 内容变少，释放多余的块 */
+            inode_d.data[b] = (uint32_t)-1;
+        } else if (b < nblks && NEWFS_BLK_HOLE(inode_d.data[b])) {
+            int blkno = newfs_alloc_blk();
+            if (blkno < 0) {
+                return -NEWFS_ERROR_NOSPACE;
+            }
+            inode_d.data[b] = blkno;
+        }
+    }
+    if (len == 0) {
+        newfs_free_ino(*ino);
+        *ino = 0;
+        return NEWFS_ERROR_NONE;
+    }
+    out = (uint8_t *)calloc(nblks, blk_sz);
+    memcpy(out, buf, len);
+    if (nbytes > len) {
+        uint32_t crc = newfs_crc32c(buf, len);
+        memcpy(out + len, &crc, sizeof(crc));
+    }
+    for (int b = 0; b < nblks; b++) {
+        ret |= your_write(NEWFS_DATA_OFS(inode_d.data[b]), out + b * blk_sz, blk_sz);
+    }
+    free(out);
+    inode_d.size = len;
+    ret |= newfs_inode_d_write(*ino, &inode_d);
+    return ret ? -NEWFS_ERROR_IO : NEWFS_ERROR_NONE;
 }
 
 /**
- * @brief 从磁盘中读取inode节点
+ * @brief 从磁盘中读取inode节点并加入inode缓存。
+ * 目录的子目录项、文件的数据块都不在这里读入，分别由newfs_dir_load和读写路径按需加载。
+ * 读失败或校验不符时inode按空文件/空目录处理并标记csum_bad，访问返回EIO，磁盘上的内容留给fsck
  * 
  * @param dentry dentry指向ino，读取该inode
  * @param ino inode唯一编号
  * @return struct newfs_inode* 
  */
 struct newfs_inode* newfs_read_inode(struct newfs_dentry * dentry, int ino){
-	struct newfs_inode* inode = (struct newfs_inode *)malloc(sizeof(struct newfs_inode));
+	struct newfs_inode* inode = (struct newfs_inode *)newfs_slab_alloc(&newfs_inode_slab);
 	struct newfs_inode_d inode_d;
-    struct newfs_dentry* sub_dentry;
-    struct newfs_dentry_d dentry_d;
-	int    dir_cnt = 0, i = 0;
-
-	// 计算inode在磁盘中的偏移
-    int inodes_per_block = NEWFS_IO_SZ() / sizeof(struct newfs_inode_d);
-    int off = (ino / inodes_per_block);
-    int idx = ino % inodes_per_block;
-	int inode_offset = super.inode_offset + off * NEWFS_IO_SZ() + idx * sizeof(struct newfs_inode_d);
-	// 读取inode到内存
-	your_read(inode_offset, &inode_d, sizeof(struct newfs_inode_d));
-
-	inode->dir_cnt = 0;
+	int    i = 0;
+	int    slot = newfs_snap_slot(ino);
+
+	// 读取inode到内存，inode_d按槽位连续存放；只读挂载快照时读快照时刻的版本
+	inode->csum_bad = slot < 0 || newfs_inode_d_read(slot, &inode_d) != NEWFS_ERROR_NONE;
+	if (inode->csum_bad) {
+		memset(&inode_d, 0, sizeof(inode_d));
+		memset(inode_d.data, 0xFF, sizeof(inode_d.data));
+		inode_d.ino   = ino;
+		inode_d.ftype = dentry->ftype;
+		inode_d.xattr_blk = (uint32_t)-1;
+	}
+
 	inode->ino = inode_d.ino;
 	inode->size = inode_d.size;
 	inode->ftype = inode_d.ftype;
-	// memcpy(inode->target_path, inode_d.target_path, SFS_MAX_FILE_NAME);
+	inode->dir_cnt = NEWFS_IS_DIR(inode) ? inode_d.dir_cnt : 0;
+	inode->nlink = NEWFS_IS_DIR(inode) || inode_d.nlink <= 0 ? 1 : inode_d.nlink;
     inode->dentry = dentry;
     inode->dentrys = NULL;
+    inode->dirty = false;
+    inode->dirty_next = NULL;
+    inode->dir_loaded = inode->csum_bad;
+    inode->unlinked = false;
+    inode->reclaim_next = NULL;
+    inode->ref = 0;
+    inode->nr_cached = 0;
+    inode->lru_prev = inode->lru_next = inode->hash_next = NULL;
+    inode->snap_gen = 0;
 	for (i = 0; i < NEWFS_DATA_PER_FILE; i++) {
         inode->data[i] = inode_d.data[i];
-        // inode->data_blks[i] = NULL;
-    }
-
-	/* 内存中的inode的数据或子目录项部分也需要读出 */
-	if (NEWFS_IS_DIR(inode)) {
-		// 读取目录项
-        inode->dir_cnt = inode_d.dir_cnt;
-		dir_cnt = inode->dir_cnt;
-        int i = 0, j;
-        while (inode_d.data[i] != -1 && i < NEWFS_DATA_PER_FILE) {
-            int dentry_block = inode->data[i];
-            int max_dentries_per_block = NEWFS_IO_SZ() / sizeof(struct newfs_dentry_d);
-
-            for (j = 0; j < max_dentries_per_block; j++) {
-                if (i * max_dentries_per_block + j >= dir_cnt) {
-                    break;  /* 读完所有目录项 */
-                }
-                int offset_in_block = j;
-                // 计算目录项在磁盘中的偏移
-                int dentry_offset = NEWFS_DATA_OFS(dentry_block) + offset_in_block * sizeof(struct newfs_dentry_d);
-                // 读取目录项到内存
-                your_read(dentry_offset, &dentry_d, sizeof(struct newfs_dentry_d));
-
-                sub_dentry = new_dentry(dentry_d.name, dentry_d.ftype);
-                sub_dentry->ino    = dentry_d.ino;
-                sub_dentry->parent = inode->dentry;
-                newfs_alloc_dentry(inode, sub_dentry);
+        inode->data_blks[i] = NULL;
+    }
+    memset(inode->blk_dirty, 0, sizeof(inode->blk_dirty));
+    /* inode内的扩展属性随inode一起读入，之后读取不再访问设备 */
+    inode->xattr_blk = inode_d.xattr_blk;
+    inode->xattr_len = inode_d.xattr_len <= NEWFS_XATTR_INLINE
+                       && newfs_xattr_ents_ok(inode_d.xattr, inode_d.xattr_len) ? inode_d.xattr_len : 0;
+    memcpy(inode->xattr, inode_d.xattr, inode->xattr_len);
+    if (NEWFS_IS_INLINE_LINK(inode)) {
+        /* 短目标存放在data[]中，移到缓冲里，data[]恢复为无数据块 */
+        inode->data_blks[0] = newfs_buf_alloc();
+        newfs_icache_charge(NEWFS_IO_SZ());
+        memcpy(inode->data_blks[0], inode_d.data, inode->size);
+        memset(inode->data, 0xFF, sizeof(inode->data));
+    }
+
+    dentry->inode = inode;
+    newfs_icache_insert(inode);
+	return inode;
+}
+
+/**
+ * @brief 按需读入目录的全部子目录项，已读入时直接返回
+ * 
+ * @param inode 目录inode
+ * @return int 0成功，否则返回错误码
+ */
+int newfs_dir_load(struct newfs_inode * inode) {
+    struct newfs_dentry*   sub_dentry;
+    struct newfs_dentry_d* dentry_d;
+    int    max_dentries_per_block = NEWFS_IO_SZ() / sizeof(struct newfs_dentry_d);
+    int    dir_cnt = inode->dir_cnt;
+    uint8_t* blk_buf;
+
+    if (!NEWFS_IS_DIR(inode) || inode->dir_loaded) {
+        return NEWFS_ERROR_NONE;
+    }
+
+    blk_buf = newfs_buf_alloc();
+    for (int i = 0; i < NEWFS_DATA_PER_FILE && i * max_dentries_per_block < dir_cnt; i++) {
+        if (inode->data[i] == -1) {
+            break;
+        }
+        // 后端支持映射时直接解析设备上的目录项，否则整块读入
+        dentry_d = (struct newfs_dentry_d *)newfs_bdev_map(NEWFS_DRIVER(), NEWFS_DATA_OFS(inode->data[i]), NEWFS_IO_SZ());
+        if (dentry_d == NULL) {
+            if (your_read(NEWFS_DATA_OFS(inode->data[i]), blk_buf, NEWFS_IO_SZ()) != NEWFS_ERROR_NONE) {
+                NEWFS_TRACE(NEWFS_TC_DENTRY, NEWFS_TL_ERR, "inode %d: io error", inode->ino);
+                newfs_buf_free(blk_buf);
+                return -NEWFS_ERROR_IO;
             }
-            i++;
+            dentry_d = (struct newfs_dentry_d *)blk_buf;
         }
-	} else if (NEWFS_IS_REG(inode)) {
-        // 读取文件数据
-        for(int blk_cnt = 0; blk_cnt < NEWFS_DATA_PER_FILE; blk_cnt++){
-            if(inode->data[blk_cnt] == -1) break;
-            inode->data_blks[blk_cnt] = (uint8_t *)malloc(NEWFS_IO_SZ());
-            if (your_read(NEWFS_DATA_OFS(inode->data[blk_cnt]), inode->data_blks[blk_cnt], 
-                                NEWFS_IO_SZ()) != NEWFS_ERROR_NONE) {
-                NEWFS_DBG("[%s] io error\n", __func__);
-                return NULL;                    
+        if (NEWFS_CSUM_ON() && !newfs_csum_dirblk_ok(dentry_d, NEWFS_IO_SZ())) {
+            /* 目录块损坏：丢弃已读入的目录项，目录按空处理且不再写回，访问返回EIO */
+            NEWFS_TRACE(NEWFS_TC_DENTRY, NEWFS_TL_ERR, "inode %d: dentry block %d checksum mismatch",
+                        inode->ino, i);
+            while (inode->dentrys != NULL) {
+                sub_dentry     = inode->dentrys;
+                inode->dentrys = sub_dentry->brother;
+                free_dentry(sub_dentry);
+                newfs_icache_charge(-(long)sizeof(struct newfs_dentry));
             }
+            newfs_buf_free(blk_buf);
+            newfs_clear_dirty(inode);
+            inode->csum_bad   = true;
+            inode->dir_loaded = true;
+            return -NEWFS_ERROR_IO;
         }
-
-	}
-	return inode;
+        for (int j = 0; j < max_dentries_per_block; j++) {
+            if (i * max_dentries_per_block + j >= dir_cnt) {
+                break;  /* 读完所有目录项 */
+            }
+            sub_dentry = new_dentry(dentry_d[j].name, dentry_d[j].ftype);
+            sub_dentry->ino    = dentry_d[j].ino;
+            sub_dentry->parent = inode->dentry;
+            /* 目录项已在磁盘数据块中，只挂入链表，不能再走newfs_alloc_dentry重复分配块和计数 */
+            sub_dentry->brother = inode->dentrys;
+            inode->dentrys      = sub_dentry;
+            newfs_icache_charge(sizeof(struct newfs_dentry));
+        }
+    }
+    newfs_buf_free(blk_buf);
+    inode->dir_loaded = true;
+    return NEWFS_ERROR_NONE;
 }
 
 /**
@@ -393,39 +1392,42 @@ struct newfs_dentry* newfs_lookup(const char * path, bool* is_find, bool* is_roo
     int   lvl = 0;
     bool  is_hit;
     char* fname = NULL;
-    char* path_cpy = (char*)malloc(strlen(path));
+    char* path_cpy;
+    uint64_t start = newfs_stat_now();
 	*is_root = false;
-    strcpy(path_cpy, path);
+	*is_find = false;
+
+    /* 在两次操作之间回收缓存，不会淘汰本次查找路径上的inode */
+    newfs_icache_shrink();
 
     if (total_lvl == 0) {                           	/* 根目录 */
 		*is_find = true;
 		*is_root = true;
         dentry_ret = super.root_dentry;
+        newfs_stat_end(NEWFS_OP_LOOKUP, start, NEWFS_ERROR_NONE);
 		return dentry_ret;
     }
+    path_cpy = strdup(path);
 	fname = strtok(path_cpy, "/");   
     while (fname)
     {   
         lvl++;
-        if (dentry_cursor->inode == NULL) {             /* Cache机制 */
-            newfs_read_inode(dentry_cursor, dentry_cursor->ino);
-        }
+        inode = newfs_iget(dentry_cursor);              /* Cache机制 */
 
-        inode = dentry_cursor->inode;
-
-        if (NEWFS_IS_REG(inode) && lvl < total_lvl) {
-			// 是文件类型但是还没到最后一级，报错
-            NEWFS_DBG("[%s] not a dir\n", __func__);
+        if (!NEWFS_IS_DIR(inode)) {
+			// 路径中间一级不是目录(还要在其中查找fname)，报错
+            NEWFS_TRACE(NEWFS_TC_DENTRY, NEWFS_TL_DEBUG, "%s: not a dir", inode->dentry->name);
             dentry_ret = inode->dentry;
             break;
         }
         if (NEWFS_IS_DIR(inode)) {
+            newfs_dir_load(inode);                      /* 子目录项按需读入 */
             dentry_cursor = inode->dentrys;
             is_hit        = false;
 
             while (dentry_cursor)   /* 遍历子目录项 */
             {
-                if (memcmp(dentry_cursor->name, fname, strlen(fname)) == 0) {
+                if (strcmp(dentry_cursor->name, fname) == 0) {
                     is_hit = true;
                     break;
                 }
@@ -435,7 +1437,7 @@ struct newfs_dentry* newfs_lookup(const char * path, bool* is_find, bool* is_roo
             if (!is_hit) {
                 // 未找到，返回上一级目录项
 				*is_find = false;
-                NEWFS_DBG("[%s] not found: %s\n", __func__, fname);
+                NEWFS_TRACE(NEWFS_TC_DENTRY, NEWFS_TL_DEBUG, "not found: %s", fname);
                 dentry_ret = inode->dentry;
                 break;
             }
@@ -448,11 +1450,10 @@ struct newfs_dentry* newfs_lookup(const char * path, bool* is_find, bool* is_roo
         }
         fname = strtok(NULL, "/"); 
     }
+    free(path_cpy);
 
-    if (dentry_ret->inode == NULL) {
-        dentry_ret->inode = newfs_read_inode(dentry_ret, dentry_ret->ino);
-    }
-    
+    newfs_iget(dentry_ret);
+    newfs_stat_end(NEWFS_OP_LOOKUP, start, *is_find ? NEWFS_ERROR_NONE : -NEWFS_ERROR_NOTFOUND);
     return dentry_ret;
 }
 
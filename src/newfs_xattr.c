@@ -0,0 +1,439 @@
+#include "newfs.h"
+#include <sys/xattr.h>
+
+extern struct newfs_super    super;
+
+/******************************************************************************
+* SECTION: 扩展属性
+* 属性存放在inode槽位末尾的扩展属性区(xattr[])中，随inode一次读入，之后读取只查内存，
+* 不再访问设备；放不下的属性存放在该inode的一个属性块(xattr_blk)中，该inode所有大属性共用这一块。
+* 两处都是首尾相接的newfs_xattr_ent_d条目，属性块前面另有头部与校验和。
+* 设置时优先放在inode内，放不下才写入属性块；属性块在修改时立即写回，inode标记为脏，随inode写回。
+* 快照保存inode时复制一份属性块归快照所有，与目录块相同，属性块因此总是只有一个引用。
+* 只有带NEWFS_FEAT_XATTR的文件系统支持扩展属性，旧镜像的操作返回EOPNOTSUPP。
+*******************************************************************************/
+struct newfs_xattr_stat xattr_stat;
+
+/**
+ * @brief 条目占用的字节数
+ */
+static int xattr_ent_size(int name_len, int value_len) {
+    return (int)sizeof(struct newfs_xattr_ent_d) + name_len + value_len;
+}
+
+/**
+ * @brief 属性块最多能存放的条目字节数
+ */
+static int xattr_blk_cap(int blk_sz) {
+    return blk_sz - (int)sizeof(struct newfs_xattr_blk_d);
+}
+
+/**
+ * @brief 条目序列是否完整：每项名字非空，且恰好铺满len字节。只依赖参数，fsck同样使用
+ */
+bool newfs_xattr_ents_ok(const uint8_t* ents, int len) {
+    struct newfs_xattr_ent_d ent;
+    int ofs = 0;
+
+    while (ofs < len) {
+        if (len - ofs < (int)sizeof(ent)) {
+            return false;
+        }
+        memcpy(&ent, ents + ofs, sizeof(ent));
+        if (ent.name_len == 0 || xattr_ent_size(ent.name_len, ent.value_len) > len - ofs) {
+            return false;
+        }
+        ofs += xattr_ent_size(ent.name_len, ent.value_len);
+    }
+    return ofs == len;
+}
+
+/**
+ * @brief 属性块是否可用：幻数、长度、条目与校验和。只依赖参数，fsck同样使用
+ *
+ * @param blk 整个属性块
+ * @param blk_sz 逻辑块大小
+ * @param csum 文件系统是否带NEWFS_FEAT_CSUM
+ */
+bool newfs_xattr_blk_ok(const void* blk, int blk_sz, bool csum) {
+    const struct newfs_xattr_blk_d* hdr  = (const struct newfs_xattr_blk_d *)blk;
+    const uint8_t*                  ents = (const uint8_t *)blk + sizeof(*hdr);
+
+    if (hdr->magic != NEWFS_XATTR_MAGIC || hdr->len > (uint32_t)xattr_blk_cap(blk_sz)
+        || !newfs_xattr_ents_ok(ents, hdr->len)) {
+        return false;
+    }
+    return !csum || newfs_crc32c(ents, hdr->len) == hdr->csum;
+}
+
+/**
+ * @brief 在条目序列中查找名字
+ *
+ * @param ent 找到时返回条目头部
+ * @return int 条目的偏移，没有找到返回-1
+ */
+static int xattr_find(const uint8_t* ents, int len, const char* name, int name_len,
+                      struct newfs_xattr_ent_d* ent) {
+    int ofs = 0;
+
+    while (ofs < len) {
+        memcpy(ent, ents + ofs, sizeof(*ent));
+        if (ent->name_len == name_len && memcmp(ents + ofs + sizeof(*ent), name, name_len) == 0) {
+            return ofs;
+        }
+        ofs += xattr_ent_size(ent->name_len, ent->value_len);
+    }
+    return -1;
+}
+
+/**
+ * @brief 删除偏移ofs处的条目，后面的条目前移
+ */
+static void xattr_del(uint8_t* ents, int* len, int ofs) {
+    struct newfs_xattr_ent_d ent;
+    int sz;
+
+    memcpy(&ent, ents + ofs, sizeof(ent));
+    sz = xattr_ent_size(ent.name_len, ent.value_len);
+    memmove(ents + ofs, ents + ofs + sz, *len - ofs - sz);
+    *len -= sz;
+}
+
+/**
+ * @brief 在末尾追加一个条目，调用者已保证放得下
+ */
+static void xattr_add(uint8_t* ents, int* len, const char* name, int name_len,
+                      const void* value, int value_len) {
+    struct newfs_xattr_ent_d ent;
+
+    ent.name_len  = name_len;
+    ent.pad       = 0;
+    ent.value_len = value_len;
+    memcpy(ents + *len, &ent, sizeof(ent));
+    memcpy(ents + *len + sizeof(ent), name, name_len);
+    if (value_len > 0) {
+        memcpy(ents + *len + sizeof(ent) + name_len, value, value_len);
+    }
+    *len += xattr_ent_size(name_len, value_len);
+}
+
+/**
+ * @brief 读入inode的属性块并校验
+ *
+ * @param buf 一个逻辑块大小的缓冲区，条目从头部之后开始
+ * @param len 返回条目字节数，没有属性块时为0
+ * @return int 0成功；读失败或属性块损坏返回-NEWFS_ERROR_IO
+ */
+static int xattr_blk_load(struct newfs_inode* inode, uint8_t* buf, int* len) {
+    *len = 0;
+    if (NEWFS_BLK_HOLE(inode->xattr_blk)) {
+        return NEWFS_ERROR_NONE;
+    }
+    xattr_stat.blk_reads++;
+    if (inode->xattr_blk >= (uint32_t)super.data_blks
+        || your_read(NEWFS_DATA_OFS(inode->xattr_blk), buf, NEWFS_IO_SZ()) != NEWFS_ERROR_NONE
+        || !newfs_xattr_blk_ok(buf, NEWFS_IO_SZ(), NEWFS_CSUM_ON())) {
+        NEWFS_TRACE(NEWFS_TC_INODE, NEWFS_TL_ERR, "inode %d: bad xattr block %u", inode->ino, inode->xattr_blk);
+        return -NEWFS_ERROR_IO;
+    }
+    *len = ((struct newfs_xattr_blk_d *)buf)->len;
+    return NEWFS_ERROR_NONE;
+}
+
+/**
+ * @brief 写回属性块：没有条目时释放，没有块时先分配
+ *
+ * @param buf xattr_blk_load读入并修改后的缓冲区
+ * @param len 条目字节数
+ * @return int 0成功，否则返回错误码
+ */
+static int xattr_blk_store(struct newfs_inode* inode, uint8_t* buf, int len) {
+    struct newfs_xattr_blk_d* hdr = (struct newfs_xattr_blk_d *)buf;
+    int blkno;
+
+    if (len == 0) {
+        if (!NEWFS_BLK_HOLE(inode->xattr_blk)) {
+            newfs_free_blk(inode->xattr_blk);
+            inode->xattr_blk = (uint32_t)-1;
+        }
+        return NEWFS_ERROR_NONE;
+    }
+    blkno = NEWFS_BLK_HOLE(inode->xattr_blk) ? newfs_alloc_blk() : (int)inode->xattr_blk;
+    if (blkno < 0) {
+        return -NEWFS_ERROR_NOSPACE;
+    }
+    hdr->magic = NEWFS_XATTR_MAGIC;
+    hdr->len   = len;
+    hdr->csum  = NEWFS_CSUM_ON() ? newfs_crc32c(buf + sizeof(*hdr), len) : 0;
+    memset(buf + sizeof(*hdr) + len, 0, xattr_blk_cap(NEWFS_IO_SZ()) - len);
+    xattr_stat.blk_writes++;
+    if (your_write(NEWFS_DATA_OFS(blkno), buf, NEWFS_IO_SZ()) != NEWFS_ERROR_NONE) {
+        if (NEWFS_BLK_HOLE(inode->xattr_blk)) {
+            newfs_free_blk(blkno);
+        }
+        return -NEWFS_ERROR_IO;
+    }
+    inode->xattr_blk = blkno;
+    return NEWFS_ERROR_NONE;
+}
+
+/**
+ * @brief 读取属性值，inode内的属性不访问设备
+ *
+ * @param name 属性名，含名字空间前缀，如"user.split"
+ * @param buf 输出缓冲区
+ * @param size 缓冲区大小，0表示只查询值的长度
+ * @return int 值的长度；没有该属性返回-NEWFS_ERROR_NODATA，缓冲区不够返回-NEWFS_ERROR_RANGE
+ */
+int newfs_xattr_get(struct newfs_inode* inode, const char* name, void* buf, size_t size) {
+    struct newfs_xattr_ent_d ent;
+    const uint8_t* ents = inode->xattr;
+    uint8_t* blk = NULL;
+    int name_len = strlen(name), len, ofs, ret;
+
+    if (!NEWFS_XATTR_ON()) {
+        return -NEWFS_ERROR_NOTSUP;
+    }
+    xattr_stat.gets++;
+    ofs = xattr_find(inode->xattr, inode->xattr_len, name, name_len, &ent);
+    if (ofs >= 0) {
+        xattr_stat.inline_hits++;
+    } else if (!NEWFS_BLK_HOLE(inode->xattr_blk)) {
+        blk = newfs_buf_alloc();
+        if ((ret = xattr_blk_load(inode, blk, &len)) != NEWFS_ERROR_NONE) {
+            newfs_buf_free(blk);
+            return ret;
+        }
+        ents = blk + sizeof(struct newfs_xattr_blk_d);
+        ofs  = xattr_find(ents, len, name, name_len, &ent);
+    }
+    if (ofs < 0) {
+        ret = -NEWFS_ERROR_NODATA;
+    } else if (size == 0) {
+        ret = ent.value_len;
+    } else if (size < ent.value_len) {
+        ret = -NEWFS_ERROR_RANGE;
+    } else {
+        memcpy(buf, ents + ofs + sizeof(ent) + ent.name_len, ent.value_len);
+        ret = ent.value_len;
+    }
+    if (blk) {
+        newfs_buf_free(blk);
+    }
+    return ret;
+}
+
+/**
+ * @brief 把条目序列中的名字依次以'\0'结尾追加到buf
+ */
+static int xattr_names(const uint8_t* ents, int len, char* buf, size_t size, int total) {
+    struct newfs_xattr_ent_d ent;
+
+    for (int ofs = 0; ofs < len; ofs += xattr_ent_size(ent.name_len, ent.value_len)) {
+        memcpy(&ent, ents + ofs, sizeof(ent));
+        if (size > 0 && (size_t)total + ent.name_len + 1 <= size) {
+            memcpy(buf + total, ents + ofs + sizeof(ent), ent.name_len);
+            buf[total + ent.name_len] = '\0';
+        }
+        total += ent.name_len + 1;
+    }
+    return total;
+}
+
+/**
+ * @brief 列出全部属性名，每个以'\0'结尾
+ *
+ * @param size 缓冲区大小，0表示只查询所需长度
+ * @return int 名字的总长度；缓冲区不够返回-NEWFS_ERROR_RANGE
+ */
+int newfs_xattr_list(struct newfs_inode* inode, char* buf, size_t size) {
+    uint8_t* blk;
+    int total, len, ret;
+
+    if (!NEWFS_XATTR_ON()) {
+        return 0;
+    }
+    xattr_stat.gets++;
+    total = xattr_names(inode->xattr, inode->xattr_len, buf, size, 0);
+    if (!NEWFS_BLK_HOLE(inode->xattr_blk)) {
+        blk = newfs_buf_alloc();
+        ret = xattr_blk_load(inode, blk, &len);
+        if (ret == NEWFS_ERROR_NONE) {
+            total = xattr_names(blk + sizeof(struct newfs_xattr_blk_d), len, buf, size, total);
+        }
+        newfs_buf_free(blk);
+        if (ret != NEWFS_ERROR_NONE) {
+            return ret;
+        }
+    } else {
+        xattr_stat.inline_hits++;
+    }
+    return size > 0 && (size_t)total > size ? -NEWFS_ERROR_RANGE : total;
+}
+
+/**
+ * @brief newfs_xattr_set的主体，blk为调用者提供的块缓冲区
+ */
+static int xattr_set(struct newfs_inode* inode, const char* name, const void* value, int size,
+                     int flags, uint8_t* blk) {
+    struct newfs_xattr_ent_d ent;
+    uint8_t* ents     = blk + sizeof(struct newfs_xattr_blk_d);
+    int      name_len = strlen(name);
+    int      need     = xattr_ent_size(name_len, size);
+    int      blk_len  = 0, blk_ofs = -1, in_ofs, in_old = 0, ret;
+    bool     blk_loaded = false, inline_fits;
+
+    in_ofs = xattr_find(inode->xattr, inode->xattr_len, name, name_len, &ent);
+    if (in_ofs >= 0) {
+        in_old = xattr_ent_size(ent.name_len, ent.value_len);
+    }
+    inline_fits = inode->xattr_len - in_old + need <= NEWFS_XATTR_INLINE;
+
+    /* inode内没有时要查属性块，放不进inode时要改属性块，两种情况都先读入 */
+    if (in_ofs < 0 || !inline_fits) {
+        if ((ret = xattr_blk_load(inode, blk, &blk_len)) != NEWFS_ERROR_NONE) {
+            return ret;
+        }
+        blk_loaded = true;
+        blk_ofs    = in_ofs < 0 ? xattr_find(ents, blk_len, name, name_len, &ent) : -1;
+    }
+    if ((flags & XATTR_CREATE) && (in_ofs >= 0 || blk_ofs >= 0)) {
+        return -NEWFS_ERROR_EXISTS;
+    }
+    if ((flags & XATTR_REPLACE) && in_ofs < 0 && blk_ofs < 0) {
+        return -NEWFS_ERROR_NODATA;
+    }
+    if (!inline_fits) {
+        int blk_old = blk_ofs >= 0 ? xattr_ent_size(ent.name_len, ent.value_len) : 0;
+        if (blk_len - blk_old + need > xattr_blk_cap(NEWFS_IO_SZ())
+            || (NEWFS_BLK_HOLE(inode->xattr_blk) && super.free_blk_cnt == 0)) {
+            return -NEWFS_ERROR_NOSPACE;
+        }
+    }
+    if ((ret = newfs_snap_cow(inode)) != NEWFS_ERROR_NONE) {
+        return ret;
+    }
+
+    /* 先写属性块，失败时inode内的属性保持不变 */
+    if (blk_ofs >= 0) {
+        xattr_del(ents, &blk_len, blk_ofs);
+    }
+    if (!inline_fits) {
+        xattr_add(ents, &blk_len, name, name_len, value, size);
+        xattr_stat.spills++;
+    }
+    if (blk_loaded && (blk_ofs >= 0 || !inline_fits)
+        && (ret = xattr_blk_store(inode, blk, blk_len)) != NEWFS_ERROR_NONE) {
+        return ret;
+    }
+    if (in_ofs >= 0) {
+        xattr_del(inode->xattr, &inode->xattr_len, in_ofs);
+    }
+    if (inline_fits) {
+        xattr_add(inode->xattr, &inode->xattr_len, name, name_len, value, size);
+    }
+    newfs_mark_dirty(inode);
+    return NEWFS_ERROR_NONE;
+}
+
+/**
+ * @brief 设置属性：放得进inode的扩展属性区就放在inode内，否则写入属性块
+ *
+ * @param name 属性名，含名字空间前缀
+ * @param value 属性值，可以为空
+ * @param size 值的长度
+ * @param flags XATTR_CREATE要求属性不存在，XATTR_REPLACE要求属性已存在
+ * @return int 0成功，否则返回错误码
+ */
+int newfs_xattr_set(struct newfs_inode* inode, const char* name, const void* value, size_t size, int flags) {
+    size_t   name_len = strlen(name);
+    uint8_t* blk;
+    int      ret;
+
+    if (!NEWFS_XATTR_ON()) {
+        return -NEWFS_ERROR_NOTSUP;
+    }
+    if (name_len == 0) {
+        return -NEWFS_ERROR_INVAL;
+    }
+    if (name_len > NEWFS_XATTR_NAME_MAX) {
+        return -NEWFS_ERROR_RANGE;
+    }
+    if (size > UINT16_MAX || xattr_ent_size(name_len, size) > xattr_blk_cap(NEWFS_IO_SZ())) {
+        return -NEWFS_ERROR_NOSPACE;
+    }
+    blk = newfs_buf_alloc();
+    ret = xattr_set(inode, name, value, (int)size, flags, blk);
+    newfs_buf_free(blk);
+    return ret;
+}
+
+/**
+ * @brief 删除属性，属性块中的最后一个属性删除后释放属性块
+ *
+ * @return int 0成功；没有该属性返回-NEWFS_ERROR_NODATA
+ */
+int newfs_xattr_remove(struct newfs_inode* inode, const char* name) {
+    struct newfs_xattr_ent_d ent;
+    int      name_len = strlen(name), len, ofs, ret;
+    uint8_t* blk;
+
+    if (!NEWFS_XATTR_ON()) {
+        return -NEWFS_ERROR_NOTSUP;
+    }
+    ofs = xattr_find(inode->xattr, inode->xattr_len, name, name_len, &ent);
+    if (ofs >= 0) {
+        if ((ret = newfs_snap_cow(inode)) != NEWFS_ERROR_NONE) {
+            return ret;
+        }
+        xattr_del(inode->xattr, &inode->xattr_len, ofs);
+        newfs_mark_dirty(inode);
+        return NEWFS_ERROR_NONE;
+    }
+    if (NEWFS_BLK_HOLE(inode->xattr_blk)) {
+        return -NEWFS_ERROR_NODATA;
+    }
+
+    blk = newfs_buf_alloc();
+    if ((ret = xattr_blk_load(inode, blk, &len)) == NEWFS_ERROR_NONE) {
+        ofs = xattr_find(blk + sizeof(struct newfs_xattr_blk_d), len, name, name_len, &ent);
+        if (ofs < 0) {
+            ret = -NEWFS_ERROR_NODATA;
+        } else if ((ret = newfs_snap_cow(inode)) == NEWFS_ERROR_NONE) {
+            xattr_del(blk + sizeof(struct newfs_xattr_blk_d), &len, ofs);
+            ret = xattr_blk_store(inode, blk, len);
+            newfs_mark_dirty(inode);
+        }
+    }
+    newfs_buf_free(blk);
+    return ret;
+}
+
+/**
+ * @brief 快照保存inode时为旧版本复制一份属性块，inode内的属性随槽位一起复制
+ *
+ * @param inode_d 保存到快照的旧inode，xattr_blk改为新块
+ * @return int 0成功，否则返回错误码
+ */
+int newfs_xattr_copy(struct newfs_inode_d* inode_d) {
+    uint8_t* buf;
+    int blkno, ret = NEWFS_ERROR_NONE;
+
+    if (NEWFS_BLK_HOLE(inode_d->xattr_blk)) {
+        return NEWFS_ERROR_NONE;
+    }
+    if ((blkno = newfs_alloc_blk()) < 0) {
+        return -NEWFS_ERROR_NOSPACE;
+    }
+    buf = newfs_buf_alloc();
+    if (inode_d->xattr_blk >= (uint32_t)super.data_blks
+        || your_read(NEWFS_DATA_OFS(inode_d->xattr_blk), buf, NEWFS_IO_SZ()) != NEWFS_ERROR_NONE
+        || your_write(NEWFS_DATA_OFS(blkno), buf, NEWFS_IO_SZ()) != NEWFS_ERROR_NONE) {
+        newfs_free_blk(blkno);
+        ret = -NEWFS_ERROR_IO;
+    } else {
+        inode_d->xattr_blk = blkno;
+    }
+    newfs_buf_free(buf);
+    return ret;
+}
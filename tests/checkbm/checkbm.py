@@ -27,7 +27,7 @@ TOKENS_TOBE_CHECK = [SUPER, INODE_MAP, DATA_MAP, INODE]
 """ Path Resolution """
 root = os.path.split(os.path.realpath(__file__))[0]
 home = os.environ['HOME']
-ddriver = home + "/ddriver"
+ddriver = os.environ.get("NEWFS_IMAGE", home + "/ddriver")   # NEWFS_IMAGE: 使用mmap镜像文件后端时的镜像路径
 
 parser = argparse.ArgumentParser()
 parser.add_argument("-l", "--layout", help="absolute path of .layout file")
@@ -3,8 +3,11 @@ POINTS=0
 TOTAL_POINTS=0
 TEST_CASES=(mount.sh mkdir.sh touch.sh ls.sh remount.sh)
 # mount.sh mkdir.sh touch.sh ls.sh remount.sh (read.sh write.sh cp.sh)
-ALL_TEST_CASES=(mount.sh mkdir.sh touch.sh ls.sh remount.sh rw.sh cp.sh)
-ALL_TEST_SCORES=(1 4 5 4 16 2 2)
+# 扩展特性测试(等级7)，每项特性一个用例
+FEATURE_TEST_CASES=(statfs.sh clean_umount.sh lazy_load.sh slab.sh mmap.sh async.sh fhandle.sh blksize.sh bench.sh stats.sh trace.sh replay.sh fsck.sh unlink.sh rename.sh fallocate.sh sparse.sh clone.sh compress.sh dedup.sh csum.sh snapshot.sh link.sh prefetch.sh xattr.sh)
+FEATURE_TEST_SCORES=(4 3 2 1 2 2 3 3 2 2 3 3 2 3 3 3 3 3 3 3 3 3 3 3 3)
+ALL_TEST_CASES=(mount.sh mkdir.sh touch.sh ls.sh remount.sh rw.sh cp.sh "${FEATURE_TEST_CASES[@]}")
+ALL_TEST_SCORES=(1 4 5 4 16 2 2 "${FEATURE_TEST_SCORES[@]}")
 MNTPOINT='./mnt'
 PROJECT_NAME="newfs"
 
@@ -35,6 +38,10 @@ elif [[ "${LEVEL}" == "6" ]]; then
     echo "开始mount, mkdir, touch, ls, read&write, cp, umount测试"
     TEST_CASES=(mount.sh mkdir.sh touch.sh ls.sh remount.sh rw.sh cp.sh)
     sleep 1
+elif [[ "${LEVEL}" == "7" ]]; then
+    echo "开始扩展特性测试"
+    TEST_CASES=("${FEATURE_TEST_CASES[@]}")
+    sleep 1
 else
     echo "未知测试参数"
     exit 1
@@ -78,9 +85,14 @@ function core_tester() {
     fi
 }
 
+# 设置NEWFS_IMAGE时改用普通镜像文件(mmap后端)测试，不依赖ddriver
 function clean_ddriver() {
     sleep 1
-    ddriver -r > /dev/null
+    if [[ -n "${NEWFS_IMAGE}" ]]; then
+        rm -f "${NEWFS_IMAGE}"
+    else
+        ddriver -r > /dev/null
+    fi
 }
 
 function pass() {
@@ -95,8 +107,49 @@ function fail() {
 }
 
 # Utils
+function newfs_device() {
+    if [[ -n "${NEWFS_IMAGE}" ]]; then
+        echo "mmap:${NEWFS_IMAGE}"
+    else
+        echo "$HOME/ddriver"
+    fi
+}
+
+# 额外参数原样传给newfs，如mount_fuse --blksize=4096
 function mount_fuse() {
-    "$ROOT_PATH"/../build/"${PROJECT_NAME}" --device="$HOME"/ddriver "${MNTPOINT}"
+    "$ROOT_PATH"/../build/"${PROJECT_NAME}" --device="$(newfs_device)" "$@" "${MNTPOINT}"
+}
+
+# 卸载并等待newfs进程退出，此时元数据已全部写回设备
+function umount_fuse() {
+    umount "${MNTPOINT}"
+    while pgrep -f "${PROJECT_NAME} .*${MNTPOINT}" > /dev/null; do
+        sleep 0.1
+    done
+}
+
+# 模拟异常退出：直接杀掉newfs进程，内存中未写回的状态全部丢失
+function crash_fuse() {
+    pkill -9 -f "${PROJECT_NAME} .*${MNTPOINT}"
+    while pgrep -f "${PROJECT_NAME} .*${MNTPOINT}" > /dev/null; do
+        sleep 0.1
+    done
+    umount "${MNTPOINT}" 2>/dev/null || umount -l "${MNTPOINT}"
+}
+
+# 对测试设备运行fsck.newfs，需在卸载后调用，返回fsck的退出码
+function run_fsck() {
+    "$ROOT_PATH"/../build/fsck."${PROJECT_NAME}" "$@" "$(newfs_device)"
+}
+
+# 读取挂载点下.newfs_stats中[$1]段的$2字段
+function stat_of() {
+    sed -n "/^\[$1\]/,/^\[/s/^$2 //p" "${MNTPOINT}"/.newfs_stats
+}
+
+function remount_fuse() {
+    umount_fuse
+    mount_fuse "$@"
 }
 
 function check_mount() {
@@ -226,6 +279,9 @@ function handle_timeout() {
 echo "测试脚本工程根目录: $ROOT_PATH"
 
 max_execution_time=100
+if [[ "${LEVEL}" == "7" ]]; then
+    max_execution_time=600
+fi
 (
     sleep $max_execution_time
     handle_timeout
@@ -0,0 +1,62 @@
+#!/bin/bash
+
+TEST_CASE="case 13 - async backend"
+
+ASYNC_IMAGE="/tmp/${PROJECT_NAME}_async_test.img"
+ASYNC_SRC="/tmp/${PROJECT_NAME}_async_src"
+
+function compare_files () {
+    _TEST_CASE=$1
+    for i in 0 1 2; do
+        if ! cmp -s "${ASYNC_SRC}"/file$i "${MNTPOINT}"/file$i; then
+            fail "$_TEST_CASE: ${MNTPOINT}/file$i与写入的内容不同"
+            return 1
+        fi
+    done
+    return 0
+}
+
+# 参数为后端scheme，uring不可用时后端自动退回线程池
+function check_async_backend () {
+    _SCHEME=$1
+    _TEST_CASE=$2
+    rm -f "${ASYNC_IMAGE}"
+    "$ROOT_PATH"/../build/"${PROJECT_NAME}" --device="${_SCHEME}:${ASYNC_IMAGE}" "${MNTPOINT}"
+    if ! check_mount; then
+        fail "$_TEST_CASE: 使用--device=${_SCHEME}:${ASYNC_IMAGE}挂载失败"
+        return 1
+    fi
+
+    for i in 0 1 2; do
+        cp "${ASYNC_SRC}"/file$i "${MNTPOINT}"/file$i
+    done
+    if ! compare_files "$_TEST_CASE"; then
+        return 1
+    fi
+    umount_fuse
+    if ! OUTPUT=$("$ROOT_PATH"/../build/fsck."${PROJECT_NAME}" "${_SCHEME}:${ASYNC_IMAGE}"); then
+        fail "$_TEST_CASE: fsck报告错误: ${OUTPUT}"
+        return 1
+    fi
+
+    "$ROOT_PATH"/../build/"${PROJECT_NAME}" --device="${_SCHEME}:${ASYNC_IMAGE}" "${MNTPOINT}"
+    if ! compare_files "$_TEST_CASE"; then
+        return 1
+    fi
+    umount_fuse
+    return 0
+}
+
+mkdir -p "${ASYNC_SRC}"
+for i in 0 1 2; do
+    head -c 300000 /dev/urandom > "${ASYNC_SRC}"/file$i
+done
+
+TEST_CASE="case 13.1 - io_uring backend"
+core_tester echo "uring" check_async_backend "$TEST_CASE"
+
+TEST_CASE="case 13.2 - thread-pool backend"
+core_tester echo "aio" check_async_backend "$TEST_CASE"
+
+clean_mount
+rm -rf "${ASYNC_IMAGE}" "${ASYNC_SRC}"
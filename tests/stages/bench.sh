@@ -0,0 +1,47 @@
+#!/bin/bash
+
+TEST_CASE="case 16 - benchmark"
+
+BENCH_IMAGE="/tmp/${PROJECT_NAME}_bench_test.img"
+BENCH_OUT="/tmp/${PROJECT_NAME}_bench_test.json"
+
+function check_bench_run () {
+    _TEST_CASE=$2
+    rm -f "${BENCH_IMAGE}" "${BENCH_OUT}"
+    if ! "$ROOT_PATH"/../build/"${PROJECT_NAME}"_bench --device=mmap:"${BENCH_IMAGE}" --files=50 --iters=20 \
+            --out="${BENCH_OUT}" 2>/dev/null; then
+        fail "$_TEST_CASE: ${PROJECT_NAME}_bench运行失败"
+        return 1
+    fi
+    return 0
+}
+
+# 每个场景都要有结果，且次数与吞吐都大于0
+function check_bench_json () {
+    _TEST_CASE=$2
+    if ! OUTPUT=$(python3 - "${BENCH_OUT}" <<'PY'
+import json, sys
+res = {r["name"]: r for r in json.load(open(sys.argv[1]))["results"]}
+want = ["mount_format", "umount", "mount", "create", "stat", "unlink", "lookup_deep_cold",
+        "lookup_deep", "readdir_wide", "seq_write_4k", "seq_read_4k", "rand_read_4k", "rand_write_4k"]
+for name in want:
+    if name not in res:
+        sys.exit("missing scenario " + name)
+    r = res[name]
+    if r["ops"] <= 0 or r["ops_per_sec"] <= 0 or not 0 <= r["lat_us"]["p50"] <= r["lat_us"]["max"]:
+        sys.exit("bad result for " + name)
+PY
+    ); then
+        fail "$_TEST_CASE: 基准测试的JSON结果不正确: ${OUTPUT}"
+        return 1
+    fi
+    return 0
+}
+
+TEST_CASE="case 16.1 - run ${PROJECT_NAME}_bench on an image"
+core_tester echo "$TEST_CASE" check_bench_run "$TEST_CASE"
+
+TEST_CASE="case 16.2 - benchmark JSON lists every scenario"
+core_tester echo "$TEST_CASE" check_bench_json "$TEST_CASE"
+
+rm -f "${BENCH_IMAGE}" "${BENCH_OUT}"
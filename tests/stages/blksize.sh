@@ -0,0 +1,65 @@
+#!/bin/bash
+
+TEST_CASE="case 15 - block size"
+
+BS_SRC="/tmp/${PROJECT_NAME}_blksize_src"
+
+# 参数为格式化时的块大小，remount时不带--blksize，应沿用超级块中记录的值
+function check_blksize () {
+    _BSIZE=$1
+    _TEST_CASE=$2
+    clean_ddriver
+    mount_fuse --blksize="$_BSIZE"
+    if (( $(stat -f -c %S "${MNTPOINT}") != _BSIZE )); then
+        fail "$_TEST_CASE: 以--blksize=$_BSIZE格式化后statfs块大小为$(stat -f -c %S "${MNTPOINT}")"
+        return 1
+    fi
+
+    mkdir_and_check "${MNTPOINT}"/dir0
+    cp "${BS_SRC}" "${MNTPOINT}"/dir0/file0
+    for i in $(seq 0 39); do
+        touch_and_check "${MNTPOINT}"/dir0/empty$i
+    done
+    remount_fuse
+
+    if (( $(stat -f -c %S "${MNTPOINT}") != _BSIZE )); then
+        fail "$_TEST_CASE: remount后块大小变为$(stat -f -c %S "${MNTPOINT}")"
+        return 1
+    fi
+    if ! cmp -s "${BS_SRC}" "${MNTPOINT}"/dir0/file0 || (( $(ls "${MNTPOINT}"/dir0 | wc -l) != 41 )); then
+        fail "$_TEST_CASE: 块大小$_BSIZE时remount后目录或文件内容不正确"
+        return 1
+    fi
+    umount_fuse
+    if ! OUTPUT=$(run_fsck); then
+        fail "$_TEST_CASE: 块大小$_BSIZE时fsck报告错误: ${OUTPUT}"
+        return 1
+    fi
+    return 0
+}
+
+function check_bad_blksize () {
+    _TEST_CASE=$2
+    clean_ddriver
+    mount_fuse --blksize=3000 2>/dev/null
+    if check_mount; then
+        fail "$_TEST_CASE: --blksize=3000不是2的幂, 不应挂载成功"
+        umount_fuse
+        return 1
+    fi
+    return 0
+}
+
+head -c 200000 /dev/urandom > "${BS_SRC}"
+
+TEST_CASE="case 15.1 - 1024-byte blocks"
+core_tester echo 1024 check_blksize "$TEST_CASE"
+
+TEST_CASE="case 15.2 - 4096-byte blocks"
+core_tester echo 4096 check_blksize "$TEST_CASE"
+
+TEST_CASE="case 15.3 - reject a block size that is not a power of two"
+core_tester echo 3000 check_bad_blksize "$TEST_CASE"
+
+clean_mount
+rm -f "${BS_SRC}"
@@ -0,0 +1,96 @@
+#!/bin/bash
+
+TEST_CASE="case 9 - clean umount"
+
+function prepare_tree () {
+    mkdir_and_check "${MNTPOINT}"/dir0
+    mkdir_and_check "${MNTPOINT}"/dir0/dir1
+    for i in 0 1 2 3; do
+        touch_and_check "${MNTPOINT}"/dir0/dir1/file$i
+        echo "content of file$i" > "${MNTPOINT}"/dir0/dir1/file$i
+    done
+}
+
+function check_tree () {
+    _TEST_CASE=$1
+    for i in 0 1 2 3; do
+        if [[ "$(cat "${MNTPOINT}"/dir0/dir1/file$i 2>/dev/null)" != "content of file$i" ]]; then
+            fail "$_TEST_CASE: ${MNTPOINT}/dir0/dir1/file$i内容不正确"
+            return 1
+        fi
+    done
+    return 0
+}
+
+function check_clean_fsck () {
+    _TEST_CASE=$2
+    prepare_tree
+    umount_fuse
+
+    OUTPUT=$(run_fsck)
+    RET=$?
+    if (( RET != 0 )) || [[ "${OUTPUT}" == *"not cleanly unmounted"* ]]; then
+        fail "$_TEST_CASE: 正常卸载后fsck应报告clean, 退出码$RET, 输出: ${OUTPUT}"
+        return 1
+    fi
+    return 0
+}
+
+function check_crash_fsck () {
+    _TEST_CASE=$2
+    mount_fuse
+    mkdir "${MNTPOINT}"/dir_crash
+    touch "${MNTPOINT}"/dir0/file_crash
+    crash_fuse
+
+    OUTPUT=$(run_fsck)
+    RET=$?
+    if [[ "${OUTPUT}" != *"not cleanly unmounted"* ]]; then
+        fail "$_TEST_CASE: 异常退出后超级块应标记为未正常卸载, 输出: ${OUTPUT}"
+        return 1
+    fi
+    # close时已写回新inode与位图、目录项还没写回，只允许留下孤儿inode和泄漏的块
+    if (( RET != 0 )) && { [[ "${OUTPUT}" == *"doubly-allocated"* ]] \
+            || [[ "${OUTPUT}" != *" 0 inodes in use but not marked"* ]] \
+            || [[ "${OUTPUT}" != *" 0 blocks in use but not marked"* ]]; }; then
+        fail "$_TEST_CASE: 异常退出后磁盘上的inode引用了未占用的inode或块, 输出: ${OUTPUT}"
+        return 1
+    fi
+    run_fsck --repair > /dev/null
+    if ! OUTPUT=$(run_fsck); then
+        fail "$_TEST_CASE: fsck --repair之后仍有错误, 输出: ${OUTPUT}"
+        return 1
+    fi
+    return 0
+}
+
+function check_remount_after_crash () {
+    _TEST_CASE=$2
+    mount_fuse
+    if ! check_tree "$_TEST_CASE"; then
+        return 1
+    fi
+    touch_and_check "${MNTPOINT}"/dir0/file_after
+    umount_fuse
+
+    OUTPUT=$(run_fsck)
+    RET=$?
+    if (( RET != 0 )) || [[ "${OUTPUT}" == *"not cleanly unmounted"* ]]; then
+        fail "$_TEST_CASE: 异常退出后再次正常卸载, fsck应报告clean, 退出码$RET, 输出: ${OUTPUT}"
+        return 1
+    fi
+    return 0
+}
+
+try_mount_or_fail
+
+TEST_CASE="case 9.1 - fsck is clean after umount"
+core_tester echo "$TEST_CASE" check_clean_fsck "$TEST_CASE"
+
+TEST_CASE="case 9.2 - crash leaves a consistent dirty image"
+core_tester echo "$TEST_CASE" check_crash_fsck "$TEST_CASE"
+
+TEST_CASE="case 9.3 - remount after crash"
+core_tester echo "$TEST_CASE" check_remount_after_crash "$TEST_CASE"
+
+umount_fuse
@@ -0,0 +1,81 @@
+#!/bin/bash
+
+TEST_CASE="case 25 - server-side clone"
+
+CLONE="$ROOT_PATH"/../build/newfs_clone
+
+function check_clone_shares_blocks () {
+    _TEST_CASE=$2
+    BSIZE=$(stat -f -c %S "${MNTPOINT}")
+    mkdir_and_check "${MNTPOINT}"/data
+    head -c $((256 * BSIZE)) /dev/urandom > "${MNTPOINT}"/data/shard
+    BEFORE=$(stat -f -c %f "${MNTPOINT}")
+    if ! OUTPUT=$("${CLONE}" "${MNTPOINT}"/data/shard "${MNTPOINT}"/copy 2>&1); then
+        fail "$_TEST_CASE: newfs_clone失败: ${OUTPUT}"
+        return 1
+    fi
+    if ! cmp -s "${MNTPOINT}"/data/shard "${MNTPOINT}"/copy; then
+        fail "$_TEST_CASE: 复制后内容不一致"
+        return 1
+    fi
+    USED=$(( BEFORE - $(stat -f -c %f "${MNTPOINT}") ))
+    if (( USED >= 64 )); then
+        fail "$_TEST_CASE: 复制256个块占用了${USED}个新块, 应共享源文件的块"
+        return 1
+    fi
+    return 0
+}
+
+function check_clone_cow () {
+    _TEST_CASE=$2
+    BSIZE=$(stat -f -c %S "${MNTPOINT}")
+    cp "${MNTPOINT}"/data/shard /tmp/newfs_clone_src
+    echo "changed" | dd of="${MNTPOINT}"/copy bs=1 seek=$((10 * BSIZE)) conv=notrunc status=none
+    if ! cmp -s "${MNTPOINT}"/data/shard /tmp/newfs_clone_src; then
+        fail "$_TEST_CASE: 修改复制出的文件影响了源文件"
+        return 1
+    fi
+    echo "0123456789" > "${MNTPOINT}"/part
+    if ! "${CLONE}" --src_off=$((3 * BSIZE)) --dst_off=2 --len=4 "${MNTPOINT}"/data/shard "${MNTPOINT}"/part \
+            || ! cmp -s -n 4 -i $((3 * BSIZE)):2 "${MNTPOINT}"/data/shard "${MNTPOINT}"/part \
+            || [[ "$(head -c 2 "${MNTPOINT}"/part)" != "01" ]] \
+            || [[ "$(stat -c %s "${MNTPOINT}"/part)" != "11" ]]; then
+        fail "$_TEST_CASE: 按偏移和长度复制的结果不正确"
+        return 1
+    fi
+    if "${CLONE}" "${MNTPOINT}"/data/shard /tmp/newfs_clone_out 2>/dev/null; then
+        fail "$_TEST_CASE: 复制到其他文件系统应失败"
+        return 1
+    fi
+    return 0
+}
+
+function check_clone_remount () {
+    _TEST_CASE=$2
+    remount_fuse
+    rm "${MNTPOINT}"/data/shard
+    if [[ "$(head -c 10000 "${MNTPOINT}"/copy | md5sum)" != "$(head -c 10000 /tmp/newfs_clone_src | md5sum)" ]]; then
+        fail "$_TEST_CASE: 删除源文件并remount后, 复制出的文件内容不正确"
+        return 1
+    fi
+    umount_fuse
+    if ! OUTPUT=$(run_fsck); then
+        fail "$_TEST_CASE: fsck报告错误: ${OUTPUT}"
+        return 1
+    fi
+    rm -f /tmp/newfs_clone_src
+    return 0
+}
+
+try_mount_or_fail
+
+TEST_CASE="case 25.1 - newfs_clone shares blocks"
+core_tester echo "$TEST_CASE" check_clone_shares_blocks "$TEST_CASE"
+
+TEST_CASE="case 25.2 - cloned files are copy-on-write"
+core_tester echo "$TEST_CASE" check_clone_cow "$TEST_CASE"
+
+TEST_CASE="case 25.3 - clones survive remount and source removal"
+core_tester echo "$TEST_CASE" check_clone_remount "$TEST_CASE"
+
+umount_fuse
@@ -0,0 +1,78 @@
+#!/bin/bash
+
+TEST_CASE="case 26 - compression"
+
+function text_data () {
+    yes "label,checksum,version" | head -c "$1"
+}
+
+function check_compress_text () {
+    _TEST_CASE=$2
+    BSIZE=$(stat -f -c %S "${MNTPOINT}")
+    touch_and_check "${MNTPOINT}"/text
+    BEFORE=$(stat -f -c %f "${MNTPOINT}")
+    text_data $((200 * BSIZE)) > "${MNTPOINT}"/text
+    USED=$(( BEFORE - $(stat -f -c %f "${MNTPOINT}") ))
+    if (( USED >= 100 )); then
+        fail "$_TEST_CASE: 可压缩的200个块写回后仍占用了${USED}个块"
+        return 1
+    fi
+    if (( $(stat_of compress clusters) == 0 )) || awk -v r="$(stat_of compress ratio)" 'BEGIN { exit !(r < 2) }'; then
+        fail "$_TEST_CASE: 统计中应有压缩的簇且压缩比大于2, 实际: $(stat_of compress clusters) $(stat_of compress ratio)"
+        return 1
+    fi
+    if ! text_data $((200 * BSIZE)) | cmp -s - "${MNTPOINT}"/text; then
+        fail "$_TEST_CASE: 压缩后读出的内容不正确"
+        return 1
+    fi
+    return 0
+}
+
+function check_compress_fallback () {
+    _TEST_CASE=$2
+    BSIZE=$(stat -f -c %S "${MNTPOINT}")
+    head -c $((50 * BSIZE)) /dev/urandom > /tmp/newfs_rand
+    cp /tmp/newfs_rand "${MNTPOINT}"/rand
+    if (( $(stat_of compress fallbacks) == 0 )); then
+        fail "$_TEST_CASE: 随机数据不可压缩, 应按原样存储并计入fallbacks"
+        return 1
+    fi
+    if ! cmp -s /tmp/newfs_rand "${MNTPOINT}"/rand; then
+        fail "$_TEST_CASE: 不可压缩的数据读出不正确"
+        return 1
+    fi
+    return 0
+}
+
+function check_compress_remount () {
+    _TEST_CASE=$2
+    BSIZE=$(stat -f -c %S "${MNTPOINT}")
+    umount_fuse
+    # 不带--compress也能读出已压缩的簇
+    mount_fuse
+    if ! text_data $((200 * BSIZE)) | cmp -s - "${MNTPOINT}"/text \
+            || ! cmp -s /tmp/newfs_rand "${MNTPOINT}"/rand; then
+        fail "$_TEST_CASE: 不带--compress重新挂载后内容不正确"
+        return 1
+    fi
+    umount_fuse
+    if ! OUTPUT=$(run_fsck); then
+        fail "$_TEST_CASE: fsck报告错误: ${OUTPUT}"
+        return 1
+    fi
+    rm -f /tmp/newfs_rand
+    return 0
+}
+
+mount_fuse --compress
+
+TEST_CASE="case 26.1 - compressible data takes fewer blocks"
+core_tester echo "$TEST_CASE" check_compress_text "$TEST_CASE"
+
+TEST_CASE="case 26.2 - incompressible data falls back to raw blocks"
+core_tester echo "$TEST_CASE" check_compress_fallback "$TEST_CASE"
+
+TEST_CASE="case 26.3 - compressed files read back without --compress"
+core_tester echo "$TEST_CASE" check_compress_remount "$TEST_CASE"
+
+umount_fuse
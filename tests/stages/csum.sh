@@ -0,0 +1,96 @@
+#!/bin/bash
+
+TEST_CASE="case 28 - checksums"
+
+IMAGE="${NEWFS_IMAGE:-$HOME/ddriver}"
+
+# 在镜像中找到第一个出现$1的位置，把其后第$2个字节改掉
+function corrupt_after () {
+    _OFF=$(grep -obUa "$1" "${IMAGE}" | head -1 | cut -d: -f1)
+    if [[ -z "${_OFF}" ]]; then
+        return 1
+    fi
+    printf 'X' | dd of="${IMAGE}" bs=1 seek=$((_OFF + $2)) conv=notrunc status=none
+}
+
+function check_data_csum () {
+    _TEST_CASE=$2
+    yes "CSUM_DATA_PATTERN" | head -c 4096 > "${MNTPOINT}"/bad
+    echo "intact" > "${MNTPOINT}"/good
+    mkdir_and_check "${MNTPOINT}"/dir
+    touch_and_check "${MNTPOINT}"/dir/csum_dentry_name
+    umount_fuse
+    if ! corrupt_after CSUM_DATA_PATTERN 2000; then
+        fail "$_TEST_CASE: 镜像中找不到文件数据"
+        return 1
+    fi
+    mount_fuse --data_csum
+    if cat "${MNTPOINT}"/bad > /dev/null 2>&1; then
+        fail "$_TEST_CASE: 数据块损坏后读取应返回EIO"
+        return 1
+    fi
+    # 改写损坏块的一部分需要先读入旧内容，应报告EIO而不是空间不足
+    if OUTPUT=$(echo "patch" | dd of="${MNTPOINT}"/bad bs=1 seek=2010 conv=notrunc status=none 2>&1) \
+            || [[ "${OUTPUT}" != *"Input/output error"* ]]; then
+        fail "$_TEST_CASE: 改写损坏的数据块应返回EIO, 实际: ${OUTPUT}"
+        return 1
+    fi
+    if [[ "$(cat "${MNTPOINT}"/good)" != "intact" ]]; then
+        fail "$_TEST_CASE: 未损坏的文件应能正常读取"
+        return 1
+    fi
+    if (( $(stat_of csum data_failed) == 0 )); then
+        fail "$_TEST_CASE: [csum]统计中data_failed应大于0"
+        return 1
+    fi
+    umount_fuse
+    return 0
+}
+
+function check_dirblk_csum () {
+    _TEST_CASE=$2
+    if ! corrupt_after csum_dentry_name 0; then
+        fail "$_TEST_CASE: 镜像中找不到目录项"
+        return 1
+    fi
+    OUTPUT=$(run_fsck)
+    RET=$?
+    if (( RET != 4 )) || [[ "${OUTPUT}" != *"directory block checksum mismatches"* ]]; then
+        fail "$_TEST_CASE: 目录块损坏后fsck应报告校验错误, 退出码$RET, 输出: ${OUTPUT}"
+        return 1
+    fi
+    mount_fuse
+    if ls "${MNTPOINT}"/dir > /dev/null 2>&1; then
+        fail "$_TEST_CASE: 目录块损坏后读目录应返回EIO"
+        return 1
+    fi
+    umount_fuse
+    return 0
+}
+
+function check_csum_repair () {
+    _TEST_CASE=$2
+    run_fsck --repair > /dev/null
+    if ! OUTPUT=$(run_fsck); then
+        fail "$_TEST_CASE: fsck --repair之后仍有错误, 输出: ${OUTPUT}"
+        return 1
+    fi
+    mount_fuse
+    if ! ls "${MNTPOINT}"/dir > /dev/null || [[ "$(cat "${MNTPOINT}"/good)" != "intact" ]]; then
+        fail "$_TEST_CASE: 修复后目录应可读, 其他文件不受影响"
+        return 1
+    fi
+    umount_fuse
+    return 0
+}
+
+mount_fuse --data_csum
+
+TEST_CASE="case 28.1 - corrupted data blocks read as EIO"
+core_tester echo "$TEST_CASE" check_data_csum "$TEST_CASE"
+
+TEST_CASE="case 28.2 - corrupted directory blocks are detected"
+core_tester echo "$TEST_CASE" check_dirblk_csum "$TEST_CASE"
+
+TEST_CASE="case 28.3 - fsck repairs the corrupted directory"
+core_tester echo "$TEST_CASE" check_csum_repair "$TEST_CASE"
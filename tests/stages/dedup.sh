@@ -0,0 +1,74 @@
+#!/bin/bash
+
+TEST_CASE="case 27 - deduplication"
+
+function check_dedup_copy () {
+    _TEST_CASE=$2
+    BSIZE=$(stat -f -c %S "${MNTPOINT}")
+    head -c $((100 * BSIZE)) /dev/urandom > /tmp/newfs_shard
+    cp /tmp/newfs_shard "${MNTPOINT}"/shard0
+    touch_and_check "${MNTPOINT}"/shard1
+    BEFORE=$(stat -f -c %f "${MNTPOINT}")
+    WRITES=$(stat_of device write_cnt)
+    cp /tmp/newfs_shard "${MNTPOINT}"/shard1
+    USED=$(( BEFORE - $(stat -f -c %f "${MNTPOINT}") ))
+    WRITES=$(( $(stat_of device write_cnt) - WRITES ))
+    if (( USED >= 10 )); then
+        fail "$_TEST_CASE: 重复写入100个相同的块又占用了${USED}个块"
+        return 1
+    fi
+    if (( WRITES >= 50 )); then
+        fail "$_TEST_CASE: 重复的块不应再写回设备, 实际写了${WRITES}次"
+        return 1
+    fi
+    if (( $(stat_of dedup hits) < 100 )) || (( $(stat_of dedup saved_bytes) < 100 * BSIZE )); then
+        fail "$_TEST_CASE: [dedup]统计不正确: hits $(stat_of dedup hits) saved_bytes $(stat_of dedup saved_bytes)"
+        return 1
+    fi
+    return 0
+}
+
+function check_dedup_cow () {
+    _TEST_CASE=$2
+    echo "changed" | dd of="${MNTPOINT}"/shard1 conv=notrunc status=none
+    if ! cmp -s /tmp/newfs_shard "${MNTPOINT}"/shard0; then
+        fail "$_TEST_CASE: 修改共享块的一个副本影响了另一个文件"
+        return 1
+    fi
+    if [[ "$(head -c 7 "${MNTPOINT}"/shard1)" != "changed" ]]; then
+        fail "$_TEST_CASE: 修改后的副本内容不正确"
+        return 1
+    fi
+    return 0
+}
+
+function check_dedup_remount () {
+    _TEST_CASE=$2
+    umount_fuse
+    mount_fuse
+    rm "${MNTPOINT}"/shard0
+    if ! cmp -s <(tail -c +9 /tmp/newfs_shard) <(tail -c +9 "${MNTPOINT}"/shard1); then
+        fail "$_TEST_CASE: 删除一个副本并remount后, 另一个副本内容不正确"
+        return 1
+    fi
+    umount_fuse
+    if ! OUTPUT=$(run_fsck); then
+        fail "$_TEST_CASE: fsck报告错误: ${OUTPUT}"
+        return 1
+    fi
+    rm -f /tmp/newfs_shard
+    return 0
+}
+
+mount_fuse --dedup
+
+TEST_CASE="case 27.1 - duplicate blocks are shared, not rewritten"
+core_tester echo "$TEST_CASE" check_dedup_copy "$TEST_CASE"
+
+TEST_CASE="case 27.2 - shared blocks are copy-on-write"
+core_tester echo "$TEST_CASE" check_dedup_cow "$TEST_CASE"
+
+TEST_CASE="case 27.3 - shared blocks survive remount and removal"
+core_tester echo "$TEST_CASE" check_dedup_remount "$TEST_CASE"
+
+umount_fuse
@@ -0,0 +1,95 @@
+#!/bin/bash
+
+TEST_CASE="case 23 - fallocate and truncate"
+
+function free_blocks () {
+    stat -f -c %f "${MNTPOINT}"
+}
+
+function check_fallocate () {
+    _TEST_CASE=$2
+    BSIZE=$(stat -f -c %S "${MNTPOINT}")
+    BEFORE=$(free_blocks)
+    if ! fallocate -l $((40 * BSIZE)) "${MNTPOINT}"/prealloc; then
+        fail "$_TEST_CASE: fallocate失败"
+        return 1
+    fi
+    if [[ "$(stat -c %s "${MNTPOINT}"/prealloc)" != "$((40 * BSIZE))" ]] \
+            || (( $(free_blocks) > BEFORE - 40 )); then
+        fail "$_TEST_CASE: fallocate后文件大小或占用块数不正确"
+        return 1
+    fi
+    if [[ -n "$(tr -d '\0' < "${MNTPOINT}"/prealloc)" ]]; then
+        fail "$_TEST_CASE: 预分配但未写入的区域应读出0"
+        return 1
+    fi
+    touch_and_check "${MNTPOINT}"/keep
+    if ! fallocate -n -l $((10 * BSIZE)) "${MNTPOINT}"/keep \
+            || [[ "$(stat -c %s "${MNTPOINT}"/keep)" != "0" ]] \
+            || [[ "$(stat -c %b "${MNTPOINT}"/keep)" == "0" ]]; then
+        fail "$_TEST_CASE: KEEP_SIZE应只预留空间、不改变文件大小"
+        return 1
+    fi
+    if fallocate -l 1G "${MNTPOINT}"/toolarge 2>/dev/null; then
+        fail "$_TEST_CASE: 超过文件最大长度的fallocate应失败"
+        return 1
+    fi
+    return 0
+}
+
+function check_truncate () {
+    _TEST_CASE=$2
+    BSIZE=$(stat -f -c %S "${MNTPOINT}")
+    BEFORE=$(free_blocks)
+    truncate -s $((100 * BSIZE)) "${MNTPOINT}"/sparse
+    if [[ "$(stat -c %s "${MNTPOINT}"/sparse)" != "$((100 * BSIZE))" ]] \
+            || [[ "$(stat -c %b "${MNTPOINT}"/sparse)" != "0" ]] || (( $(free_blocks) != BEFORE )); then
+        fail "$_TEST_CASE: truncate增长应只留下空洞、不分配块"
+        return 1
+    fi
+    head -c $((30 * BSIZE)) /dev/urandom > "${MNTPOINT}"/shrink
+    head -c $((10 * BSIZE)) "${MNTPOINT}"/shrink > /tmp/newfs_shrink_head
+    truncate -s $((10 * BSIZE)) "${MNTPOINT}"/shrink
+    if ! cmp -s "${MNTPOINT}"/shrink /tmp/newfs_shrink_head; then
+        fail "$_TEST_CASE: truncate缩短后保留部分的内容不正确"
+        return 1
+    fi
+    rm -f "${MNTPOINT}"/sparse
+    if (( $(free_blocks) != BEFORE - 10 )); then
+        fail "$_TEST_CASE: truncate缩短后尾部的块没有释放, 之前$BEFORE 之后$(free_blocks)"
+        return 1
+    fi
+    return 0
+}
+
+function check_fallocate_remount () {
+    _TEST_CASE=$2
+    echo "written into prealloc" | dd of="${MNTPOINT}"/prealloc conv=notrunc status=none
+    remount_fuse
+    if [[ "$(head -c 21 "${MNTPOINT}"/prealloc)" != "written into prealloc" ]] \
+            || ! cmp -s "${MNTPOINT}"/shrink /tmp/newfs_shrink_head \
+            || [[ "$(stat -c %b "${MNTPOINT}"/keep)" == "0" ]]; then
+        fail "$_TEST_CASE: remount后预分配或截断的文件不正确"
+        return 1
+    fi
+    umount_fuse
+    if ! OUTPUT=$(run_fsck); then
+        fail "$_TEST_CASE: fsck报告错误: ${OUTPUT}"
+        return 1
+    fi
+    rm -f /tmp/newfs_shrink_head
+    return 0
+}
+
+try_mount_or_fail
+
+TEST_CASE="case 23.1 - fallocate reserves zeroed space"
+core_tester echo "$TEST_CASE" check_fallocate "$TEST_CASE"
+
+TEST_CASE="case 23.2 - truncate grows sparse and shrinks by freeing blocks"
+core_tester echo "$TEST_CASE" check_truncate "$TEST_CASE"
+
+TEST_CASE="case 23.3 - preallocated files persist across remount"
+core_tester echo "$TEST_CASE" check_fallocate_remount "$TEST_CASE"
+
+umount_fuse
@@ -0,0 +1,80 @@
+#!/bin/bash
+
+TEST_CASE="case 14 - file handle"
+
+FH_SRC="/tmp/${PROJECT_NAME}_fhandle_src"
+
+function check_held_fd () {
+    _TEST_CASE=$2
+    exec 3<> "${MNTPOINT}"/file0
+    echo "first line" >&3
+    echo "second line" >&3
+    if [[ "$(cat "${MNTPOINT}"/file0)" != $'first line\nsecond line' ]]; then
+        exec 3>&-
+        fail "$_TEST_CASE: 文件保持打开时, 其它打开看到的内容不正确"
+        return 1
+    fi
+    exec 3>&-
+    return 0
+}
+
+function check_sparse_remount () {
+    _TEST_CASE=$2
+    BSIZE=$(stat -f -c %S "${MNTPOINT}")
+    echo "tail block" | dd of="${MNTPOINT}"/file1 bs="$BSIZE" seek=5 conv=notrunc status=none
+    remount_fuse
+
+    if (( $(stat -c %s "${MNTPOINT}"/file1) != 5 * BSIZE + 11 )); then
+        fail "$_TEST_CASE: 空洞之后写入的文件remount后大小不正确"
+        return 1
+    fi
+    if [[ "$(dd if="${MNTPOINT}"/file1 bs="$BSIZE" skip=5 status=none)" != "tail block" ]]; then
+        fail "$_TEST_CASE: 空洞之后的数据块remount后丢失"
+        return 1
+    fi
+    if [[ -n "$(head -c $((5 * BSIZE)) "${MNTPOINT}"/file1 | tr -d '\0')" ]]; then
+        fail "$_TEST_CASE: 空洞部分应读出0"
+        return 1
+    fi
+    return 0
+}
+
+# 已有文件写入新块并close后异常退出：close已写回inode，位图也必须已写回
+function check_crash_after_close () {
+    _TEST_CASE=$2
+    BSIZE=$(stat -f -c %S "${MNTPOINT}")
+    head -c $((3 * BSIZE)) /dev/urandom > "${FH_SRC}"
+    cp "${FH_SRC}" "${MNTPOINT}"/file0
+    crash_fuse
+
+    if ! OUTPUT=$(run_fsck); then
+        fail "$_TEST_CASE: close后异常退出, fsck报告错误: ${OUTPUT}"
+        return 1
+    fi
+
+    mount_fuse
+    head -c $((3 * BSIZE)) /dev/urandom > "${MNTPOINT}"/file2
+    if ! cmp -s "${FH_SRC}" "${MNTPOINT}"/file0; then
+        fail "$_TEST_CASE: 异常退出前close的文件内容被新文件覆盖"
+        return 1
+    fi
+    umount_fuse
+    if ! OUTPUT=$(run_fsck); then
+        fail "$_TEST_CASE: 异常退出后新建文件, fsck报告错误: ${OUTPUT}"
+        return 1
+    fi
+    return 0
+}
+
+try_mount_or_fail
+
+TEST_CASE="case 14.1 - read while another handle is open"
+core_tester echo "$TEST_CASE" check_held_fd "$TEST_CASE"
+
+TEST_CASE="case 14.2 - data after a hole survives remount"
+core_tester echo "$TEST_CASE" check_sparse_remount "$TEST_CASE"
+
+TEST_CASE="case 14.3 - crash after close keeps allocations"
+core_tester echo "$TEST_CASE" check_crash_after_close "$TEST_CASE"
+
+rm -f "${FH_SRC}"
@@ -0,0 +1,70 @@
+#!/bin/bash
+
+TEST_CASE="case 20 - fsck"
+
+FSCK_IMAGE="${NEWFS_IMAGE:-$HOME/ddriver}"
+FSCK_SRC="/tmp/${PROJECT_NAME}_fsck_src"
+
+# 超级块中的32位整数字段，参数为字节偏移
+function super_field () {
+    od -An -t d4 -j "$1" -N 4 "${FSCK_IMAGE}" | tr -d ' '
+}
+
+function check_fsck_detect () {
+    _TEST_CASE=$2
+    mkdir_and_check "${MNTPOINT}"/dir0
+    cp "${FSCK_SRC}" "${MNTPOINT}"/dir0/file0
+    umount_fuse
+
+    # 清掉数据块位图的前32位，已用的块变为未标记
+    DAT_MAP_OFFSET=$(super_field 20)
+    dd if=/dev/zero of="${FSCK_IMAGE}" bs=1 seek="${DAT_MAP_OFFSET}" count=4 conv=notrunc status=none
+
+    OUTPUT=$(run_fsck)
+    RET=$?
+    if (( RET != 4 )) || [[ "${OUTPUT}" == *" 0 blocks in use but not marked"* ]]; then
+        fail "$_TEST_CASE: 位图被清除后fsck应报告未标记的块并返回4, 退出码$RET, 输出: ${OUTPUT}"
+        return 1
+    fi
+    return 0
+}
+
+function check_fsck_repair () {
+    _TEST_CASE=$2
+    run_fsck --repair > /dev/null
+    RET=$?
+    if (( RET != 1 )); then
+        fail "$_TEST_CASE: fsck --repair修复后应返回1, 实际$RET"
+        return 1
+    fi
+    if ! OUTPUT=$(run_fsck); then
+        fail "$_TEST_CASE: 修复后fsck仍报告错误: ${OUTPUT}"
+        return 1
+    fi
+
+    mount_fuse
+    if ! cmp -s "${FSCK_SRC}" "${MNTPOINT}"/dir0/file0; then
+        fail "$_TEST_CASE: 修复后文件内容不正确"
+        return 1
+    fi
+    # 修复后的位图必须保护已有的块，新文件不能覆盖它们
+    cp "${FSCK_SRC}" "${MNTPOINT}"/file1
+    if ! cmp -s "${FSCK_SRC}" "${MNTPOINT}"/dir0/file0; then
+        fail "$_TEST_CASE: 修复后新建文件覆盖了已有文件的块"
+        return 1
+    fi
+    umount_fuse
+    return 0
+}
+
+head -c 20000 /dev/urandom > "${FSCK_SRC}"
+try_mount_or_fail
+
+TEST_CASE="case 20.1 - fsck detects a cleared bitmap"
+core_tester echo "$TEST_CASE" check_fsck_detect "$TEST_CASE"
+
+TEST_CASE="case 20.2 - fsck --repair rebuilds the bitmap"
+core_tester echo "$TEST_CASE" check_fsck_repair "$TEST_CASE"
+
+clean_mount
+rm -f "${FSCK_SRC}"
@@ -0,0 +1,73 @@
+#!/bin/bash
+
+TEST_CASE="case 10 - lazy load"
+
+# 目录数×文件数不超过镜像的inode数，1MB的缓存上限放不下全部inode
+DIRS=6
+FILES=15
+
+function check_files () {
+    _TEST_CASE=$1
+    for d in $(seq 0 $((DIRS - 1))); do
+        if (( $(ls "${MNTPOINT}"/dir$d | wc -l) != FILES )); then
+            fail "$_TEST_CASE: ${MNTPOINT}/dir$d中应有$FILES个文件"
+            return 1
+        fi
+        for f in $(seq 0 $((FILES - 1))); do
+            if [[ "$(cat "${MNTPOINT}"/dir$d/file$f)" != "content of dir$d/file$f" ]]; then
+                fail "$_TEST_CASE: ${MNTPOINT}/dir$d/file$f内容不正确"
+                return 1
+            fi
+        done
+    done
+    return 0
+}
+
+function check_evict () {
+    _TEST_CASE=$2
+    for d in $(seq 0 $((DIRS - 1))); do
+        mkdir_and_check "${MNTPOINT}"/dir$d
+        for f in $(seq 0 $((FILES - 1))); do
+            echo "content of dir$d/file$f" > "${MNTPOINT}"/dir$d/file$f
+        done
+    done
+    if ! check_files "$_TEST_CASE"; then
+        return 1
+    fi
+
+    EVICTIONS=$(stat_of icache evictions)
+    if (( EVICTIONS == 0 )); then
+        fail "$_TEST_CASE: 超过--cache_mb上限后应淘汰inode, 实际evictions为$EVICTIONS"
+        return 1
+    fi
+    return 0
+}
+
+function check_lazy_remount () {
+    _TEST_CASE=$2
+    remount_fuse --cache_mb=1
+
+    INODES=$(stat_of icache inodes)
+    if (( INODES > 2 )); then
+        fail "$_TEST_CASE: 挂载后只应读入根目录, 实际缓存了$INODES个inode"
+        return 1
+    fi
+    if ! check_files "$_TEST_CASE"; then
+        return 1
+    fi
+
+    umount_fuse
+    if ! OUTPUT=$(run_fsck); then
+        fail "$_TEST_CASE: 卸载后fsck报告错误: ${OUTPUT}"
+        return 1
+    fi
+    return 0
+}
+
+mount_fuse --cache_mb=1
+
+TEST_CASE="case 10.1 - evict inodes under --cache_mb"
+core_tester echo "$TEST_CASE" check_evict "$TEST_CASE"
+
+TEST_CASE="case 10.2 - load directories lazily after remount"
+core_tester echo "$TEST_CASE" check_lazy_remount "$TEST_CASE"
@@ -0,0 +1,80 @@
+#!/bin/bash
+
+TEST_CASE="case 30 - hard links and symlinks"
+
+# 300字节的目标放不进inode，存放在一个数据块中
+LONG_TARGET=$(printf 'shard%.0s' $(seq 60))
+
+function check_hard_link () {
+    _TEST_CASE=$2
+    mkdir_and_check "${MNTPOINT}"/shards
+    echo "tensor" > "${MNTPOINT}"/shards/a
+    if ! ln "${MNTPOINT}"/shards/a "${MNTPOINT}"/b; then
+        fail "$_TEST_CASE: 创建硬链接失败"
+        return 1
+    fi
+    echo "appended" >> "${MNTPOINT}"/b
+    if [[ "$(cat "${MNTPOINT}"/shards/a)" != $'tensor\nappended' ]]; then
+        fail "$_TEST_CASE: 通过一个硬链接写入的内容应能从另一个读出"
+        return 1
+    fi
+    if ln "${MNTPOINT}"/shards "${MNTPOINT}"/shards2 2>/dev/null; then
+        fail "$_TEST_CASE: 不应允许对目录创建硬链接"
+        return 1
+    fi
+    return 0
+}
+
+function check_symlink () {
+    _TEST_CASE=$2
+    ln -s shards/a "${MNTPOINT}"/short
+    ln -s "${LONG_TARGET}" "${MNTPOINT}"/long
+    ln -s missing "${MNTPOINT}"/dangling
+    if [[ "$(readlink "${MNTPOINT}"/short)" != "shards/a" ]] \
+            || [[ "$(readlink "${MNTPOINT}"/long)" != "${LONG_TARGET}" ]]; then
+        fail "$_TEST_CASE: readlink结果不正确"
+        return 1
+    fi
+    if [[ "$(head -1 "${MNTPOINT}"/short)" != "tensor" ]] || cat "${MNTPOINT}"/dangling 2>/dev/null; then
+        fail "$_TEST_CASE: 通过符号链接访问的结果不正确"
+        return 1
+    fi
+    return 0
+}
+
+function check_link_remount () {
+    _TEST_CASE=$2
+    # 内核按路径缓存属性，链接数在重新挂载后检查
+    remount_fuse
+    if [[ "$(stat -c %h "${MNTPOINT}"/shards/a)" != "2" ]] || [[ "$(stat -c %h "${MNTPOINT}"/b)" != "2" ]] \
+            || [[ "$(readlink "${MNTPOINT}"/long)" != "${LONG_TARGET}" ]]; then
+        fail "$_TEST_CASE: remount后链接数或符号链接目标不正确"
+        return 1
+    fi
+    rm "${MNTPOINT}"/shards/a
+    remount_fuse
+    if [[ "$(stat -c %h "${MNTPOINT}"/b)" != "1" ]] || [[ "$(cat "${MNTPOINT}"/b)" != $'tensor\nappended' ]] \
+            || [[ -e "${MNTPOINT}"/short ]]; then
+        fail "$_TEST_CASE: 删除一个硬链接后, 另一个应保留内容且链接数为1"
+        return 1
+    fi
+    umount_fuse
+    if ! OUTPUT=$(run_fsck); then
+        fail "$_TEST_CASE: fsck报告错误: ${OUTPUT}"
+        return 1
+    fi
+    return 0
+}
+
+try_mount_or_fail
+
+TEST_CASE="case 30.1 - hard links share one inode"
+core_tester echo "$TEST_CASE" check_hard_link "$TEST_CASE"
+
+TEST_CASE="case 30.2 - short and long symlinks"
+core_tester echo "$TEST_CASE" check_symlink "$TEST_CASE"
+
+TEST_CASE="case 30.3 - links persist across remount"
+core_tester echo "$TEST_CASE" check_link_remount "$TEST_CASE"
+
+umount_fuse
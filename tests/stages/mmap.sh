@@ -0,0 +1,57 @@
+#!/bin/bash
+
+TEST_CASE="case 12 - mmap backend"
+
+MMAP_IMAGE="/tmp/${PROJECT_NAME}_mmap_test.img"
+MARKER="mmap-backend-marker-$RANDOM$RANDOM"
+
+function mount_mmap () {
+    "$ROOT_PATH"/../build/"${PROJECT_NAME}" --device=mmap:"${MMAP_IMAGE}" "${MNTPOINT}"
+}
+
+function check_mmap_create () {
+    _TEST_CASE=$2
+    rm -f "${MMAP_IMAGE}"
+    mount_mmap
+    if ! check_mount; then
+        fail "$_TEST_CASE: 使用--device=mmap:${MMAP_IMAGE}挂载失败"
+        return 1
+    fi
+    if (( $(stat -c %s "${MMAP_IMAGE}") != 4 * 1024 * 1024 )); then
+        fail "$_TEST_CASE: 新建镜像文件应为4MB, 实际$(stat -c %s "${MMAP_IMAGE}")字节"
+        return 1
+    fi
+    mkdir_and_check "${MNTPOINT}"/dir0
+    echo "${MARKER}" > "${MNTPOINT}"/dir0/file0
+    return 0
+}
+
+function check_mmap_persist () {
+    _TEST_CASE=$2
+    umount_fuse
+    if ! grep -q "${MARKER}" "${MMAP_IMAGE}"; then
+        fail "$_TEST_CASE: 卸载后镜像文件中找不到写入的数据"
+        return 1
+    fi
+    if ! OUTPUT=$("$ROOT_PATH"/../build/fsck."${PROJECT_NAME}" mmap:"${MMAP_IMAGE}"); then
+        fail "$_TEST_CASE: fsck报告错误: ${OUTPUT}"
+        return 1
+    fi
+
+    mount_mmap
+    if [[ "$(cat "${MNTPOINT}"/dir0/file0)" != "${MARKER}" ]]; then
+        fail "$_TEST_CASE: 重新挂载镜像文件后内容不正确"
+        return 1
+    fi
+    umount_fuse
+    return 0
+}
+
+TEST_CASE="case 12.1 - create and mount an mmap image"
+core_tester echo "$TEST_CASE" check_mmap_create "$TEST_CASE"
+
+TEST_CASE="case 12.2 - mmap image persists across remount"
+core_tester echo "$TEST_CASE" check_mmap_persist "$TEST_CASE"
+
+clean_mount
+rm -f "${MMAP_IMAGE}"
@@ -0,0 +1,80 @@
+#!/bin/bash
+
+TEST_CASE="case 31 - directory prefetch"
+
+FILES=20
+
+function dataset_sum () {
+    for i in $(seq 0 $((FILES - 1))); do
+        cat "${MNTPOINT}"/trimmed/f$i
+    done | md5sum
+}
+
+function check_prefetch_hint () {
+    _TEST_CASE=$2
+    BSIZE=$(stat -f -c %S "${MNTPOINT}")
+    mkdir_and_check "${MNTPOINT}"/trimmed
+    for i in $(seq 0 $((FILES - 1))); do
+        head -c $((8 * BSIZE)) /dev/urandom > "${MNTPOINT}"/trimmed/f$i
+    done
+    SUM=$(dataset_sum)
+    remount_fuse
+    # NEWFS_IOC_PREFETCH = _IO('N', 6)
+    if ! OUTPUT=$(python3 -c 'import fcntl, os, sys; fcntl.ioctl(os.open(sys.argv[1], os.O_RDONLY), 0x4e06)' \
+                  "${MNTPOINT}"/trimmed 2>&1); then
+        fail "$_TEST_CASE: 预取ioctl失败: ${OUTPUT}"
+        return 1
+    fi
+    if [[ "$(dataset_sum)" != "${SUM}" ]]; then
+        fail "$_TEST_CASE: 预取后读出的内容不正确"
+        return 1
+    fi
+    if (( $(stat_of prefetch jobs) == 0 )) || (( $(stat_of prefetch hits) < FILES / 2 )); then
+        fail "$_TEST_CASE: 预取提示后打开文件应命中预取, 实际jobs $(stat_of prefetch jobs) hits $(stat_of prefetch hits)"
+        return 1
+    fi
+    return 0
+}
+
+function check_prefetch_scan () {
+    _TEST_CASE=$2
+    remount_fuse
+    if [[ "$(dataset_sum)" != "${SUM}" ]]; then
+        fail "$_TEST_CASE: 按目录顺序读取的内容不正确"
+        return 1
+    fi
+    if (( $(stat_of prefetch epochs) == 0 )) || (( $(stat_of prefetch hits) == 0 )); then
+        fail "$_TEST_CASE: 逐个读取目录中的文件应触发预取, 实际epochs $(stat_of prefetch epochs) hits $(stat_of prefetch hits)"
+        return 1
+    fi
+    return 0
+}
+
+function check_prefetch_off () {
+    _TEST_CASE=$2
+    umount_fuse
+    mount_fuse --prefetch_mb=-1
+    if [[ "$(dataset_sum)" != "${SUM}" ]] || (( $(stat_of prefetch jobs) != 0 )); then
+        fail "$_TEST_CASE: --prefetch_mb=-1时不应预取, 内容应不变"
+        return 1
+    fi
+    umount_fuse
+    if ! OUTPUT=$(run_fsck); then
+        fail "$_TEST_CASE: fsck报告错误: ${OUTPUT}"
+        return 1
+    fi
+    return 0
+}
+
+try_mount_or_fail
+
+TEST_CASE="case 31.1 - prefetch a directory on an explicit hint"
+core_tester echo "$TEST_CASE" check_prefetch_hint "$TEST_CASE"
+
+TEST_CASE="case 31.2 - detect a file-by-file directory scan"
+core_tester echo "$TEST_CASE" check_prefetch_scan "$TEST_CASE"
+
+TEST_CASE="case 31.3 - --prefetch_mb=-1 disables prefetch"
+core_tester echo "$TEST_CASE" check_prefetch_off "$TEST_CASE"
+
+umount_fuse
@@ -0,0 +1,146 @@
+#!/bin/bash
+
+TEST_CASE="case 22 - rename"
+
+# 异常退出后的fsck输出只允许孤儿inode与泄漏的块，不能有重复分配、校验或槽位不一致
+function crash_fsck_ok () {
+    _OUTPUT=$1
+    if [[ "${_OUTPUT}" == *"doubly-allocated"* ]] || [[ "${_OUTPUT}" == *"mismatches"* ]] \
+            || [[ "${_OUTPUT}" == *"invalid or duplicate"* ]] \
+            || [[ "${_OUTPUT}" != *" 0 inodes in use but not marked"* ]] \
+            || [[ "${_OUTPUT}" != *" 0 blocks in use but not marked"* ]]; then
+        return 1
+    fi
+    return 0
+}
+
+function check_rename_basic () {
+    _TEST_CASE=$2
+    mkdir_and_check "${MNTPOINT}"/x
+    mkdir_and_check "${MNTPOINT}"/z
+    echo "old" > "${MNTPOINT}"/x/a
+    echo "victim" > "${MNTPOINT}"/x/b
+    INO=$(stat -c %i "${MNTPOINT}"/x/a)
+    mv "${MNTPOINT}"/x/a "${MNTPOINT}"/x/b
+    if [[ -e "${MNTPOINT}"/x/a ]] || [[ "$(cat "${MNTPOINT}"/x/b)" != "old" ]]; then
+        fail "$_TEST_CASE: 同目录覆盖式重命名后内容不正确"
+        return 1
+    fi
+    if [[ "$(stat -c %i "${MNTPOINT}"/x/b)" != "${INO}" ]]; then
+        fail "$_TEST_CASE: 重命名不应改变inode"
+        return 1
+    fi
+    mkdir_and_check "${MNTPOINT}"/x/sub
+    if mv "${MNTPOINT}"/x "${MNTPOINT}"/x/sub/x 2>/dev/null; then
+        fail "$_TEST_CASE: 不应允许把目录移动到自己的子树中"
+        return 1
+    fi
+    mv "${MNTPOINT}"/x/sub "${MNTPOINT}"/z/sub
+    if [[ ! -d "${MNTPOINT}"/z/sub ]] || [[ -e "${MNTPOINT}"/x/sub ]]; then
+        fail "$_TEST_CASE: 跨目录移动目录失败"
+        return 1
+    fi
+    return 0
+}
+
+function check_rename_checkpoint () {
+    _TEST_CASE=$2
+    BSIZE=$(stat -f -c %S "${MNTPOINT}")
+    rm -f /tmp/newfs_rename_ckpt /tmp/newfs_rename_ready
+    umount_fuse                                 # x与z本身先落盘
+    mount_fuse
+    # 先写临时文件再重命名，不关闭文件就异常退出：关闭fd会触发flush写回数据，因此在另一个进程中保持打开
+    python3 - "${MNTPOINT}" "${BSIZE}" <<'PYEOF' &
+import os, sys, time
+mnt, bsize = sys.argv[1], int(sys.argv[2])
+data = os.urandom(200 * bsize)
+with open("/tmp/newfs_rename_ckpt", "wb") as f:
+    f.write(data)
+fd = os.open(os.path.join(mnt, "x/ckpt.tmp"), os.O_WRONLY | os.O_CREAT, 0o644)
+os.write(fd, data)
+os.rename(os.path.join(mnt, "x/ckpt.tmp"), os.path.join(mnt, "z/ckpt"))
+open("/tmp/newfs_rename_ready", "w").close()
+time.sleep(60)
+PYEOF
+    PID=$!
+    for _ in $(seq 100); do
+        [[ -e /tmp/newfs_rename_ready ]] && break
+        sleep 0.1
+    done
+    crash_fuse
+    kill "${PID}" 2>/dev/null
+    wait "${PID}" 2>/dev/null
+
+    OUTPUT=$(run_fsck)
+    if ! crash_fsck_ok "${OUTPUT}"; then
+        fail "$_TEST_CASE: 重命名后异常退出, fsck报告错误: ${OUTPUT}"
+        return 1
+    fi
+    run_fsck --repair > /dev/null
+    mount_fuse
+    if ! cmp -s /tmp/newfs_rename_ckpt "${MNTPOINT}"/z/ckpt || [[ -e "${MNTPOINT}"/x/ckpt.tmp ]]; then
+        fail "$_TEST_CASE: 异常退出后重命名得到的检查点内容应完整"
+        return 1
+    fi
+    rm -f /tmp/newfs_rename_ckpt /tmp/newfs_rename_ready
+    return 0
+}
+
+function check_rename_crash () {
+    _TEST_CASE=$2
+    umount_fuse
+    mount_fuse
+    echo "moved" > "${MNTPOINT}"/x/f
+    umount_fuse
+    mount_fuse
+    # 两个父目录里都有尚未写回目录的新文件和新目录
+    echo "new file" > "${MNTPOINT}"/x/new
+    touch "${MNTPOINT}"/z/new2
+    mkdir "${MNTPOINT}"/z/newdir
+    touch "${MNTPOINT}"/z/newdir/inner
+    mv "${MNTPOINT}"/x/f "${MNTPOINT}"/z/f
+    crash_fuse
+
+    OUTPUT=$(run_fsck)
+    if ! crash_fsck_ok "${OUTPUT}"; then
+        fail "$_TEST_CASE: 重命名后异常退出, 磁盘目录引用了未写回的inode或块, 输出: ${OUTPUT}"
+        return 1
+    fi
+    run_fsck --repair > /dev/null
+    mount_fuse
+    if [[ "$(cat "${MNTPOINT}"/z/f 2>/dev/null)" != "moved" ]] || [[ -e "${MNTPOINT}"/x/f ]]; then
+        fail "$_TEST_CASE: 异常退出后被移动的文件应只出现在新位置且内容完整"
+        return 1
+    fi
+    if [[ "$(cat "${MNTPOINT}"/x/new 2>/dev/null)" != "new file" ]] \
+            || ! cat "${MNTPOINT}"/z/new2 > /dev/null || ! ls "${MNTPOINT}"/z/newdir > /dev/null; then
+        fail "$_TEST_CASE: 异常退出后父目录中的其他文件无法读取"
+        return 1
+    fi
+    # 新建文件不能复用仍被引用的inode号
+    touch "${MNTPOINT}"/x/after
+    INOS=$(find "${MNTPOINT}"/x "${MNTPOINT}"/z -exec stat -c %i {} + | sort | uniq -d)
+    if [[ -n "${INOS}" ]]; then
+        fail "$_TEST_CASE: 异常退出后重新挂载, 新文件复用了已占用的inode号: ${INOS}"
+        return 1
+    fi
+    umount_fuse
+    if ! OUTPUT=$(run_fsck); then
+        fail "$_TEST_CASE: 异常退出后再次正常卸载, fsck报告错误: ${OUTPUT}"
+        return 1
+    fi
+    return 0
+}
+
+try_mount_or_fail
+
+TEST_CASE="case 22.1 - rename within and across directories"
+core_tester echo "$TEST_CASE" check_rename_basic "$TEST_CASE"
+
+TEST_CASE="case 22.2 - a renamed checkpoint survives a crash"
+core_tester echo "$TEST_CASE" check_rename_checkpoint "$TEST_CASE"
+
+TEST_CASE="case 22.3 - crash after a cross-directory rename"
+core_tester echo "$TEST_CASE" check_rename_crash "$TEST_CASE"
+
+umount_fuse
@@ -0,0 +1,85 @@
+#!/bin/bash
+
+TEST_CASE="case 19 - record and replay"
+
+REC_TRACE="/tmp/${PROJECT_NAME}_replay_test.trace"
+REC_BAD="/tmp/${PROJECT_NAME}_replay_bad.trace"
+REC_IMAGE="/tmp/${PROJECT_NAME}_replay_test.img"
+
+function run_replay () {
+    "$ROOT_PATH"/../build/"${PROJECT_NAME}"_replay --device=mmap:"${REC_IMAGE}" "$@"
+}
+
+function check_record () {
+    _TEST_CASE=$2
+    rm -f "${REC_TRACE}"
+    mount_fuse --record="${REC_TRACE}"
+    mkdir_and_check "${MNTPOINT}"/dir0
+    echo "hello" > "${MNTPOINT}"/dir0/file0
+    cat "${MNTPOINT}"/dir0/file0 > /dev/null
+    mv "${MNTPOINT}"/dir0/file0 "${MNTPOINT}"/file1
+    ln "${MNTPOINT}"/file1 "${MNTPOINT}"/file2
+    ln -s file1 "${MNTPOINT}"/link0
+    readlink "${MNTPOINT}"/link0 > /dev/null
+    python3 -c "import os, sys; os.setxattr(sys.argv[1], 'user.k', b'v')" "${MNTPOINT}"/file1
+    truncate -s 10000 "${MNTPOINT}"/file1
+    rm "${MNTPOINT}"/file2
+    rmdir "${MNTPOINT}"/dir0
+    umount_fuse
+
+    # 记录文件头: 幻数"NFTR"与版本号
+    if [[ "$(head -c 4 "${REC_TRACE}" 2>/dev/null)" != "NFTR" ]]; then
+        fail "$_TEST_CASE: --record没有生成操作记录文件"
+        return 1
+    fi
+    return 0
+}
+
+function check_replay () {
+    _TEST_CASE=$2
+    if ! OUTPUT=$(run_replay "${REC_TRACE}" 2>&1); then
+        fail "$_TEST_CASE: 回放失败: ${OUTPUT}"
+        return 1
+    fi
+    if [[ "${OUTPUT}" != *'"skipped": 0,'* || "${OUTPUT}" != *'"mismatch": 0,'* ]] \
+        || [[ "${OUTPUT}" == *'"records": 0,'* ]]; then
+        fail "$_TEST_CASE: 回放结果与记录不一致: ${OUTPUT}"
+        return 1
+    fi
+    return 0
+}
+
+# 参数: 文件偏移 写入的字节(八进制转义)
+function corrupt_trace () {
+    cp "${REC_TRACE}" "${REC_BAD}"
+    printf "$2" | dd of="${REC_BAD}" bs=1 seek="$1" conv=notrunc status=none
+}
+
+function check_replay_reject () {
+    _TEST_CASE=$2
+    # 文件头中的版本号在偏移4
+    corrupt_trace 4 '\143\000'
+    if OUTPUT=$(run_replay "${REC_BAD}" 2>&1) || [[ "${OUTPUT}" != *"unsupported trace version 99"* ]]; then
+        fail "$_TEST_CASE: 未知版本的记录应被拒绝: ${OUTPUT}"
+        return 1
+    fi
+    # 第一条记录的操作号在偏移16+38
+    corrupt_trace 54 '\372'
+    if OUTPUT=$(run_replay "${REC_BAD}" 2>&1) || [[ "${OUTPUT}" != *"unknown op 250"* ]]; then
+        fail "$_TEST_CASE: 含未知操作的记录应被拒绝: ${OUTPUT}"
+        return 1
+    fi
+    return 0
+}
+
+TEST_CASE="case 19.1 - record operations with --record"
+core_tester echo "$TEST_CASE" check_record "$TEST_CASE"
+
+TEST_CASE="case 19.2 - replay reproduces every result"
+core_tester echo "$TEST_CASE" check_replay "$TEST_CASE"
+
+TEST_CASE="case 19.3 - reject unknown versions and ops"
+core_tester echo "$TEST_CASE" check_replay_reject "$TEST_CASE"
+
+clean_mount
+rm -f "${REC_TRACE}" "${REC_BAD}" "${REC_IMAGE}"
@@ -0,0 +1,60 @@
+#!/bin/bash
+
+TEST_CASE="case 11 - slab"
+
+ROUNDS=4
+FILES=60
+
+# 输出: in_use chunks
+function slab_of () {
+    sed -n "/^\[slab\]/,\$s/^$1 .*in_use=\([0-9]*\) *chunks=\([0-9]*\).*/\1 \2/p" "${MNTPOINT}"/.newfs_stats
+}
+
+function wait_reclaim () {
+    for _ in $(seq 50); do
+        if [[ "$(sed -n '/^\[reclaim\]/,/^\[/s/^queued //p' "${MNTPOINT}"/.newfs_stats)" == "0" ]]; then
+            return
+        fi
+        sleep 0.1
+    done
+}
+
+function churn () {
+    for f in $(seq "$FILES"); do
+        echo "content of file$f" > "${MNTPOINT}"/file$f
+    done
+    rm -f "${MNTPOINT}"/file*
+    wait_reclaim
+}
+
+function check_slab_reuse () {
+    _TEST_CASE=$2
+    read -r DENTRY0 _ <<< "$(slab_of dentry)"
+    read -r INODE0 _ <<< "$(slab_of inode)"
+
+    churn
+    churn
+    read -r _ CHUNKS <<< "$(slab_of inode)"
+    for _ in $(seq 3 "$ROUNDS"); do
+        churn
+    done
+    read -r DENTRY1 _ <<< "$(slab_of dentry)"
+    read -r INODE1 CHUNKS1 <<< "$(slab_of inode)"
+
+    if (( DENTRY1 != DENTRY0 || INODE1 != INODE0 )); then
+        fail "$_TEST_CASE: 删除全部文件后对象未释放, dentry $DENTRY0->$DENTRY1, inode $INODE0->$INODE1"
+        return 1
+    fi
+    if (( CHUNKS1 != CHUNKS )); then
+        fail "$_TEST_CASE: 反复创建删除时inode slab持续增长, chunks $CHUNKS->$CHUNKS1"
+        return 1
+    fi
+    return 0
+}
+
+try_mount_or_fail
+
+TEST_CASE="case 11.1 - slab objects are reused across create/unlink rounds"
+core_tester echo "$TEST_CASE" check_slab_reuse "$TEST_CASE"
+
+umount_fuse
@@ -0,0 +1,97 @@
+#!/bin/bash
+
+TEST_CASE="case 29 - snapshots"
+
+# 对挂载点内的文件$2调用NEWFS_IOC_SNAP_CREATE或NEWFS_IOC_SNAP_DELETE，快照名为$3
+function snap_ioctl () {
+    python3 - "$1" "$2" "$3" <<'PYEOF'
+import fcntl, os, sys
+NEWFS_SNAP_NAME_LEN   = 32
+NEWFS_IOC_SNAP_CREATE = (1 << 30) | (NEWFS_SNAP_NAME_LEN << 16) | (ord("N") << 8) | 4   # _IOW('N', 4, ...)
+NEWFS_IOC_SNAP_DELETE = (1 << 30) | (NEWFS_SNAP_NAME_LEN << 16) | (ord("N") << 8) | 5   # _IOW('N', 5, ...)
+cmd = NEWFS_IOC_SNAP_CREATE if sys.argv[1] == "create" else NEWFS_IOC_SNAP_DELETE
+fd = os.open(sys.argv[2], os.O_RDONLY)
+fcntl.ioctl(fd, cmd, sys.argv[3].encode().ljust(NEWFS_SNAP_NAME_LEN, b"\0"))
+PYEOF
+}
+
+function check_snap_create () {
+    _TEST_CASE=$2
+    BSIZE=$(stat -f -c %S "${MNTPOINT}")
+    mkdir_and_check "${MNTPOINT}"/run
+    echo "epoch 1" > "${MNTPOINT}"/run/ckpt
+    head -c $((20 * BSIZE)) /dev/urandom > /tmp/newfs_snap_weights
+    cp /tmp/newfs_snap_weights "${MNTPOINT}"/run/weights
+    if ! OUTPUT=$(snap_ioctl create "${MNTPOINT}"/run/ckpt run1 2>&1); then
+        fail "$_TEST_CASE: 创建快照失败: ${OUTPUT}"
+        return 1
+    fi
+    if snap_ioctl create "${MNTPOINT}"/run/ckpt run1 2>/dev/null; then
+        fail "$_TEST_CASE: 重复的快照名应创建失败"
+        return 1
+    fi
+    echo "epoch 2" > "${MNTPOINT}"/run/ckpt
+    echo "changed" | dd of="${MNTPOINT}"/run/weights conv=notrunc status=none
+    touch_and_check "${MNTPOINT}"/run/after
+    if [[ "$(cat "${MNTPOINT}"/run/ckpt)" != "epoch 2" ]] || [[ "$(stat_of snap snapshots)" != "1" ]]; then
+        fail "$_TEST_CASE: 创建快照后当前视图应照常可写, 且统计中有1个快照"
+        return 1
+    fi
+    return 0
+}
+
+function check_snap_mount () {
+    _TEST_CASE=$2
+    umount_fuse
+    mount_fuse --snapshot=run1
+    if [[ "$(cat "${MNTPOINT}"/run/ckpt)" != "epoch 1" ]] \
+            || ! cmp -s /tmp/newfs_snap_weights "${MNTPOINT}"/run/weights \
+            || [[ -e "${MNTPOINT}"/run/after ]]; then
+        fail "$_TEST_CASE: 快照中应是创建快照时的内容"
+        return 1
+    fi
+    if touch "${MNTPOINT}"/run/x 2>/dev/null || rm "${MNTPOINT}"/run/ckpt 2>/dev/null; then
+        fail "$_TEST_CASE: 快照应以只读方式挂载"
+        return 1
+    fi
+    umount_fuse
+    mount_fuse
+    if [[ "$(cat "${MNTPOINT}"/run/ckpt)" != "epoch 2" ]] || [[ ! -e "${MNTPOINT}"/run/after ]]; then
+        fail "$_TEST_CASE: 挂载快照后当前视图不应改变"
+        return 1
+    fi
+    return 0
+}
+
+function check_snap_delete () {
+    _TEST_CASE=$2
+    BEFORE=$(stat -f -c %f "${MNTPOINT}")
+    if ! OUTPUT=$(snap_ioctl delete "${MNTPOINT}"/run/ckpt run1 2>&1); then
+        fail "$_TEST_CASE: 删除快照失败: ${OUTPUT}"
+        return 1
+    fi
+    if (( $(stat -f -c %f "${MNTPOINT}") <= BEFORE )) || [[ "$(stat_of snap snapshots)" != "0" ]]; then
+        fail "$_TEST_CASE: 删除快照后应释放只被快照引用的块"
+        return 1
+    fi
+    umount_fuse
+    if ! OUTPUT=$(run_fsck); then
+        fail "$_TEST_CASE: fsck报告错误: ${OUTPUT}"
+        return 1
+    fi
+    rm -f /tmp/newfs_snap_weights
+    return 0
+}
+
+try_mount_or_fail
+
+TEST_CASE="case 29.1 - create a snapshot and keep writing"
+core_tester echo "$TEST_CASE" check_snap_create "$TEST_CASE"
+
+TEST_CASE="case 29.2 - mount the snapshot read-only"
+core_tester echo "$TEST_CASE" check_snap_mount "$TEST_CASE"
+
+TEST_CASE="case 29.3 - delete the snapshot"
+core_tester echo "$TEST_CASE" check_snap_delete "$TEST_CASE"
+
+umount_fuse
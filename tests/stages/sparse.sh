@@ -0,0 +1,84 @@
+#!/bin/bash
+
+TEST_CASE="case 24 - sparse files"
+
+# 用NEWFS_IOC_SEEK_DATA/NEWFS_IOC_SEEK_HOLE查找数据与空洞，输出: 数据起点 空洞起点
+function seek_data_hole () {
+    python3 - "$1" "$2" <<'PYEOF'
+import fcntl, os, struct, sys
+NEWFS_IOC_SEEK_DATA = 0xC0084E01    # _IOWR('N', 1, off_t)
+NEWFS_IOC_SEEK_HOLE = 0xC0084E02    # _IOWR('N', 2, off_t)
+fd = os.open(sys.argv[1], os.O_RDONLY)
+start = struct.pack("q", int(sys.argv[2]))
+data = struct.unpack("q", fcntl.ioctl(fd, NEWFS_IOC_SEEK_DATA, start))[0]
+hole = struct.unpack("q", fcntl.ioctl(fd, NEWFS_IOC_SEEK_HOLE, struct.pack("q", data)))[0]
+print(data, hole)
+PYEOF
+}
+
+function check_sparse_write () {
+    _TEST_CASE=$2
+    BSIZE=$(stat -f -c %S "${MNTPOINT}")
+    touch_and_check "${MNTPOINT}"/sparse
+    BEFORE=$(stat -f -c %f "${MNTPOINT}")
+    echo -n "tail" | dd of="${MNTPOINT}"/sparse bs=1 seek=$((100 * BSIZE)) conv=notrunc status=none
+    if [[ "$(stat -c %s "${MNTPOINT}"/sparse)" != "$((100 * BSIZE + 4))" ]] \
+            || (( $(stat -f -c %f "${MNTPOINT}") < BEFORE - 1 )); then
+        fail "$_TEST_CASE: 在大偏移处写入应只分配写到的块"
+        return 1
+    fi
+    if [[ -n "$(head -c $((100 * BSIZE)) "${MNTPOINT}"/sparse | tr -d '\0')" ]] \
+            || [[ "$(tail -c 4 "${MNTPOINT}"/sparse)" != "tail" ]]; then
+        fail "$_TEST_CASE: 空洞应读出0, 写入的数据应保持不变"
+        return 1
+    fi
+    return 0
+}
+
+function check_seek_data_hole () {
+    _TEST_CASE=$2
+    BSIZE=$(stat -f -c %S "${MNTPOINT}")
+    if ! OUTPUT=$(seek_data_hole "${MNTPOINT}"/sparse 0 2>&1); then
+        fail "$_TEST_CASE: SEEK_DATA/SEEK_HOLE ioctl失败: ${OUTPUT}"
+        return 1
+    fi
+    if [[ "${OUTPUT}" != "$((100 * BSIZE)) $((100 * BSIZE + 4))" ]]; then
+        fail "$_TEST_CASE: SEEK_DATA/SEEK_HOLE结果不正确, 期望[$((100 * BSIZE)) $((100 * BSIZE + 4))], 实际[${OUTPUT}]"
+        return 1
+    fi
+    if seek_data_hole "${MNTPOINT}"/sparse $((100 * BSIZE + 4)) > /dev/null 2>&1; then
+        fail "$_TEST_CASE: 文件末尾之后的SEEK_DATA应失败"
+        return 1
+    fi
+    return 0
+}
+
+function check_sparse_remount () {
+    _TEST_CASE=$2
+    BSIZE=$(stat -f -c %S "${MNTPOINT}")
+    remount_fuse
+    if [[ "$(tail -c 4 "${MNTPOINT}"/sparse)" != "tail" ]] \
+            || [[ "$(seek_data_hole "${MNTPOINT}"/sparse 0)" != "$((100 * BSIZE)) $((100 * BSIZE + 4))" ]]; then
+        fail "$_TEST_CASE: remount后空洞或数据不正确"
+        return 1
+    fi
+    umount_fuse
+    if ! OUTPUT=$(run_fsck); then
+        fail "$_TEST_CASE: fsck报告错误: ${OUTPUT}"
+        return 1
+    fi
+    return 0
+}
+
+try_mount_or_fail
+
+TEST_CASE="case 24.1 - writes past a hole allocate only the written block"
+core_tester echo "$TEST_CASE" check_sparse_write "$TEST_CASE"
+
+TEST_CASE="case 24.2 - SEEK_DATA and SEEK_HOLE"
+core_tester echo "$TEST_CASE" check_seek_data_hole "$TEST_CASE"
+
+TEST_CASE="case 24.3 - holes persist across remount"
+core_tester echo "$TEST_CASE" check_sparse_remount "$TEST_CASE"
+
+umount_fuse
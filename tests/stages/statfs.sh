@@ -0,0 +1,108 @@
+#!/bin/bash
+
+TEST_CASE="case 8 - statfs"
+
+# 输出: 总块数 空闲块数 可用块数 总inode数 空闲inode数 块大小
+function statfs_of () {
+    stat -f -c '%b %f %a %c %d %S' "${MNTPOINT}"
+}
+
+function check_statfs_fresh () {
+    _TEST_CASE=$2
+    read -r BLOCKS BFREE BAVAIL FILES FFREE BSIZE <<< "$(statfs_of)"
+
+    if (( BLOCKS == 0 || BSIZE == 0 )); then
+        fail "$_TEST_CASE: statfs返回的总块数或块大小为0"
+        return 1
+    fi
+    if (( BFREE != BLOCKS || BAVAIL != BFREE )); then
+        fail "$_TEST_CASE: 新文件系统应全部空闲, 实际总块数$BLOCKS 空闲$BFREE 可用$BAVAIL"
+        return 1
+    fi
+    if (( FFREE != FILES - 1 )); then
+        fail "$_TEST_CASE: 新文件系统只有根目录占用inode, 实际总数$FILES 空闲$FFREE"
+        return 1
+    fi
+    return 0
+}
+
+function check_statfs_usage () {
+    _TEST_CASE=$2
+    read -r _ _ _ _ FFREE0 BSIZE <<< "$(statfs_of)"
+    mkdir_and_check "${MNTPOINT}"/dir0
+    touch_and_check "${MNTPOINT}"/dir0/file0
+    read -r _ BFREE1 _ _ FFREE1 _ <<< "$(statfs_of)"
+
+    if (( FFREE0 - FFREE1 != 2 )); then
+        fail "$_TEST_CASE: 新建目录和文件后空闲inode应减少2, 实际减少$((FFREE0 - FFREE1))"
+        return 1
+    fi
+
+    dd if=/dev/urandom of="${MNTPOINT}"/dir0/file0 bs="$BSIZE" count=10 status=none
+    read -r _ BFREE2 _ _ _ _ <<< "$(statfs_of)"
+    if (( BFREE1 - BFREE2 != 10 )); then
+        fail "$_TEST_CASE: 写入10个块后空闲块应减少10, 实际减少$((BFREE1 - BFREE2))"
+        return 1
+    fi
+    return 0
+}
+
+function check_statfs_remount () {
+    _TEST_CASE=$2
+    BEFORE=$(statfs_of)
+    remount_fuse
+    AFTER=$(statfs_of)
+
+    if [[ "${BEFORE}" != "${AFTER}" ]]; then
+        fail "$_TEST_CASE: remount前后statfs不一致, 之前[$BEFORE] 之后[$AFTER]"
+        return 1
+    fi
+    return 0
+}
+
+function check_statfs_full () {
+    _TEST_CASE=$2
+    read -r _ _ _ _ FFREE _ <<< "$(statfs_of)"
+    mkdir_and_check "${MNTPOINT}"/full
+    for i in $(seq "${FFREE}"); do
+        if ! ERR=$(touch "${MNTPOINT}"/full/file$i 2>&1); then
+            break
+        fi
+    done
+    if [[ "${ERR}" != *"No space left on device"* ]] || [[ -e "${MNTPOINT}"/full/file$i ]]; then
+        fail "$_TEST_CASE: inode用尽后创建文件应返回ENOSPC且不留下目录项, 实际: ${ERR}"
+        return 1
+    fi
+    if mkdir "${MNTPOINT}"/full/dir 2>/dev/null || [[ -e "${MNTPOINT}"/full/dir ]]; then
+        fail "$_TEST_CASE: inode用尽后mkdir应失败且不留下目录项"
+        return 1
+    fi
+    read -r _ _ _ _ FFREE1 _ <<< "$(statfs_of)"
+    if (( FFREE1 != 0 )); then
+        fail "$_TEST_CASE: inode用尽后空闲inode应为0, 实际$FFREE1"
+        return 1
+    fi
+    rm -r "${MNTPOINT}"/full
+    umount_fuse
+    if ! OUTPUT=$(run_fsck); then
+        fail "$_TEST_CASE: inode用尽后fsck报告错误: ${OUTPUT}"
+        return 1
+    fi
+    return 0
+}
+
+try_mount_or_fail
+
+TEST_CASE="case 8.1 - statfs of a fresh ${PROJECT_NAME}"
+core_tester echo "$TEST_CASE" check_statfs_fresh "$TEST_CASE"
+
+TEST_CASE="case 8.2 - statfs follows inode and block usage"
+core_tester echo "$TEST_CASE" check_statfs_usage "$TEST_CASE"
+
+TEST_CASE="case 8.3 - statfs survives remount"
+core_tester echo "$TEST_CASE" check_statfs_remount "$TEST_CASE"
+
+TEST_CASE="case 8.4 - creating files fails cleanly when inodes run out"
+core_tester echo "$TEST_CASE" check_statfs_full "$TEST_CASE"
+
+umount_fuse
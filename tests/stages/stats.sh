@@ -0,0 +1,65 @@
+#!/bin/bash
+
+TEST_CASE="case 17 - stats file"
+
+STATS="${MNTPOINT}/.newfs_stats"
+
+# 参数: 操作名 列号(2次数 3错误 4字节)
+function op_stat () {
+    awk -v op="$1" -v col="$2" '/^\[ops\]/ { in_ops = 1; next } /^\[/ { in_ops = 0 } in_ops && $1 == op { print $col }' "${STATS}"
+}
+
+function check_stats_file () {
+    _TEST_CASE=$2
+    if [[ "$(stat -c %A "${STATS}")" != "-r--r--r--" ]]; then
+        fail "$_TEST_CASE: ${STATS}应为只读文件, 实际权限$(stat -c %A "${STATS}")"
+        return 1
+    fi
+    if (echo x > "${STATS}") 2>/dev/null; then
+        fail "$_TEST_CASE: ${STATS}不应可写"
+        return 1
+    fi
+    for section in ops latency_hist device icache slab; do
+        if ! grep -q "^\[$section\]" "${STATS}"; then
+            fail "$_TEST_CASE: ${STATS}中缺少[$section]"
+            return 1
+        fi
+    done
+    return 0
+}
+
+function check_stats_counters () {
+    _TEST_CASE=$2
+    MKDIR0=$(op_stat mkdir 2)
+    WRITE0=$(op_stat write 4)
+    for i in 0 1 2; do
+        mkdir_and_check "${MNTPOINT}"/dir$i
+    done
+    head -c 5000 /dev/zero > "${MNTPOINT}"/dir0/file0
+    MKDIR1=$(op_stat mkdir 2)
+    WRITE1=$(op_stat write 4)
+
+    if (( MKDIR1 - MKDIR0 != 3 )); then
+        fail "$_TEST_CASE: 创建3个目录后mkdir计数增加了$((MKDIR1 - MKDIR0))"
+        return 1
+    fi
+    if (( WRITE1 - WRITE0 != 5000 )); then
+        fail "$_TEST_CASE: 写入5000字节后write字节数增加了$((WRITE1 - WRITE0))"
+        return 1
+    fi
+    if ! grep -q "^mkdir [0-9]" "${STATS}"; then
+        fail "$_TEST_CASE: [latency_hist]中没有mkdir的延迟分布"
+        return 1
+    fi
+    return 0
+}
+
+try_mount_or_fail
+
+TEST_CASE="case 17.1 - ${STATS} is a read-only stats file"
+core_tester echo "$TEST_CASE" check_stats_file "$TEST_CASE"
+
+TEST_CASE="case 17.2 - per-op counters follow operations"
+core_tester echo "$TEST_CASE" check_stats_counters "$TEST_CASE"
+
+umount_fuse
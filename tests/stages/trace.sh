@@ -0,0 +1,78 @@
+#!/bin/bash
+
+TEST_CASE="case 18 - trace"
+
+TRACE_LOG="/tmp/${PROJECT_NAME}_trace_test.log"
+
+# 前台运行newfs以保留stderr，跟踪记录由SIGUSR2导出到stderr
+function mount_traced () {
+    "$ROOT_PATH"/../build/"${PROJECT_NAME}" --device="$(newfs_device)" "$@" -f "${MNTPOINT}" 2> "${TRACE_LOG}" &
+    TRACE_PID=$!
+    for _ in $(seq 50); do
+        if check_mount; then
+            return
+        fi
+        sleep 0.1
+    done
+}
+
+# 参数为查找不存在文件的次数，之后导出跟踪记录并卸载
+function miss_and_dump () {
+    for i in $(seq "$1"); do
+        stat "${MNTPOINT}"/missing$i > /dev/null 2>&1
+    done
+    kill -USR2 "${TRACE_PID}"
+    sleep 0.5
+    umount_fuse
+    wait "${TRACE_PID}"
+}
+
+function check_trace_dump () {
+    _TEST_CASE=$2
+    mount_traced --trace=4
+    miss_and_dump 5
+    if ! grep -q "newfs_lookup: not found: missing5" "${TRACE_LOG}"; then
+        fail "$_TEST_CASE: --trace=4时SIGUSR2导出的记录中没有查找失败的调试信息"
+        return 1
+    fi
+    return 0
+}
+
+function check_trace_ratelimit () {
+    _TEST_CASE=$2
+    mount_traced --trace=4
+    for i in $(seq 300); do
+        stat "${MNTPOINT}"/flood$i > /dev/null 2>&1
+    done
+    # 被限速的条数在下一秒的第一条记录前汇总
+    sleep 1.1
+    miss_and_dump 1
+    MISSES=$(grep -c "newfs_lookup: not found" "${TRACE_LOG}")
+    if (( MISSES >= 100 )) || ! grep -q "messages suppressed" "${TRACE_LOG}"; then
+        fail "$_TEST_CASE: 300次查找失败记录了$MISSES条, 应被限速并汇总"
+        return 1
+    fi
+    return 0
+}
+
+function check_trace_default () {
+    _TEST_CASE=$2
+    mount_traced
+    miss_and_dump 5
+    if grep -q "newfs_lookup: not found" "${TRACE_LOG}"; then
+        fail "$_TEST_CASE: 默认级别下不应记录调试信息"
+        return 1
+    fi
+    return 0
+}
+
+TEST_CASE="case 18.1 - dump the trace ring on SIGUSR2"
+core_tester echo "$TEST_CASE" check_trace_dump "$TEST_CASE"
+
+TEST_CASE="case 18.2 - rate-limit a flood of lookup misses"
+core_tester echo "$TEST_CASE" check_trace_ratelimit "$TEST_CASE"
+
+TEST_CASE="case 18.3 - debug records are off by default"
+core_tester echo "$TEST_CASE" check_trace_default "$TEST_CASE"
+
+rm -f "${TRACE_LOG}"
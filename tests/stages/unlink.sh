@@ -0,0 +1,86 @@
+#!/bin/bash
+
+TEST_CASE="case 21 - unlink and rmdir"
+
+# 输出: 空闲块数 空闲inode数，等后台释放完成后再统计
+function free_counts () {
+    for _ in $(seq 50); do
+        if [[ "$(sed -n '/^\[reclaim\]/,/^\[/s/^queued //p' "${MNTPOINT}"/.newfs_stats)" == "0" ]]; then
+            break
+        fi
+        sleep 0.1
+    done
+    stat -f -c '%f %d' "${MNTPOINT}"
+}
+
+function check_unlink_free () {
+    _TEST_CASE=$2
+    BSIZE=$(stat -f -c %S "${MNTPOINT}")
+    touch_and_check "${MNTPOINT}"/keep
+    BEFORE=$(free_counts)
+    head -c $((50 * BSIZE)) /dev/urandom > "${MNTPOINT}"/file0
+    rm "${MNTPOINT}"/file0
+    if [[ -e "${MNTPOINT}"/file0 ]]; then
+        fail "$_TEST_CASE: 删除后${MNTPOINT}/file0仍然存在"
+        return 1
+    fi
+    AFTER=$(free_counts)
+    if [[ "${BEFORE}" != "${AFTER}" ]]; then
+        fail "$_TEST_CASE: 删除文件后空间没有全部释放, 之前[$BEFORE] 之后[$AFTER]"
+        return 1
+    fi
+    return 0
+}
+
+function check_rmdir_tree () {
+    _TEST_CASE=$2
+    BEFORE=$(free_counts)
+    for d in 0 1 2; do
+        mkdir -p "${MNTPOINT}"/tree/dir$d
+        for f in 0 1 2 3 4; do
+            echo "content of dir$d/file$f" > "${MNTPOINT}"/tree/dir$d/file$f
+        done
+    done
+    if rmdir "${MNTPOINT}"/tree/dir0 2>/dev/null; then
+        fail "$_TEST_CASE: rmdir非空目录应失败"
+        return 1
+    fi
+    rm -r "${MNTPOINT}"/tree
+    if [[ -e "${MNTPOINT}"/tree ]]; then
+        fail "$_TEST_CASE: rm -r后目录仍然存在"
+        return 1
+    fi
+    AFTER=$(free_counts)
+    if [[ "${BEFORE}" != "${AFTER}" ]]; then
+        fail "$_TEST_CASE: rm -r后空间没有全部释放, 之前[$BEFORE] 之后[$AFTER]"
+        return 1
+    fi
+    return 0
+}
+
+function check_unlink_remount () {
+    _TEST_CASE=$2
+    umount_fuse
+    if ! OUTPUT=$(run_fsck); then
+        fail "$_TEST_CASE: 删除后卸载, fsck报告错误: ${OUTPUT}"
+        return 1
+    fi
+    mount_fuse
+    if [[ "$(ls "${MNTPOINT}")" != "keep" ]]; then
+        fail "$_TEST_CASE: remount后根目录应只剩keep, 实际: $(ls "${MNTPOINT}")"
+        return 1
+    fi
+    umount_fuse
+    return 0
+}
+
+try_mount_or_fail
+
+TEST_CASE="case 21.1 - unlink frees blocks and the inode"
+core_tester echo "$TEST_CASE" check_unlink_free "$TEST_CASE"
+
+TEST_CASE="case 21.2 - rm -r removes a subtree"
+core_tester echo "$TEST_CASE" check_rmdir_tree "$TEST_CASE"
+
+TEST_CASE="case 21.3 - removals persist across remount"
+core_tester echo "$TEST_CASE" check_unlink_remount "$TEST_CASE"
@@ -0,0 +1,92 @@
+#!/bin/bash
+
+TEST_CASE="case 32 - extended attributes"
+
+# 在python中执行$1，文件路径为p，失败时输出异常
+function xattr_py () {
+    python3 - "$2" <<PYEOF
+import errno, os, sys
+p = sys.argv[1]
+def fails(err, fn, *args):
+    try:
+        fn(*args)
+    except OSError as e:
+        return e.errno == err
+    return False
+$1
+PYEOF
+}
+
+function check_xattr_small () {
+    _TEST_CASE=$2
+    echo "shard" > "${MNTPOINT}"/shard
+    if ! OUTPUT=$(xattr_py '
+os.setxattr(p, "user.label", b"7")
+os.setxattr(p, "user.version", b"v1")
+assert os.getxattr(p, "user.label") == b"7"
+assert sorted(os.listxattr(p)) == ["user.label", "user.version"]
+assert fails(errno.EEXIST, os.setxattr, p, "user.label", b"8", os.XATTR_CREATE)
+assert fails(errno.ENODATA, os.setxattr, p, "user.none", b"8", os.XATTR_REPLACE)
+os.setxattr(p, "user.label", b"8", os.XATTR_REPLACE)
+assert os.getxattr(p, "user.label") == b"8"
+os.removexattr(p, "user.version")
+assert fails(errno.ENODATA, os.getxattr, p, "user.version")
+assert os.listxattr(p) == ["user.label"]
+' "${MNTPOINT}"/shard 2>&1); then
+        fail "$_TEST_CASE: 属性的设置、读取、列出或删除结果不正确: ${OUTPUT}"
+        return 1
+    fi
+    return 0
+}
+
+function check_xattr_large () {
+    _TEST_CASE=$2
+    if ! OUTPUT=$(xattr_py '
+os.setxattr(p, "user.checksum", b"c" * 400)
+assert os.getxattr(p, "user.checksum") == b"c" * 400
+assert os.getxattr(p, "user.label") == b"8"
+assert fails(errno.ENOSPC, os.setxattr, p, "user.huge", b"h" * 4000)
+' "${MNTPOINT}"/shard 2>&1); then
+        fail "$_TEST_CASE: 大属性的读写结果不正确: ${OUTPUT}"
+        return 1
+    fi
+    if (( $(stat_of xattr spills) == 0 )); then
+        fail "$_TEST_CASE: 放不进inode的属性应移到属性块, [xattr] spills应大于0"
+        return 1
+    fi
+    return 0
+}
+
+function check_xattr_remount () {
+    _TEST_CASE=$2
+    remount_fuse
+    # 小属性在inode内，读取不需要额外读属性块
+    if ! OUTPUT=$(xattr_py 'assert os.getxattr(p, "user.label") == b"8"' "${MNTPOINT}"/shard 2>&1) \
+            || (( $(stat_of xattr blk_reads) != 0 )) || (( $(stat_of xattr inline_hits) == 0 )); then
+        fail "$_TEST_CASE: remount后读取inode内的属性不应读属性块: ${OUTPUT} blk_reads $(stat_of xattr blk_reads)"
+        return 1
+    fi
+    if ! OUTPUT=$(xattr_py 'assert os.getxattr(p, "user.checksum") == b"c" * 400' "${MNTPOINT}"/shard 2>&1); then
+        fail "$_TEST_CASE: remount后属性块中的属性不正确: ${OUTPUT}"
+        return 1
+    fi
+    umount_fuse
+    if ! OUTPUT=$(run_fsck); then
+        fail "$_TEST_CASE: fsck报告错误: ${OUTPUT}"
+        return 1
+    fi
+    return 0
+}
+
+try_mount_or_fail
+
+TEST_CASE="case 32.1 - set, get, list and remove attributes"
+core_tester echo "$TEST_CASE" check_xattr_small "$TEST_CASE"
+
+TEST_CASE="case 32.2 - large attributes spill to the xattr block"
+core_tester echo "$TEST_CASE" check_xattr_large "$TEST_CASE"
+
+TEST_CASE="case 32.3 - inline attributes are read without extra I/O"
+core_tester echo "$TEST_CASE" check_xattr_remount "$TEST_CASE"
+
+umount_fuse
@@ -11,7 +11,7 @@
 # fi 
 # cd - || exit
 
-read -r -p "请输入测试方式[N(基础功能测试) / E(进阶功能测试) / S(分阶段测试)]: " TEST_METHOD
+read -r -p "请输入测试方式[N(基础功能测试) / E(进阶功能测试) / F(扩展特性测试) / S(分阶段测试)]: " TEST_METHOD
 
 # 编译src
 cd ..; mkdir build >/dev/null 2>&1; cd build
@@ -32,6 +32,8 @@ if [[ "${TEST_METHOD}" == "E" ]]; then
     ./main.sh "6"
 elif [[ "${TEST_METHOD}" == "N" ]]; then
     ./main.sh "4"
+elif [[ "${TEST_METHOD}" == "F" ]]; then
+    ./main.sh "7"
 else
     echo "----测试阶段1：mount测试"
     echo "----测试阶段2：增加 mkdir 和 touch 测试"
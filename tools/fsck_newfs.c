@@ -0,0 +1,1440 @@
+/**
+ * @file fsck_newfs.c
+ * @brief newfs离线一致性检查与修复(fsck.newfs)
+ *
+ * 1) 读超级块与两张位图，按大批量顺序读入整个inode区；
+ * 2) 从根目录出发，用工作窃取线程池并行遍历目录树：每个线程优先处理自己队列尾部的目录，
+ *    空闲时从其他线程队列头部窃取。遍历中按引用重建inode位图与数据块位图(原子置位)并统计每块的引用数，
+ *    同时发现越界块号、无效目录项、类型不符的目录项；非目录inode按目录项数统计硬链接，与nlink比较；
+ *    超级块中记有中断的跨目录重命名且新父目录已引用被移动的inode时，原父目录中的旧目录项按无效处理；
+ * 3) 校验快照表与各快照的映射表，登记快照保存的旧inode及其数据块；
+ *    单线程检查多次引用的块：只有非目录inode中带共享标记的引用是合法的克隆，其余按重复引用处理；
+ *    再与磁盘上的共享块引用计数表比较；
+ * 4) 按64位字比较重建位图与磁盘位图，得到孤儿inode、泄漏块与未登记的块；
+ * 5) 带NEWFS_FEAT_CSUM时校验超级块、正常卸载后的位图、被引用的inode、目录块与隐藏inode内容的CRC32C；
+ *    带NEWFS_FEAT_XATTR时检查inode内的扩展属性区与属性块；
+ * 6) --repair时：重复块复制一份给后来者，越界块号清除，压缩有问题的目录并修正dir_cnt与nlink，
+ *    按重建的引用数重写引用计数表，写回重建的位图与超级块计数，标记为正常卸载。
+ *    快照元数据不可用时丢弃全部快照，它们保存的inode与块随位图重建释放。
+ *    不可用的inode内扩展属性清空，不可用的属性块丢弃。
+ *    孤儿inode与泄漏块随位图重建一并释放；写回的inode、目录块、位图与超级块重新计算校验和。
+ *
+ * 用法: fsck.newfs [--repair] [--jobs=N] [--verbose] <device>
+ * device与newfs的--device相同，如mmap:/tmp/newfs.img。文件系统必须处于未挂载状态。
+ * 退出码与e2fsck一致：0无错误，1错误已修复，4有未修复的错误，8操作失败。
+ */
+#include "newfs.h"
+#include <getopt.h>
+#include <sched.h>
+
+#define FSCK_OK             0
+#define FSCK_FIXED          1
+#define FSCK_UNCORRECTED    4
+#define FSCK_ERROR          8
+
+#define FSCK_BATCH          (8 * 1024 * 1024)   /* 读inode区的单批大小 */
+#define FSCK_MAX_REPORT     20                  /* 每类问题最多逐条打印的条数 */
+#define FSCK_LINK_HIDDEN    0x80000000u         /* links[]中标记根目录与隐藏inode，目录项不能指向它们 */
+#define FSCK_XATTR_IDX      NEWFS_DATA_PER_FILE /* 问题记录中表示属性块的块下标 */
+
+/******************************************************************************
+* SECTION: 参数与全局状态
+*******************************************************************************/
+struct fsck_options {
+    bool        repair;
+    bool        verbose;
+    int         jobs;
+    const char* device;
+};
+
+static struct fsck_options opts = {
+    .repair  = false,
+    .verbose = false,
+    .jobs    = 0,
+    .device  = NULL,
+};
+
+static struct newfs_bdev*    bdev;
+static struct newfs_super_d  sb;
+static int                   blk_sz;
+static int                   per_blk;           /* 每个逻辑块的目录项数 */
+static uint8_t*              image;             /* 后端支持映射时为整个设备，遍历时零拷贝读目录块 */
+static pthread_mutex_t       io_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct newfs_inode_d* itable;            /* 整个inode区 */
+static uint8_t*              disk_ino_map;      /* 磁盘上的位图 */
+static uint8_t*              disk_blk_map;
+static uint64_t*             ino_map;           /* 按引用重建的位图，按64位字原子置位 */
+static uint64_t*             blk_map;
+static int                   ino_words, blk_words;
+static bool                  rename_stale;      /* 中断的重命名已写入新父目录，原父目录中的旧项作废 */
+static uint32_t*             blk_refs;          /* 每个数据块被引用的次数 */
+static uint32_t*             blk_plain;         /* 其中不带共享标记的引用数(目录的引用总是计入) */
+static uint32_t*             links;             /* 每个非目录inode被目录项引用的次数 */
+static bool                  share_valid;       /* sb.share_ino指向可用的引用计数表inode */
+static bool                  dedup_valid;       /* sb.dedup_ino指向可用的去重索引inode */
+static bool                  csum_valid;        /* sb.csum_ino指向可用的数据块校验表inode */
+static bool                  csum_on;           /* 文件系统带NEWFS_FEAT_CSUM */
+static int                   ino_sz;            /* 磁盘上inode槽位大小，旧镜像没有校验和或扩展属性字段 */
+static bool                  xattr_on;          /* 文件系统带NEWFS_FEAT_XATTR */
+static int                   snap_ino;          /* 快照表inode，不带NEWFS_FEAT_SNAP的镜像为0 */
+static bool                  snap_valid;        /* 快照表与全部映射表可用，保存的inode已登记 */
+
+/******************************************************************************
+* SECTION: 问题记录
+* 遍历线程并发追加，统一加一把锁；问题数通常很少，不在热路径上
+*******************************************************************************/
+enum fsck_fix {
+    FIX_DUP_BLOCK,      /* 数据块已被其他inode引用，修复时复制一份 */
+    FIX_BAD_BLOCK,      /* 块号越界，修复时清除 */
+    FIX_DROP_DENTRY,    /* 目录项无效或重复链接，修复时删除 */
+    FIX_FTYPE,          /* 目录项类型与inode不符，修复时以inode为准 */
+    FIX_DIR_CNT,        /* dir_cnt超出已分配的目录块，修复时截断 */
+    FIX_INO_SLOT,       /* inode槽位中的ino与槽号不符 */
+    FIX_SHARE_TABLE,    /* 共享块引用计数表与实际引用不符，修复时重写 */
+    FIX_DEDUP_INDEX,    /* 去重索引inode不可用，修复时丢弃 */
+    FIX_INODE_CSUM,     /* inode校验和不符，修复时按检查后的内容重写 */
+    FIX_DIRBLK_CSUM,    /* 目录块校验和不符，修复时重写目录 */
+    FIX_CSUM_TABLE,     /* 数据块校验表inode不可用，修复时丢弃 */
+    FIX_SNAP_TABLE,     /* 快照表或映射表不可用，修复时丢弃全部快照 */
+    FIX_NLINK,          /* nlink与指向它的目录项数不符，修复时以目录项数为准 */
+    FIX_XATTR,          /* 扩展属性区或属性块损坏，修复时丢弃 */
+    FIX_NR
+};
+
+static const char* fix_names[FIX_NR] = {
+    [FIX_DUP_BLOCK]   = "doubly-allocated blocks",
+    [FIX_BAD_BLOCK]   = "out-of-range block numbers",
+    [FIX_DROP_DENTRY] = "invalid or duplicate dentries",
+    [FIX_FTYPE]       = "dentry type mismatches",
+    [FIX_DIR_CNT]     = "dir_cnt mismatches",
+    [FIX_INO_SLOT]    = "inode slot mismatches",
+    [FIX_SHARE_TABLE] = "block refcount table mismatches",
+    [FIX_DEDUP_INDEX] = "unusable dedup indexes",
+    [FIX_INODE_CSUM]  = "inode checksum mismatches",
+    [FIX_DIRBLK_CSUM] = "directory block checksum mismatches",
+    [FIX_CSUM_TABLE]  = "unusable data checksum tables",
+    [FIX_SNAP_TABLE]  = "unusable snapshot tables",
+    [FIX_NLINK]       = "link count mismatches",
+    [FIX_XATTR]       = "unusable extended attributes",
+};
+
+struct fsck_problem {
+    int      fix;       /* FIX_* */
+    uint32_t ino;       /* 所属inode(目录项问题为父目录) */
+    int      idx;       /* 块下标(FSCK_XATTR_IDX为属性块)或目录项下标 */
+    int      arg;       /* FIX_FTYPE: 正确类型；FIX_DIR_CNT: 截断后的dir_cnt；FIX_NLINK: 正确的nlink */
+};
+
+static struct fsck_problem* problems;
+static int                  nr_problems, cap_problems;
+static int                  nr_by_fix[FIX_NR];
+static pthread_mutex_t      problem_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void problem_add(int fix, uint32_t ino, int idx, int arg) {
+    pthread_mutex_lock(&problem_lock);
+    if (nr_problems == cap_problems) {
+        cap_problems = cap_problems ? cap_problems * 2 : 64;
+        problems = (struct fsck_problem *)realloc(problems, sizeof(*problems) * cap_problems);
+    }
+    problems[nr_problems++] = (struct fsck_problem){ fix, ino, idx, arg };
+    if (opts.verbose || nr_by_fix[fix] < FSCK_MAX_REPORT) {
+        fprintf(stderr, "inode %u: %s (index %d)\n", ino, fix_names[fix], idx);
+    }
+    nr_by_fix[fix]++;
+    pthread_mutex_unlock(&problem_lock);
+}
+
+/******************************************************************************
+* SECTION: 设备访问
+*******************************************************************************/
+/**
+ * @brief 任意偏移与长度的读，按设备IO单位对齐后读入
+ */
+static int fsck_read(long offset, void* buf, int size) {
+    int  io_sz = bdev->io_sz;
+    long down  = offset / io_sz * io_sz;
+    int  len   = (offset + size - down + io_sz - 1) / io_sz * io_sz;
+    uint8_t* tmp;
+    int  ret;
+
+    if (image) {
+        memcpy(buf, image + offset, size);
+        return NEWFS_ERROR_NONE;
+    }
+    if (down == offset && len == size) {
+        pthread_mutex_lock(&io_lock);
+        ret = newfs_bdev_read(bdev, offset, buf, size);
+        pthread_mutex_unlock(&io_lock);
+        return ret;
+    }
+    tmp = (uint8_t *)malloc(len);
+    pthread_mutex_lock(&io_lock);
+    ret = newfs_bdev_read(bdev, down, tmp, len);
+    pthread_mutex_unlock(&io_lock);
+    memcpy(buf, tmp + (offset - down), size);
+    free(tmp);
+    return ret;
+}
+
+/**
+ * @brief 任意偏移与长度的写，未对齐时读-改-写，只在单线程的修复阶段调用
+ */
+static int fsck_write(long offset, const void* buf, int size) {
+    int  io_sz = bdev->io_sz;
+    long down  = offset / io_sz * io_sz;
+    int  len   = (offset + size - down + io_sz - 1) / io_sz * io_sz;
+    uint8_t* tmp;
+    int  ret;
+
+    if (down == offset && len == size) {
+        return newfs_bdev_write(bdev, offset, buf, size);
+    }
+    tmp = (uint8_t *)malloc(len);
+    ret = newfs_bdev_read(bdev, down, tmp, len);
+    if (ret == NEWFS_ERROR_NONE) {
+        memcpy(tmp + (offset - down), buf, size);
+        ret = newfs_bdev_write(bdev, down, tmp, len);
+    }
+    free(tmp);
+    return ret;
+}
+
+static long blk_ofs(uint32_t blkno) {
+    return sb.data_offset + (long)blkno * blk_sz;
+}
+
+static long ino_ofs(uint32_t ino) {
+    return sb.inode_offset + (long)ino * ino_sz;
+}
+
+/**
+ * @brief 写回内存中的inode，带校验时先重新计算校验和
+ */
+static int write_inode(uint32_t ino) {
+    if (csum_on) {
+        newfs_csum_inode_seal(&itable[ino], ino_sz);
+    }
+    return fsck_write(ino_ofs(ino), &itable[ino], ino_sz);
+}
+
+/**
+ * @brief 隐藏inode内容在磁盘上的字节数，与newfs一致：带校验时内容之后紧跟4字节CRC32C
+ */
+static int hidden_bytes(int len) {
+    return csum_on && len > 0 ? len + (int)sizeof(uint32_t) : len;
+}
+
+/**
+ * @brief 隐藏inode的大小是否为ent_sz的整数倍且放得下
+ */
+static bool hidden_fits(const struct newfs_inode_d* inode, int ent_sz) {
+    return inode->size >= 0 && inode->size % ent_sz == 0
+        && hidden_bytes(inode->size) <= NEWFS_DATA_PER_FILE * blk_sz;
+}
+
+/**
+ * @brief 校验隐藏inode内容末尾的CRC32C，不带校验的文件系统总是通过
+ */
+static bool hidden_csum_ok(uint32_t ino) {
+    struct newfs_inode_d* inode = &itable[ino];
+    int      nbytes = hidden_bytes(inode->size);
+    uint8_t* buf;
+    uint32_t crc;
+    bool     ok = true;
+
+    if (!csum_on || inode->size == 0) {
+        return true;
+    }
+    buf = (uint8_t *)malloc((nbytes + blk_sz - 1) / blk_sz * blk_sz);
+    for (int b = 0; ok && b * blk_sz < nbytes; b++) {
+        ok = inode->data[b] < (uint32_t)sb.data_blks
+             && fsck_read(blk_ofs(inode->data[b]), buf + (long)b * blk_sz, blk_sz) == NEWFS_ERROR_NONE;
+    }
+    if (ok) {
+        memcpy(&crc, buf + inode->size, sizeof(crc));
+        ok = newfs_crc32c(buf, inode->size) == crc;
+    }
+    free(buf);
+    return ok;
+}
+
+/**
+ * @brief 读出隐藏inode的内容(不含校验和)，需由调用者free
+ *
+ * @return void* 内容，块号越界或读失败时返回NULL
+ */
+static void* hidden_load(uint32_t ino) {
+    struct newfs_inode_d* inode = &itable[ino];
+    uint8_t* buf = (uint8_t *)malloc((inode->size + blk_sz - 1) / blk_sz * blk_sz + 1);
+
+    for (int b = 0; (long)b * blk_sz < inode->size; b++) {
+        if (inode->data[b] >= (uint32_t)sb.data_blks
+            || fsck_read(blk_ofs(inode->data[b]), buf + (long)b * blk_sz, blk_sz) != NEWFS_ERROR_NONE) {
+            free(buf);
+            return NULL;
+        }
+    }
+    return buf;
+}
+
+/******************************************************************************
+* SECTION: 位图
+*******************************************************************************/
+/**
+ * @brief 原子置位
+ *
+ * @return bool 该位此前是否已置位
+ */
+static bool bit_claim(uint64_t* map, int pos) {
+    uint64_t mask = 1ull << (pos % 64);
+    return __atomic_fetch_or(&map[pos / 64], mask, __ATOMIC_RELAXED) & mask;
+}
+
+static void bit_clear(uint64_t* map, int pos) {
+    __atomic_fetch_and(&map[pos / 64], ~(1ull << (pos % 64)), __ATOMIC_RELAXED);
+}
+
+static bool bit_test(const uint64_t* map, int pos) {
+    return (map[pos / 64] >> (pos % 64)) & 1;
+}
+
+/**
+ * @brief 取磁盘位图的第w个64位字，超出nbits的部分清零
+ */
+static uint64_t disk_word(const uint8_t* map, int w, int nbits) {
+    uint64_t v = 0;
+
+    for (int b = 0; b < 8 && w * 64 + b * 8 < nbits; b++) {
+        v |= (uint64_t)map[w * 8 + b] << (b * 8);
+    }
+    if ((w + 1) * 64 > nbits) {
+        v &= (1ull << (nbits - w * 64)) - 1;
+    }
+    return v;
+}
+
+/**
+ * @brief 按64位字比较重建位图与磁盘位图
+ *
+ * @param only_disk 磁盘上置位但未被引用的位数
+ * @param only_ref 被引用但磁盘上未置位的位数
+ * @return int 被引用的位数
+ */
+static int bitmap_diff(const char* what, const uint8_t* disk, const uint64_t* ref, int words,
+                       int nbits, int* only_disk, int* only_ref) {
+    int used = 0, shown = 0;
+
+    *only_disk = *only_ref = 0;
+    for (int w = 0; w < words; w++) {
+        uint64_t d = disk_word(disk, w, nbits), r = ref[w];
+        used += __builtin_popcountll(r);
+        if (d == r) {
+            continue;
+        }
+        *only_disk += __builtin_popcountll(d & ~r);
+        *only_ref  += __builtin_popcountll(r & ~d);
+        for (uint64_t x = d ^ r; x && (opts.verbose || shown < FSCK_MAX_REPORT); x &= x - 1, shown++) {
+            int pos = w * 64 + __builtin_ctzll(x);
+            fprintf(stderr, "%s %d: %s\n", what, pos,
+                    (d >> (pos % 64)) & 1 ? "marked in bitmap but unreferenced" : "referenced but not marked");
+        }
+    }
+    return used;
+}
+
+/******************************************************************************
+* SECTION: 工作窃取线程池
+* 每个线程一个双端队列：自己从尾部压入、弹出(深度优先，局部性好)，窃取者从头部取。
+* pending为已入队未处理完的目录数，为0时全部线程退出。
+*******************************************************************************/
+struct fsck_deque {
+    pthread_mutex_t lock;
+    uint32_t*       items;
+    int             head, tail, cap;
+};
+
+static struct fsck_deque* deques;
+static long               pending;
+
+static void deque_push(struct fsck_deque* dq, uint32_t ino) {
+    __atomic_add_fetch(&pending, 1, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&dq->lock);
+    if (dq->tail == dq->cap) {
+        if (dq->head > 0) {                             /* 先回收头部已被取走的空间 */
+            memmove(dq->items, dq->items + dq->head, sizeof(uint32_t) * (dq->tail - dq->head));
+            dq->tail -= dq->head;
+            dq->head  = 0;
+        }
+        if (dq->tail == dq->cap) {
+            dq->cap   = dq->cap ? dq->cap * 2 : 256;
+            dq->items = (uint32_t *)realloc(dq->items, sizeof(uint32_t) * dq->cap);
+        }
+    }
+    dq->items[dq->tail++] = ino;
+    pthread_mutex_unlock(&dq->lock);
+}
+
+static bool deque_pop(struct fsck_deque* dq, uint32_t* ino, bool steal) {
+    bool ok = false;
+
+    pthread_mutex_lock(&dq->lock);
+    if (dq->head < dq->tail) {
+        *ino = steal ? dq->items[dq->head++] : dq->items[--dq->tail];
+        ok   = true;
+    }
+    pthread_mutex_unlock(&dq->lock);
+    return ok;
+}
+
+/******************************************************************************
+* SECTION: 遍历
+*******************************************************************************/
+static int alloc_free_blk(void);
+
+static bool ino_valid(uint32_t ino) {
+    return ino < (uint32_t)sb.ino_max;
+}
+
+/**
+ * @brief 块下标对应的块号字段，FSCK_XATTR_IDX为属性块
+ */
+static uint32_t* blk_slot(struct newfs_inode_d* inode, int idx) {
+    return idx == FSCK_XATTR_IDX ? &inode->xattr_blk : &inode->data[idx];
+}
+
+/**
+ * @brief 登记inode引用的全部数据块，fallocate预分配的未写入块同样占用空间。
+ * 这里只计数，多次引用是否合法由遍历结束后的check_shares判断
+ */
+static void claim_blocks(uint32_t ino) {
+    struct newfs_inode_d* inode = &itable[ino];
+
+    if (xattr_on && !NEWFS_BLK_HOLE(inode->xattr_blk)) {
+        if (inode->xattr_blk >= (uint32_t)sb.data_blks) {
+            problem_add(FIX_BAD_BLOCK, ino, FSCK_XATTR_IDX, 0);
+        } else {
+            bit_claim(blk_map, inode->xattr_blk);
+            __atomic_add_fetch(&blk_refs[inode->xattr_blk], 1, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&blk_plain[inode->xattr_blk], 1, __ATOMIC_RELAXED);
+        }
+    }
+    if (NEWFS_IS_INLINE_LINK(inode)) {
+        return;                                             /* data[]中是链接目标 */
+    }
+    for (int i = 0; i < NEWFS_DATA_PER_FILE; i++) {
+        uint32_t blkno = NEWFS_BLKNO(inode->data[i]);
+        if (NEWFS_BLK_HOLE(inode->data[i])) {
+            continue;
+        }
+        if (blkno >= (uint32_t)sb.data_blks) {
+            problem_add(FIX_BAD_BLOCK, ino, i, 0);
+            continue;
+        }
+        bit_claim(blk_map, blkno);
+        __atomic_add_fetch(&blk_refs[blkno], 1, __ATOMIC_RELAXED);
+        if (inode->ftype == NEWFS_DIR || !NEWFS_BLK_IS_SHARED(inode->data[i])) {
+            __atomic_add_fetch(&blk_plain[blkno], 1, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+/**
+ * @brief 检查一个目录：登记其数据块，逐项检查目录项，子目录放入当前线程的队列
+ */
+static void check_dir(uint32_t ino, struct fsck_deque* dq, uint8_t* buf) {
+    struct newfs_inode_d* dir = &itable[ino];
+    int dir_cnt = dir->dir_cnt;
+    int avail   = 0;                                        /* 开头连续有效块可容纳的目录项数 */
+    int cur_blk = -1;
+    struct newfs_dentry_d* ents = NULL;
+
+    claim_blocks(ino);
+    while (avail / per_blk < NEWFS_DATA_PER_FILE && dir->data[avail / per_blk] < (uint32_t)sb.data_blks) {
+        avail += per_blk;
+    }
+    if (dir_cnt < 0 || dir_cnt > avail) {                   /* 目录项所在块缺失，截断 */
+        dir_cnt = dir_cnt < 0 ? 0 : avail;
+        problem_add(FIX_DIR_CNT, ino, dir->dir_cnt, dir_cnt);
+    }
+    for (int i = 0; i < dir_cnt; i++) {
+        int      b = i / per_blk;
+        uint32_t child;
+        struct newfs_dentry_d* de;
+
+        if (b != cur_blk) {
+            uint32_t blkno = dir->data[b];
+            if (image) {
+                ents = (struct newfs_dentry_d *)(image + blk_ofs(blkno));
+            } else {
+                fsck_read(blk_ofs(blkno), buf, blk_sz);
+                ents = (struct newfs_dentry_d *)buf;
+            }
+            cur_blk = b;
+            if (csum_on && !newfs_csum_dirblk_ok(ents, blk_sz)) {
+                problem_add(FIX_DIRBLK_CSUM, ino, b, 0);
+            }
+        }
+        de    = &ents[i % per_blk];
+        child = de->ino;
+        if (de->name[0] == '\0' || memchr(de->name, '\0', MAX_NAME_LEN) == NULL || !ino_valid(child)) {
+            problem_add(FIX_DROP_DENTRY, ino, i, 0);
+            continue;
+        }
+        if (rename_stale && ino == (uint32_t)sb.rename_src && child == (uint32_t)sb.rename_ino) {
+            problem_add(FIX_DROP_DENTRY, ino, i, 0);        /* 重命名前的旧位置 */
+            continue;
+        }
+        if (itable[child].ftype != NEWFS_DIR) {
+            uint32_t prev = __atomic_fetch_add(&links[child], 1, __ATOMIC_RELAXED);
+            if (prev & FSCK_LINK_HIDDEN) {
+                problem_add(FIX_DROP_DENTRY, ino, i, 0);
+                continue;
+            }
+            if (prev > 0) {                                 /* 硬链接，inode已由第一个目录项登记 */
+                if (de->ftype != itable[child].ftype) {
+                    problem_add(FIX_FTYPE, ino, i, itable[child].ftype);
+                }
+                continue;
+            }
+        }
+        if (bit_claim(ino_map, child)) {                    /* 已被其他目录项引用(含根目录) */
+            problem_add(FIX_DROP_DENTRY, ino, i, 0);
+            continue;
+        }
+        if (itable[child].ino != child) {
+            problem_add(FIX_INO_SLOT, child, 0, 0);
+        }
+        if (de->ftype != itable[child].ftype) {
+            problem_add(FIX_FTYPE, ino, i, itable[child].ftype);
+        }
+        if (itable[child].ftype == NEWFS_DIR) {
+            deque_push(dq, child);
+        } else {
+            claim_blocks(child);
+        }
+    }
+}
+
+/**
+ * @brief 检查超级块中的跨目录重命名意图，结论与newfs挂载时的newfs_rename_recover一致：
+ * 新父目录中已有被移动的inode则重命名已生效，否则两个目录都还是旧状态
+ */
+static void check_rename_intent(void) {
+    struct newfs_inode_d* dir;
+
+    if (sb.rename_src == sb.rename_dst || !ino_valid(sb.rename_src) || !ino_valid(sb.rename_dst)
+        || itable[sb.rename_dst].ftype != NEWFS_DIR) {
+        return;
+    }
+    dir = &itable[sb.rename_dst];
+    for (int i = 0; i < dir->dir_cnt && i / per_blk < NEWFS_DATA_PER_FILE; i++) {
+        uint32_t blkno = dir->data[i / per_blk];
+        struct newfs_dentry_d de;
+
+        if (blkno >= (uint32_t)sb.data_blks
+            || fsck_read(blk_ofs(blkno) + (long)(i % per_blk) * sizeof(de), &de, sizeof(de)) != NEWFS_ERROR_NONE) {
+            break;
+        }
+        if (de.ino == (uint32_t)sb.rename_ino) {
+            rename_stale = true;
+            break;
+        }
+    }
+    printf("interrupted rename of inode %d (%d -> %d), %s\n", sb.rename_ino, sb.rename_src,
+           sb.rename_dst, rename_stale ? "completing" : "discarding");
+}
+
+static int worker_id_next;
+
+static void* fsck_worker(void* arg) {
+    int      id  = __atomic_fetch_add(&worker_id_next, 1, __ATOMIC_RELAXED);
+    uint8_t* buf = (uint8_t *)malloc(blk_sz);
+    uint32_t ino;
+
+    (void)arg;
+    for (;;) {
+        bool got = deque_pop(&deques[id], &ino, false);
+        for (int k = 1; !got && k < opts.jobs; k++) {
+            got = deque_pop(&deques[(id + k) % opts.jobs], &ino, true);
+        }
+        if (got) {
+            check_dir(ino, &deques[id], buf);
+            __atomic_sub_fetch(&pending, 1, __ATOMIC_RELEASE);
+        } else if (__atomic_load_n(&pending, __ATOMIC_ACQUIRE) == 0) {
+            break;
+        } else {
+            sched_yield();
+        }
+    }
+    free(buf);
+    return NULL;
+}
+
+static void walk_tree(void) {
+    pthread_t* tids = (pthread_t *)calloc(opts.jobs, sizeof(pthread_t));
+
+    deques = (struct fsck_deque *)calloc(opts.jobs, sizeof(struct fsck_deque));
+    for (int i = 0; i < opts.jobs; i++) {
+        pthread_mutex_init(&deques[i].lock, NULL);
+    }
+    bit_claim(ino_map, sb.root_ino);
+    links[sb.root_ino] = FSCK_LINK_HIDDEN;
+    if (share_valid) {                                  /* 引用计数表inode不挂在目录树中 */
+        bit_claim(ino_map, sb.share_ino);
+        claim_blocks(sb.share_ino);
+        links[sb.share_ino] = FSCK_LINK_HIDDEN;         /* 隐藏inode是普通文件，目录项不能当作它的硬链接 */
+    }
+    if (dedup_valid) {                                  /* 去重索引inode同样不在目录树中 */
+        bit_claim(ino_map, sb.dedup_ino);
+        claim_blocks(sb.dedup_ino);
+        links[sb.dedup_ino] = FSCK_LINK_HIDDEN;
+    }
+    if (csum_valid) {                                   /* 数据块校验表inode同样不在目录树中 */
+        bit_claim(ino_map, sb.csum_ino);
+        claim_blocks(sb.csum_ino);
+        links[sb.csum_ino] = FSCK_LINK_HIDDEN;
+    }
+    deque_push(&deques[0], sb.root_ino);
+    for (int i = 0; i < opts.jobs; i++) {
+        pthread_create(&tids[i], NULL, fsck_worker, NULL);
+    }
+    for (int i = 0; i < opts.jobs; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    for (int i = 0; i < opts.jobs; i++) {
+        free(deques[i].items);
+        pthread_mutex_destroy(&deques[i].lock);
+    }
+    free(deques);
+    free(tids);
+}
+
+/**
+ * @brief 比较每个非目录inode的nlink与遍历中数到的目录项数，旧镜像的nlink为0，按1处理
+ */
+static void check_links(void) {
+    for (uint32_t ino = 0; ino < (uint32_t)sb.ino_max; ino++) {
+        uint32_t cnt = links[ino];
+        int      nlink;
+
+        if (cnt == 0 || (cnt & FSCK_LINK_HIDDEN) || itable[ino].ftype == NEWFS_DIR) {
+            continue;
+        }
+        nlink = itable[ino].nlink > 0 ? itable[ino].nlink : 1;
+        if (nlink != (int)cnt) {
+            problem_add(FIX_NLINK, ino, nlink, (int)cnt);
+        }
+    }
+}
+
+/******************************************************************************
+* SECTION: 共享块
+* 克隆产生的共享块在每个引用处都带NEWFS_BLK_SHARED标记，引用数记在sb.share_ino的表中。
+*******************************************************************************/
+static int share_per_blk(void) {
+    return blk_sz / (int)sizeof(struct newfs_share_d);
+}
+
+/**
+ * @brief 校验超级块中的引用计数表inode
+ */
+static void check_share_ino(void) {
+    struct newfs_inode_d* inode;
+
+    share_valid = false;
+    if (sb.share_ino == 0) {
+        return;
+    }
+    if (!ino_valid(sb.share_ino)) {
+        problem_add(FIX_SHARE_TABLE, 0, 0, 0);
+        return;
+    }
+    inode = &itable[sb.share_ino];
+    if (sb.share_ino != sb.root_ino && inode->ftype == NEWFS_REG_FILE
+        && hidden_fits(inode, sizeof(struct newfs_share_d))) {
+        share_valid = true;
+    } else {
+        problem_add(FIX_SHARE_TABLE, sb.share_ino, 0, 0);
+    }
+}
+
+/**
+ * @brief 多次引用的块：带共享标记的引用保留，不带标记的引用(含目录)按重复处理，
+ * 修复时各复制一份；全部引用都不带标记时第一个引用者保留原块。
+ * 之后blk_refs为修复后的引用数，再与磁盘上的引用计数表比较
+ */
+static void check_shares(void) {
+    int   last = xattr_on ? FSCK_XATTR_IDX : FSCK_XATTR_IDX - 1;     /* 属性块同样参与检查 */
+    int   per = share_per_blk(), n = 0;
+    bool  same = true;
+    uint8_t* buf;
+
+    for (uint32_t ino = 0; ino < (uint32_t)sb.ino_max; ino++) {
+        struct newfs_inode_d* inode = &itable[ino];
+        if (!bit_test(ino_map, ino)) {
+            continue;
+        }
+        for (int i = NEWFS_IS_INLINE_LINK(inode) ? FSCK_XATTR_IDX : 0; i <= last; i++) {
+            uint32_t* slot = blk_slot(inode, i);
+            uint32_t blkno = NEWFS_BLKNO(*slot);
+            if (NEWFS_BLK_HOLE(*slot) || blkno >= (uint32_t)sb.data_blks
+                || blk_refs[blkno] < 2 || blk_plain[blkno] == 0
+                || (i < FSCK_XATTR_IDX && inode->ftype != NEWFS_DIR && NEWFS_BLK_IS_SHARED(*slot))) {
+                continue;
+            }
+            if (blk_plain[blkno] == blk_refs[blkno]) {
+                blk_plain[blkno]--;                     /* 第一个引用者保留原块 */
+                continue;
+            }
+            problem_add(FIX_DUP_BLOCK, ino, i, 0);
+            blk_refs[blkno]--;
+            blk_plain[blkno]--;
+        }
+    }
+
+    if (sb.share_ino != 0 && !share_valid) {
+        return;                                         /* 已记为FIX_SHARE_TABLE */
+    }
+    n    = share_valid ? itable[sb.share_ino].size / (int)sizeof(struct newfs_share_d) : 0;
+    same = !share_valid || hidden_csum_ok(sb.share_ino);
+    buf  = (uint8_t *)malloc(blk_sz);
+    for (int b = 0, k = 0; b * per < n && same; b++) {
+        uint32_t blkno = itable[sb.share_ino].data[b];
+        struct newfs_share_d* ents = (struct newfs_share_d *)buf;
+
+        if (blkno >= (uint32_t)sb.data_blks || fsck_read(blk_ofs(blkno), buf, blk_sz) != NEWFS_ERROR_NONE) {
+            same = false;
+            break;
+        }
+        for (int e = 0; e < per && b * per + e < n; e++) {
+            while (k < sb.data_blks && blk_refs[k] < 2) {
+                k++;
+            }
+            if (k == sb.data_blks || ents[e].blkno != (uint32_t)k || ents[e].ref != blk_refs[k]) {
+                same = false;
+                break;
+            }
+            k++;
+        }
+    }
+    free(buf);
+    for (int k = 0; same && k < sb.data_blks; k++) {
+        n -= blk_refs[k] >= 2;
+    }
+    if (!same || n != 0) {
+        problem_add(FIX_SHARE_TABLE, sb.share_ino, 0, 0);
+    }
+}
+
+/**
+ * @brief 按修复后的引用数重写引用计数表，按需分配或释放表inode及其数据块
+ */
+static int write_share_table(void) {
+    struct newfs_inode_d* inode;
+    struct newfs_share_d* ents;
+    uint8_t* buf;
+    int      n = 0, nblks, ret = NEWFS_ERROR_NONE;
+
+    for (int k = 0; k < sb.data_blks; k++) {
+        n += blk_refs[k] >= 2;
+    }
+    while (hidden_bytes(n * (int)sizeof(*ents)) > NEWFS_DATA_PER_FILE * blk_sz) {
+        n--;                                /* 表装不下的块只会泄漏，不会被提前释放 */
+    }
+    nblks = (hidden_bytes(n * (int)sizeof(*ents)) + blk_sz - 1) / blk_sz;
+    if (!share_valid && n == 0) {
+        sb.share_ino = 0;
+        return NEWFS_ERROR_NONE;
+    }
+    if (!share_valid) {
+        int ino = -1;
+        for (int i = 0; i < sb.ino_max && ino < 0; i++) {
+            if (!bit_test(ino_map, i)) {
+                ino = i;
+            }
+        }
+        if (ino < 0) {
+            return -NEWFS_ERROR_NOSPACE;
+        }
+        bit_claim(ino_map, ino);
+        inode = &itable[ino];
+        memset(inode, 0, sizeof(*inode));
+        memset(inode->data, 0xFF, sizeof(inode->data));
+        inode->ino       = ino;
+        inode->ftype     = NEWFS_REG_FILE;
+        inode->xattr_blk = -1;
+        sb.share_ino     = ino;
+    }
+    inode = &itable[sb.share_ino];
+    for (int b = 0; b < NEWFS_DATA_PER_FILE; b++) {
+        uint32_t blkno = inode->data[b];
+        if (b >= nblks && !NEWFS_BLK_HOLE(blkno)) {
+            if (blkno < (uint32_t)sb.data_blks && blk_refs[blkno] <= 1) {
+                bit_clear(blk_map, blkno);
+            }
+            inode->data[b] = -1;
+        } else if (b < nblks && (NEWFS_BLK_HOLE(blkno) || blkno >= (uint32_t)sb.data_blks)) {
+            int nb = alloc_free_blk();
+            if (nb < 0) {
+                return -NEWFS_ERROR_NOSPACE;
+            }
+            inode->data[b] = nb;
+        }
+    }
+    if (n == 0) {
+        bit_clear(ino_map, sb.share_ino);
+        memset(inode, 0, sizeof(*inode));
+        ret |= write_inode(sb.share_ino);
+        sb.share_ino = 0;
+        return ret ? -NEWFS_ERROR_IO : NEWFS_ERROR_NONE;
+    }
+
+    buf  = (uint8_t *)calloc(nblks, blk_sz);       /* 表项连续存放，带校验时末尾跟CRC32C */
+    ents = (struct newfs_share_d *)buf;
+    for (int e = 0, k = 0; e < n; e++, k++) {
+        while (blk_refs[k] < 2) {
+            k++;
+        }
+        ents[e].blkno = k;
+        ents[e].ref   = blk_refs[k];
+    }
+    if (csum_on) {
+        uint32_t crc = newfs_crc32c(buf, n * sizeof(*ents));
+        memcpy(buf + n * sizeof(*ents), &crc, sizeof(crc));
+    }
+    for (int b = 0; b < nblks; b++) {
+        ret |= fsck_write(blk_ofs(inode->data[b]), buf + (long)b * blk_sz, blk_sz);
+    }
+    free(buf);
+    inode->size = n * sizeof(struct newfs_share_d);
+    ret |= write_inode(sb.share_ino);
+    return ret ? -NEWFS_ERROR_IO : NEWFS_ERROR_NONE;
+}
+
+/******************************************************************************
+* SECTION: 快照
+* 快照表(超级块中的snap_ino)每项指向一个映射表inode，映射表按ino排序记录快照保存的旧inode槽位。
+* 这些inode都不在目录树中，遍历之后统一校验：任何一处不可用都丢弃全部快照，不逐个修补；
+* 可用时登记表inode与保存的inode，保存的普通文件数据块带共享标记，计入引用数。
+*******************************************************************************/
+/**
+ * @brief 隐藏inode是否可用且未被目录树或其他隐藏inode占用
+ */
+static bool snap_hidden_ok(int ino, int ent_sz, const uint8_t* seen) {
+    return ino > 0 && ino_valid(ino) && !seen[ino] && !bit_test(ino_map, ino)
+        && itable[ino].ftype == NEWFS_REG_FILE && hidden_fits(&itable[ino], ent_sz) && hidden_csum_ok(ino);
+}
+
+/**
+ * @brief 校验快照表与映射表，可用时登记其中的inode与数据块，否则记为FIX_SNAP_TABLE
+ */
+static void check_snaps(void) {
+    struct newfs_snap_d* tab  = NULL;
+    uint8_t*             seen = (uint8_t *)calloc(sb.ino_max, 1);   /* 已由快照占用的inode */
+    bool ok;
+    int  n = 0;
+
+    snap_valid = false;
+    if (snap_ino == 0) {
+        free(seen);
+        return;
+    }
+    ok = snap_hidden_ok(snap_ino, sizeof(struct newfs_snap_d), seen)
+         && itable[snap_ino].size / (int)sizeof(struct newfs_snap_d) <= NEWFS_SNAP_MAX
+         && (tab = (struct newfs_snap_d *)hidden_load(snap_ino)) != NULL;
+    if (ok) {
+        seen[snap_ino] = 1;
+        n = itable[snap_ino].size / (int)sizeof(struct newfs_snap_d);
+    }
+    for (int i = 0; ok && i < n; i++) {
+        struct newfs_snap_map_d* map;
+        int cnt;
+
+        if (tab[i].map_ino == 0) {
+            continue;
+        }
+        if (!snap_hidden_ok(tab[i].map_ino, sizeof(struct newfs_snap_map_d), seen)
+            || (map = (struct newfs_snap_map_d *)hidden_load(tab[i].map_ino)) == NULL) {
+            ok = false;
+            break;
+        }
+        seen[tab[i].map_ino] = 1;
+        cnt = itable[tab[i].map_ino].size / (int)sizeof(struct newfs_snap_map_d);
+        for (int k = 0; ok && k < cnt; k++) {
+            uint32_t slot = map[k].slot;
+
+            ok = ino_valid(map[k].ino) && (k == 0 || map[k - 1].ino < map[k].ino);
+            if (ok && slot != NEWFS_SNAP_ABSENT) {
+                ok = ino_valid(slot) && !seen[slot] && !bit_test(ino_map, slot) && itable[slot].ino == map[k].ino
+                     && (itable[slot].ftype == NEWFS_REG_FILE || itable[slot].ftype == NEWFS_DIR
+                         || itable[slot].ftype == NEWFS_SYM_LINK);
+                if (ok) {
+                    seen[slot] = 2;
+                }
+            }
+        }
+        free(map);
+    }
+    free(tab);
+    if (!ok) {
+        problem_add(FIX_SNAP_TABLE, snap_ino, 0, 0);
+        free(seen);
+        return;
+    }
+    for (uint32_t ino = 0; ino < (uint32_t)sb.ino_max; ino++) {
+        if (seen[ino]) {
+            bit_claim(ino_map, ino);
+            claim_blocks(ino);
+        }
+    }
+    snap_valid = true;
+    free(seen);
+}
+
+/**
+ * @brief 丢弃全部快照。保存的inode未登记，随位图重建释放；共享块引用数已按不含快照重算
+ */
+static void drop_snaps(void) {
+    snap_ino    = 0;
+    sb.snap_ino = 0;
+}
+
+/******************************************************************************
+* SECTION: 去重索引
+* 索引(sb.dedup_ino)只在正常卸载后被newfs读入。修复会改动块的归属，写回时一律丢弃索引，
+* 下次--dedup挂载从空索引开始；索引中的块在引用处带的共享标记保留，不影响正确性。
+*******************************************************************************/
+/**
+ * @brief 校验超级块中的去重索引inode
+ */
+static void check_dedup_ino(void) {
+    struct newfs_inode_d* inode;
+
+    dedup_valid = false;
+    if (sb.dedup_ino == 0) {
+        return;
+    }
+    if (!ino_valid(sb.dedup_ino)) {
+        problem_add(FIX_DEDUP_INDEX, 0, 0, 0);
+        return;
+    }
+    inode = &itable[sb.dedup_ino];
+    if (sb.dedup_ino != sb.root_ino && sb.dedup_ino != sb.share_ino && inode->ftype == NEWFS_REG_FILE
+        && hidden_fits(inode, sizeof(struct newfs_dedup_d))) {
+        dedup_valid = true;
+        if (!hidden_csum_ok(sb.dedup_ino)) {
+            problem_add(FIX_DEDUP_INDEX, sb.dedup_ino, 0, 0);   /* 修复时连同数据块一起丢弃 */
+        }
+    } else {
+        problem_add(FIX_DEDUP_INDEX, sb.dedup_ino, 0, 0);
+    }
+}
+
+/**
+ * @brief 丢弃一个隐藏inode，释放其inode与数据块
+ *
+ * @param ino 超级块中记录隐藏inode号的字段，清零
+ * @param valid 该inode是否已在遍历中登记
+ */
+static void drop_hidden(int* ino, bool* valid) {
+    struct newfs_inode_d* inode;
+
+    if (*valid) {
+        inode = &itable[*ino];
+        for (int b = 0; b < NEWFS_DATA_PER_FILE; b++) {
+            uint32_t blkno = inode->data[b];
+            if (!NEWFS_BLK_HOLE(blkno) && blkno < (uint32_t)sb.data_blks && blk_refs[blkno] <= 1) {
+                bit_clear(blk_map, blkno);
+            }
+        }
+        bit_clear(ino_map, *ino);
+        memset(inode, 0, sizeof(*inode));
+        write_inode(*ino);
+        *valid = false;
+    }
+    *ino = 0;
+}
+
+/******************************************************************************
+* SECTION: 数据块校验表
+* 表(sb.csum_ino)每个数据块一项，只在正常卸载后被newfs --data_csum读入。
+* 与去重索引一样，修复与异常退出后一律丢弃，下次挂载从空表开始，空项不校验。
+*******************************************************************************/
+/**
+ * @brief 校验超级块中的数据块校验表inode
+ */
+static void check_csum_ino(void) {
+    struct newfs_inode_d* inode;
+
+    csum_valid = false;
+    if (sb.csum_ino == 0) {
+        return;
+    }
+    if (!ino_valid(sb.csum_ino)) {
+        problem_add(FIX_CSUM_TABLE, 0, 0, 0);
+        return;
+    }
+    inode = &itable[sb.csum_ino];
+    if (sb.csum_ino != sb.root_ino && sb.csum_ino != sb.share_ino && sb.csum_ino != sb.dedup_ino
+        && inode->ftype == NEWFS_REG_FILE && inode->size == sb.data_blks * (int)sizeof(uint32_t)
+        && hidden_fits(inode, sizeof(uint32_t))) {
+        csum_valid = true;
+        if (!hidden_csum_ok(sb.csum_ino)) {
+            problem_add(FIX_CSUM_TABLE, sb.csum_ino, 0, 0);
+        }
+    } else {
+        problem_add(FIX_CSUM_TABLE, sb.csum_ino, 0, 0);
+    }
+}
+
+/**
+ * @brief 检查被引用的inode的校验和，在遍历之后进行，只检查位图重建后仍在使用的inode
+ */
+static void check_inode_csums(void) {
+    if (!csum_on) {
+        return;
+    }
+    for (uint32_t ino = 0; ino < (uint32_t)sb.ino_max; ino++) {
+        if (bit_test(ino_map, ino) && !newfs_csum_inode_ok(&itable[ino], ino_sz)) {
+            problem_add(FIX_INODE_CSUM, ino, 0, 0);
+        }
+    }
+}
+
+/**
+ * @brief 检查被引用的inode的扩展属性：inode内的条目序列与属性块的头部、条目和校验和。
+ * 只检查只有一个引用的属性块，多次引用的由check_shares按重复块处理
+ */
+static void check_xattrs(void) {
+    uint8_t* buf;
+
+    if (!xattr_on) {
+        return;
+    }
+    buf = (uint8_t *)malloc(blk_sz);
+    for (uint32_t ino = 0; ino < (uint32_t)sb.ino_max; ino++) {
+        struct newfs_inode_d* inode = &itable[ino];
+        uint32_t blkno = inode->xattr_blk;
+        if (!bit_test(ino_map, ino)) {
+            continue;
+        }
+        if (inode->xattr_len > NEWFS_XATTR_INLINE || !newfs_xattr_ents_ok(inode->xattr, inode->xattr_len)) {
+            problem_add(FIX_XATTR, ino, 0, 0);
+        }
+        if (NEWFS_BLK_HOLE(blkno) || blkno >= (uint32_t)sb.data_blks || blk_refs[blkno] != 1) {
+            continue;
+        }
+        if (fsck_read(blk_ofs(blkno), buf, blk_sz) != NEWFS_ERROR_NONE
+            || !newfs_xattr_blk_ok(buf, blk_sz, csum_on)) {
+            problem_add(FIX_XATTR, ino, FSCK_XATTR_IDX, 0);
+        }
+    }
+    free(buf);
+}
+
+/**
+ * @brief 按重建的位图统计已用的inode与数据块
+ */
+static void count_used(int* used_ino, int* used_blk) {
+    *used_ino = *used_blk = 0;
+    for (int w = 0; w < ino_words; w++) {
+        *used_ino += __builtin_popcountll(ino_map[w]);
+    }
+    for (int w = 0; w < blk_words; w++) {
+        *used_blk += __builtin_popcountll(blk_map[w]);
+    }
+}
+
+/******************************************************************************
+* SECTION: 修复
+*******************************************************************************/
+static int alloc_free_blk(void) {
+    for (int w = 0; w < blk_words; w++) {
+        if (~blk_map[w] != 0) {
+            int pos = w * 64 + __builtin_ctzll(~blk_map[w]);
+            if (pos >= sb.data_blks) {
+                break;
+            }
+            bit_claim(blk_map, pos);
+            return pos;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief 重写目录：删除无效目录项、修正类型、按截断后的dir_cnt压缩存放
+ */
+static int rewrite_dir(uint32_t ino) {
+    struct newfs_inode_d* dir = &itable[ino];
+    int    limit = dir->dir_cnt, kept = 0;
+    struct newfs_dentry_d* ents;
+    uint8_t* drop;
+    uint8_t* blk;
+    int    ret = NEWFS_ERROR_NONE;
+
+    for (int p = 0; p < nr_problems; p++) {
+        if (problems[p].ino == ino && problems[p].fix == FIX_DIR_CNT) {
+            limit = problems[p].arg < limit ? problems[p].arg : limit;
+        }
+    }
+    if (limit < 0) {
+        limit = 0;
+    }
+    ents = (struct newfs_dentry_d *)calloc(limit + 1, sizeof(*ents));
+    drop = (uint8_t *)calloc(limit + 1, 1);
+    for (int i = 0; i < limit; i++) {
+        fsck_read(blk_ofs(dir->data[i / per_blk]) + (long)(i % per_blk) * sizeof(*ents),
+                  &ents[i], sizeof(*ents));
+    }
+    for (int p = 0; p < nr_problems; p++) {
+        struct fsck_problem* pb = &problems[p];
+        if (pb->ino != ino || pb->idx < 0 || pb->idx >= limit) {
+            continue;
+        }
+        if (pb->fix == FIX_DROP_DENTRY) {
+            drop[pb->idx] = 1;
+        } else if (pb->fix == FIX_FTYPE) {
+            ents[pb->idx].ftype = (NEWFS_FILE_TYPE)pb->arg;
+        }
+    }
+    for (int i = 0; i < limit; i++) {
+        if (!drop[i]) {
+            ents[kept++] = ents[i];
+        }
+    }
+    /* 按整块写回，块末尾重新计算校验和 */
+    blk = (uint8_t *)malloc(blk_sz);
+    for (int b = 0; b * per_blk < kept; b++) {
+        int cnt = kept - b * per_blk < per_blk ? kept - b * per_blk : per_blk;
+        memset(blk, 0, blk_sz);
+        memcpy(blk, &ents[b * per_blk], cnt * sizeof(*ents));
+        if (csum_on) {
+            newfs_csum_dirblk_seal(blk, blk_sz);
+        }
+        if (fsck_write(blk_ofs(dir->data[b]), blk, blk_sz) != NEWFS_ERROR_NONE) {
+            ret = -NEWFS_ERROR_IO;
+        }
+    }
+    dir->dir_cnt = kept;
+    free(blk);
+    free(ents);
+    free(drop);
+    return ret;
+}
+
+static int repair(void) {
+    uint8_t* buf   = (uint8_t *)malloc(blk_sz);
+    uint8_t* dirty = (uint8_t *)calloc(sb.ino_max, 1);   /* 需要写回的inode */
+    int      ret   = NEWFS_ERROR_NONE;
+
+    for (int p = 0; p < nr_problems; p++) {
+        struct fsck_problem* pb = &problems[p];
+        struct newfs_inode_d* inode = &itable[pb->ino];
+
+        switch (pb->fix) {
+        case FIX_DUP_BLOCK: {
+            uint32_t* slot  = blk_slot(inode, pb->idx);
+            int       blkno = alloc_free_blk();
+            if (blkno >= 0 && fsck_read(blk_ofs(NEWFS_BLKNO(*slot)), buf, blk_sz) == NEWFS_ERROR_NONE
+                && fsck_write(blk_ofs(blkno), buf, blk_sz) == NEWFS_ERROR_NONE) {
+                /* 后引用者获得一份独立的拷贝，保留未写入与压缩标记 */
+                *slot = blkno | (*slot & (NEWFS_BLK_UNWRITTEN | NEWFS_BLK_COMPRESSED));
+            } else {
+                *slot = -1;
+            }
+            dirty[pb->ino] = 1;
+            break;
+        }
+        case FIX_BAD_BLOCK:
+            *blk_slot(inode, pb->idx) = -1;
+            dirty[pb->ino] = 1;
+            break;
+        case FIX_INO_SLOT:
+            inode->ino = pb->ino;
+            dirty[pb->ino] = 1;
+            break;
+        case FIX_NLINK:
+            inode->nlink = pb->arg;
+            dirty[pb->ino] = dirty[pb->ino] ? dirty[pb->ino] : 1;
+            break;
+        case FIX_INODE_CSUM:
+            dirty[pb->ino] = dirty[pb->ino] ? dirty[pb->ino] : 1;
+            break;
+        case FIX_XATTR:
+            if (pb->idx == FSCK_XATTR_IDX) {
+                bit_clear(blk_map, inode->xattr_blk);  /* 只有这一个引用，随位图重建释放 */
+                inode->xattr_blk = -1;
+            } else {
+                inode->xattr_len = 0;
+                memset(inode->xattr, 0, sizeof(inode->xattr));
+            }
+            dirty[pb->ino] = dirty[pb->ino] ? dirty[pb->ino] : 1;
+            break;
+        case FIX_DROP_DENTRY:
+        case FIX_FTYPE:
+        case FIX_DIR_CNT:
+        case FIX_DIRBLK_CSUM:
+            dirty[pb->ino] = 2;                     /* 目录需要重写目录项 */
+            break;
+        default:
+            break;
+        }
+    }
+    if (nr_by_fix[FIX_SNAP_TABLE]) {
+        drop_snaps();
+    }
+    if (nr_by_fix[FIX_SHARE_TABLE] && write_share_table() != NEWFS_ERROR_NONE) {
+        ret = -NEWFS_ERROR_IO;
+    }
+    for (uint32_t ino = 0; ino < (uint32_t)sb.ino_max; ino++) {
+        if (dirty[ino] == 2 && rewrite_dir(ino) != NEWFS_ERROR_NONE) {
+            ret = -NEWFS_ERROR_IO;
+        }
+        if (dirty[ino] && write_inode(ino) != NEWFS_ERROR_NONE) {
+            ret = -NEWFS_ERROR_IO;
+        }
+    }
+    free(dirty);
+    free(buf);
+    return ret;
+}
+
+/**
+ * @brief 写回重建的位图与超级块，标记为正常卸载
+ */
+static int write_maps(int used_ino, int used_blk) {
+    int      ino_bytes = sb.ino_map_blks * blk_sz, blk_bytes = sb.dat_map_blks * blk_sz;
+    uint8_t* map;
+    uint8_t* sb_buf;
+    int      ret = NEWFS_ERROR_NONE;
+
+    map = (uint8_t *)calloc(1, ino_bytes > blk_bytes ? ino_bytes : blk_bytes);
+    memcpy(map, ino_map, (sb.ino_max + 7) / 8);
+    ret |= fsck_write(sb.ino_map_offset, map, ino_bytes);
+    sb.ino_map_csum = csum_on ? newfs_csum_map(map, ino_bytes) : 0;
+    memset(map, 0, ino_bytes > blk_bytes ? ino_bytes : blk_bytes);
+    memcpy(map, blk_map, (sb.data_blks + 7) / 8);
+    ret |= fsck_write(sb.dat_map_offset, map, blk_bytes);
+    sb.dat_map_csum = csum_on ? newfs_csum_map(map, blk_bytes) : 0;
+    free(map);
+
+    sb.free_ino_cnt = sb.ino_max - used_ino;
+    sb.free_blk_cnt = sb.data_blks - used_blk;
+    sb.ino_hint     = 0;
+    sb.blk_hint     = 0;
+    sb.state        = NEWFS_STATE_CLEAN;
+    sb.rename_ino   = sb.rename_src = sb.rename_dst = 0;
+    if (csum_on) {
+        newfs_csum_super_seal(&sb);
+    }
+    sb_buf = (uint8_t *)calloc(1, blk_sz);
+    fsck_read(0, sb_buf, blk_sz);
+    memcpy(sb_buf, &sb, sizeof(sb));
+    ret |= fsck_write(0, sb_buf, blk_sz);
+    free(sb_buf);
+    return ret ? -NEWFS_ERROR_IO : NEWFS_ERROR_NONE;
+}
+
+/******************************************************************************
+* SECTION: 入口
+*******************************************************************************/
+/**
+ * @brief 读超级块并校验布局
+ */
+static int load_super(void) {
+    if (fsck_read(0, &sb, sizeof(sb)) != NEWFS_ERROR_NONE) {
+        fprintf(stderr, "fsck.newfs: %s: cannot read superblock\n", opts.device);
+        return -1;
+    }
+    if (sb.magic != NEWFS_MAGIC) {
+        fprintf(stderr, "fsck.newfs: %s: bad magic, not a newfs image\n", opts.device);
+        return -1;
+    }
+    csum_on = (sb.features & NEWFS_FEAT_CSUM) != 0;
+    xattr_on = (sb.features & NEWFS_FEAT_XATTR) != 0;
+    ino_sz  = newfs_inode_d_size(sb.features);
+    snap_ino = (sb.features & NEWFS_FEAT_SNAP) ? sb.snap_ino : 0;   /* 否则该位置是超级块校验和 */
+    blk_sz  = sb.blks_size ? sb.blks_size : 2 * bdev->io_sz;
+    per_blk = blk_sz / sizeof(struct newfs_dentry_d);
+    if (blk_sz % bdev->io_sz != 0 || sb.ino_max <= 0 || sb.data_blks <= 0
+        || sb.root_ino < 0 || sb.root_ino >= sb.ino_max
+        || (long)sb.data_offset + (long)sb.data_blks * blk_sz > bdev->size
+        || (long)sb.inode_offset + (long)sb.ino_max * ino_sz > sb.data_offset) {
+        fprintf(stderr, "fsck.newfs: %s: inconsistent superblock layout\n", opts.device);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief 大批量顺序读入inode区与两张位图
+ */
+static int load_tables(void) {
+    long total = (long)sb.ino_max * ino_sz;
+    uint8_t* dst;
+
+    itable = (struct newfs_inode_d *)calloc(sb.ino_max, sizeof(struct newfs_inode_d));
+    dst    = ino_sz == (int)sizeof(struct newfs_inode_d) ? (uint8_t *)itable : (uint8_t *)malloc(total);
+    for (long done = 0; done < total; done += FSCK_BATCH) {
+        int len = total - done < FSCK_BATCH ? (int)(total - done) : FSCK_BATCH;
+        if (fsck_read(sb.inode_offset + done, dst + done, len) != NEWFS_ERROR_NONE) {
+            return -1;
+        }
+    }
+    if (dst != (uint8_t *)itable) {                     /* 旧镜像的槽位较小，逐个展开 */
+        for (int i = 0; i < sb.ino_max; i++) {
+            memcpy(&itable[i], dst + (long)i * ino_sz, ino_sz);
+        }
+        free(dst);
+    }
+    disk_ino_map = (uint8_t *)malloc(sb.ino_map_blks * blk_sz);
+    disk_blk_map = (uint8_t *)malloc(sb.dat_map_blks * blk_sz);
+    if (fsck_read(sb.ino_map_offset, disk_ino_map, sb.ino_map_blks * blk_sz) != NEWFS_ERROR_NONE
+        || fsck_read(sb.dat_map_offset, disk_blk_map, sb.dat_map_blks * blk_sz) != NEWFS_ERROR_NONE) {
+        return -1;
+    }
+    ino_words = (sb.ino_max + 63) / 64;
+    blk_words = (sb.data_blks + 63) / 64;
+    ino_map   = (uint64_t *)calloc(ino_words, sizeof(uint64_t));
+    blk_map   = (uint64_t *)calloc(blk_words, sizeof(uint64_t));
+    blk_refs  = (uint32_t *)calloc(sb.data_blks, sizeof(uint32_t));
+    blk_plain = (uint32_t *)calloc(sb.data_blks, sizeof(uint32_t));
+    links     = (uint32_t *)calloc(sb.ino_max, sizeof(uint32_t));
+    return 0;
+}
+
+static void usage(const char* prog) {
+    fprintf(stderr, "usage: %s [--repair] [--jobs=N] [--verbose] <device>\n", prog);
+}
+
+int main(int argc, char** argv) {
+    static const struct option long_opts[] = {
+        { "repair",  no_argument,       NULL, 'y' },
+        { "jobs",    required_argument, NULL, 'j' },
+        { "verbose", no_argument,       NULL, 'v' },
+        { NULL, 0, NULL, 0 },
+    };
+    int c, used_ino, used_blk, orphans, unmarked_ino, leaked, unmarked_blk;
+    int errors = 0, status = FSCK_OK;
+
+    while ((c = getopt_long(argc, argv, "yj:v", long_opts, NULL)) != -1) {
+        switch (c) {
+        case 'y': opts.repair  = true;         break;
+        case 'j': opts.jobs    = atoi(optarg); break;
+        case 'v': opts.verbose = true;         break;
+        default:  usage(argv[0]); return FSCK_ERROR;
+        }
+    }
+    if (optind != argc - 1) {
+        usage(argv[0]);
+        return FSCK_ERROR;
+    }
+    opts.device = argv[optind];
+    if (opts.jobs <= 0) {
+        opts.jobs = sysconf(_SC_NPROCESSORS_ONLN) > 0 ? (int)sysconf(_SC_NPROCESSORS_ONLN) : 1;
+    }
+
+    bdev = newfs_bdev_open(opts.device);
+    if (bdev == NULL) {
+        fprintf(stderr, "fsck.newfs: cannot open device %s\n", opts.device);
+        return FSCK_ERROR;
+    }
+    if (bdev->size <= INT32_MAX) {
+        image = (uint8_t *)newfs_bdev_map(bdev, 0, (int)bdev->size);
+    }
+    if (load_super() != 0 || load_tables() != 0) {
+        newfs_bdev_close(bdev);
+        return FSCK_ERROR;
+    }
+    if (itable[sb.root_ino].ftype != NEWFS_DIR) {
+        fprintf(stderr, "fsck.newfs: root inode %d is not a directory\n", sb.root_ino);
+        newfs_bdev_close(bdev);
+        return FSCK_UNCORRECTED;
+    }
+
+    if (csum_on && !newfs_csum_super_ok(&sb)) {
+        printf("superblock checksum mismatch\n");
+        errors++;
+    }
+    /* 位图只在卸载时写回，异常退出后校验和本来就可能过时 */
+    if (csum_on && sb.state == NEWFS_STATE_CLEAN
+        && (!newfs_csum_map_ok(sb.ino_map_csum, disk_ino_map, sb.ino_map_blks * blk_sz)
+            || !newfs_csum_map_ok(sb.dat_map_csum, disk_blk_map, sb.dat_map_blks * blk_sz))) {
+        printf("bitmap checksum mismatch\n");
+        errors++;
+    }
+    check_rename_intent();
+    check_share_ino();
+    check_dedup_ino();
+    check_csum_ino();
+    walk_tree();
+    check_links();
+    check_snaps();
+    check_inode_csums();
+    check_xattrs();
+    check_shares();
+
+    used_ino = bitmap_diff("inode", disk_ino_map, ino_map, ino_words, sb.ino_max, &orphans, &unmarked_ino);
+    used_blk = bitmap_diff("block", disk_blk_map, blk_map, blk_words, sb.data_blks, &leaked, &unmarked_blk);
+    for (int f = 0; f < FIX_NR; f++) {
+        if (nr_by_fix[f]) {
+            printf("%d %s\n", nr_by_fix[f], fix_names[f]);
+        }
+        errors += nr_by_fix[f];
+    }
+    printf("%d orphaned inodes, %d inodes in use but not marked\n", orphans, unmarked_ino);
+    printf("%d leaked blocks, %d blocks in use but not marked\n", leaked, unmarked_blk);
+    errors += orphans + unmarked_ino + leaked + unmarked_blk;
+    if (sb.state != NEWFS_STATE_CLEAN) {
+        printf("filesystem was not cleanly unmounted\n");
+    }
+    if (sb.free_ino_cnt != sb.ino_max - used_ino || sb.free_blk_cnt != sb.data_blks - used_blk) {
+        printf("free counters wrong: inodes %d (should be %d), blocks %d (should be %d)\n",
+               sb.free_ino_cnt, sb.ino_max - used_ino, sb.free_blk_cnt, sb.data_blks - used_blk);
+        errors++;
+    }
+
+    if (errors == 0) {
+        if (sb.state != NEWFS_STATE_CLEAN && opts.repair) {
+            drop_hidden(&sb.dedup_ino, &dedup_valid);   /* 异常退出后索引与校验表可能过时 */
+            drop_hidden(&sb.csum_ino, &csum_valid);
+            count_used(&used_ino, &used_blk);
+            write_maps(used_ino, used_blk);         /* 只需标记为正常卸载 */
+            newfs_bdev_flush(bdev);
+        }
+        printf("%s: clean, %d/%d inodes, %d/%d blocks\n", opts.device, used_ino, sb.ino_max,
+               used_blk, sb.data_blks);
+    } else if (!opts.repair) {
+        printf("%s: %d errors found, run with --repair to fix\n", opts.device, errors);
+        status = FSCK_UNCORRECTED;
+    } else {
+        int ret = repair();
+        drop_hidden(&sb.dedup_ino, &dedup_valid);
+        drop_hidden(&sb.csum_ino, &csum_valid);
+        count_used(&used_ino, &used_blk);       /* 表inode可能被分配或释放，含修复时新分配的块 */
+        ret |= write_maps(used_ino, used_blk);
+        newfs_bdev_flush(bdev);
+        if (ret != NEWFS_ERROR_NONE) {
+            fprintf(stderr, "fsck.newfs: %s: write failed during repair\n", opts.device);
+            status = FSCK_UNCORRECTED;
+        } else {
+            printf("%s: %d errors fixed, %d/%d inodes, %d/%d blocks\n", opts.device, errors,
+                   used_ino, sb.ino_max, used_blk, sb.data_blks);
+            status = FSCK_FIXED;
+        }
+    }
+
+    newfs_bdev_close(bdev);
+    free(itable);
+    free(disk_ino_map);
+    free(disk_blk_map);
+    free(ino_map);
+    free(blk_map);
+    free(blk_refs);
+    free(blk_plain);
+    free(links);
+    free(problems);
+    return status;
+}
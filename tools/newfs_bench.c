@@ -0,0 +1,449 @@
+/**
+ * @file newfs_bench.c
+ * @brief newfs微基准测试
+ *
+ * 在进程内挂载newfs(不经过内核FUSE)，按FUSE的方式调用操作表，对各场景计时。
+ * 结果以JSON输出：每个场景的ops/sec、延迟分位数以及设备读写/seek次数，便于不同构建之间比较。
+ *
+ * 用法: newfs_bench [--device=mmap:/tmp/newfs_bench.img] [--blksize=B] [--files=N]
+ *                   [--depth=D] [--width=W] [--file_kb=K] [--iters=I] [--out=path]
+ * 每个场景开始前都会重新格式化设备。设备计数以设备IO单位计；挂载/卸载场景跨越设备的打开与关闭，计数为0。
+ */
+#include "newfs.h"
+#include <time.h>
+#include <getopt.h>
+
+extern struct custom_options newfs_options;
+extern struct newfs_super    super;
+
+/******************************************************************************
+* SECTION: 参数
+*******************************************************************************/
+struct bench_options {
+    const char* device;
+    int         blksize;
+    int         files;      /* create/stat/unlink的文件数 */
+    int         depth;      /* 深路径查找的目录层数 */
+    int         width;      /* 宽目录的目录项数 */
+    int         file_kb;    /* 读写测试的文件大小 */
+    int         iters;      /* 查找、readdir、挂载的重复次数 */
+    const char* out;
+};
+
+static struct bench_options opts = {
+    .device  = "mmap:/tmp/newfs_bench.img",
+    .blksize = 0,
+    .files   = 100,
+    .depth   = 16,
+    .width   = 100,
+    .file_kb = 512,
+    .iters   = 200,
+    .out     = NULL,
+};
+
+static const struct fuse_operations* ops;
+static int                           file_max;  /* 首次挂载时记录的单文件上限 */
+static FILE*                         json;
+static int                           nr_results;
+
+/******************************************************************************
+* SECTION: 计时与统计
+*******************************************************************************/
+struct bench_stat {
+    const char*          name;
+    long                 n;
+    long                 cap;
+    double*              lat_us;    /* 每次操作的延迟 */
+    double               total_us;
+    long                 bytes;     /* 读写场景的数据量 */
+    struct ddriver_state dev_begin;
+};
+
+static double now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static void dev_state(struct ddriver_state* st) {
+    memset(st, 0, sizeof(*st));
+    if (super.bdev) {
+        newfs_bdev_ioctl(super.bdev, IOC_REQ_DEVICE_STATE, st);
+    }
+}
+
+static void stat_begin(struct bench_stat* bs, const char* name, long cap) {
+    memset(bs, 0, sizeof(*bs));
+    bs->name   = name;
+    bs->cap    = cap;
+    bs->lat_us = (double *)malloc(sizeof(double) * cap);
+    dev_state(&bs->dev_begin);
+}
+
+static void stat_add(struct bench_stat* bs, double us) {
+    if (bs->n < bs->cap) {
+        bs->lat_us[bs->n++] = us;
+    }
+    bs->total_us += us;
+}
+
+static int cmp_double(const void* a, const void* b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile(struct bench_stat* bs, double p) {
+    long i = (long)(p * (bs->n - 1) + 0.5);
+    return bs->n ? bs->lat_us[i] : 0;
+}
+
+/**
+ * @brief 输出一个场景的JSON结果并释放统计
+ */
+static void stat_end(struct bench_stat* bs) {
+    struct ddriver_state dev_end;
+
+    dev_state(&dev_end);
+    qsort(bs->lat_us, bs->n, sizeof(double), cmp_double);
+    fprintf(json, "%s    {\"name\": \"%s\", \"ops\": %ld, \"ops_per_sec\": %.1f, ",
+            nr_results++ ? ",\n" : "", bs->name, bs->n,
+            bs->total_us > 0 ? bs->n / (bs->total_us / 1e6) : 0);
+    if (bs->bytes) {
+        fprintf(json, "\"mb_per_sec\": %.2f, ",
+                bs->total_us > 0 ? bs->bytes / (bs->total_us / 1e6) / (1024 * 1024) : 0);
+    }
+    fprintf(json, "\"lat_us\": {\"p50\": %.2f, \"p90\": %.2f, \"p99\": %.2f, \"max\": %.2f}, ",
+            percentile(bs, 0.50), percentile(bs, 0.90), percentile(bs, 0.99),
+            bs->n ? bs->lat_us[bs->n - 1] : 0);
+    fprintf(json, "\"device\": {\"read\": %d, \"write\": %d, \"seek\": %d}}",
+            dev_end.read_cnt - bs->dev_begin.read_cnt,
+            dev_end.write_cnt - bs->dev_begin.write_cnt,
+            dev_end.seek_cnt - bs->dev_begin.seek_cnt);
+    free(bs->lat_us);
+}
+
+/******************************************************************************
+* SECTION: 挂载辅助
+*******************************************************************************/
+static void bench_mount(void) {
+    ops->init(NULL);
+    if (super.bdev == NULL) {
+        fprintf(stderr, "newfs_bench: cannot open device %s\n", opts.device);
+        exit(1);
+    }
+}
+
+static void bench_umount(void) {
+    ops->destroy(NULL);
+}
+
+/**
+ * @brief 清掉超级块幻数，下次挂载时重新格式化
+ */
+static void bench_reset(void) {
+    struct newfs_bdev* bdev = newfs_bdev_open(opts.device);
+    uint8_t* zero;
+
+    if (bdev == NULL) {
+        fprintf(stderr, "newfs_bench: cannot open device %s\n", opts.device);
+        exit(1);
+    }
+    zero = (uint8_t *)calloc(1, bdev->io_sz);
+    newfs_bdev_write(bdev, 0, zero, bdev->io_sz);
+    newfs_bdev_flush(bdev);
+    newfs_bdev_close(bdev);
+    free(zero);
+}
+
+static void bench_fresh_mount(void) {
+    bench_reset();
+    bench_mount();
+}
+
+/******************************************************************************
+* SECTION: 场景
+*******************************************************************************/
+/**
+ * @brief 格式化、卸载、重新挂载的耗时
+ */
+static void bench_mount_umount(void) {
+    struct bench_stat mkfs, umount, mount;
+    double t;
+
+    stat_begin(&mkfs,   "mount_format", opts.iters);
+    stat_begin(&umount, "umount",       opts.iters);
+    stat_begin(&mount,  "mount",        opts.iters);
+    for (int i = 0; i < opts.iters; i++) {
+        bench_reset();
+        t = now_us(); bench_mount();  stat_add(&mkfs,   now_us() - t);
+        t = now_us(); bench_umount(); stat_add(&umount, now_us() - t);
+        t = now_us(); bench_mount();  stat_add(&mount,  now_us() - t);
+        bench_umount();
+    }
+    stat_end(&mkfs);
+    stat_end(&umount);
+    stat_end(&mount);
+}
+
+/**
+ * @brief 创建、stat、删除N个文件
+ */
+static void bench_files(void) {
+    struct bench_stat bs;
+    struct stat st;
+    char path[MAX_NAME_LEN];
+    double t;
+
+    bench_fresh_mount();
+    ops->mkdir("/files", 0755);
+
+    stat_begin(&bs, "create", opts.files);
+    for (int i = 0; i < opts.files; i++) {
+        snprintf(path, sizeof(path), "/files/f%d", i);
+        t = now_us();
+        ops->mknod(path, S_IFREG | 0644, 0);
+        stat_add(&bs, now_us() - t);
+    }
+    stat_end(&bs);
+
+    stat_begin(&bs, "stat", opts.files);
+    for (int i = 0; i < opts.files; i++) {
+        snprintf(path, sizeof(path), "/files/f%d", i);
+        t = now_us();
+        ops->getattr(path, &st);
+        stat_add(&bs, now_us() - t);
+    }
+    stat_end(&bs);
+
+    /* 没有unlink时计时的只是空循环，跳过该场景而不是输出无意义的数字 */
+    if (ops->unlink == NULL) {
+        fprintf(stderr, "newfs_bench: unlink not supported, skipping unlink scenario\n");
+    } else {
+        stat_begin(&bs, "unlink", opts.files);
+        for (int i = 0; i < opts.files; i++) {
+            snprintf(path, sizeof(path), "/files/f%d", i);
+            t = now_us();
+            ops->unlink(path);
+            stat_add(&bs, now_us() - t);
+        }
+        stat_end(&bs);
+    }
+    bench_umount();
+}
+
+/**
+ * @brief 深路径查找：建立depth层目录，反复stat最深的文件，分别在冷、热缓存下测
+ */
+static void bench_lookup_deep(void) {
+    struct bench_stat bs;
+    struct stat st;
+    char   path[4096] = "";
+    double t;
+
+    bench_fresh_mount();
+    for (int i = 0; i < opts.depth; i++) {
+        size_t len = strlen(path);
+        snprintf(path + len, sizeof(path) - len, "/d%d", i);
+        ops->mkdir(path, 0755);
+    }
+    strncat(path, "/leaf", sizeof(path) - strlen(path) - 1);
+    ops->mknod(path, S_IFREG | 0644, 0);
+
+    bench_umount();
+    bench_mount();
+    stat_begin(&bs, "lookup_deep_cold", 1);
+    t = now_us();
+    ops->getattr(path, &st);
+    stat_add(&bs, now_us() - t);
+    stat_end(&bs);
+
+    stat_begin(&bs, "lookup_deep", opts.iters);
+    for (int i = 0; i < opts.iters; i++) {
+        t = now_us();
+        ops->getattr(path, &st);
+        stat_add(&bs, now_us() - t);
+    }
+    stat_end(&bs);
+    bench_umount();
+}
+
+static int count_filler(void* buf, const char* name, const struct stat* st, off_t off) {
+    (*(int *)buf)++;
+    return 0;
+}
+
+/**
+ * @brief 宽目录readdir，每次完整列出width个目录项
+ */
+static void bench_readdir_wide(void) {
+    struct bench_stat bs;
+    struct fuse_file_info fi;
+    char   path[MAX_NAME_LEN];
+    double t;
+
+    bench_fresh_mount();
+    ops->mkdir("/wide", 0755);
+    for (int i = 0; i < opts.width; i++) {
+        snprintf(path, sizeof(path), "/wide/e%d", i);
+        ops->mknod(path, S_IFREG | 0644, 0);
+    }
+    bench_umount();
+    bench_mount();
+
+    stat_begin(&bs, "readdir_wide", opts.iters);
+    for (int i = 0; i < opts.iters; i++) {
+        int cnt = 0;
+        memset(&fi, 0, sizeof(fi));
+        t = now_us();
+        if (ops->opendir) {
+            ops->opendir("/wide", &fi);
+        }
+        ops->readdir("/wide", &cnt, count_filler, 0, &fi);
+        if (ops->releasedir) {
+            ops->releasedir("/wide", &fi);
+        }
+        stat_add(&bs, now_us() - t);
+        if (cnt != opts.width) {
+            fprintf(stderr, "newfs_bench: readdir returned %d of %d entries\n", cnt, opts.width);
+        }
+    }
+    stat_end(&bs);
+    bench_umount();
+}
+
+/**
+ * @brief 以io_sz为单位顺序或随机读写一个file_kb大小的文件
+ */
+static void bench_rw_one(const char* name, bool is_write, bool is_random, int io_sz, bool cold) {
+    struct bench_stat bs;
+    struct fuse_file_info fi;
+    long   file_sz = (long)opts.file_kb * 1024;
+    long   nr_io   = file_sz / io_sz;
+    char*  buf     = (char *)malloc(io_sz);
+    char   full_name[64];
+    double t;
+
+    if (cold) {
+        bench_umount();
+        bench_mount();
+    }
+    memset(buf, 0x5a, io_sz);
+    memset(&fi, 0, sizeof(fi));
+    fi.flags = O_RDWR;
+    ops->open("/data", &fi);
+
+    snprintf(full_name, sizeof(full_name), "%s_%dk", name, io_sz / 1024);
+    stat_begin(&bs, full_name, nr_io);
+    srand(12345);                               /* 随机序列可重复 */
+    for (long i = 0; i < nr_io; i++) {
+        off_t off = (is_random ? rand() % nr_io : i) * io_sz;
+        int   ret;
+        t = now_us();
+        ret = is_write ? ops->write("/data", buf, io_sz, off, &fi)
+                       : ops->read("/data", buf, io_sz, off, &fi);
+        stat_add(&bs, now_us() - t);
+        if (ret > 0) {
+            bs.bytes += ret;
+        }
+    }
+    if (is_write && ops->flush) {
+        t = now_us();
+        ops->flush("/data", &fi);               /* 写回计入总时间，不计入单次延迟 */
+        bs.total_us += now_us() - t;
+    }
+    ops->release("/data", &fi);
+    stat_end(&bs);
+    free(buf);
+}
+
+static void bench_rw(void) {
+    static const int io_sizes[] = { 4096, 65536, 131072 };
+
+    if ((long)opts.file_kb * 1024 > file_max) {
+        opts.file_kb = file_max / 1024;
+    }
+    for (size_t i = 0; i < sizeof(io_sizes) / sizeof(io_sizes[0]); i++) {
+        int io_sz = io_sizes[i];
+        if (io_sz > opts.file_kb * 1024) {
+            continue;
+        }
+        bench_fresh_mount();
+        ops->mknod("/data", S_IFREG | 0644, 0);
+        bench_rw_one("seq_write",  true,  false, io_sz, false);
+        bench_rw_one("seq_read",   false, false, io_sz, true);
+        bench_rw_one("rand_read",  false, true,  io_sz, true);
+        bench_rw_one("rand_write", true,  true,  io_sz, false);
+        bench_umount();
+    }
+}
+
+/******************************************************************************
+* SECTION: 入口
+*******************************************************************************/
+static void usage(const char* prog) {
+    fprintf(stderr, "usage: %s [--device=URI] [--blksize=B] [--files=N] [--depth=D] [--width=W]\n"
+                    "          [--file_kb=K] [--iters=I] [--out=PATH]\n", prog);
+}
+
+int main(int argc, char** argv) {
+    static const struct option long_opts[] = {
+        { "device",  required_argument, NULL, 'd' },
+        { "blksize", required_argument, NULL, 'b' },
+        { "files",   required_argument, NULL, 'n' },
+        { "depth",   required_argument, NULL, 'D' },
+        { "width",   required_argument, NULL, 'w' },
+        { "file_kb", required_argument, NULL, 's' },
+        { "iters",   required_argument, NULL, 'i' },
+        { "out",     required_argument, NULL, 'o' },
+        { NULL, 0, NULL, 0 },
+    };
+    int c, json_fd;
+
+    while ((c = getopt_long(argc, argv, "", long_opts, NULL)) != -1) {
+        switch (c) {
+        case 'd': opts.device  = optarg;       break;
+        case 'b': opts.blksize = atoi(optarg); break;
+        case 'n': opts.files   = atoi(optarg); break;
+        case 'D': opts.depth   = atoi(optarg); break;
+        case 'w': opts.width   = atoi(optarg); break;
+        case 's': opts.file_kb = atoi(optarg); break;
+        case 'i': opts.iters   = atoi(optarg); break;
+        case 'o': opts.out     = optarg;       break;
+        default:  usage(argv[0]); return 1;
+        }
+    }
+
+    /* 文件系统自身的调试输出走stdout，JSON改用单独的流，stdout丢弃 */
+    if (opts.out) {
+        json = fopen(opts.out, "w");
+    } else {
+        json_fd = dup(STDOUT_FILENO);
+        json    = fdopen(json_fd, "w");
+    }
+    if (json == NULL || freopen("/dev/null", "w", stdout) == NULL) {
+        perror("newfs_bench");
+        return 1;
+    }
+
+    newfs_options.device   = opts.device;
+    newfs_options.blksize  = opts.blksize;
+    newfs_options.cache_mb = NEWFS_ICACHE_DEFAULT_MB;
+    ops = newfs_operations();
+
+    /* 先挂载一次取得实际的块大小与文件上限 */
+    bench_fresh_mount();
+    fprintf(json, "{\n  \"device\": \"%s\",\n  \"blksize\": %d,\n  \"disk_size\": %d,\n"
+                  "  \"results\": [\n", opts.device, super.blks_size, super.disk_size);
+    file_max = super.file_max;
+    bench_umount();
+
+    bench_mount_umount();
+    bench_files();
+    bench_lookup_deep();
+    bench_readdir_wide();
+    bench_rw();
+
+    fprintf(json, "\n  ]\n}\n");
+    fclose(json);
+    return 0;
+}
@@ -0,0 +1,168 @@
+/**
+ * @file newfs_clone.c
+ * @brief 在同一个newfs挂载点内服务端复制文件
+ *
+ * 对目标文件调用NEWFS_IOC_CLONE_RANGE，由newfs在进程内按块共享或块到块复制，
+ * 数据不经过内核FUSE与用户态缓冲区往返。源文件按挂载点内的路径传给newfs，
+ * 挂载点由源文件向上查找st_dev变化的位置得到。
+ *
+ * 用法: newfs_clone [--src_off=N] [--dst_off=N] [--len=N] <src> <dst>
+ * 目标文件不存在时创建，不截断；--len默认为源文件从src_off到末尾的长度。
+ */
+#include "newfs.h"
+#include <getopt.h>
+#include <limits.h>
+#include <libgen.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+
+/******************************************************************************
+* SECTION: 参数
+*******************************************************************************/
+struct clone_options {
+    int64_t     src_off;
+    int64_t     dst_off;
+    int64_t     len;        /* -1为复制到源文件末尾 */
+    const char* src;
+    const char* dst;
+};
+
+static struct clone_options opts = {
+    .src_off = 0,
+    .dst_off = 0,
+    .len     = -1,
+};
+
+/******************************************************************************
+* SECTION: 路径
+*******************************************************************************/
+/**
+ * @brief 求文件在其所在挂载点内的路径：从文件向上逐级比较st_dev，跨出文件系统的前一级即为挂载点
+ *
+ * @param path 文件路径
+ * @param rel 返回挂载点内的路径，以'/'开头
+ * @param dev 返回文件所在文件系统的设备号
+ * @return int 0成功，-1失败并设置errno
+ */
+static int clone_mount_path(const char* path, char* rel, dev_t* dev) {
+    char        real[PATH_MAX], up[PATH_MAX];
+    struct stat st, pst;
+    size_t      root;
+
+    if (realpath(path, real) == NULL || stat(real, &st) != 0) {
+        return -1;
+    }
+    strcpy(up, real);
+    root = strlen(up);
+    while (root > 1) {
+        char* slash = strrchr(up, '/');
+        slash[slash == up ? 1 : 0] = '\0';   /* 截到父目录，根目录保留'/' */
+        if (stat(up, &pst) != 0) {
+            return -1;
+        }
+        if (pst.st_dev != st.st_dev) {
+            break;
+        }
+        root = strlen(up);
+    }
+    if (root <= 1) {
+        root = 0;                               /* 挂载在根目录 */
+    }
+    if (strlen(real + root) >= NEWFS_CLONE_PATH_MAX) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(rel, real[root] == '\0' ? "/" : real + root);
+    *dev = st.st_dev;
+    return 0;
+}
+
+/******************************************************************************
+* SECTION: 入口
+*******************************************************************************/
+static void usage(const char* prog) {
+    fprintf(stderr, "usage: %s [--src_off=N] [--dst_off=N] [--len=N] <src> <dst>\n", prog);
+}
+
+int main(int argc, char** argv) {
+    static const struct option long_opts[] = {
+        { "src_off", required_argument, NULL, 's' },
+        { "dst_off", required_argument, NULL, 'd' },
+        { "len",     required_argument, NULL, 'l' },
+        { NULL, 0, NULL, 0 },
+    };
+    struct newfs_clone_range arg;
+    struct stat st;
+    char   dst_dir[PATH_MAX];
+    dev_t  src_dev;
+    int    c, fd;
+
+    while ((c = getopt_long(argc, argv, "", long_opts, NULL)) != -1) {
+        switch (c) {
+        case 's': opts.src_off = atoll(optarg); break;
+        case 'd': opts.dst_off = atoll(optarg); break;
+        case 'l': opts.len     = atoll(optarg); break;
+        default:  usage(argv[0]); return 1;
+        }
+    }
+    if (optind != argc - 2 || opts.src_off < 0 || opts.dst_off < 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    opts.src = argv[optind];
+    opts.dst = argv[optind + 1];
+
+    memset(&arg, 0, sizeof(arg));
+    if (clone_mount_path(opts.src, arg.src, &src_dev) != 0 || stat(opts.src, &st) != 0) {
+        fprintf(stderr, "newfs_clone: %s: %s\n", opts.src, strerror(errno));
+        return 1;
+    }
+    if (opts.len < 0) {
+        opts.len = st.st_size > opts.src_off ? st.st_size - opts.src_off : 0;
+    }
+    /* 目标必须与源在同一个挂载点内，ioctl按挂载点内的路径查找源文件 */
+    strcpy(dst_dir, opts.dst);
+    if (stat(dirname(dst_dir), &st) != 0) {
+        fprintf(stderr, "newfs_clone: %s: %s\n", opts.dst, strerror(errno));
+        return 1;
+    }
+    if (st.st_dev != src_dev) {
+        fprintf(stderr, "newfs_clone: %s: %s\n", opts.dst, strerror(EXDEV));
+        return 1;
+    }
+    fd = open(opts.dst, O_WRONLY | O_CREAT, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "newfs_clone: %s: %s\n", opts.dst, strerror(errno));
+        return 1;
+    }
+
+    /* newfs一次可能只复制一部分，循环直到复制完或源文件结束 */
+    while (opts.len > 0) {
+        arg.src_off = opts.src_off;
+        arg.dst_off = opts.dst_off;
+        arg.len     = opts.len;
+        arg.copied  = 0;
+        if (ioctl(fd, NEWFS_IOC_CLONE_RANGE, &arg) != 0) {
+            fprintf(stderr, "newfs_clone: %s -> %s: %s\n", opts.src, opts.dst, strerror(errno));
+            close(fd);
+            return 1;
+        }
+        if (arg.copied <= 0) {
+            break;
+        }
+        opts.src_off += arg.copied;
+        opts.dst_off += arg.copied;
+        opts.len     -= arg.copied;
+    }
+    /* 服务端复制绕过了内核，内核缓存的文件大小已过时；setattr的应答会带回新属性并使页缓存失效 */
+    if (futimens(fd, NULL) != 0) {
+        fprintf(stderr, "newfs_clone: %s: %s\n", opts.dst, strerror(errno));
+        close(fd);
+        return 1;
+    }
+    if (close(fd) != 0) {
+        fprintf(stderr, "newfs_clone: %s: %s\n", opts.dst, strerror(errno));
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,550 @@
+/**
+ * @file newfs_replay.c
+ * @brief 回放newfs --record=<file>记录的操作序列
+ *
+ * 与newfs_bench相同，在进程内挂载newfs并直接调用操作表。按记录顺序重放每个操作，
+ * 写入内容用固定模式填充(记录中不含数据)。可以尽快回放，也可以按原始时间间隔回放。
+ * 结果以JSON输出：总耗时、吞吐、各操作计数与平均延迟、返回值与记录不一致的次数、
+ * 设备读写/seek次数以及inode缓存命中情况，用于对比缓存、分配器等改动。
+ *
+ * 用法: newfs_replay [--device=mmap:/tmp/newfs_replay.img] [--blksize=B] [--cache_mb=M]
+ *                    [--compress] [--dedup] [--data_csum] [--timing] [--keep] [--out=path] <trace>
+ * 默认先格式化设备；--keep时在现有镜像上回放。设备计数包含卸载前的最终写回。
+ */
+#include "newfs.h"
+#include <time.h>
+#include <getopt.h>
+
+extern struct custom_options    newfs_options;
+extern struct newfs_super       super;
+extern struct newfs_icache_stat icache_stat;
+extern struct newfs_comp_stat   comp_stat;
+extern struct newfs_dedup_stat  dedup_stat;
+extern struct newfs_csum_stat   csum_stat;
+
+/******************************************************************************
+* SECTION: 参数
+*******************************************************************************/
+struct replay_options {
+    const char* device;
+    int         blksize;
+    int         cache_mb;
+    bool        timing;     /* 按原始时间间隔回放 */
+    bool        keep;       /* 不格式化，在现有镜像上回放 */
+    bool        compress;   /* 同newfs --compress */
+    bool        dedup;      /* 同newfs --dedup */
+    bool        data_csum;  /* 同newfs --data_csum */
+    const char* out;
+    const char* trace;
+};
+
+static struct replay_options opts = {
+    .device   = "mmap:/tmp/newfs_replay.img",
+    .blksize  = 0,
+    .cache_mb = NEWFS_ICACHE_DEFAULT_MB,
+    .timing   = false,
+    .keep     = false,
+    .compress = false,
+    .dedup    = false,
+    .data_csum = false,
+    .out      = NULL,
+    .trace    = NULL,
+};
+
+static const char* op_names[NEWFS_REC_NR] = {
+    [NEWFS_REC_GETATTR]    = "getattr",
+    [NEWFS_REC_READDIR]    = "readdir",
+    [NEWFS_REC_OPEN]       = "open",
+    [NEWFS_REC_OPENDIR]    = "opendir",
+    [NEWFS_REC_READ]       = "read",
+    [NEWFS_REC_WRITE]      = "write",
+    [NEWFS_REC_MKNOD]      = "mknod",
+    [NEWFS_REC_MKDIR]      = "mkdir",
+    [NEWFS_REC_FLUSH]      = "flush",
+    [NEWFS_REC_RELEASE]    = "release",
+    [NEWFS_REC_RELEASEDIR] = "releasedir",
+    [NEWFS_REC_STATFS]     = "statfs",
+    [NEWFS_REC_UTIMENS]    = "utimens",
+    [NEWFS_REC_UNLINK]     = "unlink",
+    [NEWFS_REC_RMDIR]      = "rmdir",
+    [NEWFS_REC_RENAME]     = "rename",
+    [NEWFS_REC_TRUNCATE]   = "truncate",
+    [NEWFS_REC_FALLOCATE]  = "fallocate",
+    [NEWFS_REC_IOCTL]      = "ioctl",
+    [NEWFS_REC_CLONE]      = "clone",
+    [NEWFS_REC_SNAP]       = "snap",
+    [NEWFS_REC_LINK]       = "link",
+    [NEWFS_REC_SYMLINK]    = "symlink",
+    [NEWFS_REC_READLINK]   = "readlink",
+    [NEWFS_REC_SETXATTR]   = "setxattr",
+    [NEWFS_REC_GETXATTR]   = "getxattr",
+    [NEWFS_REC_LISTXATTR]  = "listxattr",
+    [NEWFS_REC_REMOVEXATTR] = "removexattr",
+};
+
+static const struct fuse_operations* ops;
+
+/******************************************************************************
+* SECTION: 记录文件
+*******************************************************************************/
+static uint8_t* trace_buf;
+static size_t   trace_len;
+
+/**
+ * @brief 整个读入记录文件，避免回放计时包含读记录的IO
+ */
+static int trace_load(const char* path) {
+    FILE* fp = fopen(path, "r");
+    struct newfs_rec_hdr_d* hdr;
+    long len;
+    size_t pos;
+
+    if (fp == NULL) {
+        fprintf(stderr, "newfs_replay: %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    fseek(fp, 0, SEEK_END);
+    len = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    trace_buf = (uint8_t *)malloc(len > 0 ? len : 1);
+    trace_len = fread(trace_buf, 1, len, fp);
+    fclose(fp);
+
+    hdr = (struct newfs_rec_hdr_d *)trace_buf;
+    if (trace_len < sizeof(*hdr) || hdr->magic != NEWFS_REC_MAGIC
+        || hdr->rec_size != sizeof(struct newfs_rec_d)) {
+        fprintf(stderr, "newfs_replay: %s is not a newfs trace\n", path);
+        return -1;
+    }
+    if (hdr->version != NEWFS_REC_VERSION) {
+        fprintf(stderr, "newfs_replay: %s: unsupported trace version %d (expected %d)\n",
+                path, hdr->version, NEWFS_REC_VERSION);
+        return -1;
+    }
+
+    /* 回放前检查全部操作号，不认识的操作说明记录与本工具不匹配，整体拒绝 */
+    for (pos = sizeof(*hdr); pos + sizeof(struct newfs_rec_d) <= trace_len; ) {
+        struct newfs_rec_d* rec = (struct newfs_rec_d *)(trace_buf + pos);
+
+        if (pos + sizeof(*rec) + rec->path_len > trace_len) {
+            break;                                  /* 记录被截断(未正常卸载) */
+        }
+        if (rec->op == 0 || rec->op >= NEWFS_REC_NR) {
+            fprintf(stderr, "newfs_replay: %s: unknown op %d at offset %zu\n", path, rec->op, pos);
+            return -1;
+        }
+        pos += sizeof(*rec) + rec->path_len;
+    }
+    return 0;
+}
+
+/******************************************************************************
+* SECTION: 句柄映射
+* 记录中的fh是记录时的句柄值，回放时对应到本进程open得到的fuse_file_info
+*******************************************************************************/
+struct replay_handle {
+    uint64_t              rec_fh;
+    struct fuse_file_info fi;
+    bool                  used;
+};
+
+static struct replay_handle* handles;
+static int                   nr_handles;
+
+static struct fuse_file_info* handle_find(uint64_t rec_fh) {
+    for (int i = 0; i < nr_handles; i++) {
+        if (handles[i].used && handles[i].rec_fh == rec_fh) {
+            return &handles[i].fi;
+        }
+    }
+    return NULL;
+}
+
+static struct fuse_file_info* handle_new(uint64_t rec_fh) {
+    int i;
+
+    for (i = 0; i < nr_handles && handles[i].used; i++) {
+    }
+    if (i == nr_handles) {
+        nr_handles = nr_handles ? nr_handles * 2 : 16;
+        handles = (struct replay_handle *)realloc(handles, sizeof(*handles) * nr_handles);
+        memset(handles + i, 0, sizeof(*handles) * (nr_handles - i));
+    }
+    memset(&handles[i], 0, sizeof(handles[i]));
+    handles[i].rec_fh = rec_fh;
+    handles[i].used   = true;
+    return &handles[i].fi;
+}
+
+static void handle_drop(uint64_t rec_fh) {
+    for (int i = 0; i < nr_handles; i++) {
+        if (handles[i].used && handles[i].rec_fh == rec_fh) {
+            handles[i].used = false;
+            return;
+        }
+    }
+}
+
+/******************************************************************************
+* SECTION: 回放
+*******************************************************************************/
+struct replay_stat {
+    long   count;
+    long   mismatch;    /* 返回值与记录不一致 */
+    double total_us;
+};
+
+static struct replay_stat stats[NEWFS_REC_NR];
+static long               nr_skipped;     /* 找不到句柄等无法回放的记录 */
+static long               read_bytes, write_bytes;
+static char*              io_buf;
+static size_t             io_buf_sz;
+
+static double now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int null_filler(void* buf, const char* name, const struct stat* st, off_t off) {
+    return 0;
+}
+
+static void dev_state(struct ddriver_state* st) {
+    memset(st, 0, sizeof(*st));
+    if (super.bdev) {
+        newfs_bdev_ioctl(super.bdev, IOC_REQ_DEVICE_STATE, st);
+    }
+}
+
+static void replay_reset(void) {
+    struct newfs_bdev* bdev = newfs_bdev_open(opts.device);
+    uint8_t* zero;
+
+    if (bdev == NULL) {
+        fprintf(stderr, "newfs_replay: cannot open device %s\n", opts.device);
+        exit(1);
+    }
+    zero = (uint8_t *)calloc(1, bdev->io_sz);
+    newfs_bdev_write(bdev, 0, zero, bdev->io_sz);
+    newfs_bdev_flush(bdev);
+    newfs_bdev_close(bdev);
+    free(zero);
+}
+
+/**
+ * @brief 重放一条记录
+ *
+ * @return int 操作返回值；无法重放时返回INT32_MIN
+ */
+static int replay_one(struct newfs_rec_d* rec, const char* path) {
+    struct fuse_file_info  tmp;
+    struct fuse_file_info* fi;
+    struct stat            st;
+    struct statvfs         vfs;
+    int ret;
+
+    if (rec->size > io_buf_sz && (rec->op == NEWFS_REC_READ || rec->op == NEWFS_REC_WRITE
+                                || rec->op == NEWFS_REC_READLINK || rec->op == NEWFS_REC_SETXATTR
+                                || rec->op == NEWFS_REC_GETXATTR || rec->op == NEWFS_REC_LISTXATTR)) {
+        io_buf_sz = rec->size;
+        io_buf    = (char *)realloc(io_buf, io_buf_sz);
+        memset(io_buf, 0x5a, io_buf_sz);
+    }
+
+    switch (rec->op) {
+    case NEWFS_REC_GETATTR:
+        return ops->getattr(path, &st);
+    case NEWFS_REC_STATFS:
+        return ops->statfs ? ops->statfs(path, &vfs) : 0;
+    case NEWFS_REC_UTIMENS:
+        return ops->utimens ? ops->utimens(path, NULL) : 0;
+    case NEWFS_REC_MKNOD:
+        return ops->mknod(path, rec->size, 0);
+    case NEWFS_REC_MKDIR:
+        return ops->mkdir(path, rec->size);
+    case NEWFS_REC_UNLINK:
+        return ops->unlink(path);
+    case NEWFS_REC_RMDIR:
+        return ops->rmdir(path);
+    case NEWFS_REC_RENAME:
+        return ops->rename(path, path + strlen(path) + 1);     /* "from\0to" */
+    case NEWFS_REC_LINK:
+        return ops->link(path, path + strlen(path) + 1);       /* "from\0to" */
+    case NEWFS_REC_SYMLINK:
+        return ops->symlink(path, path + strlen(path) + 1);    /* "target\0linkpath" */
+    case NEWFS_REC_READLINK:
+        return ops->readlink(path, io_buf, rec->size);
+    case NEWFS_REC_SETXATTR:                                    /* "path\0name"，值不记录，用填充数据代替 */
+        return ops->setxattr(path, path + strlen(path) + 1, io_buf, rec->size, rec->pad);
+    case NEWFS_REC_GETXATTR:
+        return ops->getxattr(path, path + strlen(path) + 1, io_buf, rec->size);
+    case NEWFS_REC_LISTXATTR:
+        return ops->listxattr(path, io_buf, rec->size);
+    case NEWFS_REC_REMOVEXATTR:
+        return ops->removexattr(path, path + strlen(path) + 1);
+    case NEWFS_REC_TRUNCATE:
+        if (rec->fh == 0) {
+            return ops->truncate(path, rec->offset);
+        }
+        break;
+    case NEWFS_REC_OPEN:
+    case NEWFS_REC_OPENDIR:
+        if (rec->ret != 0) {
+            memset(&tmp, 0, sizeof(tmp));
+            fi = &tmp;                              /* 记录时失败，回放结果不保留 */
+        } else {
+            fi = handle_new(rec->fh);
+        }
+        fi->flags = rec->size;
+        ret = rec->op == NEWFS_REC_OPEN ? ops->open(path, fi) : ops->opendir(path, fi);
+        if (fi == &tmp && ret == 0) {
+            (rec->op == NEWFS_REC_OPEN ? ops->release : ops->releasedir)(path, fi);
+        } else if (fi != &tmp && ret != 0) {
+            handle_drop(rec->fh);
+        }
+        return ret;
+    case NEWFS_REC_READDIR:
+        fi = rec->fh ? handle_find(rec->fh) : NULL;
+        return ops->readdir(path, NULL, null_filler, rec->offset, fi);
+    default:
+        break;
+    }
+
+    /* 以下操作需要打开时的句柄 */
+    if ((fi = handle_find(rec->fh)) == NULL) {
+        return INT32_MIN;
+    }
+    switch (rec->op) {
+    case NEWFS_REC_READ:
+        ret = ops->read(path, io_buf, rec->size, rec->offset, fi);
+        read_bytes += ret > 0 ? ret : 0;
+        return ret;
+    case NEWFS_REC_WRITE:
+        ret = ops->write(path, io_buf, rec->size, rec->offset, fi);
+        write_bytes += ret > 0 ? ret : 0;
+        return ret;
+    case NEWFS_REC_TRUNCATE:
+        return ops->ftruncate(path, rec->offset, fi);
+    case NEWFS_REC_FALLOCATE:
+        return ops->fallocate(path, rec->pad, rec->offset, rec->size, fi);
+    case NEWFS_REC_IOCTL: {
+        off_t pos = rec->offset;
+        return ops->ioctl(path, (int)rec->size, NULL, fi, 0, &pos);
+    }
+    case NEWFS_REC_CLONE: {
+        struct newfs_clone_range cr;
+        const char* src = path + strlen(path) + 1;              /* "dst\0src\0"+src_off */
+
+        memset(&cr, 0, sizeof(cr));
+        strncpy(cr.src, src, NEWFS_CLONE_PATH_MAX - 1);
+        memcpy(&cr.src_off, src + strlen(src) + 1, sizeof(cr.src_off));
+        cr.dst_off = rec->offset;
+        cr.len     = rec->size;
+        return ops->ioctl(path, (int)NEWFS_IOC_CLONE_RANGE, NULL, fi, 0, &cr);
+    }
+    case NEWFS_REC_SNAP: {
+        struct newfs_snap_arg snap;                             /* "path\0name" */
+
+        memset(&snap, 0, sizeof(snap));
+        strncpy(snap.name, path + strlen(path) + 1, NEWFS_SNAP_NAME_LEN - 1);
+        return ops->ioctl(path, (int)rec->size, NULL, fi, 0, &snap);
+    }
+    case NEWFS_REC_FLUSH:
+        return ops->flush ? ops->flush(path, fi) : 0;
+    case NEWFS_REC_RELEASE:
+    case NEWFS_REC_RELEASEDIR:
+        ret = (rec->op == NEWFS_REC_RELEASE ? ops->release : ops->releasedir)(path, fi);
+        handle_drop(rec->fh);
+        return ret;
+    default:
+        return INT32_MIN;
+    }
+}
+
+/**
+ * @brief 依次重放全部记录
+ *
+ * @return long 重放的记录数
+ */
+static long replay_all(void) {
+    size_t pos   = sizeof(struct newfs_rec_hdr_d);
+    double begin = now_us();
+    char   path[4096];
+    long   n     = 0;
+
+    while (pos + sizeof(struct newfs_rec_d) <= trace_len) {
+        struct newfs_rec_d* rec = (struct newfs_rec_d *)(trace_buf + pos);
+        double t;
+        int    ret;
+
+        if (pos + sizeof(*rec) + rec->path_len > trace_len || rec->path_len >= sizeof(path)) {
+            break;                                  /* 记录被截断(未正常卸载) */
+        }
+        memcpy(path, trace_buf + pos + sizeof(*rec), rec->path_len);
+        path[rec->path_len] = '\0';
+        pos += sizeof(*rec) + rec->path_len;
+        if (opts.timing) {
+            double wait = begin + rec->ts / 1e3 - now_us();
+            if (wait > 0) {
+                usleep((useconds_t)wait);
+            }
+        }
+        t   = now_us();
+        ret = replay_one(rec, path);
+        if (ret == INT32_MIN) {
+            nr_skipped++;
+            continue;
+        }
+        stats[rec->op].total_us += now_us() - t;
+        stats[rec->op].count++;
+        if (ret != rec->ret) {
+            stats[rec->op].mismatch++;
+        }
+        n++;
+    }
+    return n;
+}
+
+/******************************************************************************
+* SECTION: 入口
+*******************************************************************************/
+static void usage(const char* prog) {
+    fprintf(stderr, "usage: %s [--device=URI] [--blksize=B] [--cache_mb=M] [--compress] [--dedup]\n"
+                    "          [--data_csum] [--timing] [--keep] [--out=PATH] <trace>\n", prog);
+}
+
+int main(int argc, char** argv) {
+    static const struct option long_opts[] = {
+        { "device",   required_argument, NULL, 'd' },
+        { "blksize",  required_argument, NULL, 'b' },
+        { "cache_mb", required_argument, NULL, 'c' },
+        { "compress", no_argument,       NULL, 'z' },
+        { "dedup",    no_argument,       NULL, 'u' },
+        { "data_csum", no_argument,      NULL, 's' },
+        { "timing",   no_argument,       NULL, 't' },
+        { "keep",     no_argument,       NULL, 'k' },
+        { "out",      required_argument, NULL, 'o' },
+        { NULL, 0, NULL, 0 },
+    };
+    struct ddriver_state dev_begin, dev_end;
+    FILE*  json;
+    double begin, elapsed_us;
+    long   n, mismatch = 0;
+    int    c, json_fd, first = 1;
+
+    while ((c = getopt_long(argc, argv, "", long_opts, NULL)) != -1) {
+        switch (c) {
+        case 'd': opts.device   = optarg;       break;
+        case 'b': opts.blksize  = atoi(optarg); break;
+        case 'c': opts.cache_mb = atoi(optarg); break;
+        case 'z': opts.compress = true;         break;
+        case 'u': opts.dedup    = true;         break;
+        case 's': opts.data_csum = true;        break;
+        case 't': opts.timing   = true;         break;
+        case 'k': opts.keep     = true;         break;
+        case 'o': opts.out      = optarg;       break;
+        default:  usage(argv[0]); return 1;
+        }
+    }
+    if (optind != argc - 1) {
+        usage(argv[0]);
+        return 1;
+    }
+    opts.trace = argv[optind];
+    if (trace_load(opts.trace) != 0) {
+        return 1;
+    }
+
+    /* 文件系统自身的调试输出走stdout，JSON改用单独的流，stdout丢弃 */
+    if (opts.out) {
+        json = fopen(opts.out, "w");
+    } else {
+        json_fd = dup(STDOUT_FILENO);
+        json    = fdopen(json_fd, "w");
+    }
+    if (json == NULL || freopen("/dev/null", "w", stdout) == NULL) {
+        perror("newfs_replay");
+        return 1;
+    }
+
+    newfs_options.device   = opts.device;
+    newfs_options.blksize  = opts.blksize;
+    newfs_options.cache_mb = opts.cache_mb;
+    newfs_options.compress = opts.compress;
+    newfs_options.dedup    = opts.dedup;
+    newfs_options.data_csum = opts.data_csum;
+    ops = newfs_operations();
+
+    if (!opts.keep) {
+        replay_reset();
+    }
+    ops->init(NULL);
+    if (super.bdev == NULL) {
+        fprintf(stderr, "newfs_replay: cannot open device %s\n", opts.device);
+        return 1;
+    }
+
+    dev_state(&dev_begin);
+    begin = now_us();
+    n     = replay_all();
+    newfs_flush_dirty();                            /* 最终写回计入耗时与设备计数 */
+    elapsed_us = now_us() - begin;
+    dev_state(&dev_end);
+
+    fprintf(json, "{\n  \"trace\": \"%s\",\n  \"device\": \"%s\",\n  \"blksize\": %d,\n"
+                  "  \"cache_mb\": %d,\n  \"timing\": \"%s\",\n",
+            opts.trace, opts.device, super.blks_size, opts.cache_mb,
+            opts.timing ? "original" : "fast");
+    for (int op = 1; op < NEWFS_REC_NR; op++) {
+        mismatch += stats[op].mismatch;
+    }
+    fprintf(json, "  \"records\": %ld,\n  \"skipped\": %ld,\n  \"mismatch\": %ld,\n"
+                  "  \"elapsed_s\": %.6f,\n  \"ops_per_sec\": %.1f,\n",
+            n, nr_skipped, mismatch, elapsed_us / 1e6,
+            elapsed_us > 0 ? n / (elapsed_us / 1e6) : 0);
+    fprintf(json, "  \"read_mb_per_sec\": %.2f,\n  \"write_mb_per_sec\": %.2f,\n",
+            elapsed_us > 0 ? read_bytes / (elapsed_us / 1e6) / (1024 * 1024) : 0,
+            elapsed_us > 0 ? write_bytes / (elapsed_us / 1e6) / (1024 * 1024) : 0);
+    fprintf(json, "  \"device_ops\": {\"read\": %d, \"write\": %d, \"seek\": %d},\n",
+            dev_end.read_cnt - dev_begin.read_cnt, dev_end.write_cnt - dev_begin.write_cnt,
+            dev_end.seek_cnt - dev_begin.seek_cnt);
+    fprintf(json, "  \"icache\": {\"hits\": %ld, \"misses\": %ld, \"evictions\": %ld},\n",
+            icache_stat.hits, icache_stat.misses, icache_stat.evictions);
+    if (opts.compress) {
+        fprintf(json, "  \"compress\": {\"clusters\": %ld, \"fallbacks\": %ld, \"ratio\": %.3f, "
+                      "\"comp_us\": %.1f, \"decomp_us\": %.1f},\n",
+                comp_stat.clusters, comp_stat.fallbacks,
+                comp_stat.stored_bytes ? (double)comp_stat.raw_bytes / comp_stat.stored_bytes : 0,
+                comp_stat.comp_ns / 1000.0, comp_stat.decomp_ns / 1000.0);
+    }
+    if (opts.dedup) {
+        fprintf(json, "  \"dedup\": {\"hits\": %ld, \"inserts\": %ld, \"ratio\": %.3f, "
+                      "\"hash_us\": %.1f, \"verify_us\": %.1f, \"index_mem\": %ld},\n",
+                dedup_stat.hits, dedup_stat.inserts,
+                dedup_stat.inserts ? (double)(dedup_stat.hits + dedup_stat.inserts) / dedup_stat.inserts : 0,
+                dedup_stat.hash_ns / 1000.0, dedup_stat.verify_ns / 1000.0, newfs_dedup_mem());
+    }
+    fprintf(json, "  \"csum\": {\"impl\": \"%s\", \"meta_verified\": %ld, \"meta_failed\": %ld, "
+                  "\"data_verified\": %ld, \"data_failed\": %ld, \"data_updated\": %ld, \"crc_us\": %.1f},\n",
+            newfs_crc32c_impl(), csum_stat.meta_verifies, csum_stat.meta_failures, csum_stat.data_verifies,
+            csum_stat.data_failures, csum_stat.data_updates, csum_stat.ns / 1000.0);
+    fprintf(json, "  \"ops\": [\n");
+    for (int op = 1; op < NEWFS_REC_NR; op++) {
+        if (stats[op].count == 0) {
+            continue;
+        }
+        fprintf(json, "%s    {\"name\": \"%s\", \"count\": %ld, \"avg_us\": %.2f, \"mismatch\": %ld}",
+                first ? "" : ",\n", op_names[op], stats[op].count,
+                stats[op].total_us / stats[op].count, stats[op].mismatch);
+        first = 0;
+    }
+    fprintf(json, "\n  ]\n}\n");
+    fclose(json);
+
+    ops->destroy(NULL);
+    free(trace_buf);
+    free(handles);
+    free(io_buf);
+    return 0;
+}